@@ -0,0 +1,78 @@
+"""Checkpointing many versions of one evolving map.
+
+Derives ``--versions`` versions of a map of ``--size`` str -> int
+items, each with ``--changes`` random ``set()``/``delete()`` calls
+from the previous one, and reports for a plain pickle of the list of
+versions and for ``immutables.archive()``:
+
+* the size of the result;
+* the time it takes to write and to load it;
+* the memory the loaded versions take.
+
+Usage:
+
+    $ python bench/bench_archive.py [--size N] [--versions V] [--changes C]
+"""
+
+import argparse
+import pickle
+import random
+import time
+import tracemalloc
+
+import immutables
+
+
+def bench(label, dump, load, versions):
+    started = time.perf_counter()
+    data = dump(versions)
+    dumped = time.perf_counter() - started
+
+    tracemalloc.start()
+    try:
+        started = time.perf_counter()
+        loaded = load(data)
+        elapsed = time.perf_counter() - started
+        memory = tracemalloc.get_traced_memory()[0]
+    finally:
+        tracemalloc.stop()
+
+    assert loaded == versions
+    print('{:<12} {:>12.1f} {:>12.1f} {:>12.1f} {:>12.1f}'.format(
+        label, len(data) / 1e6, dumped * 1000, elapsed * 1000,
+        memory / 1e6))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=100000)
+    parser.add_argument('--versions', type=int, default=200)
+    parser.add_argument('--changes', type=int, default=10)
+    args = parser.parse_args()
+
+    rnd = random.Random(0)
+    m = immutables.Map(
+        ('key-{}'.format(i), i) for i in range(args.size))
+    versions = [m]
+    for v in range(args.versions - 1):
+        with m.mutate() as mm:
+            for _ in range(args.changes):
+                k = 'key-{}'.format(rnd.randrange(args.size * 2))
+                if k in mm and rnd.random() < 0.5:
+                    del mm[k]
+                else:
+                    mm[k] = v
+            m = mm.finish()
+        versions.append(m)
+
+    print('{:,} versions of a map of {:,} items, {} changes each'.format(
+        args.versions, args.size, args.changes))
+    print('{:<12} {:>12} {:>12} {:>12} {:>12}'.format(
+        '', 'size MB', 'dump ms', 'load ms', 'memory MB'))
+    bench('archive', immutables.archive, immutables.unarchive, versions)
+    bench('pickle',
+          lambda vs: pickle.dumps(vs, protocol=5), pickle.loads, versions)
+
+
+if __name__ == '__main__':
+    main()
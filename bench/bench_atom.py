@@ -0,0 +1,102 @@
+"""Shared Map state: Atom vs a Map behind a lock.
+
+Runs ``--readers`` threads reading the current map and 0 to
+``--max-writers`` threads updating it for ``--seconds`` each, with
+an ``immutables.Atom`` and with a ``threading.Lock`` around reads and
+updates, and reports reads and updates per second.  Readers of an
+Atom never wait; updates that lose a race are retried.  On
+free-threaded builds of Python (3.13t and later) the threads run in
+parallel and contention shows; with the GIL they take turns.
+
+Usage:
+
+    $ python bench/bench_atom.py [--readers R] [--max-writers W]
+"""
+
+import argparse
+import threading
+import time
+
+import immutables
+
+
+class Locked:
+
+    def __init__(self, m):
+        self.m = m
+        self.lock = threading.Lock()
+
+    def deref(self):
+        with self.lock:
+            return self.m
+
+    def swap(self, fn, *args):
+        with self.lock:
+            self.m = fn(self.m, *args)
+            return self.m
+
+
+def update(m, key):
+    return m.set(key, m.get(key, 0) + 1)
+
+
+def bench(state, readers, writers, seconds):
+    stop = threading.Event()
+    counts = [0] * (readers + writers)
+
+    def read(n):
+        count = 0
+        while not stop.is_set():
+            for _ in range(100):
+                state.deref()
+            count += 100
+        counts[n] = count
+
+    def write(n):
+        count = 0
+        key = str(n % 16)
+        while not stop.is_set():
+            state.swap(update, key)
+            count += 1
+        counts[n] = count
+
+    threads = [threading.Thread(target=read, args=(n,))
+               for n in range(readers)]
+    threads += [threading.Thread(target=write, args=(readers + n,))
+                for n in range(writers)]
+    for t in threads:
+        t.start()
+    time.sleep(seconds)
+    stop.set()
+    for t in threads:
+        t.join()
+
+    return (sum(counts[:readers]) / seconds,
+            sum(counts[readers:]) / seconds)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=1000)
+    parser.add_argument('--readers', type=int, default=4)
+    parser.add_argument('--max-writers', type=int, default=4)
+    parser.add_argument('--seconds', type=float, default=2.0)
+    args = parser.parse_args()
+
+    m = immutables.Map((str(i), i) for i in range(args.size))
+
+    print('Maps of {:,} items, {} reader threads'.format(
+        args.size, args.readers))
+    print('{:>8} {:>16} {:>16} {:>16} {:>16}'.format(
+        'writers', 'Atom reads/s', 'Lock reads/s',
+        'Atom updates/s', 'Lock updates/s'))
+    for writers in range(args.max_writers + 1):
+        atom = bench(immutables.Atom(m), args.readers, writers,
+                     args.seconds)
+        locked = bench(Locked(m), args.readers, writers, args.seconds)
+        print('{:>8} {:>16,.0f} {:>16,.0f} {:>16,.0f} {:>16,.0f}'.format(
+            writers, atom[0], locked[0], atom[1], locked[1]))
+
+
+if __name__ == '__main__':
+    main()
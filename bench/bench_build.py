@@ -0,0 +1,52 @@
+"""Building large maps in one go.
+
+Reports the time it takes to build a map of ``--size`` str -> int
+items out of:
+
+* a dict;
+* a list of ``(key, value)`` tuples;
+* a list of keys, with ``Map.fromkeys()``;
+
+and, for comparison, the time it takes to build the same dict.
+
+Usage:
+
+    $ python bench/bench_build.py [--size N] [--repeat R]
+"""
+
+import argparse
+import time
+
+import immutables
+
+
+def bench(label, fn, arg, repeat):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        res = fn(arg)
+        best = min(best, time.perf_counter() - started)
+        # Don't count the time it takes to free the result.
+        del res
+    print('{:<28} {:>12.1f} ms'.format(label, best * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=2000000)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    keys = ['key-{}'.format(i) for i in range(args.size)]
+    items = list(zip(keys, range(args.size)))
+    dct = dict(items)
+
+    print('Maps of {:,} keys'.format(args.size))
+    bench('Map(dict)', immutables.Map, dct, args.repeat)
+    bench('Map(list of pairs)', immutables.Map, items, args.repeat)
+    bench('Map.fromkeys(list)', immutables.Map.fromkeys, keys, args.repeat)
+    bench('dict(list of pairs)', dict, items, args.repeat)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,62 @@
+"""Building a large map on several threads.
+
+Builds a map out of a dict of ``--size`` items while the process is
+allowed to run on 1 to ``--max-threads`` CPUs, and reports the time
+of every build.  Free-threaded builds of Python (3.13t and later)
+hash the keys and build the tree on as many threads as there are
+CPUs; with the GIL maps are built on one thread and the time stays
+flat.  Needs ``os.sched_setaffinity()`` (Linux).
+
+Usage:
+
+    $ python bench/bench_bulk_threads.py [--size N] [--max-threads T]
+"""
+
+import argparse
+import os
+import sys
+import time
+
+import immutables
+
+
+def bench(items, repeat):
+    best = None
+    for _ in range(repeat):
+        started = time.perf_counter()
+        immutables.Map(items)
+        elapsed = time.perf_counter() - started
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=10000000)
+    parser.add_argument('--repeat', type=int, default=3)
+    parser.add_argument('--max-threads', type=int, default=16)
+    args = parser.parse_args()
+
+    cpus = sorted(os.sched_getaffinity(0))
+    gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+    items = {str(i): i for i in range(args.size)}
+
+    print('Maps of {:,} items, {}'.format(
+        args.size, 'GIL enabled' if gil else 'free-threaded'))
+    print('{:>8} {:>12} {:>10}'.format('threads', 'seconds', 'speedup'))
+    base = None
+    count = 1
+    try:
+        while count <= min(args.max_threads, len(cpus)):
+            os.sched_setaffinity(0, cpus[:count])
+            elapsed = bench(items, args.repeat)
+            base = base or elapsed
+            print('{:>8} {:>12.3f} {:>9.2f}x'.format(
+                count, elapsed, base / elapsed))
+            count *= 2
+    finally:
+        os.sched_setaffinity(0, cpus)
+
+
+if __name__ == '__main__':
+    main()
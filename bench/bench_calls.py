@@ -0,0 +1,60 @@
+"""Overhead of calling Map methods.
+
+Calls methods of a map of one item, where the cost of the call
+itself dominates the cost of the lookup or the update, and reports
+the average time of each call.  Times of a dict are given for
+reference.
+
+Usage:
+
+    $ python bench/bench_calls.py [--number N]
+"""
+
+import argparse
+import timeit
+
+import immutables
+
+
+CASES = [
+    ('m.get(k)', 'd.get(k)'),
+    ('m.get(missing, None)', 'd.get(missing, None)'),
+    ('m[k]', 'd[k]'),
+    ('m.set(k, 2)', None),
+    ('m.update(k2=2)', None),
+    ('Map()', 'dict()'),
+    ('Map(m)', 'dict(d)'),
+    ('Map(k2=2)', 'dict(k2=2)'),
+    ('mm.set(k, 2)', 'd.__setitem__(k, 2)'),
+    ('mm.get(k)', None),
+]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--number', type=int, default=2000000)
+    args = parser.parse_args()
+
+    env = {
+        'Map': immutables.Map,
+        'm': immutables.Map(k=1),
+        'mm': immutables.Map(k=1).mutate(),
+        'd': {'k': 1},
+        'k': 'k',
+        'missing': 'missing',
+    }
+
+    def bench(stmt):
+        best = min(timeit.repeat(
+            stmt, globals=env, number=args.number, repeat=5))
+        return best / args.number * 1e9
+
+    print('{:<24} {:>10} {:>28}'.format('', 'ns', 'dict ns'))
+    for stmt, ref in CASES:
+        print('{:<24} {:>10.1f} {:>28}'.format(
+            stmt, bench(stmt),
+            '{:.1f} ({})'.format(bench(ref), ref) if ref else ''))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,52 @@
+"""Chains of set() and delete() calls.
+
+Times expressions like ``m.set(k1, v).set(k2, v).set(k3, v)`` on maps
+of ``--size`` items.  Only the first call of a chain has to copy the
+nodes it changes; the calls after it update the Map the previous one
+returned in place, as nothing else refers to it.  Python 3.14 or
+later is needed for that; older versions copy on every call.
+
+Usage:
+
+    $ python bench/bench_chains.py [--size N] [--number N]
+"""
+
+import argparse
+import timeit
+
+import immutables
+
+
+CASES = [
+    'm.set(k0, 1)',
+    'm.set(k0, 1).set(k1, 1)',
+    'm.set(k0, 1).set(k1, 1).set(k2, 1).set(k3, 1)',
+    'm.set(k0, 1).set(k1, 1).set(k2, 1).set(k3, 1)'
+    '.set(k4, 1).set(k5, 1).set(k6, 1).set(k7, 1)',
+    'm.set(k0, 1).delete(k0)',
+    'm.delete(e0).delete(e1).delete(e2).delete(e3)',
+]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=100000)
+    parser.add_argument('--number', type=int, default=200000)
+    args = parser.parse_args()
+
+    env = {'m': immutables.Map((str(i), i) for i in range(args.size))}
+    for i in range(8):
+        env['k{}'.format(i)] = 'new-{}'.format(i)
+        env['e{}'.format(i)] = str(i * 7)
+
+    print('Maps of {:,} items'.format(args.size))
+    print('{:<48} {:>10}'.format('', 'ns'))
+    for stmt in CASES:
+        best = min(timeit.repeat(
+            stmt, globals=env, number=args.number, repeat=5))
+        label = stmt if len(stmt) <= 48 else stmt[:45] + '...'
+        print('{:<48} {:>10.1f}'.format(label, best / args.number * 1e9))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,61 @@
+"""Persistent set() and delete() churn.
+
+Times set() and delete() calls whose results are thrown away or
+replace the map they were called on, on maps of ``--size`` items.
+Every call copies one node per tree level and frees the nodes of
+the map it replaces, so these are dominated by node allocation.
+
+Usage:
+
+    $ python bench/bench_churn.py [--size N] [--number N]
+"""
+
+import argparse
+import timeit
+
+import immutables
+
+
+CASES = [
+    # The result is thrown away.
+    ('m.set(k, 1)', 'pass'),
+    ('m.delete(e)', 'pass'),
+    # The result replaces a map that is then freed.
+    ('h = h.set(k, n); n += 1', 'h = m; n = 0'),
+    ('h = h.set(k, 1).delete(k)', 'h = m'),
+    # Colliding keys end up in a Collision node.
+    ('m.set(c, 1)', 'pass'),
+]
+
+
+class Colliding(str):
+
+    def __hash__(self):
+        return 42
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=100000)
+    parser.add_argument('--number', type=int, default=500000)
+    args = parser.parse_args()
+
+    m = immutables.Map((str(i), i) for i in range(args.size))
+    m = m.set(Colliding('a'), 1)
+    env = {
+        'm': m,
+        'k': 'new',
+        'e': str(args.size // 2),
+        'c': Colliding('b'),
+    }
+
+    print('Maps of {:,} items'.format(args.size))
+    print('{:<32} {:>10}'.format('', 'ns'))
+    for stmt, setup in CASES:
+        best = min(timeit.repeat(
+            stmt, setup, globals=env, number=args.number, repeat=5))
+        print('{:<32} {:>10.1f}'.format(stmt, best / args.number * 1e9))
+
+
+if __name__ == '__main__':
+    main()
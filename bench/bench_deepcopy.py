@@ -0,0 +1,55 @@
+"""Copying maps with the copy module.
+
+For maps of ``--size`` items with values that copy to themselves
+(ints) and with values that don't (lists), reports the time
+``copy.copy()`` and ``copy.deepcopy()`` take, and the time the same
+deep copy takes through ``__reduce_ex__()``, which is what the copy
+module falls back to for objects that can't copy themselves.
+
+Usage:
+
+    $ python bench/bench_deepcopy.py [--size N] [--repeat R]
+"""
+
+import argparse
+import copy
+import time
+
+import immutables
+
+
+def reduce_deepcopy(m):
+    # What copy.deepcopy() does for objects without __deepcopy__().
+    return copy._reconstruct(m, {}, *m.__reduce_ex__(4))
+
+
+def bench(label, func, m, repeat):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        func(m)
+        best = min(best, time.perf_counter() - started)
+    print('{:<28} {:>12.3f} ms'.format(label, best * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=1000000)
+    parser.add_argument('--repeat', type=int, default=3)
+    args = parser.parse_args()
+
+    print('Maps of {:,} items'.format(args.size))
+    for kind, make in (('int', int), ('list', lambda i: [i])):
+        m = immutables.Map(
+            ('key-{}'.format(i), make(i)) for i in range(args.size))
+        assert reduce_deepcopy(m) == m
+
+        print('{} values:'.format(kind))
+        bench('  copy.copy()', copy.copy, m, args.repeat)
+        bench('  copy.deepcopy()', copy.deepcopy, m, args.repeat)
+        bench('  deepcopy via __reduce_ex__', reduce_deepcopy, m,
+              args.repeat)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,71 @@
+"""Diffing versions of a large map.
+
+Reports the time it takes to find the added, removed and changed
+keys of a map and a version of it derived with a few ``set()`` and
+``delete()`` calls:
+
+* with ``Map.diff()``;
+* by iterating over both maps and looking every key up in the other
+  one, which is what had to be done before ``Map.diff()``.
+
+Usage:
+
+    $ python bench/bench_diff.py [--size N] [--changes C] [--repeat R]
+"""
+
+import argparse
+import time
+
+import immutables
+
+
+def py_diff(a, b):
+    added = {k: v for k, v in b.items() if k not in a}
+    removed = {}
+    changed = {}
+    for k, v in a.items():
+        try:
+            w = b[k]
+        except KeyError:
+            removed[k] = v
+        else:
+            if v != w:
+                changed[k] = (v, w)
+    return added, removed, changed
+
+
+def bench(label, fn, a, b, repeat):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        fn(a, b)
+        best = min(best, time.perf_counter() - started)
+    print('{:<24} {:>12.3f} ms'.format(label, best * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=1000000)
+    parser.add_argument('--changes', type=int, default=10)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    keys = ['key-{}'.format(i) for i in range(args.size)]
+    m = immutables.Map(zip(keys, range(args.size)))
+
+    derived = m
+    for i in range(args.changes):
+        k = keys[i * 7919 % args.size]
+        if i % 3 == 0:
+            derived = derived.delete(k)
+        else:
+            derived = derived.set(k, -1)
+        derived = derived.set('new-{}'.format(i), i)
+
+    print('Maps of {:,} keys, {} changes'.format(args.size, args.changes * 2))
+    bench('Map.diff()', immutables.Map.diff, m, derived, args.repeat)
+    bench('iterate and look up', py_diff, m, derived, args.repeat)
+
+
+if __name__ == '__main__':
+    main()
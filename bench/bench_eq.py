@@ -0,0 +1,55 @@
+"""Comparing large maps.
+
+Reports the time ``==`` takes for:
+
+* a map and a version of it derived with a few ``set()`` calls;
+* a map and an equal map built independently (no shared nodes).
+
+Usage:
+
+    $ python bench/bench_eq.py [--size N] [--changes C] [--repeat R]
+"""
+
+import argparse
+import time
+
+import immutables
+
+
+def bench(label, a, b, repeat):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        a == b
+        best = min(best, time.perf_counter() - started)
+    print('{:<32} {:>12.3f} ms'.format(label, best * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=1000000)
+    parser.add_argument('--changes', type=int, default=3)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    keys = ['key-{}'.format(i) for i in range(args.size)]
+    m = immutables.Map(zip(keys, range(args.size)))
+
+    derived = m
+    for i in range(args.changes):
+        derived = derived.set(keys[i * 7919 % args.size], -1)
+    restored = derived
+    for i in range(args.changes):
+        k = keys[i * 7919 % args.size]
+        restored = restored.set(k, m[k])
+
+    copy = immutables.Map(zip(keys, range(args.size)))
+
+    print('Maps of {:,} keys'.format(args.size))
+    bench('derived, not equal', m, derived, args.repeat)
+    bench('derived, equal', m, restored, args.repeat)
+    bench('built separately, equal', m, copy, args.repeat)
+
+
+if __name__ == '__main__':
+    main()
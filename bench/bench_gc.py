@@ -0,0 +1,56 @@
+"""GC pauses with large maps alive.
+
+Builds a map of ``--size`` str -> int items, keeps it alive, and
+reports the number of objects tracked by the GC and the duration of
+a full ``gc.collect()``.  The same is then done for a map whose
+values are lists, which the GC has to see no matter what.
+
+Usage:
+
+    $ python bench/bench_gc.py [--size N] [--repeat R]
+"""
+
+import argparse
+import gc
+import time
+
+import immutables
+
+
+def bench(label, m, repeat):
+    gc.collect()
+    tracked = len(gc.get_objects())
+
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        gc.collect()
+        best = min(best, time.perf_counter() - started)
+
+    print('{:<24} {:>14,} {:>14.2f}'.format(label, tracked, best * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=5000000)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    keys = ['key-{}'.format(i) for i in range(args.size)]
+
+    print('{:<24} {:>14} {:>14}'.format(
+        'map of {:,}'.format(args.size), 'GC objects', 'collect() ms'))
+
+    bench('nothing', None, args.repeat)
+
+    m = immutables.Map(zip(keys, range(args.size)))
+    bench('str -> int', m, args.repeat)
+    del m
+
+    m = immutables.Map((k, []) for k in keys)
+    bench('str -> list', m, args.repeat)
+    del m
+
+
+if __name__ == '__main__':
+    main()
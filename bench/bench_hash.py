@@ -0,0 +1,49 @@
+"""Hashing maps derived from already hashed maps.
+
+Maps are often used as cache keys, and new versions of them are
+derived with ``set()`` all the time.  For every map size this
+reports the time it takes to hash the map for the first time, and
+the average time to hash a map derived from it with one ``set()``.
+
+Usage:
+
+    $ python bench/bench_hash.py [--sizes 1000,100000,1000000]
+"""
+
+import argparse
+import time
+
+import immutables
+
+
+def bench(size, derived):
+    m = immutables.Map(('key-{}'.format(i), i) for i in range(size))
+
+    started = time.perf_counter()
+    hash(m)
+    first = time.perf_counter() - started
+
+    maps = [m.set('key-{}'.format(i), -i) for i in range(derived)]
+    started = time.perf_counter()
+    for d in maps:
+        hash(d)
+    elapsed = (time.perf_counter() - started) / derived
+
+    print('{:>12,} {:>16.1f} {:>16.2f}'.format(
+        size, first * 1e6, elapsed * 1e6))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--sizes', default='1000,100000,1000000')
+    parser.add_argument('--derived', type=int, default=100)
+    args = parser.parse_args()
+
+    print('{:>12} {:>16} {:>16}'.format(
+        'keys', 'first hash us', 'derived hash us'))
+    for size in args.sizes.split(','):
+        bench(int(size), args.derived)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,85 @@
+"""Hash collisions and lookup latency of large maps.
+
+For every map size this reports:
+
+* the number of collision nodes the map needs, i.e. the number of
+  distinct hashes shared by two or more keys;
+* the number of collision nodes the map would need if hashes were
+  XOR-folded to 32 bits (as older versions of immutables did);
+* the average latency of ``Map.get()`` for keys that are in the map.
+
+Building maps with tens of millions of keys takes a lot of memory
+and time; use ``--sizes`` to pick smaller ones.
+
+Usage:
+
+    $ python bench/bench_hash_bits.py [--sizes 1000000,10000000,50000000]
+"""
+
+import argparse
+import array
+import random
+import sys
+import time
+
+import immutables
+
+
+def fold32(h):
+    h &= 0xffffffffffffffff
+    return (h & 0xffffffff) ^ (h >> 32)
+
+
+def count_shared(hashes):
+    """Return the number of distinct values that occur more than once."""
+    hashes = sorted(hashes)
+    shared = 0
+    prev = None
+    counted = False
+    for h in hashes:
+        if h == prev:
+            if not counted:
+                shared += 1
+                counted = True
+        else:
+            prev = h
+            counted = False
+    return shared
+
+
+def bench(size, lookups):
+    keys = ['key-{}'.format(i) for i in range(size)]
+
+    hashes = array.array('q', map(hash, keys))
+    full = count_shared(hashes)
+    folded = count_shared(array.array('Q', map(fold32, hashes)))
+    del hashes
+
+    m = immutables.Map(zip(keys, range(size)))
+
+    sample = random.sample(keys, min(lookups, size))
+    get = m.get
+    started = time.perf_counter()
+    for k in sample:
+        get(k)
+    elapsed = time.perf_counter() - started
+
+    print('{:>12,} {:>18,} {:>18,} {:>14.0f}'.format(
+        size, full, folded, elapsed / len(sample) * 1e9))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--sizes', default='1000000,10000000,50000000')
+    parser.add_argument('--lookups', type=int, default=1000000)
+    args = parser.parse_args()
+
+    print('hash width: {} bits'.format(sys.hash_info.width))
+    print('{:>12} {:>18} {:>18} {:>14}'.format(
+        'keys', 'collision nodes', 'if 32-bit folded', 'get() ns'))
+    for size in args.sizes.split(','):
+        bench(int(size), args.lookups)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,63 @@
+"""Miss-heavy lookup benchmark.
+
+Measures ``Map.get()`` and ``in`` for keys that are *not* in the map.
+Tuple keys are used on purpose: comparing two tuples is a full Python
+level ``__eq__`` call, so every key comparison the trie performs on
+a miss shows up in the timings.
+
+Usage:
+
+    $ python bench/bench_lookup.py [--size N] [--repeat R]
+"""
+
+import argparse
+import time
+
+import immutables
+
+
+def make_keys(n, offset=0):
+    return [(i + offset, 'k', i * 7) for i in range(n)]
+
+
+def bench(label, fn, repeat):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        fn()
+        best = min(best, time.perf_counter() - started)
+    print('{:<32} {:>10.2f} ms'.format(label, best * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=100000)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    keys = make_keys(args.size)
+    missing = make_keys(args.size, offset=args.size)
+    m = immutables.Map(zip(keys, range(args.size)))
+
+    def get_missing():
+        get = m.get
+        for k in missing:
+            get(k)
+
+    def contains_missing():
+        for k in missing:
+            k in m
+
+    def get_present():
+        get = m.get
+        for k in keys:
+            get(k)
+
+    print('Map of {} tuple keys'.format(args.size))
+    bench('get() misses', get_missing, args.repeat)
+    bench('in misses', contains_missing, args.repeat)
+    bench('get() hits', get_present, args.repeat)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,112 @@
+"""Loading a large lookup table at process start.
+
+Writes a table of ``--size`` items (str, int and bytes keys and
+values) to a pickled ``Map`` and to a ``MappedMap`` file, and then, in
+a fresh process for each, reports:
+
+* the time it takes to load the table;
+* the average latency of lookups of keys that are in the table;
+* the memory the process had to allocate for the table by itself,
+  i.e. the memory other processes loading the same table can't share;
+  pages of the file stay in the page cache (``Anonymous`` in
+  ``/proc/self/smaps_rollup``, so Linux only).
+
+Usage:
+
+    $ python bench/bench_mapped.py [--size N] [--lookups L]
+"""
+
+import argparse
+import os
+import pickle
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+import immutables
+
+
+def anonymous_mb():
+    try:
+        with open('/proc/self/smaps_rollup') as f:
+            lines = f.read().splitlines()
+    except OSError:
+        return float('nan')
+
+    kb = 0
+    for line in lines:
+        if line.startswith('Anonymous:'):
+            kb += int(line.split()[1])
+    return kb / 1024
+
+
+def make_items(size):
+    for i in range(size):
+        if i % 3 == 0:
+            yield 'key-{}'.format(i), i
+        elif i % 3 == 1:
+            yield i, 'value-{}'.format(i)
+        else:
+            yield 'key-{}'.format(i).encode(), 'value-{}'.format(i).encode()
+
+
+def child(kind, path, size, lookups):
+    keys = [k for k, _ in make_items(size)]
+    sample = random.Random(0).sample(keys, min(lookups, size))
+    del keys
+
+    before = anonymous_mb()
+    started = time.perf_counter()
+    if kind == 'pickled Map':
+        with open(path, 'rb') as f:
+            table = pickle.load(f)
+    else:
+        table = immutables.MappedMap(path)
+    loaded = time.perf_counter() - started
+
+    get = table.get
+    started = time.perf_counter()
+    for k in sample:
+        get(k)
+    elapsed = time.perf_counter() - started
+
+    print('{:<14} {:>12.1f} {:>12.0f} {:>14.1f}'.format(
+        kind, loaded * 1000, elapsed / len(sample) * 1e9,
+        anonymous_mb() - before))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=5000000)
+    parser.add_argument('--lookups', type=int, default=1000000)
+    parser.add_argument('--child', nargs=2, help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.child:
+        child(args.child[0], args.child[1], args.size, args.lookups)
+        return
+
+    with tempfile.TemporaryDirectory() as dir:
+        pickled = os.path.join(dir, 'table.pickle')
+        mapped = os.path.join(dir, 'table.map')
+
+        m = immutables.Map(make_items(args.size))
+        with open(pickled, 'wb') as f:
+            pickle.dump(m, f, protocol=5)
+        immutables.MappedMap.write(mapped, m)
+        del m
+
+        print('table of {:,} items'.format(args.size))
+        print('{:<14} {:>12} {:>12} {:>14}'.format(
+            '', 'load ms', 'get() ns', 'own MB'))
+        for kind, path in (('pickled Map', pickled), ('MappedMap', mapped)):
+            subprocess.run(
+                [sys.executable, __file__, '--size', str(args.size),
+                 '--lookups', str(args.lookups), '--child', kind, path],
+                check=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,58 @@
+"""Merging large maps.
+
+Reports the time ``Map.update()`` takes to merge one map into
+another for:
+
+* two maps with no keys in common;
+* two maps with half of their keys in common;
+* a large map and a map of a few keys;
+* a map and a version of it derived with a few ``set()`` calls.
+
+Usage:
+
+    $ python bench/bench_merge.py [--size N] [--repeat R]
+"""
+
+import argparse
+import time
+
+import immutables
+
+
+def bench(label, a, b, repeat):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        merged = a.update(b)
+        best = min(best, time.perf_counter() - started)
+        # Don't count the time it takes to free the result.
+        del merged
+    print('{:<28} {:>12.3f} ms'.format(label, best * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=1000000)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    size = args.size
+    a = immutables.Map(('a-{}'.format(i), i) for i in range(size))
+    b = immutables.Map(('b-{}'.format(i), i) for i in range(size))
+    half = immutables.Map(
+        ('a-{}'.format(i), -i) for i in range(size // 2, size + size // 2))
+    few = immutables.Map(('b-{}'.format(i), i) for i in range(20))
+
+    derived = a
+    for i in range(10):
+        derived = derived.set('a-{}'.format(i * 7919 % size), -1)
+
+    print('Maps of {:,} keys'.format(size))
+    bench('no keys in common', a, b, args.repeat)
+    bench('half of the keys in common', a, half, args.repeat)
+    bench('and a map of 20 keys', a, few, args.repeat)
+    bench('and a derived map', a, derived, args.repeat)
+
+
+if __name__ == '__main__':
+    main()
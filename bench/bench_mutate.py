@@ -0,0 +1,57 @@
+"""Loading keys one by one through mutate().
+
+Reports the time it takes to add ``--size`` str -> int items with
+``MapMutation.set()``:
+
+* to an empty map;
+* to a map of ``--size`` other items;
+
+including the time of ``finish()``.
+
+Usage:
+
+    $ python bench/bench_mutate.py [--size N] [--repeat R]
+"""
+
+import argparse
+import time
+
+import immutables
+
+
+def load(m, items):
+    mm = m.mutate()
+    for k, v in items:
+        mm.set(k, v)
+    return mm.finish()
+
+
+def bench(label, m, items, repeat):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        res = load(m, items)
+        best = min(best, time.perf_counter() - started)
+        # Don't count the time it takes to free the result.
+        del res
+    print('{:<28} {:>12.1f} ms'.format(label, best * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=1000000)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    items = [('key-{}'.format(i), i) for i in range(args.size)]
+    other = immutables.Map(
+        ('other-{}'.format(i), i) for i in range(args.size))
+
+    print('Loading {:,} keys'.format(args.size))
+    bench('into an empty map', immutables.Map(), items, args.repeat)
+    bench('into a map of {:,}'.format(args.size), other, items,
+          args.repeat)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,85 @@
+"""Keeping a copy of a map in another process up to date.
+
+Every tick, ``--changes`` keys of a map of ``--size`` items are set
+or deleted, and the new version is shipped to a replica, either as a
+pickled dict of all items or as a patch from the previous version.
+Reports, per tick, the size of what is shipped, the time it takes to
+make it on the sending side, and the time it takes to rebuild the new
+version on the replica.
+
+Usage:
+
+    $ python bench/bench_patch.py [--size N] [--changes C] [--ticks T]
+"""
+
+import argparse
+import pickle
+import random
+import time
+
+import immutables
+
+
+def make_versions(size, changes, ticks):
+    rnd = random.Random(0)
+    m = immutables.Map(('key-{}'.format(i), i) for i in range(size))
+    versions = [m]
+    for tick in range(ticks):
+        with m.mutate() as mm:
+            for _ in range(changes):
+                k = 'key-{}'.format(rnd.randrange(size * 2))
+                if k in mm and rnd.random() < 0.3:
+                    del mm[k]
+                else:
+                    mm[k] = -tick
+            m = mm.finish()
+        versions.append(m)
+    return versions
+
+
+def bench(label, versions, send, receive):
+    sent = 0
+    send_time = 0
+    receive_time = 0
+    replica = versions[0]
+
+    for prev, m in zip(versions, versions[1:]):
+        started = time.perf_counter()
+        data = send(prev, m)
+        send_time += time.perf_counter() - started
+        sent += len(data)
+
+        started = time.perf_counter()
+        replica = receive(replica, data)
+        receive_time += time.perf_counter() - started
+
+    assert replica == versions[-1]
+    ticks = len(versions) - 1
+    print('{:<14} {:>14,.0f} {:>12.3f} {:>12.3f}'.format(
+        label, sent / ticks, send_time / ticks * 1000,
+        receive_time / ticks * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=1000000)
+    parser.add_argument('--changes', type=int, default=100)
+    parser.add_argument('--ticks', type=int, default=10)
+    args = parser.parse_args()
+
+    versions = make_versions(args.size, args.changes, args.ticks)
+
+    print('map of {:,} items, {:,} changes per tick'.format(
+        args.size, args.changes))
+    print('{:<14} {:>14} {:>12} {:>12}'.format(
+        '', 'bytes', 'send ms', 'receive ms'))
+    bench('patch', versions,
+          lambda prev, m: prev.make_patch(m),
+          lambda replica, data: replica.apply_patch(data))
+    bench('pickled dict', versions,
+          lambda prev, m: pickle.dumps(dict(m.items()), 5),
+          lambda replica, data: immutables.Map(pickle.loads(data)))
+
+
+if __name__ == '__main__':
+    main()
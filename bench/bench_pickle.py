@@ -0,0 +1,75 @@
+"""Pickling large maps.
+
+For every map size this reports the time it takes to pickle a map of
+str -> int items and to unpickle it, with pickle protocols 4 and 5
+(the latter passing the shape of the tree out-of-band), and the size
+of the pickle.
+
+Usage:
+
+    $ python bench/bench_pickle.py [--sizes 100000,1000000] [--repeat R]
+"""
+
+import argparse
+import pickle
+import time
+
+import immutables
+
+
+def best_of(fn, repeat):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        res = fn()
+        best = min(best, time.perf_counter() - started)
+        # Don't count the time it takes to free the result.
+        del res
+    return best * 1000
+
+
+def bench(size, protocol, repeat):
+    m = immutables.Map(('key-{}'.format(i), i) for i in range(size))
+
+    if protocol == 5:
+        buffers = []
+        data = pickle.dumps(m, 5, buffer_callback=buffers.append)
+        total = len(data) + sum(len(b.raw()) for b in buffers)
+
+        def dump():
+            return pickle.dumps(m, 5, buffer_callback=[].append)
+
+        def load():
+            return pickle.loads(data, buffers=buffers)
+    else:
+        data = pickle.dumps(m, protocol)
+        total = len(data)
+
+        def dump():
+            return pickle.dumps(m, protocol)
+
+        def load():
+            return pickle.loads(data)
+
+    assert load() == m
+
+    print('{:>10,} {:>6} {:>12.1f} {:>12.1f} {:>12,}'.format(
+        size, protocol, best_of(dump, repeat), best_of(load, repeat),
+        total))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--sizes', default='100000,1000000')
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    print('{:>10} {:>6} {:>12} {:>12} {:>12}'.format(
+        'keys', 'proto', 'dumps ms', 'loads ms', 'bytes'))
+    for size in args.sizes.split(','):
+        for protocol in (4, 5):
+            bench(int(size), protocol, args.repeat)
+
+
+if __name__ == '__main__':
+    main()
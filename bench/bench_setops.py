@@ -0,0 +1,99 @@
+"""Set operations on large maps.
+
+Reports the time ``Map.intersection()``, ``Map.difference()`` and
+``Map.symmetric_difference()`` take for:
+
+* two maps with half of their keys in common;
+* a map and a version of it derived with a few ``set()`` and
+  ``delete()`` calls;
+
+and the time the same operations take when written as a loop over
+the items of the maps, the way they had to be written before.
+
+Usage:
+
+    $ python bench/bench_setops.py [--size N] [--repeat R]
+"""
+
+import argparse
+import time
+
+import immutables
+
+
+def loop_intersection(a, b):
+    with immutables.Map().mutate() as mm:
+        for k, v in a.items():
+            if k in b:
+                mm[k] = v
+        return mm.finish()
+
+
+def loop_difference(a, b):
+    with a.mutate() as mm:
+        for k in b:
+            mm.pop(k, None)
+        return mm.finish()
+
+
+def loop_symmetric_difference(a, b):
+    with a.mutate() as mm:
+        for k, v in b.items():
+            if k in a:
+                del mm[k]
+            else:
+                mm[k] = v
+        return mm.finish()
+
+
+OPS = [
+    ('intersection', immutables.Map.intersection, loop_intersection),
+    ('difference', immutables.Map.difference, loop_difference),
+    ('symmetric_difference', immutables.Map.symmetric_difference,
+     loop_symmetric_difference),
+]
+
+
+def best_of(fn, a, b, repeat):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        res = fn(a, b)
+        best = min(best, time.perf_counter() - started)
+        # Don't count the time it takes to free the result.
+        del res
+    return best * 1000
+
+
+def bench(label, a, b, repeat):
+    print(label)
+    for name, method, loop in OPS:
+        print('  {:<24} {:>12.3f} ms {:>12.3f} ms'.format(
+            name, best_of(method, a, b, repeat),
+            best_of(loop, a, b, repeat)))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=1000000)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    size = args.size
+    a = immutables.Map(('a-{}'.format(i), i) for i in range(size))
+    half = immutables.Map(
+        ('a-{}'.format(i), -i) for i in range(size // 2, size + size // 2))
+
+    derived = a
+    for i in range(10):
+        derived = derived.set('a-{}'.format(i * 7919 % size), -1)
+        derived = derived.delete('a-{}'.format(i * 7907 % size))
+        derived = derived.set('b-{}'.format(i), i)
+
+    print('Maps of {:,} keys {:>24} {:>15}'.format(size, 'method', 'loop'))
+    bench('half of the keys in common', a, half, args.repeat)
+    bench('and a derived map', a, derived, args.repeat)
+
+
+if __name__ == '__main__':
+    main()
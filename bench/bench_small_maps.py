@@ -0,0 +1,83 @@
+"""Latency and memory footprint of small maps.
+
+For every map size from 0 to 16 this reports:
+
+* the latency of ``Map.set()`` adding a new key to a map of that size;
+* the latency of ``Map.get()`` for a key that is in the map (or a
+  missing key for the empty map);
+* the number of bytes allocated per map, i.e. the memory taken by
+  the ``Map`` object and its tree nodes, but not by keys and values.
+
+Usage:
+
+    $ python bench/bench_small_maps.py [--maps N] [--repeat R]
+"""
+
+import argparse
+import time
+import tracemalloc
+
+import immutables
+
+
+def best_of(fn, repeat, loops):
+    best = float('inf')
+    for _ in range(repeat):
+        started = time.perf_counter()
+        fn(loops)
+        best = min(best, time.perf_counter() - started)
+    return best / loops * 1e9
+
+
+def bytes_per_map(keys, count):
+    items = [(k, k) for k in keys]
+    tracemalloc.start()
+    try:
+        before = tracemalloc.get_traced_memory()[0]
+        maps = [immutables.Map(items) for _ in range(count)]
+        after = tracemalloc.get_traced_memory()[0]
+    finally:
+        tracemalloc.stop()
+    # The list holding the maps is not part of the footprint.
+    return (after - before) / len(maps) - 8
+
+
+def bench(size, args):
+    keys = ['key-{}'.format(i) for i in range(size + 1)]
+    m = immutables.Map((k, k) for k in keys[:size])
+    new_key = keys[size]
+    get_key = keys[size // 2] if size else new_key
+
+    def do_set(loops):
+        set = m.set
+        for _ in range(loops):
+            set(new_key, None)
+
+    def do_get(loops):
+        get = m.get
+        for _ in range(loops):
+            get(get_key)
+
+    set_ns = best_of(do_set, args.repeat, args.loops)
+    get_ns = best_of(do_get, args.repeat, args.loops)
+    size_b = bytes_per_map(keys[:size], args.maps)
+
+    print('{:>5} {:>10.1f} {:>10.1f} {:>12.0f}'.format(
+        size, set_ns, get_ns, size_b))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--maps', type=int, default=10000)
+    parser.add_argument('--loops', type=int, default=200000)
+    parser.add_argument('--repeat', type=int, default=5)
+    args = parser.parse_args()
+
+    print('{:>5} {:>10} {:>10} {:>12}'.format(
+        'size', 'set() ns', 'get() ns', 'bytes/map'))
+    for size in range(17):
+        bench(size, args)
+
+
+if __name__ == '__main__':
+    main()
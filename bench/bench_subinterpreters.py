@@ -0,0 +1,112 @@
+"""Map lookups in parallel subinterpreters.
+
+Runs the same lookups in 1 to ``--max-interpreters`` subinterpreters,
+one thread each, every one of them with a map of ``--size`` items of
+its own, and reports the total number of lookups per second.  On
+Python 3.12+ every subinterpreter has its own GIL, so throughput
+scales with the number of interpreters; on older versions they share
+one and it stays flat.
+
+Usage:
+
+    $ python bench/bench_subinterpreters.py [--size N] [--lookups L]
+"""
+
+import argparse
+import sys
+import threading
+import time
+
+
+SETUP = '''\
+import sys
+sys.path[:] = {path!r}
+import immutables
+m = immutables.Map((str(i), i) for i in range({size}))
+keys = [str(i) for i in range(0, {size}, 7)]
+'''
+
+LOOKUPS = '''\
+for _ in range({rounds}):
+    for k in keys:
+        m[k]
+'''
+
+
+def interpreters_api():
+    # Returns create(), run(interp, code) and destroy(interp) of the
+    # subinterpreters module of this version of Python.
+    try:
+        from concurrent import interpreters  # 3.14+
+        return (interpreters.create, lambda i, code: i.exec(code),
+                lambda i: i.close())
+    except ImportError:
+        pass
+
+    try:
+        import _interpreters as mod  # 3.13
+        run_string = mod.exec
+    except ImportError:
+        import _xxsubinterpreters as mod
+        run_string = mod.run_string
+
+    def run(interp, code):
+        err = run_string(interp, code)
+        if err is not None:
+            raise RuntimeError(err)
+
+    return mod.create, run, mod.destroy
+
+
+def bench(api, count, size, lookups):
+    create, run, destroy = api
+    interps = [create() for _ in range(count)]
+    try:
+        setup = SETUP.format(path=sys.path, size=size)
+        for interp in interps:
+            run(interp, setup)
+
+        nkeys = len(range(0, size, 7))
+        rounds = max(1, lookups // nkeys)
+        code = LOOKUPS.format(rounds=rounds)
+        threads = [threading.Thread(target=run, args=(interp, code))
+                   for interp in interps]
+
+        started = time.perf_counter()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.perf_counter() - started
+    finally:
+        for interp in interps:
+            destroy(interp)
+
+    return count * rounds * nkeys / elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=100000)
+    parser.add_argument('--lookups', type=int, default=2000000)
+    parser.add_argument('--max-interpreters', type=int, default=8)
+    args = parser.parse_args()
+
+    api = interpreters_api()
+
+    print('Maps of {:,} items, {:,} lookups per interpreter'.format(
+        args.size, args.lookups))
+    print('{:>12} {:>16} {:>10}'.format(
+        'interpreters', 'lookups/s', 'speedup'))
+    base = None
+    count = 1
+    while count <= args.max_interpreters:
+        rate = bench(api, count, args.size, args.lookups)
+        base = base or rate
+        print('{:>12} {:>16,.0f} {:>9.2f}x'.format(
+            count, rate, rate / base))
+        count *= 2
+
+
+if __name__ == '__main__':
+    main()
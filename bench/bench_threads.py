@@ -0,0 +1,73 @@
+"""Concurrent lookups in a shared map.
+
+Starts 1 to ``--max-threads`` threads that look up random keys of the
+same map of ``--size`` items, and reports the total number of lookups
+per second.  Lookups in a Map don't take locks, so on a free-threaded
+build of Python (3.13t and later) the throughput grows with the number
+of threads; with the GIL, it stays flat.
+
+Usage:
+
+    $ python bench/bench_threads.py [--size N] [--lookups L]
+"""
+
+import argparse
+import random
+import sys
+import threading
+import time
+
+import immutables
+
+
+def worker(m, keys, lookups, barrier):
+    get = m.get
+    barrier.wait()
+    for _ in range(lookups // len(keys)):
+        for k in keys:
+            get(k)
+
+
+def bench(m, keys, threads, lookups):
+    barrier = threading.Barrier(threads + 1)
+    pool = [
+        threading.Thread(target=worker, args=(m, keys, lookups, barrier))
+        for _ in range(threads)
+    ]
+    for t in pool:
+        t.start()
+    barrier.wait()
+    started = time.perf_counter()
+    for t in pool:
+        t.join()
+    return threads * lookups / (time.perf_counter() - started)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=100000)
+    parser.add_argument('--lookups', type=int, default=2000000)
+    parser.add_argument('--max-threads', type=int, default=32)
+    args = parser.parse_args()
+
+    m = immutables.Map(('key-{}'.format(i), i) for i in range(args.size))
+    rnd = random.Random(0)
+    keys = ['key-{}'.format(rnd.randrange(args.size)) for _ in range(1000)]
+
+    gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+    print('map of {:,} items, GIL {}'.format(
+        args.size, 'enabled' if gil else 'disabled'))
+    print('{:>8} {:>16} {:>10}'.format('threads', 'lookups/s', 'speedup'))
+
+    threads = 1
+    base = None
+    while threads <= args.max_threads:
+        rate = bench(m, keys, threads, args.lookups)
+        base = base or rate
+        print('{:>8} {:>16,.0f} {:>9.2f}x'.format(
+            threads, rate, rate / base))
+        threads *= 2
+
+
+if __name__ == '__main__':
+    main()
@@ -5,12 +5,24 @@ import sys
 from typing import TYPE_CHECKING
 
 if TYPE_CHECKING:
+    from ._map import Atom
     from ._map import Map
+    from ._map import MappedMap
+    from ._map import archive
+    from ._map import unarchive
 else:
     try:
+        from ._map import Atom
         from ._map import Map
+        from ._map import MappedMap
+        from ._map import archive
+        from ._map import unarchive
     except ImportError:
+        from .map import Atom
         from .map import Map
+        from .map import MappedMap
+        from .map import archive
+        from .map import unarchive
     else:
         import collections.abc as _abc
         _abc.Mapping.register(Map)
@@ -22,4 +34,11 @@ from ._protocols import MapMutation as MapMutation
 
 from ._version import __version__
 
-__all__ = 'Map',
+
+def get_include() -> str:
+    """Return the directory with capi.h, the header of the C API."""
+    import os.path
+    return os.path.dirname(__file__)
+
+
+__all__ = 'Atom', 'Map', 'MappedMap', 'archive', 'unarchive'
@@ -1,6 +1,10 @@
 #include <stddef.h> /* For offsetof */
 #include "pythoncapi_compat.h"
 #include "_map.h"
+#include "structmember.h"  /* For T_PYSSIZET */
+#define IMMUTABLES_CAPI_IMPLEMENTATION
+#include "capi.h"
+#include <math.h>
 
 
 /*
@@ -96,7 +100,8 @@ These nodes are very simple.  Essentially they are arrays of 32 pointers
 we used to illustrate the high-level idea in the previous section.
 
 We use Array nodes only when we need to store more than 16 pointers
-in a single node.
+in a single node.  Each of their children is a separate node, even
+if it only holds a single key/value pair.
 
 Array nodes do not store key objects or value objects.  They are used
 only as an indirection level - their pointers point to other nodes in
@@ -169,16 +174,55 @@ a number of pointers, but use bitmap compression to eliminate unused
 pointers.
 
 
-Bitmap nodes have two pointers for each item:
+Bitmap nodes keep key/value pairs and sub-nodes apart, and use two
+bitmaps to do that: `b_datamap` has a bit set for every slot that
+holds a key/value pair, and `b_nodemap` has a bit set for every slot
+that points to another tree level.  A slot can't be set in both.
 
-  +----+----+----+----+  --  +----+----+
-  | k1 | v1 | k2 | v2 |  ..  | kN | vN |
-  +----+----+----+----+  --  +----+----+
+Key/value pairs are stored first, two pointers each, in the order
+of their slots.  Sub-nodes follow, one pointer each, in the reverse
+order of their slots:
 
-When kI == NULL, vI points to another tree level.
+  +----+----+----+----+  --  +----+----+  --  +----+----+
+  | k1 | v1 | k2 | v2 |  ..  | kN | vN |  ..  | n2 | n1 |
+  +----+----+----+----+  --  +----+----+  --  +----+----+
 
-When kI != NULL, the actual key object is stored in kI, and its
-value is stored in vI.
+So the index of a key/value pair is computed with `b_datamap`, and
+the index of a sub-node with `b_nodemap`.  Iterating over a node
+yields all of its key/value pairs before descending into its
+sub-nodes.
+
+The pointers are followed by an array of N hashes, one for each
+key/value pair:
+
+  +----+----+  --  +----+----+----+  --  +----+----+  --  +----+
+  | k1 | v1 |  ..  | kN | vN | nM |  ..  | n1 | h1 |  ..  | hN |
+  +----+----+  --  +----+----+----+  --  +----+----+  --  +----+
+
+hI is the hash of kI.  Keeping it around allows to reject a key
+with a different hash by comparing two integers instead of calling
+`__eq__`, and saves us from calling `__hash__` again when the key
+has to be moved to another node.
+
+
+Canonical Shape
+---------------
+
+The tree is kept in a canonical shape: two maps with the same keys
+always have the same tree structure, no matter in which order the
+keys were added or removed.  The following rules make sure of that:
+
+ * A key is stored at the first level where no other key shares
+   its slot.  Once two keys share a slot, they're moved to a
+   sub-node; if a sub-node ends up with a single key/value pair
+   after a deletion, that pair is moved back into the parent node.
+
+ * Collision nodes are only used once all hash bits are consumed;
+   keys with equal hashes are pushed down through a chain of
+   single sub-node Bitmap nodes until then.
+
+ * A node is an Array node if and only if it has more than 16
+   occupied slots.
 
 
 Collision Nodes
@@ -205,6 +249,104 @@ High-level functions accept a MapObject object and dispatch to
 lower-level functions depending on what kind of node h_root points to.
 
 
+Hashing
+-------
+
+Map.__hash__ combines hashes of all keys and values.  To avoid doing
+that for every new version of a map, each node memoizes the combined
+hash of its subtree (the `*_subtree_hash` fields): hashing a map
+derived from an already hashed one only recomputes the nodes on the
+path copied by map_node_assoc or map_node_without.  Nodes updated
+in place by a mutation drop their memoized hash.
+
+
+Garbage Collection
+------------------
+
+Tree nodes and Maps are GC objects, but most maps only hold strings,
+numbers and other objects that can't be part of a reference cycle.
+Like CPython dicts, nodes and Maps are created untracked, and only
+start being tracked once they refer to something the GC may need
+to see (see map_maybe_tracked()).  A map of atomic keys and values
+is then invisible to the GC, no matter how big it is.
+
+A node updated in place by a mutation can start being tracked after
+its parent was checked.  That's why parents re-check their children
+on the way back up, even if the child pointer didn't change.
+
+
+Small Maps
+----------
+
+Most maps are tiny, and for them the tree is pure overhead: an extra
+GC-tracked object to allocate, and bitmap arithmetic on every lookup.
+So maps with up to MAP_SMALL_MAX_COUNT items don't have a tree at all:
+their h_root is NULL, and the items are stored right in the MapObject,
+in the h_entries array, along with the hashes of the keys:
+
+  +-----------+--------+--------+--------+--------+-----+
+  | MapObject | k1 v1 h1        | k2 v2 h2        | ... |
+  +-----------+--------+--------+--------+--------+-----+
+
+Entries are sorted by hash, so a lookup is a linear scan that compares
+hashes and stops as soon as it passes the hash it's looking for.
+
+A map is small if and only if it has no more than MAP_SMALL_MAX_COUNT
+items: adding an item to a full small map builds a tree, and deleting
+an item from a tree of MAP_SMALL_MAX_COUNT + 1 items copies the rest
+of them back into a small map.  MapMutation objects always use a tree.
+
+
+Temporary Maps
+--------------
+
+In `m.set(a, 1).set(b, 2)` nothing but the second call ever sees the
+Map returned by the first one.  Like CPython does for `s += "..."` on
+strings, set() and delete() check whether they were called on such a
+temporary Map, and if so, update it in place and return it instead of
+creating a new one (see map_is_temporary()).
+
+Nodes of its tree that nothing else refers to are updated in place
+too, the way nodes owned by a mutation are: map_node_assoc() and
+map_node_without() are passed MAP_MUTID_UNIQUE, and treat every node
+with a reference count of 1 as owned.  A node that is shared makes
+all the nodes under it shared too, so below one the operation goes
+on with a mutid of 0 and copies nodes.  Chains of set() calls then
+allocate a node or two per call, instead of one per tree level.
+
+Only Python 3.14 and later can tell temporary Maps apart, with
+PyUnstable_Object_IsUniqueReferencedTemporary(): a reference count of
+1 isn't enough, as C code calling m.set() may hold the only reference
+to "m" and expect it to stay the same.  Older versions always copy.
+
+
+Spare Room
+----------
+
+Adding a key to a Bitmap node makes a copy of it one pair larger,
+which is what keeps other maps sharing the node intact.  A node
+owned by a mutation doesn't need the copy, but it has no room for
+the new pair either, so loading many keys through mutate() would
+spend most of its time in the allocator.
+
+So when a MapMutation (whose mutid has the MAP_MUTID_SPARE bit
+set) outgrows a Bitmap node it owns, the new node has twice the
+pointers of the old one.  Then Py_SIZE() of the node is its
+capacity, the unused pointers between the key/value pairs and the
+sub-nodes are NULL, and there are hashes for as many pairs as would
+fit:
+
+  +----+----+  --  +----+----+------+  --  +----+  --  +----+  --
+  | k1 | v1 |  ..  | kN | vN | NULL |  ..  | n1 | h1 |  ..  | hN | ..
+  +----+----+  --  +----+----+------+  --  +----+  --  +----+  --
+
+Inserting a pair into such a node only shifts the pairs after it,
+and so does pushing a pair down into a new sub-node.  Nodes the
+mutation copies from other maps get no spare room, as most of them
+only ever get one new key.  MapMutation.finish() shrinks the nodes
+that have room left (see map_node_trim()), so maps never keep it.
+
+
 Operations
 ==========
 
@@ -249,11 +391,6 @@ Further Reading
 */
 
 
-#define IS_ARRAY_NODE(node)     (Py_TYPE(node) == &_Map_ArrayNode_Type)
-#define IS_BITMAP_NODE(node)    (Py_TYPE(node) == &_Map_BitmapNode_Type)
-#define IS_COLLISION_NODE(node) (Py_TYPE(node) == &_Map_CollisionNode_Type)
-
-
 /* Return type for 'find' (lookup a key) functions.
 
    * F_ERROR - an error occurred;
@@ -285,49 +422,299 @@ typedef enum {I_ITEM, I_END} map_iter_t;
 
 #define HAMT_ARRAY_NODE_SIZE 32
 
+/* Maps with up to this many items are stored as a flat array. */
+#define MAP_SMALL_MAX_COUNT 8
+
+#define IS_SMALL_MAP(o)         (((BaseMapObject *)(o))->b_root == NULL)
+
+/* Number of bits in a key hash.  Keys that end up in the same slot
+   after all of them are consumed have equal hashes and are stored
+   in a Collision node. */
+#define HAMT_HASH_BITS (SIZEOF_PY_HASH_T * 8)
+
+/* The value of `*_subtree_hash` fields of nodes whose hash hasn't
+   been computed yet.  A subtree whose hash happens to be equal to it
+   is just rehashed every time. */
+#define HAMT_NO_HASH ((Py_uhash_t)-1)
+
 
 typedef struct {
     PyObject_HEAD
     MapNode *a_array[HAMT_ARRAY_NODE_SIZE];
     Py_ssize_t a_count;
     uint64_t a_mutid;
+    Py_uhash_t a_subtree_hash;
 } MapNode_Array;
 
 
 typedef struct {
     PyObject_VAR_HEAD
     uint64_t b_mutid;
-    uint32_t b_bitmap;
+    Py_uhash_t b_subtree_hash;
+    uint32_t b_datamap;
+    uint32_t b_nodemap;
     PyObject *b_array[1];
 } MapNode_Bitmap;
 
+/* Number of extra `b_array` items we need to allocate to store
+   `count` key hashes after the pointers. */
+#define BITMAP_HASHES_ITEMS(count)                                  \
+    (((count) * (Py_ssize_t)sizeof(Py_hash_t) +                       \
+      (Py_ssize_t)sizeof(PyObject *) - 1) /                         \
+     (Py_ssize_t)sizeof(PyObject *))
+
+/* The array of key hashes that follows the pointers. */
+#define BITMAP_HASHES(node)                                         \
+    ((Py_hash_t *)((char *)((MapNode_Bitmap *)(node))->b_array +      \
+                 (size_t)Py_SIZE(node) * sizeof(PyObject *)))
+
+/* Sub-nodes are stored at the end of `b_array` in reverse order;
+   the `b_array` index of the `idx`-th sub-node. */
+#define BITMAP_NODE_IDX(node, idx)                                  \
+    (Py_SIZE(node) - 1 - (idx))
+
+/* The `idx`-th sub-node. */
+#define BITMAP_NODE(node, idx)                                      \
+    ((MapNode *)(node)->b_array[BITMAP_NODE_IDX(node, idx)])
+
 
 typedef struct {
     PyObject_VAR_HEAD
     uint64_t c_mutid;
-    int32_t c_hash;
+    Py_uhash_t c_subtree_hash;
+    Py_hash_t c_hash;
     PyObject *c_array[1];
 } MapNode_Collision;
 
 
-static volatile uint64_t mutid_counter = 1;
+/* Free-threaded builds (PEP 703).
+
+   Maps and their nodes never change once they are shared, so they
+   are read without locks.  The only fields written after that are
+   the cached hashes, which are computed on demand; racing threads
+   store the same value, and the loads and stores are atomic.
+
+   MapMutations and iterators are updated in place, so their methods
+   run in a critical section of the object, which is a no-op in builds
+   with the GIL. */
+
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#  define Py_BEGIN_CRITICAL_SECTION(op) {
+#  define Py_END_CRITICAL_SECTION() }
+#  define Py_BEGIN_CRITICAL_SECTION2(a, b) {
+#  define Py_END_CRITICAL_SECTION2() }
+#endif
+
+#ifdef Py_GIL_DISABLED
+#  define MAP_LOAD_HASH(field) \
+       _Py_atomic_load_ssize_relaxed(&(field))
+#  define MAP_STORE_HASH(field, value) \
+       _Py_atomic_store_ssize_relaxed(&(field), (value))
+#  define MAP_LOAD_UHASH(field) \
+       ((Py_uhash_t)_Py_atomic_load_ssize_relaxed((Py_ssize_t *)&(field)))
+#  define MAP_STORE_UHASH(field, value) \
+       _Py_atomic_store_ssize_relaxed((Py_ssize_t *)&(field), \
+                                      (Py_ssize_t)(value))
+#else
+#  define MAP_LOAD_HASH(field) (field)
+#  define MAP_STORE_HASH(field, value) ((field) = (value))
+#  define MAP_LOAD_UHASH(field) (field)
+#  define MAP_STORE_UHASH(field, value) ((field) = (value))
+#endif
+
+
+/* Freed tree nodes are kept for reuse, the way CPython keeps freed
+   tuples: persistent set() and delete() allocate a node per tree
+   level and free the ones they replace once the old map is gone.
+
+   Bitmap nodes are kept by the number of items of their allocation
+   (pointers, then hashes), up to a node of 16 key/value pairs; Array
+   nodes and Collision nodes of two key/value pairs, the most common
+   ones, have a freelist each.  Nodes on a freelist are linked through
+   their first pointer.
+
+   Free-threaded builds share module state between threads, and
+   their allocator has per-thread free lists of its own. */
+
+#ifndef Py_GIL_DISABLED
+#  define MAP_NODE_FREELISTS
+#endif
+
+#define MAP_BITMAP_FREELIST_SIZES \
+    (HAMT_ARRAY_NODE_SIZE + BITMAP_HASHES_ITEMS(HAMT_ARRAY_NODE_SIZE / 2) + 1)
+#define MAP_BITMAP_FREELIST_MAX 100
+#define MAP_ARRAY_FREELIST_MAX 100
+#define MAP_COLLISION_FREELIST_SIZE 4
+#define MAP_COLLISION_FREELIST_MAX 20
+
+
+/* The state of a module instance.  Every interpreter that imports
+   the module creates an instance with types of its own, so that no
+   object is shared between interpreters (PEP 684). */
+typedef struct {
+    PyTypeObject *MapType;
+    PyTypeObject *MapMutationType;
+    PyTypeObject *ArrayNodeType;
+    PyTypeObject *BitmapNodeType;
+    PyTypeObject *CollisionNodeType;
+    PyTypeObject *KeysType;
+    PyTypeObject *ValuesType;
+    PyTypeObject *ItemsType;
+    PyTypeObject *KeysIterType;
+    PyTypeObject *ValuesIterType;
+    PyTypeObject *ItemsIterType;
+    PyTypeObject *MappedMapType;
+    PyTypeObject *MappedMapViewType;
+    PyTypeObject *MappedMapIterType;
+    PyTypeObject *AtomType;
+
+    /* Since bitmap nodes are immutable, one empty node is reused
+       whenever an empty bitmap node is needed.  It's created with the
+       module, so that threads never race to create it. */
+    MapNode_Bitmap *empty_bitmap_node;
+
+#ifdef MAP_NODE_FREELISTS
+    MapNode_Bitmap *bitmap_freelist[MAP_BITMAP_FREELIST_SIZES];
+    int bitmap_numfree[MAP_BITMAP_FREELIST_SIZES];
+    MapNode_Array *array_freelist;
+    int array_numfree;
+    MapNode_Collision *collision_freelist;
+    int collision_numfree;
+#endif
+
+    /* immutables._map._unpickle(), which rebuilds pickled Maps. */
+    PyObject *unpickle_func;
+
+    uint64_t mutid_counter;
+} MapState;
+
+
+/* Return the state of the module instance that created the type of
+   "o", which has to be one of the types of the module. */
+static inline MapState *
+map_state(void *o)
+{
+    return (MapState *)PyType_GetModuleState(Py_TYPE(o));
+}
+
+/* Return a mutid no other mutation uses. */
+static inline uint64_t
+map_new_mutid(MapState *st)
+{
+#ifdef Py_GIL_DISABLED
+    return _Py_atomic_add_uint64(&st->mutid_counter, 1);
+#else
+    return st->mutid_counter++;
+#endif
+}
+
+
+/* The mutid set() and delete() of temporary Maps pass down the tree;
+   it's never handed out to a mutation.  See "Temporary Maps". */
+#define MAP_MUTID_UNIQUE UINT64_MAX
+
+/* Mutids of MapMutation objects have this bit set: Bitmap nodes
+   they outgrow are replaced with nodes that have spare room.  See
+   "Spare Room". */
+#define MAP_MUTID_SPARE ((uint64_t)1 << 63)
+#define MAP_MUTID_HAS_SPARE(mutid) \
+    (((mutid) & MAP_MUTID_SPARE) && (mutid) != MAP_MUTID_UNIQUE)
+
+/* Whether an operation with "mutid" can update a node created with
+   "node_mutid" in place. */
+#define MAP_NODE_OWNED(node_mutid, mutid) \
+    ((mutid) != 0 && \
+     ((mutid) == MAP_MUTID_UNIQUE || (node_mutid) == (mutid)))
+
+#if PY_VERSION_HEX >= 0x030E0000
+#  define MAP_IS_UNIQUE_TEMPORARY(o) \
+       PyUnstable_Object_IsUniqueReferencedTemporary((PyObject *)(o))
+#  define MAP_IS_UNIQUE(o) \
+       PyUnstable_Object_IsUniquelyReferenced((PyObject *)(o))
+#elif !defined(Py_GIL_DISABLED)
+#  define MAP_IS_UNIQUE_TEMPORARY(o) 0
+#  define MAP_IS_UNIQUE(o) (Py_REFCNT(o) == 1)
+#else
+#  define MAP_IS_UNIQUE_TEMPORARY(o) 0
+#  define MAP_IS_UNIQUE(o) 0
+#endif
+
+
+/* Types are immutable, and types of objects only the module creates
+   can't be instantiated, on Python 3.10+; on 3.9 the latter get no
+   tp_new instead. */
+
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+#define MAP_TPFLAGS_IMMUTABLE Py_TPFLAGS_IMMUTABLETYPE
+#else
+#define MAP_TPFLAGS_IMMUTABLE 0
+#endif
+
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+#define MAP_TPFLAGS_INTERNAL \
+    (MAP_TPFLAGS_IMMUTABLE | Py_TPFLAGS_DISALLOW_INSTANTIATION)
+#else
+#define MAP_TPFLAGS_INTERNAL MAP_TPFLAGS_IMMUTABLE
+#endif
+
+#ifdef Py_TPFLAGS_MAPPING
+#define MAP_TPFLAGS_MAPPING Py_TPFLAGS_MAPPING
+#else
+#define MAP_TPFLAGS_MAPPING 0
+#endif
+
+
+/* Every module instance has types of its own, so objects are told
+   apart by their deallocators, which are the same for all of them. */
+
+static void
+map_tp_dealloc(MapObject *self);
+
+static void
+mapmut_tp_dealloc(MapMutationObject *self);
+
+static void
+map_node_array_dealloc(MapNode_Array *self);
+
+static void
+map_node_bitmap_dealloc(MapNode_Bitmap *self);
+
+static void
+map_node_collision_dealloc(MapNode_Collision *self);
 
-static MapNode_Bitmap *_empty_bitmap_node;
+#define Map_Check(o) \
+    (Py_TYPE(o)->tp_dealloc == (destructor)map_tp_dealloc)
+#define MapMutation_Check(o) \
+    (Py_TYPE(o)->tp_dealloc == (destructor)mapmut_tp_dealloc)
+#define IS_ARRAY_NODE(node) \
+    (Py_TYPE(node)->tp_dealloc == (destructor)map_node_array_dealloc)
+#define IS_BITMAP_NODE(node) \
+    (Py_TYPE(node)->tp_dealloc == (destructor)map_node_bitmap_dealloc)
+#define IS_COLLISION_NODE(node) \
+    (Py_TYPE(node)->tp_dealloc == (destructor)map_node_collision_dealloc)
 
 
 /* Create a new HAMT immutable mapping. */
 static MapObject *
-map_new(void);
+map_new(MapState *st);
 
 /* Return a new collection based on "o", but with an additional
    key/val pair. */
 static MapObject *
 map_assoc(MapObject *o, PyObject *key, PyObject *val);
 
+/* Like map_assoc(), for a key whose hash is already known. */
+static MapObject *
+map_assoc_hashed(MapObject *o, PyObject *key, Py_hash_t key_hash,
+                 PyObject *val);
+
 /* Return a new collection based on "o", but without "key". */
 static MapObject *
 map_without(MapObject *o, PyObject *key);
 
+static MapObject *
+map_without_hashed(MapObject *o, PyObject *key, Py_hash_t key_hash);
+
 /* Check if "v" is equal to "w".
 
    Return:
@@ -341,41 +728,70 @@ map_eq(BaseMapObject *v, BaseMapObject *w);
 static map_find_t
 map_find(BaseMapObject *o, PyObject *key, PyObject **val);
 
+static map_find_t
+map_find_hashed(BaseMapObject *o, PyObject *key, Py_hash_t key_hash,
+                PyObject **val);
+
 /* Return the size of "o"; equivalent of "len(o)". */
 static Py_ssize_t
 map_len(BaseMapObject *o);
 
 
 static MapObject *
-map_alloc(void);
+map_alloc(MapState *st, Py_ssize_t small_count);
 
 static MapNode *
 map_node_assoc(MapNode *node,
-               uint32_t shift, int32_t hash,
+               uint32_t shift, Py_hash_t hash,
                PyObject *key, PyObject *val, int* added_leaf,
                uint64_t mutid);
 
 static map_without_t
 map_node_without(MapNode *node,
-                 uint32_t shift, int32_t hash,
+                 uint32_t shift, Py_hash_t hash,
                  PyObject *key,
                  MapNode **new_node,
                  uint64_t mutid);
 
 static map_find_t
 map_node_find(MapNode *node,
-              uint32_t shift, int32_t hash,
+              uint32_t shift, Py_hash_t hash,
               PyObject *key, PyObject **val);
 
+static map_find_t
+map_node_find_item(MapNode *node,
+                   uint32_t shift, Py_hash_t hash,
+                   PyObject *key, PyObject **found_key, PyObject **val);
+
+static PyObject *
+map_py_mutate(MapObject *self, PyObject *args);
+
+static int
+mapmut_set(MapMutationObject *o, PyObject *key, Py_hash_t key_hash,
+           PyObject *val);
+
+static int
+mapmut_delete(MapMutationObject *o, PyObject *key, Py_hash_t key_hash);
+
+static int
+mapmut_finish(MapMutationObject *o);
+
 static int
 map_node_dump(MapNode *node,
               _PyUnicodeWriter *writer, int level);
 
+static int
+map_node_hash(MapNode *node, Py_uhash_t *hash);
+
+static int
+map_node_eq(MapNode *v, MapNode *w);
+
 static MapNode *
-map_node_array_new(Py_ssize_t, uint64_t mutid);
+map_node_array_new(MapState *st, Py_ssize_t, uint64_t mutid);
 
 static MapNode *
-map_node_collision_new(int32_t hash, Py_ssize_t size, uint64_t mutid);
+map_node_collision_new(MapState *st, Py_hash_t hash, Py_ssize_t size,
+                       uint64_t mutid);
 
 static inline Py_ssize_t
 map_node_collision_count(MapNode_Collision *node);
@@ -418,41 +834,51 @@ _map_node_array_validate(void *o)
 
 
 /* Returns -1 on error */
-static inline int32_t
+static inline Py_hash_t
 map_hash(PyObject *o)
 {
-    Py_hash_t hash = PyObject_Hash(o);
+    /* We use the full hash of the key: on 64-bit platforms this
+       makes the tree deeper (see _Py_HAMT_MAX_TREE_DEPTH), but
+       Collision nodes are only needed for keys whose hashes are
+       actually equal.
+    */
+    return PyObject_Hash(o);
+}
 
-#if SIZEOF_PY_HASH_T <= 4
-    return hash;
-#else
-    if (hash == -1) {
-        /* exception */
+static Py_uhash_t
+_shuffle_bits(Py_uhash_t h)
+{
+    return ((h ^ 89869747UL) ^ (h << 16)) * 3644798167UL;
+}
+
+static inline int
+map_hash_item(PyObject *key, PyObject *val, Py_uhash_t *hash)
+{
+    /* Mix a key/value pair into *hash; see map_py_hash(). */
+
+    Py_hash_t h = PyObject_Hash(key);
+    if (h == -1) {
         return -1;
     }
+    *hash ^= _shuffle_bits((Py_uhash_t)h);
 
-    /* While it's suboptimal to reduce Python's 64 bit hash to
-       32 bits via XOR, it seems that the resulting hash function
-       is good enough (this is also how Long type is hashed in Java.)
-       Storing 10, 100, 1000 Python strings results in a relatively
-       shallow and uniform tree structure.
-
-       Please don't change this hashing algorithm, as there are many
-       tests that test some exact tree shape to cover all code paths.
-    */
-    int32_t xored = (int32_t)(hash & 0xffffffffl) ^ (int32_t)(hash >> 32);
-    return xored == -1 ? -2 : xored;
-#endif
+    h = PyObject_Hash(val);
+    if (h == -1) {
+        return -1;
+    }
+    *hash ^= _shuffle_bits((Py_uhash_t)h);
+    return 0;
 }
 
 static inline uint32_t
-map_mask(int32_t hash, uint32_t shift)
+map_mask(Py_hash_t hash, uint32_t shift)
 {
-    return (((uint32_t)hash >> shift) & 0x01f);
+    assert(shift < HAMT_HASH_BITS);
+    return (uint32_t)(((Py_uhash_t)hash >> shift) & 0x01f);
 }
 
 static inline uint32_t
-map_bitpos(int32_t hash, uint32_t shift)
+map_bitpos(Py_hash_t hash, uint32_t shift)
 {
     return (uint32_t)1 << map_mask(hash, shift);
 }
@@ -477,6 +903,37 @@ map_bitcount(uint32_t i)
     return (((i + (i >> 4)) & 0xF0F0F0F) * 0x1010101) >> 24;
 }
 
+static inline int
+map_maybe_tracked(PyObject *o)
+{
+    /* Return 0 if the GC doesn't need to see "o": either it's not
+       a GC object, or it's an untracked object that can't start
+       referring to containers later.  Tuples, Maps and tree nodes
+       don't change once they are shared, so for them being
+       untracked is final. */
+
+    if (!PyType_IS_GC(Py_TYPE(o))) {
+        return 0;
+    }
+    if (PyTuple_CheckExact(o) || Map_Check(o) || IS_BITMAP_NODE(o) ||
+            IS_ARRAY_NODE(o) || IS_COLLISION_NODE(o))
+    {
+        return PyObject_GC_IsTracked(o);
+    }
+    return 1;
+}
+
+static inline void
+map_gc_track_if(void *container, PyObject *o)
+{
+    /* Start tracking "container" (a tree node or a Map), as it now
+       refers to "o", if the GC may need to see "o". */
+
+    if (map_maybe_tracked(o) && !PyObject_GC_IsTracked(container)) {
+        PyObject_GC_Track(container);
+    }
+}
+
 static inline uint32_t
 map_bitindex(uint32_t bitmap, uint32_t bit)
 {
@@ -549,27 +1006,38 @@ _map_dump_format(_PyUnicodeWriter *writer, const char *format, ...)
 /////////////////////////////////// Bitmap Node
 
 
-static MapNode *
-map_node_bitmap_new(Py_ssize_t size, uint64_t mutid)
+static MapNode_Bitmap *
+map_node_bitmap_alloc(MapState *st, Py_ssize_t size, Py_ssize_t hash_count,
+                      uint64_t mutid)
 {
-    /* Create a new bitmap node of size 'size' */
+    /* Allocate a new empty bitmap node of 'size' pointers, followed
+       by room for 'hash_count' hashes. */
 
     MapNode_Bitmap *node;
     Py_ssize_t i;
 
-    assert(size >= 0);
-    assert(size % 2 == 0);
+    assert(size >= 0 && size <= 2 * HAMT_ARRAY_NODE_SIZE);
+    assert(hash_count >= 0 && 2 * hash_count <= size + 1);
 
-    if (size == 0 && _empty_bitmap_node != NULL && mutid == 0) {
-        Py_INCREF(_empty_bitmap_node);
-        return (MapNode *)_empty_bitmap_node;
-    }
+    Py_ssize_t items = size + BITMAP_HASHES_ITEMS(hash_count);
 
-    /* No freelist; allocate a new bitmap node */
-    node = PyObject_GC_NewVar(
-        MapNode_Bitmap, &_Map_BitmapNode_Type, size);
-    if (node == NULL) {
-        return NULL;
+#ifdef MAP_NODE_FREELISTS
+    if (items < MAP_BITMAP_FREELIST_SIZES &&
+        (node = st->bitmap_freelist[items]) != NULL)
+    {
+        st->bitmap_freelist[items] = (MapNode_Bitmap *)node->b_array[0];
+        st->bitmap_numfree[items]--;
+        (void)PyObject_InitVar(
+            (PyVarObject *)node, st->BitmapNodeType, size);
+    }
+    else
+#endif
+    {
+        node = PyObject_GC_NewVar(
+            MapNode_Bitmap, st->BitmapNodeType, items);
+        if (node == NULL) {
+            return NULL;
+        }
     }
 
     Py_SET_SIZE(node, size);
@@ -578,26 +1046,165 @@ map_node_bitmap_new(Py_ssize_t size, uint64_t mutid)
         node->b_array[i] = NULL;
     }
 
-    node->b_bitmap = 0;
+    Py_hash_t *hashes = BITMAP_HASHES(node);
+    for (i = 0; i < hash_count; i++) {
+        hashes[i] = 0;
+    }
+
+    node->b_datamap = 0;
+    node->b_nodemap = 0;
     node->b_mutid = mutid;
+    node->b_subtree_hash = HAMT_NO_HASH;
 
-    PyObject_GC_Track(node);
+    /* The node is tracked once something the GC needs to see is
+       stored in it. */
 
-    if (size == 0 && _empty_bitmap_node == NULL && mutid == 0) {
-        /* Since bitmap nodes are immutable, we can cache the instance
-           for size=0 and reuse it whenever we need an empty bitmap node.
-        */
-        _empty_bitmap_node = node;
-        Py_INCREF(_empty_bitmap_node);
+    return node;
+}
+
+static MapNode *
+map_node_bitmap_new(MapState *st,
+                    Py_ssize_t data_count, Py_ssize_t node_count,
+                    uint64_t mutid)
+{
+    /* Create a new bitmap node with room for 'data_count' key/value
+       pairs and 'node_count' sub-nodes. */
+
+    Py_ssize_t size = 2 * data_count + node_count;
+
+    assert(data_count >= 0 && node_count >= 0);
+    assert(data_count + node_count <= HAMT_ARRAY_NODE_SIZE);
+
+    if (size == 0 && st->empty_bitmap_node != NULL && mutid == 0) {
+        Py_INCREF(st->empty_bitmap_node);
+        return (MapNode *)st->empty_bitmap_node;
     }
 
-    return (MapNode *)node;
+    return (MapNode *)map_node_bitmap_alloc(st, size, data_count, mutid);
 }
 
 static inline Py_ssize_t
-map_node_bitmap_count(MapNode_Bitmap *node)
+map_node_bitmap_data_count(MapNode_Bitmap *node)
 {
-    return Py_SIZE(node) / 2;
+    return (Py_ssize_t)map_bitcount(node->b_datamap);
+}
+
+static inline Py_ssize_t
+map_node_bitmap_node_count(MapNode_Bitmap *node)
+{
+    return (Py_ssize_t)map_bitcount(node->b_nodemap);
+}
+
+static inline Py_ssize_t
+map_node_bitmap_used(MapNode_Bitmap *node)
+{
+    /* The number of pointers in use; less than Py_SIZE(node) if the
+       node has spare room (see "Spare Room"). */
+
+    return 2 * map_node_bitmap_data_count(node) +
+        map_node_bitmap_node_count(node);
+}
+
+static inline Py_ssize_t
+map_node_bitmap_spare_size(MapNode_Bitmap *node, Py_ssize_t size)
+{
+    /* The size of a node with spare room that replaces 'node' once
+       it needs 'size' pointers. */
+
+    Py_ssize_t spare = 2 * Py_SIZE(node);
+    /* Bitmap nodes hold at most 16 key/value pairs. */
+    if (spare > HAMT_ARRAY_NODE_SIZE) {
+        spare = HAMT_ARRAY_NODE_SIZE;
+    }
+    return spare > size ? spare : size;
+}
+
+static inline int
+map_node_bitmap_is_single_pair(MapNode *node)
+{
+    /* Return 1 if 'node' is a Bitmap node holding exactly one
+       key/value pair and no sub-nodes.  Such nodes are always
+       inlined into their Bitmap parents. */
+
+    if (!IS_BITMAP_NODE(node)) {
+        return 0;
+    }
+    MapNode_Bitmap *b = (MapNode_Bitmap *)node;
+    return b->b_nodemap == 0 &&
+           b->b_datamap != 0 &&
+           (b->b_datamap & (b->b_datamap - 1)) == 0;
+}
+
+static inline void
+map_node_bitmap_copy_data(MapNode_Bitmap *dst, Py_ssize_t dst_idx,
+                          MapNode_Bitmap *src, Py_ssize_t src_idx,
+                          Py_ssize_t count)
+{
+    /* Copy 'count' key/value pairs along with their hashes from
+       'src' to 'dst'. */
+
+    Py_hash_t *dst_hashes = BITMAP_HASHES(dst);
+    Py_hash_t *src_hashes = BITMAP_HASHES(src);
+    Py_ssize_t i;
+
+    for (i = 0; i < count; i++) {
+        PyObject *key = src->b_array[2 * (src_idx + i)];
+        PyObject *val = src->b_array[2 * (src_idx + i) + 1];
+        Py_INCREF(key);
+        dst->b_array[2 * (dst_idx + i)] = key;
+        Py_INCREF(val);
+        dst->b_array[2 * (dst_idx + i) + 1] = val;
+        dst_hashes[dst_idx + i] = src_hashes[src_idx + i];
+        map_gc_track_if(dst, key);
+        map_gc_track_if(dst, val);
+    }
+}
+
+static inline void
+map_node_bitmap_copy_nodes(MapNode_Bitmap *dst, Py_ssize_t dst_idx,
+                           MapNode_Bitmap *src, Py_ssize_t src_idx,
+                           Py_ssize_t count)
+{
+    /* Copy 'count' sub-node pointers from 'src' to 'dst'. */
+
+    Py_ssize_t i;
+
+    for (i = 0; i < count; i++) {
+        MapNode *node = BITMAP_NODE(src, src_idx + i);
+        Py_INCREF(node);
+        dst->b_array[BITMAP_NODE_IDX(dst, dst_idx + i)] = (PyObject *)node;
+        map_gc_track_if(dst, (PyObject *)node);
+    }
+}
+
+static inline void
+map_node_bitmap_set_pair(MapNode_Bitmap *node, Py_ssize_t idx,
+                         Py_hash_t hash, PyObject *key, PyObject *val)
+{
+    Py_INCREF(key);
+    node->b_array[2 * idx] = key;
+    Py_INCREF(val);
+    node->b_array[2 * idx + 1] = val;
+    BITMAP_HASHES(node)[idx] = hash;
+    map_gc_track_if(node, key);
+    map_gc_track_if(node, val);
+}
+
+static MapNode *
+map_node_bitmap_new_pair(MapState *st, uint32_t shift, Py_hash_t hash,
+                         PyObject *key, PyObject *val, uint64_t mutid)
+{
+    /* Create a new Bitmap node with one key/value pair. */
+
+    MapNode_Bitmap *node = (MapNode_Bitmap *)map_node_bitmap_new(
+        st, 1, 0, mutid);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    map_node_bitmap_set_pair(node, 0, hash, key, val);
+    node->b_datamap = map_bitpos(hash, shift);
+    return (MapNode *)node;
 }
 
 static MapNode_Bitmap *
@@ -606,122 +1213,315 @@ map_node_bitmap_clone(MapNode_Bitmap *node, uint64_t mutid)
     /* Clone a bitmap node; return a new one with the same child notes. */
 
     MapNode_Bitmap *clone;
-    Py_ssize_t i;
+    Py_ssize_t data_count = map_node_bitmap_data_count(node);
+    Py_ssize_t node_count = map_node_bitmap_node_count(node);
 
     clone = (MapNode_Bitmap *)map_node_bitmap_new(
-        Py_SIZE(node), mutid);
+        map_state(node), data_count, node_count, mutid);
     if (clone == NULL) {
         return NULL;
     }
 
-    for (i = 0; i < Py_SIZE(node); i++) {
-        Py_XINCREF(node->b_array[i]);
-        clone->b_array[i] = node->b_array[i];
-    }
+    map_node_bitmap_copy_data(clone, 0, node, 0, data_count);
+    map_node_bitmap_copy_nodes(clone, 0, node, 0, node_count);
 
-    clone->b_bitmap = node->b_bitmap;
+    clone->b_datamap = node->b_datamap;
+    clone->b_nodemap = node->b_nodemap;
     return clone;
 }
 
 static MapNode_Bitmap *
-map_node_bitmap_clone_without(MapNode_Bitmap *o, uint32_t bit, uint64_t mutid)
+map_node_bitmap_clone_with(MapNode_Bitmap *o, uint32_t bit,
+                           Py_hash_t hash, PyObject *key, PyObject *val,
+                           uint64_t mutid)
 {
-    assert(bit & o->b_bitmap);
-    assert(map_node_bitmap_count(o) > 1);
+    /* Clone 'o' adding a new key/value pair at 'bit'. */
 
-    MapNode_Bitmap *new = (MapNode_Bitmap *)map_node_bitmap_new(
-        Py_SIZE(o) - 2, mutid);
-    if (new == NULL) {
-        return NULL;
-    }
+    assert(((o->b_datamap | o->b_nodemap) & bit) == 0);
 
-    uint32_t idx = map_bitindex(o->b_bitmap, bit);
-    uint32_t key_idx = 2 * idx;
-    uint32_t val_idx = key_idx + 1;
-    uint32_t i;
+    Py_ssize_t data_count = map_node_bitmap_data_count(o);
+    Py_ssize_t node_count = map_node_bitmap_node_count(o);
+    Py_ssize_t idx = map_bitindex(o->b_datamap, bit);
+    Py_ssize_t size = 2 * (data_count + 1) + node_count;
 
-    for (i = 0; i < key_idx; i++) {
-        Py_XINCREF(o->b_array[i]);
-        new->b_array[i] = o->b_array[i];
+    if (MAP_MUTID_HAS_SPARE(mutid) && o->b_mutid == mutid) {
+        /* The mutation has outgrown a node of its own. */
+        size = map_node_bitmap_spare_size(o, size);
     }
 
-    assert(Py_SIZE(o) >= 0 && Py_SIZE(o) <= 32);
-    for (i = val_idx + 1; i < (uint32_t)Py_SIZE(o); i++) {
-        Py_XINCREF(o->b_array[i]);
-        new->b_array[i - 2] = o->b_array[i];
+    MapNode_Bitmap *new = map_node_bitmap_alloc(
+        map_state(o), size, (size - node_count + 1) / 2, mutid);
+    if (new == NULL) {
+        return NULL;
     }
 
-    new->b_bitmap = o->b_bitmap & ~bit;
+    map_node_bitmap_copy_data(new, 0, o, 0, idx);
+    map_node_bitmap_set_pair(new, idx, hash, key, val);
+    map_node_bitmap_copy_data(new, idx + 1, o, idx, data_count - idx);
+    map_node_bitmap_copy_nodes(new, 0, o, 0, node_count);
+
+    new->b_datamap = o->b_datamap | bit;
+    new->b_nodemap = o->b_nodemap;
     return new;
 }
 
-static MapNode *
-map_node_new_bitmap_or_collision(uint32_t shift,
-                                 PyObject *key1, PyObject *val1,
-                                 int32_t key2_hash,
-                                 PyObject *key2, PyObject *val2,
-                                 uint64_t mutid)
+static void
+map_node_bitmap_insert(MapNode_Bitmap *node, uint32_t bit,
+                       Py_hash_t hash, PyObject *key, PyObject *val)
 {
-    /* Helper method.  Creates a new node for key1/val and key2/val2
-       pairs.
+    /* Add a new key/value pair at 'bit' to 'node' in place; the
+       node must have room for it. */
 
-       If key1 hash is equal to the hash of key2, a Collision node
-       will be created.  If they are not equal, a Bitmap node is
-       created.
-    */
+    assert(((node->b_datamap | node->b_nodemap) & bit) == 0);
+    assert(map_node_bitmap_used(node) + 2 <= Py_SIZE(node));
 
-    int32_t key1_hash = map_hash(key1);
-    if (key1_hash == -1) {
-        return NULL;
-    }
+    Py_ssize_t data_count = map_node_bitmap_data_count(node);
+    Py_ssize_t idx = map_bitindex(node->b_datamap, bit);
+    Py_hash_t *hashes = BITMAP_HASHES(node);
+    Py_ssize_t i;
 
-    if (key1_hash == key2_hash) {
-        MapNode_Collision *n;
-        n = (MapNode_Collision *)map_node_collision_new(key1_hash, 4, mutid);
-        if (n == NULL) {
-            return NULL;
-        }
+    for (i = data_count; i > idx; i--) {
+        node->b_array[2 * i] = node->b_array[2 * (i - 1)];
+        node->b_array[2 * i + 1] = node->b_array[2 * (i - 1) + 1];
+        hashes[i] = hashes[i - 1];
+    }
 
-        Py_INCREF(key1);
-        n->c_array[0] = key1;
-        Py_INCREF(val1);
-        n->c_array[1] = val1;
+    map_node_bitmap_set_pair(node, idx, hash, key, val);
+    node->b_datamap |= bit;
+    node->b_subtree_hash = HAMT_NO_HASH;
+}
 
-        Py_INCREF(key2);
+static void
+map_node_bitmap_data_to_node(MapNode_Bitmap *node, uint32_t bit,
+                             MapNode *sub_node)
+{
+    /* Replace the key/value pair at 'bit' with 'sub_node' in place;
+       the node then has one more pointer of spare room. */
+
+    assert(node->b_datamap & bit);
+
+    Py_ssize_t data_count = map_node_bitmap_data_count(node);
+    Py_ssize_t node_count = map_node_bitmap_node_count(node);
+    Py_ssize_t idx = map_bitindex(node->b_datamap, bit);
+    Py_ssize_t node_idx = map_bitindex(node->b_nodemap, bit);
+    Py_hash_t *hashes = BITMAP_HASHES(node);
+    PyObject *key = node->b_array[2 * idx];
+    PyObject *val = node->b_array[2 * idx + 1];
+    Py_ssize_t i;
+
+    for (i = idx; i < data_count - 1; i++) {
+        node->b_array[2 * i] = node->b_array[2 * (i + 1)];
+        node->b_array[2 * i + 1] = node->b_array[2 * (i + 1) + 1];
+        hashes[i] = hashes[i + 1];
+    }
+    node->b_array[2 * (data_count - 1)] = NULL;
+    node->b_array[2 * (data_count - 1) + 1] = NULL;
+
+    for (i = node_count; i > node_idx; i--) {
+        node->b_array[BITMAP_NODE_IDX(node, i)] =
+            node->b_array[BITMAP_NODE_IDX(node, i - 1)];
+    }
+    Py_INCREF(sub_node);
+    node->b_array[BITMAP_NODE_IDX(node, node_idx)] = (PyObject *)sub_node;
+    map_gc_track_if(node, (PyObject *)sub_node);
+
+    node->b_datamap &= ~bit;
+    node->b_nodemap |= bit;
+    node->b_subtree_hash = HAMT_NO_HASH;
+
+    Py_DECREF(key);
+    Py_DECREF(val);
+}
+
+static MapNode_Bitmap *
+map_node_bitmap_clone_without(MapNode_Bitmap *o, uint32_t bit, uint64_t mutid)
+{
+    /* Clone 'o' dropping the key/value pair at 'bit'. */
+
+    assert(o->b_datamap & bit);
+
+    Py_ssize_t data_count = map_node_bitmap_data_count(o);
+    Py_ssize_t node_count = map_node_bitmap_node_count(o);
+    Py_ssize_t idx = map_bitindex(o->b_datamap, bit);
+
+    assert(data_count + node_count > 1);
+
+    MapNode_Bitmap *new = (MapNode_Bitmap *)map_node_bitmap_new(
+        map_state(o), data_count - 1, node_count, mutid);
+    if (new == NULL) {
+        return NULL;
+    }
+
+    map_node_bitmap_copy_data(new, 0, o, 0, idx);
+    map_node_bitmap_copy_data(new, idx, o, idx + 1, data_count - idx - 1);
+    map_node_bitmap_copy_nodes(new, 0, o, 0, node_count);
+
+    new->b_datamap = o->b_datamap & ~bit;
+    new->b_nodemap = o->b_nodemap;
+    return new;
+}
+
+static MapNode_Bitmap *
+map_node_bitmap_clone_data_to_node(MapNode_Bitmap *o, uint32_t bit,
+                                   MapNode *sub_node, uint64_t mutid)
+{
+    /* Clone 'o' replacing the key/value pair at 'bit' with
+       'sub_node'. */
+
+    assert(o->b_datamap & bit);
+
+    Py_ssize_t data_count = map_node_bitmap_data_count(o);
+    Py_ssize_t node_count = map_node_bitmap_node_count(o);
+    Py_ssize_t idx = map_bitindex(o->b_datamap, bit);
+    Py_ssize_t node_idx = map_bitindex(o->b_nodemap, bit);
+
+    MapNode_Bitmap *new = (MapNode_Bitmap *)map_node_bitmap_new(
+        map_state(o), data_count - 1, node_count + 1, mutid);
+    if (new == NULL) {
+        return NULL;
+    }
+
+    map_node_bitmap_copy_data(new, 0, o, 0, idx);
+    map_node_bitmap_copy_data(new, idx, o, idx + 1, data_count - idx - 1);
+
+    map_node_bitmap_copy_nodes(new, 0, o, 0, node_idx);
+    Py_INCREF(sub_node);
+    new->b_array[BITMAP_NODE_IDX(new, node_idx)] = (PyObject *)sub_node;
+    map_gc_track_if(new, (PyObject *)sub_node);
+    map_node_bitmap_copy_nodes(
+        new, node_idx + 1, o, node_idx, node_count - node_idx);
+
+    new->b_datamap = o->b_datamap & ~bit;
+    new->b_nodemap = o->b_nodemap | bit;
+    return new;
+}
+
+static MapNode_Bitmap *
+map_node_bitmap_clone_node_to_data(MapNode_Bitmap *o, uint32_t bit,
+                                   Py_hash_t hash, PyObject *key,
+                                   PyObject *val, uint64_t mutid)
+{
+    /* Clone 'o' replacing the sub-node at 'bit' with a key/value
+       pair. */
+
+    assert(o->b_nodemap & bit);
+
+    Py_ssize_t data_count = map_node_bitmap_data_count(o);
+    Py_ssize_t node_count = map_node_bitmap_node_count(o);
+    Py_ssize_t idx = map_bitindex(o->b_datamap, bit);
+    Py_ssize_t node_idx = map_bitindex(o->b_nodemap, bit);
+
+    MapNode_Bitmap *new = (MapNode_Bitmap *)map_node_bitmap_new(
+        map_state(o), data_count + 1, node_count - 1, mutid);
+    if (new == NULL) {
+        return NULL;
+    }
+
+    map_node_bitmap_copy_data(new, 0, o, 0, idx);
+    map_node_bitmap_set_pair(new, idx, hash, key, val);
+    map_node_bitmap_copy_data(new, idx + 1, o, idx, data_count - idx);
+
+    map_node_bitmap_copy_nodes(new, 0, o, 0, node_idx);
+    map_node_bitmap_copy_nodes(
+        new, node_idx, o, node_idx + 1, node_count - node_idx - 1);
+
+    new->b_datamap = o->b_datamap | bit;
+    new->b_nodemap = o->b_nodemap & ~bit;
+    return new;
+}
+
+static MapNode *
+map_node_new_bitmap_or_collision(MapState *st, uint32_t shift,
+                                 Py_hash_t key1_hash,
+                                 PyObject *key1, PyObject *val1,
+                                 Py_hash_t key2_hash,
+                                 PyObject *key2, PyObject *val2,
+                                 uint64_t mutid)
+{
+    /* Helper method.  Creates a new node for key1/val and key2/val2
+       pairs.
+
+       While there are hash bits left to tell the keys apart, this
+       creates a Bitmap node: either with both pairs, or with a single
+       sub-node if the keys land in the same slot of this level.
+       Once all hash bits are consumed, the keys have equal hashes
+       and a Collision node is created.  This way, the shape of the
+       tree depends only on the keys it stores.
+    */
+
+    if (shift >= HAMT_HASH_BITS) {
+        assert(key1_hash == key2_hash);
+
+        MapNode_Collision *n;
+        n = (MapNode_Collision *)map_node_collision_new(
+            st, key1_hash, 4, mutid);
+        if (n == NULL) {
+            return NULL;
+        }
+
+        Py_INCREF(key1);
+        n->c_array[0] = key1;
+        Py_INCREF(val1);
+        n->c_array[1] = val1;
+
+        Py_INCREF(key2);
         n->c_array[2] = key2;
         Py_INCREF(val2);
         n->c_array[3] = val2;
 
+        for (Py_ssize_t i = 0; i < 4; i++) {
+            map_gc_track_if(n, n->c_array[i]);
+        }
+
         return (MapNode *)n;
     }
-    else {
-        int added_leaf = 0;
-        MapNode *n = map_node_bitmap_new(0, mutid);
-        if (n == NULL) {
-            return NULL;
-        }
 
-        MapNode *n2 = map_node_assoc(
-            n, shift, key1_hash, key1, val1, &added_leaf, mutid);
-        Py_DECREF(n);
-        if (n2 == NULL) {
+    uint32_t bit1 = map_bitpos(key1_hash, shift);
+    uint32_t bit2 = map_bitpos(key2_hash, shift);
+    MapNode_Bitmap *n;
+
+    if (bit1 == bit2) {
+        MapNode *sub_node = map_node_new_bitmap_or_collision(
+            st, shift + 5, key1_hash, key1, val1, key2_hash, key2, val2,
+            mutid);
+        if (sub_node == NULL) {
             return NULL;
         }
 
-        n = map_node_assoc(
-            n2, shift, key2_hash, key2, val2, &added_leaf, mutid);
-        Py_DECREF(n2);
+        n = (MapNode_Bitmap *)map_node_bitmap_new(st, 0, 1, mutid);
         if (n == NULL) {
+            Py_DECREF(sub_node);
             return NULL;
         }
 
-        return n;
+        /* borrow */
+        n->b_array[BITMAP_NODE_IDX(n, 0)] = (PyObject *)sub_node;
+        n->b_nodemap = bit1;
+        map_gc_track_if(n, (PyObject *)sub_node);
+        return (MapNode *)n;
+    }
+
+    n = (MapNode_Bitmap *)map_node_bitmap_new(st, 2, 0, mutid);
+    if (n == NULL) {
+        return NULL;
+    }
+
+    if (bit1 < bit2) {
+        map_node_bitmap_set_pair(n, 0, key1_hash, key1, val1);
+        map_node_bitmap_set_pair(n, 1, key2_hash, key2, val2);
     }
+    else {
+        map_node_bitmap_set_pair(n, 0, key2_hash, key2, val2);
+        map_node_bitmap_set_pair(n, 1, key1_hash, key1, val1);
+    }
+
+    n->b_datamap = bit1 | bit2;
+    return (MapNode *)n;
 }
 
 static MapNode *
 map_node_bitmap_assoc(MapNode_Bitmap *self,
-                      uint32_t shift, int32_t hash,
+                      uint32_t shift, Py_hash_t hash,
                       PyObject *key, PyObject *val, int* added_leaf,
                       uint64_t mutid)
 {
@@ -735,88 +1535,40 @@ map_node_bitmap_assoc(MapNode_Bitmap *self,
     */
 
     uint32_t bit = map_bitpos(hash, shift);
-    uint32_t idx = map_bitindex(self->b_bitmap, bit);
-
-    /* Bitmap node layout:
-
-    +------+------+------+------+  ---  +------+------+
-    | key1 | val1 | key2 | val2 |  ...  | keyN | valN |
-    +------+------+------+------+  ---  +------+------+
-    where `N < Py_SIZE(node)`.
-
-    The `node->b_bitmap` field is a bitmap.  For a given
-    `(shift, hash)` pair we can determine:
-
-     - If this node has the corresponding key/val slots.
-     - The index of key/val slots.
-    */
 
-    if (self->b_bitmap & bit) {
-        /* The key is set in this node */
+    if (self->b_datamap & bit) {
+        /* There's a key/value pair in the slot. */
 
+        uint32_t idx = map_bitindex(self->b_datamap, bit);
         uint32_t key_idx = 2 * idx;
         uint32_t val_idx = key_idx + 1;
 
-        assert(val_idx < (size_t)Py_SIZE(self));
+        PyObject *existing_key = self->b_array[key_idx];
+        PyObject *existing_val = self->b_array[val_idx];
+        Py_hash_t existing_hash = BITMAP_HASHES(self)[idx];
 
-        PyObject *key_or_null = self->b_array[key_idx];
-        PyObject *val_or_node = self->b_array[val_idx];
-
-        if (key_or_null == NULL) {
-            /* key is NULL.  This means that we have a few keys
-               that have the same (hash, shift) pair. */
-
-            assert(val_or_node != NULL);
-
-            MapNode *sub_node = map_node_assoc(
-                (MapNode *)val_or_node,
-                shift + 5, hash, key, val, added_leaf,
-                mutid);
-            if (sub_node == NULL) {
+        int comp_err = 0;
+        if (existing_hash == hash) {
+            /* Only keys with equal hashes can be equal. */
+            comp_err = PyObject_RichCompareBool(key, existing_key, Py_EQ);
+            if (comp_err < 0) {  /* exception in __eq__ */
                 return NULL;
             }
-
-            if (val_or_node == (PyObject *)sub_node) {
-                Py_DECREF(sub_node);
-                Py_INCREF(self);
-                return (MapNode *)self;
-            }
-
-            if (mutid != 0 && self->b_mutid == mutid) {
-                Py_SETREF(self->b_array[val_idx], (PyObject*)sub_node);
-                Py_INCREF(self);
-                return (MapNode *)self;
-            }
-            else {
-                MapNode_Bitmap *ret = map_node_bitmap_clone(self, mutid);
-                if (ret == NULL) {
-                    return NULL;
-                }
-                Py_SETREF(ret->b_array[val_idx], (PyObject*)sub_node);
-                return (MapNode *)ret;
-            }
-        }
-
-        assert(key != NULL);
-        /* key is not NULL.  This means that we have only one other
-           key in this collection that matches our hash for this shift. */
-
-        int comp_err = PyObject_RichCompareBool(key, key_or_null, Py_EQ);
-        if (comp_err < 0) {  /* exception in __eq__ */
-            return NULL;
         }
-        if (comp_err == 1) {  /* key == key_or_null */
-            if (val == val_or_node) {
+        if (comp_err == 1) {  /* key == existing_key */
+            if (val == existing_val) {
                 /* we already have the same key/val pair; return self. */
                 Py_INCREF(self);
                 return (MapNode *)self;
             }
 
             /* We're setting a new value for the key we had before. */
-            if (mutid != 0 && self->b_mutid == mutid) {
+            if (MAP_NODE_OWNED(self->b_mutid, mutid)) {
                 /* We've been mutating this node before: update inplace. */
                 Py_INCREF(val);
                 Py_SETREF(self->b_array[val_idx], val);
+                self->b_subtree_hash = HAMT_NO_HASH;
+                map_gc_track_if(self, val);
                 Py_INCREF(self);
                 return (MapNode *)self;
             }
@@ -829,35 +1581,77 @@ map_node_bitmap_assoc(MapNode_Bitmap *self,
                 }
                 Py_INCREF(val);
                 Py_SETREF(ret->b_array[val_idx], val);
+                map_gc_track_if(ret, val);
                 return (MapNode *)ret;
             }
         }
 
-        /* It's a new key, and it has the same index as *one* another key.
-           We have a collision.  We need to create a new node which will
-           combine the existing key and the key we're adding.
-
-           `map_node_new_bitmap_or_collision` will either create a new
-           Collision node if the keys have identical hashes, or
-           a new Bitmap node.
+        /* It's a new key, and it has the same index as another key.
+           Push both keys one level down into a new sub-node that
+           replaces the existing key/value pair.
         */
         MapNode *sub_node = map_node_new_bitmap_or_collision(
+            map_state(self),
             shift + 5,
-            key_or_null, val_or_node,  /* existing key/val */
+            existing_hash,
+            existing_key, existing_val,  /* existing key/val */
             hash,
             key, val,  /* new key/val */
-            self->b_mutid
+            mutid
         );
         if (sub_node == NULL) {
             return NULL;
         }
 
-        if (mutid != 0 && self->b_mutid == mutid) {
-            Py_SETREF(self->b_array[key_idx], NULL);
-            Py_SETREF(self->b_array[val_idx], (PyObject *)sub_node);
+        if (MAP_MUTID_HAS_SPARE(mutid) && self->b_mutid == mutid) {
+            map_node_bitmap_data_to_node(self, bit, sub_node);
+            Py_DECREF(sub_node);
+            *added_leaf = 1;
             Py_INCREF(self);
+            return (MapNode *)self;
+        }
 
-            *added_leaf = 1;
+        MapNode_Bitmap *ret = map_node_bitmap_clone_data_to_node(
+            self, bit, sub_node, mutid);
+        Py_DECREF(sub_node);
+        if (ret == NULL) {
+            return NULL;
+        }
+
+        *added_leaf = 1;
+        return (MapNode *)ret;
+    }
+
+    if (self->b_nodemap & bit) {
+        /* There's a sub-node in the slot: a few keys have the same
+           (hash, shift) pair.  Dispatch further down the tree. */
+
+        Py_ssize_t node_idx = map_bitindex(self->b_nodemap, bit);
+        MapNode *node = BITMAP_NODE(self, node_idx);
+
+        MapNode *sub_node = map_node_assoc(
+            node, shift + 5, hash, key, val, added_leaf, mutid);
+        if (sub_node == NULL) {
+            return NULL;
+        }
+
+        if (node == sub_node) {
+            /* The sub-node might have been updated in place. */
+            map_gc_track_if(self, (PyObject *)sub_node);
+            if (MAP_NODE_OWNED(self->b_mutid, mutid)) {
+                self->b_subtree_hash = HAMT_NO_HASH;
+            }
+            Py_DECREF(sub_node);
+            Py_INCREF(self);
+            return (MapNode *)self;
+        }
+
+        if (MAP_NODE_OWNED(self->b_mutid, mutid)) {
+            Py_SETREF(self->b_array[BITMAP_NODE_IDX(self, node_idx)],
+                      (PyObject *)sub_node);
+            self->b_subtree_hash = HAMT_NO_HASH;
+            map_gc_track_if(self, (PyObject *)sub_node);
+            Py_INCREF(self);
             return (MapNode *)self;
         }
         else {
@@ -866,292 +1660,152 @@ map_node_bitmap_assoc(MapNode_Bitmap *self,
                 Py_DECREF(sub_node);
                 return NULL;
             }
-            Py_SETREF(ret->b_array[key_idx], NULL);
-            Py_SETREF(ret->b_array[val_idx], (PyObject *)sub_node);
-
-            *added_leaf = 1;
+            Py_SETREF(ret->b_array[BITMAP_NODE_IDX(ret, node_idx)],
+                      (PyObject *)sub_node);
+            map_gc_track_if(ret, (PyObject *)sub_node);
             return (MapNode *)ret;
         }
     }
-    else {
-        /* There was no key before with the same (shift,hash). */
-
-        uint32_t n = map_bitcount(self->b_bitmap);
 
-        if (n >= 16) {
-            /* When we have a situation where we want to store more
-               than 16 nodes at one level of the tree, we no longer
-               want to use the Bitmap node with bitmap encoding.
+    /* There was no key before with the same (shift,hash). */
 
-               Instead we start using an Array node, which has
-               simpler (faster) implementation at the expense of
-               having prealocated 32 pointers for its keys/values
-               pairs.
-
-               Small map objects (<30 keys) usually don't have any
-               Array nodes at all.  Between ~30 and ~400 keys map
-               objects usually have one Array node, and usually it's
-               a root node.
-            */
+    uint32_t n = map_bitcount(self->b_datamap | self->b_nodemap);
 
-            uint32_t jdx = map_mask(hash, shift);
-            /* 'jdx' is the index of where the new key should be added
-               in the new Array node we're about to create. */
+    if (n >= 16) {
+        /* When we have a situation where we want to store more
+           than 16 nodes at one level of the tree, we no longer
+           want to use the Bitmap node with bitmap encoding.
 
-            MapNode *empty = NULL;
-            MapNode_Array *new_node = NULL;
-            MapNode *res = NULL;
+           Instead we start using an Array node, which has
+           simpler (faster) implementation at the expense of
+           having prealocated 32 pointers for its keys/values
+           pairs.
 
-            /* Create a new Array node. */
-            new_node = (MapNode_Array *)map_node_array_new(n + 1, mutid);
-            if (new_node == NULL) {
-                goto fin;
-            }
+           Small map objects (<30 keys) usually don't have any
+           Array nodes at all.  Between ~30 and ~400 keys map
+           objects usually have one Array node, and usually it's
+           a root node.
+        */
 
-            /* Create an empty bitmap node for the next
-               map_node_assoc call. */
-            empty = map_node_bitmap_new(0, mutid);
-            if (empty == NULL) {
-                goto fin;
-            }
+        uint32_t jdx = map_mask(hash, shift);
+        /* 'jdx' is the index of where the new key should be added
+           in the new Array node we're about to create. */
 
-            /* Make a new bitmap node for the key/val we're adding.
-               Set that bitmap node to new-array-node[jdx]. */
-            new_node->a_array[jdx] = map_node_assoc(
-                empty, shift + 5, hash, key, val, added_leaf, mutid);
-            if (new_node->a_array[jdx] == NULL) {
-                goto fin;
-            }
+        MapState *st = map_state(self);
+        MapNode_Array *new_node = NULL;
+        MapNode *res = NULL;
 
-            /* Copy existing key/value pairs from the current Bitmap
-               node to the new Array node we've just created. */
-            Py_ssize_t i, j;
-            for (i = 0, j = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
-                if (((self->b_bitmap >> i) & 1) != 0) {
-                    /* Ensure we don't accidentally override `jdx` element
-                       we set few lines above.
-                    */
-                    assert(new_node->a_array[i] == NULL);
+        /* Create a new Array node. */
+        new_node = (MapNode_Array *)map_node_array_new(st, n + 1, mutid);
+        if (new_node == NULL) {
+            goto fin;
+        }
 
-                    if (self->b_array[j] == NULL) {
-                        new_node->a_array[i] =
-                            (MapNode *)self->b_array[j + 1];
-                        Py_INCREF(new_node->a_array[i]);
-                    }
-                    else {
-                        int32_t rehash = map_hash(self->b_array[j]);
-                        if (rehash == -1) {
-                            goto fin;
-                        }
-
-                        new_node->a_array[i] = map_node_assoc(
-                            empty, shift + 5,
-                            rehash,
-                            self->b_array[j],
-                            self->b_array[j + 1],
-                            added_leaf,
-                            mutid);
-
-                        if (new_node->a_array[i] == NULL) {
-                            goto fin;
-                        }
-                    }
-                    j += 2;
+        /* Make a new bitmap node for the key/val we're adding.
+           Set that bitmap node to new-array-node[jdx]. */
+        new_node->a_array[jdx] = map_node_bitmap_new_pair(
+            st, shift + 5, hash, key, val, mutid);
+        if (new_node->a_array[jdx] == NULL) {
+            goto fin;
+        }
+        map_gc_track_if(new_node, (PyObject *)new_node->a_array[jdx]);
+
+        /* Move existing key/value pairs and sub-nodes from the
+           current Bitmap node to the new Array node we've just
+           created.  Every key/value pair gets a Bitmap node of
+           its own. */
+        Py_ssize_t i, j = 0, k = 0;
+        for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+            uint32_t bit_i = (uint32_t)1 << i;
+
+            if (self->b_datamap & bit_i) {
+                /* Ensure we don't accidentally override `jdx` element
+                   we set few lines above.
+                */
+                assert(new_node->a_array[i] == NULL);
+
+                new_node->a_array[i] = map_node_bitmap_new_pair(
+                    st,
+                    shift + 5,
+                    BITMAP_HASHES(self)[j],
+                    self->b_array[2 * j],
+                    self->b_array[2 * j + 1],
+                    mutid);
+                if (new_node->a_array[i] == NULL) {
+                    goto fin;
                 }
+                map_gc_track_if(new_node, (PyObject *)new_node->a_array[i]);
+                j++;
             }
+            else if (self->b_nodemap & bit_i) {
+                assert(new_node->a_array[i] == NULL);
 
-            VALIDATE_ARRAY_NODE(new_node)
-
-            /* That's it! */
-            res = (MapNode *)new_node;
-
-        fin:
-            Py_XDECREF(empty);
-            if (res == NULL) {
-                Py_XDECREF(new_node);
+                new_node->a_array[i] = BITMAP_NODE(self, k);
+                Py_INCREF(new_node->a_array[i]);
+                map_gc_track_if(new_node, (PyObject *)new_node->a_array[i]);
+                k++;
             }
-            return res;
         }
-        else {
-            /* We have less than 16 keys at this level; let's just
-               create a new bitmap node out of this node with the
-               new key/val pair added. */
-
-            uint32_t key_idx = 2 * idx;
-            uint32_t val_idx = key_idx + 1;
-            uint32_t i;
 
-            *added_leaf = 1;
+        *added_leaf = 1;
 
-            /* Allocate new Bitmap node which can have one more key/val
-               pair in addition to what we have already. */
-            MapNode_Bitmap *new_node =
-                (MapNode_Bitmap *)map_node_bitmap_new(2 * (n + 1), mutid);
-            if (new_node == NULL) {
-                return NULL;
-            }
+        VALIDATE_ARRAY_NODE(new_node)
 
-            /* Copy all keys/values that will be before the new key/value
-               we are adding. */
-            for (i = 0; i < key_idx; i++) {
-                Py_XINCREF(self->b_array[i]);
-                new_node->b_array[i] = self->b_array[i];
-            }
+        /* That's it! */
+        res = (MapNode *)new_node;
 
-            /* Set the new key/value to the new Bitmap node. */
-            Py_INCREF(key);
-            new_node->b_array[key_idx] = key;
-            Py_INCREF(val);
-            new_node->b_array[val_idx] = val;
+    fin:
+        if (res == NULL) {
+            Py_XDECREF(new_node);
+        }
+        return res;
+    }
+    else {
+        /* We have less than 16 keys at this level; let's just
+           create a new bitmap node out of this node with the
+           new key/val pair added, or add it in place if the node
+           is ours and has room for it. */
 
-            /* Copy all keys/values that will be after the new key/value
-               we are adding. */
-            assert(Py_SIZE(self) >= 0 && Py_SIZE(self) <= 32);
-            for (i = key_idx; i < (uint32_t)Py_SIZE(self); i++) {
-                Py_XINCREF(self->b_array[i]);
-                new_node->b_array[i + 2] = self->b_array[i];
-            }
+        if (MAP_NODE_OWNED(self->b_mutid, mutid) &&
+            map_node_bitmap_used(self) + 2 <= Py_SIZE(self))
+        {
+            map_node_bitmap_insert(self, bit, hash, key, val);
+            *added_leaf = 1;
+            Py_INCREF(self);
+            return (MapNode *)self;
+        }
 
-            new_node->b_bitmap = self->b_bitmap | bit;
-            return (MapNode *)new_node;
+        MapNode_Bitmap *new_node = map_node_bitmap_clone_with(
+            self, bit, hash, key, val, mutid);
+        if (new_node == NULL) {
+            return NULL;
         }
+
+        *added_leaf = 1;
+        return (MapNode *)new_node;
     }
 }
 
 static map_without_t
 map_node_bitmap_without(MapNode_Bitmap *self,
-                        uint32_t shift, int32_t hash,
+                        uint32_t shift, Py_hash_t hash,
                         PyObject *key,
                         MapNode **new_node,
                         uint64_t mutid)
 {
     uint32_t bit = map_bitpos(hash, shift);
-    if ((self->b_bitmap & bit) == 0) {
-        return W_NOT_FOUND;
-    }
-
-    uint32_t idx = map_bitindex(self->b_bitmap, bit);
-
-    uint32_t key_idx = 2 * idx;
-    uint32_t val_idx = key_idx + 1;
-
-    PyObject *key_or_null = self->b_array[key_idx];
-    PyObject *val_or_node = self->b_array[val_idx];
-
-    if (key_or_null == NULL) {
-        /* key == NULL means that 'value' is another tree node. */
-
-        MapNode *sub_node = NULL;
-        MapNode_Bitmap *target = NULL;
-
-        map_without_t res = map_node_without(
-            (MapNode *)val_or_node,
-            shift + 5, hash, key, &sub_node,
-            mutid);
-
-        switch (res) {
-            case W_EMPTY:
-                /* It's impossible for us to receive a W_EMPTY here:
-
-                    - Array nodes are converted to Bitmap nodes when
-                      we delete 16th item from them;
-
-                    - Collision nodes are converted to Bitmap when
-                      there is one item in them;
-
-                    - Bitmap node's without() inlines single-item
-                      sub-nodes.
-
-                   So in no situation we can have a single-item
-                   Bitmap child of another Bitmap node.
-                */
-                abort();
-
-            case W_NEWNODE: {
-                assert(sub_node != NULL);
-
-                if (IS_BITMAP_NODE(sub_node)) {
-                    MapNode_Bitmap *sub_tree = (MapNode_Bitmap *)sub_node;
-                    if (map_node_bitmap_count(sub_tree) == 1 &&
-                            sub_tree->b_array[0] != NULL)
-                    {
-                        /* A bitmap node with one key/value pair.  Just
-                           merge it into this node.
-
-                           Note that we don't inline Bitmap nodes that
-                           have a NULL key -- those nodes point to another
-                           tree level, and we cannot simply move tree levels
-                           up or down.
-                        */
-
-                        if (mutid != 0 && self->b_mutid == mutid) {
-                            target = self;
-                            Py_INCREF(target);
-                        }
-                        else {
-                            target = map_node_bitmap_clone(self, mutid);
-                            if (target == NULL) {
-                                Py_DECREF(sub_node);
-                                return W_ERROR;
-                            }
-                        }
-
-                        PyObject *key = sub_tree->b_array[0];
-                        PyObject *val = sub_tree->b_array[1];
-
-                        Py_INCREF(key);
-                        Py_XSETREF(target->b_array[key_idx], key);
-                        Py_INCREF(val);
-                        Py_SETREF(target->b_array[val_idx], val);
-
-                        Py_DECREF(sub_tree);
-
-                        *new_node = (MapNode *)target;
-                        return W_NEWNODE;
-                    }
-                }
-
-#if !defined(NDEBUG)
-                /* Ensure that Collision.without implementation
-                   converts to Bitmap nodes itself.
-                */
-                if (IS_COLLISION_NODE(sub_node)) {
-                    assert(map_node_collision_count(
-                            (MapNode_Collision*)sub_node) > 1);
-                }
-#endif
-
-                if (mutid != 0 && self->b_mutid == mutid) {
-                    target = self;
-                    Py_INCREF(target);
-                }
-                else {
-                    target = map_node_bitmap_clone(self, mutid);
-                    if (target == NULL) {
-                        return W_ERROR;
-                    }
-                }
 
-                Py_SETREF(target->b_array[val_idx],
-                          (PyObject *)sub_node);  /* borrow */
-
-                *new_node = (MapNode *)target;
-                return W_NEWNODE;
-            }
+    if (self->b_datamap & bit) {
+        /* We have a regular key/value pair */
 
-            case W_ERROR:
-            case W_NOT_FOUND:
-                assert(sub_node == NULL);
-                return res;
+        uint32_t idx = map_bitindex(self->b_datamap, bit);
 
-            default:
-                abort();
+        if (BITMAP_HASHES(self)[idx] != hash) {
+            return W_NOT_FOUND;
         }
-    }
-    else {
-        /* We have a regular key/value pair */
 
-        int cmp = PyObject_RichCompareBool(key_or_null, key, Py_EQ);
+        int cmp = PyObject_RichCompareBool(
+            self->b_array[2 * idx], key, Py_EQ);
         if (cmp < 0) {
             return W_ERROR;
         }
@@ -1159,7 +1813,7 @@ map_node_bitmap_without(MapNode_Bitmap *self,
             return W_NOT_FOUND;
         }
 
-        if (map_node_bitmap_count(self) == 1) {
+        if (self->b_datamap == bit && self->b_nodemap == 0) {
             return W_EMPTY;
         }
 
@@ -1171,59 +1825,235 @@ map_node_bitmap_without(MapNode_Bitmap *self,
 
         return W_NEWNODE;
     }
-}
-
-static map_find_t
-map_node_bitmap_find(MapNode_Bitmap *self,
-                     uint32_t shift, int32_t hash,
-                     PyObject *key, PyObject **val)
-{
-    /* Lookup a key in a Bitmap node. */
-
-    uint32_t bit = map_bitpos(hash, shift);
-    uint32_t idx;
-    uint32_t key_idx;
-    uint32_t val_idx;
-    PyObject *key_or_null;
-    PyObject *val_or_node;
-    int comp_err;
 
-    if ((self->b_bitmap & bit) == 0) {
-        return F_NOT_FOUND;
+    if ((self->b_nodemap & bit) == 0) {
+        return W_NOT_FOUND;
     }
 
-    idx = map_bitindex(self->b_bitmap, bit);
-    key_idx = idx * 2;
-    val_idx = key_idx + 1;
+    /* The slot holds another tree node. */
 
-    assert(val_idx < (size_t)Py_SIZE(self));
+    Py_ssize_t node_idx = map_bitindex(self->b_nodemap, bit);
+    MapNode *sub_node = NULL;
+    MapNode_Bitmap *target = NULL;
 
-    key_or_null = self->b_array[key_idx];
-    val_or_node = self->b_array[val_idx];
+    map_without_t res = map_node_without(
+        BITMAP_NODE(self, node_idx),
+        shift + 5, hash, key, &sub_node,
+        mutid);
 
-    if (key_or_null == NULL) {
-        /* There are a few keys that have the same hash at the current shift
+    switch (res) {
+        case W_EMPTY:
+            /* It's impossible for us to receive a W_EMPTY here:
+
+                - Sub-nodes of a Bitmap node always hold at least
+                  two keys: single key/value pairs are inlined;
+
+                - Array nodes hold at least 17 sub-nodes;
+
+                - Collision nodes hold at least two keys.
+
+               So deleting one key from a sub-node can't make
+               it empty.
+            */
+            abort();
+
+        case W_NEWNODE: {
+            assert(sub_node != NULL);
+
+            if (map_node_bitmap_is_single_pair(sub_node)) {
+                /* A bitmap node with one key/value pair.  Just
+                   merge it into this node, so that the tree keeps
+                   its canonical shape.
+                */
+                MapNode_Bitmap *sub_tree = (MapNode_Bitmap *)sub_node;
+
+                target = map_node_bitmap_clone_node_to_data(
+                    self, bit,
+                    BITMAP_HASHES(sub_tree)[0],
+                    sub_tree->b_array[0],
+                    sub_tree->b_array[1],
+                    mutid);
+                Py_DECREF(sub_node);
+                if (target == NULL) {
+                    return W_ERROR;
+                }
+
+                *new_node = (MapNode *)target;
+                return W_NEWNODE;
+            }
+
+#if !defined(NDEBUG)
+            /* Ensure that Collision.without implementation
+               converts to Bitmap nodes itself.
+            */
+            if (IS_COLLISION_NODE(sub_node)) {
+                assert(map_node_collision_count(
+                        (MapNode_Collision*)sub_node) > 1);
+            }
+#endif
+
+            if (MAP_NODE_OWNED(self->b_mutid, mutid)) {
+                target = self;
+                Py_INCREF(target);
+                target->b_subtree_hash = HAMT_NO_HASH;
+            }
+            else {
+                target = map_node_bitmap_clone(self, mutid);
+                if (target == NULL) {
+                    Py_DECREF(sub_node);
+                    return W_ERROR;
+                }
+            }
+
+            Py_SETREF(target->b_array[BITMAP_NODE_IDX(target, node_idx)],
+                      (PyObject *)sub_node);  /* borrow */
+            map_gc_track_if(target, (PyObject *)sub_node);
+
+            *new_node = (MapNode *)target;
+            return W_NEWNODE;
+        }
+
+        case W_ERROR:
+        case W_NOT_FOUND:
+            assert(sub_node == NULL);
+            return res;
+
+        default:
+            abort();
+    }
+}
+
+static map_find_t
+map_node_bitmap_find(MapNode_Bitmap *self,
+                     uint32_t shift, Py_hash_t hash,
+                     PyObject *key, PyObject **found_key, PyObject **val)
+{
+    /* Lookup a key in a Bitmap node. */
+
+    uint32_t bit = map_bitpos(hash, shift);
+    uint32_t idx;
+    int comp_err;
+
+    if (self->b_nodemap & bit) {
+        /* There are a few keys that have the same hash at the current shift
            that match our key.  Dispatch the lookup further down the tree. */
-        assert(val_or_node != NULL);
-        return map_node_find((MapNode *)val_or_node,
-                             shift + 5, hash, key, val);
+        idx = map_bitindex(self->b_nodemap, bit);
+        return map_node_find_item(BITMAP_NODE(self, idx),
+                                  shift + 5, hash, key, found_key, val);
+    }
+
+    if ((self->b_datamap & bit) == 0) {
+        return F_NOT_FOUND;
     }
 
     /* We have only one key -- a potential match.  Let's compare if the
-       key we are looking at is equal to the key we are looking for. */
+       key we are looking at is equal to the key we are looking for.
+       Keys with different hashes can't be equal, so check that first. */
+    idx = map_bitindex(self->b_datamap, bit);
+    if (BITMAP_HASHES(self)[idx] != hash) {
+        return F_NOT_FOUND;
+    }
+
     assert(key != NULL);
-    comp_err = PyObject_RichCompareBool(key, key_or_null, Py_EQ);
+    comp_err = PyObject_RichCompareBool(key, self->b_array[2 * idx], Py_EQ);
     if (comp_err < 0) {  /* exception in __eq__ */
         return F_ERROR;
     }
-    if (comp_err == 1) {  /* key == key_or_null */
-        *val = val_or_node;
+    if (comp_err == 1) {  /* key == existing key */
+        if (found_key != NULL) {
+            *found_key = self->b_array[2 * idx];
+        }
+        *val = self->b_array[2 * idx + 1];
         return F_FOUND;
     }
 
     return F_NOT_FOUND;
 }
 
+static int
+map_node_bitmap_eq(MapNode_Bitmap *v, MapNode_Bitmap *w)
+{
+    /* Compare two Bitmap nodes at the same level of two trees.
+
+       Trees are kept in a canonical shape, so equal maps have
+       key/value pairs and sub-nodes in the same slots.
+    */
+
+    if (v->b_datamap != w->b_datamap || v->b_nodemap != w->b_nodemap) {
+        return 0;
+    }
+
+    Py_ssize_t data_count = map_node_bitmap_data_count(v);
+    Py_ssize_t node_count = map_node_bitmap_node_count(v);
+    Py_ssize_t i;
+
+    for (i = 0; i < data_count; i++) {
+        if (BITMAP_HASHES(v)[i] != BITMAP_HASHES(w)[i]) {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < data_count; i++) {
+        int cmp = PyObject_RichCompareBool(
+            v->b_array[2 * i], w->b_array[2 * i], Py_EQ);
+        if (cmp <= 0) {
+            return cmp;
+        }
+
+        cmp = PyObject_RichCompareBool(
+            v->b_array[2 * i + 1], w->b_array[2 * i + 1], Py_EQ);
+        if (cmp <= 0) {
+            return cmp;
+        }
+    }
+
+    for (i = 0; i < node_count; i++) {
+        int cmp = map_node_eq(BITMAP_NODE(v, i), BITMAP_NODE(w, i));
+        if (cmp <= 0) {
+            return cmp;
+        }
+    }
+
+    return 1;
+}
+
+static int
+map_node_bitmap_hash(MapNode_Bitmap *self, Py_uhash_t *hash)
+{
+    /* Compute (or return the memoized) hash of a Bitmap node. */
+
+    Py_uhash_t cached = MAP_LOAD_UHASH(self->b_subtree_hash);
+    if (cached != HAMT_NO_HASH) {
+        *hash = cached;
+        return 0;
+    }
+
+    Py_uhash_t h = 0;
+    Py_ssize_t data_count = map_node_bitmap_data_count(self);
+    Py_ssize_t node_count = map_node_bitmap_node_count(self);
+    Py_ssize_t i;
+
+    for (i = 0; i < data_count; i++) {
+        if (map_hash_item(self->b_array[2 * i],
+                          self->b_array[2 * i + 1], &h))
+        {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < node_count; i++) {
+        Py_uhash_t sub_hash;
+        if (map_node_hash(BITMAP_NODE(self, i), &sub_hash)) {
+            return -1;
+        }
+        h ^= sub_hash;
+    }
+
+    MAP_STORE_UHASH(self->b_subtree_hash, h);
+    *hash = h;
+    return 0;
+}
+
 static int
 map_node_bitmap_traverse(MapNode_Bitmap *self, visitproc visit, void *arg)
 {
@@ -1243,6 +2073,7 @@ map_node_bitmap_dealloc(MapNode_Bitmap *self)
 {
     /* Bitmap's tp_dealloc */
 
+    PyTypeObject *tp = Py_TYPE(self);
     Py_ssize_t len = Py_SIZE(self);
     Py_ssize_t i;
 
@@ -1256,10 +2087,52 @@ map_node_bitmap_dealloc(MapNode_Bitmap *self)
         }
     }
 
-    Py_TYPE(self)->tp_free((PyObject *)self);
+#ifdef MAP_NODE_FREELISTS
+    /* A node with spare room (see "Spare Room") has hashes for at
+       least as many pairs as it holds, so its allocation has at
+       least this many items. */
+    Py_ssize_t items =
+        len + BITMAP_HASHES_ITEMS(map_node_bitmap_data_count(self));
+    MapState *st = map_state(self);
+    if (items > 0 && items < MAP_BITMAP_FREELIST_SIZES &&
+        st->bitmap_numfree[items] < MAP_BITMAP_FREELIST_MAX)
+    {
+        self->b_array[0] = (PyObject *)st->bitmap_freelist[items];
+        st->bitmap_freelist[items] = self;
+        st->bitmap_numfree[items]++;
+    }
+    else
+#endif
+    {
+        tp->tp_free((PyObject *)self);
+    }
+    Py_DECREF(tp);
     Py_TRASHCAN_END
 }
 
+static int
+_map_dump_bitmap(_PyUnicodeWriter *writer, const char *name, uint32_t bitmap)
+{
+    PyObject *tmp1;
+    PyObject *tmp2;
+
+    tmp1 = PyLong_FromUnsignedLong(bitmap);
+    if (tmp1 == NULL) {
+        return -1;
+    }
+    tmp2 = PyNumber_ToBase(tmp1, 2);
+    Py_DECREF(tmp1);
+    if (tmp2 == NULL) {
+        return -1;
+    }
+    if (_map_dump_format(writer, "%s=%S ", name, tmp2)) {
+        Py_DECREF(tmp2);
+        return -1;
+    }
+    Py_DECREF(tmp2);
+    return 0;
+}
+
 static int
 map_node_bitmap_dump(MapNode_Bitmap *node,
                      _PyUnicodeWriter *writer, int level)
@@ -1267,59 +2140,53 @@ map_node_bitmap_dump(MapNode_Bitmap *node,
     /* Debug build: __dump__() method implementation for Bitmap nodes. */
 
     Py_ssize_t i;
-    PyObject *tmp1;
-    PyObject *tmp2;
+    Py_ssize_t data_count = map_node_bitmap_data_count(node);
+    Py_ssize_t node_count = map_node_bitmap_node_count(node);
 
     if (_map_dump_ident(writer, level + 1)) {
         goto error;
     }
 
     if (_map_dump_format(writer, "BitmapNode(size=%zd count=%zd ",
-                         Py_SIZE(node), Py_SIZE(node) / 2))
+                         Py_SIZE(node), data_count + node_count))
     {
         goto error;
     }
 
-    tmp1 = PyLong_FromUnsignedLong(node->b_bitmap);
-    if (tmp1 == NULL) {
-        goto error;
-    }
-    tmp2 = PyNumber_ToBase(tmp1, 2);
-    Py_DECREF(tmp1);
-    if (tmp2 == NULL) {
+    if (_map_dump_bitmap(writer, "datamap", node->b_datamap) ||
+        _map_dump_bitmap(writer, "nodemap", node->b_nodemap))
+    {
         goto error;
     }
-    if (_map_dump_format(writer, "bitmap=%S id=%p):\n", tmp2, node)) {
-        Py_DECREF(tmp2);
+
+    if (_map_dump_format(writer, "id=%p):\n", node)) {
         goto error;
     }
-    Py_DECREF(tmp2);
-
-    for (i = 0; i < Py_SIZE(node); i += 2) {
-        PyObject *key_or_null = node->b_array[i];
-        PyObject *val_or_node = node->b_array[i + 1];
 
+    for (i = 0; i < data_count; i++) {
         if (_map_dump_ident(writer, level + 2)) {
             goto error;
         }
 
-        if (key_or_null == NULL) {
-            if (_map_dump_format(writer, "NULL:\n")) {
-                goto error;
-            }
+        if (_map_dump_format(writer, "%R: %R\n",
+                             node->b_array[2 * i],
+                             node->b_array[2 * i + 1]))
+        {
+            goto error;
+        }
+    }
 
-            if (map_node_dump((MapNode *)val_or_node,
-                              writer, level + 2))
-            {
-                goto error;
-            }
+    for (i = 0; i < node_count; i++) {
+        if (_map_dump_ident(writer, level + 2)) {
+            goto error;
         }
-        else {
-            if (_map_dump_format(writer, "%R: %R", key_or_null,
-                                 val_or_node))
-            {
-                goto error;
-            }
+
+        if (_map_dump_format(writer, "NODE:\n")) {
+            goto error;
+        }
+
+        if (map_node_dump(BITMAP_NODE(node, i), writer, level + 2)) {
+            goto error;
         }
 
         if (_map_dump_format(writer, "\n")) {
@@ -1337,7 +2204,8 @@ error:
 
 
 static MapNode *
-map_node_collision_new(int32_t hash, Py_ssize_t size, uint64_t mutid)
+map_node_collision_new(MapState *st, Py_hash_t hash, Py_ssize_t size,
+                       uint64_t mutid)
 {
     /* Create a new Collision node. */
 
@@ -1347,10 +2215,23 @@ map_node_collision_new(int32_t hash, Py_ssize_t size, uint64_t mutid)
     assert(size >= 4);
     assert(size % 2 == 0);
 
-    node = PyObject_GC_NewVar(
-        MapNode_Collision, &_Map_CollisionNode_Type, size);
-    if (node == NULL) {
-        return NULL;
+#ifdef MAP_NODE_FREELISTS
+    if (size == MAP_COLLISION_FREELIST_SIZE &&
+        (node = st->collision_freelist) != NULL)
+    {
+        st->collision_freelist = (MapNode_Collision *)node->c_array[0];
+        st->collision_numfree--;
+        (void)PyObject_InitVar(
+            (PyVarObject *)node, st->CollisionNodeType, size);
+    }
+    else
+#endif
+    {
+        node = PyObject_GC_NewVar(
+            MapNode_Collision, st->CollisionNodeType, size);
+        if (node == NULL) {
+            return NULL;
+        }
     }
 
     for (i = 0; i < size; i++) {
@@ -1361,8 +2242,8 @@ map_node_collision_new(int32_t hash, Py_ssize_t size, uint64_t mutid)
     node->c_hash = hash;
 
     node->c_mutid = mutid;
+    node->c_subtree_hash = HAMT_NO_HASH;
 
-    PyObject_GC_Track(node);
     return (MapNode *)node;
 }
 
@@ -1395,122 +2276,104 @@ map_node_collision_find_index(MapNode_Collision *self, PyObject *key,
 
 static MapNode *
 map_node_collision_assoc(MapNode_Collision *self,
-                         uint32_t shift, int32_t hash,
+                         uint32_t shift, Py_hash_t hash,
                          PyObject *key, PyObject *val, int* added_leaf,
                          uint64_t mutid)
 {
     /* Set a new key to this level (currently a Collision node)
-       of the tree. */
+       of the tree.
 
-    if (hash == self->c_hash) {
-        /* The hash of the 'key' we are adding matches the hash of
-           other keys in this Collision node. */
+       Collision nodes live below the last level of Bitmap nodes, so
+       the hash of the 'key' we are adding always matches the hash of
+       other keys in this Collision node. */
 
-        Py_ssize_t key_idx = -1;
-        map_find_t found;
-        MapNode_Collision *new_node;
-        Py_ssize_t i;
+    assert(hash == self->c_hash);
 
-        /* Let's try to lookup the new 'key', maybe we already have it. */
-        found = map_node_collision_find_index(self, key, &key_idx);
-        switch (found) {
-            case F_ERROR:
-                /* Exception. */
-                return NULL;
+    Py_ssize_t key_idx = -1;
+    map_find_t found;
+    MapNode_Collision *new_node;
+    Py_ssize_t i;
 
-            case F_NOT_FOUND:
-                /* This is a totally new key.  Clone the current node,
-                   add a new key/value to the cloned node. */
+    /* Let's try to lookup the new 'key', maybe we already have it. */
+    found = map_node_collision_find_index(self, key, &key_idx);
+    switch (found) {
+        case F_ERROR:
+            /* Exception. */
+            return NULL;
 
-                new_node = (MapNode_Collision *)map_node_collision_new(
-                    self->c_hash, Py_SIZE(self) + 2, mutid);
-                if (new_node == NULL) {
-                    return NULL;
-                }
+        case F_NOT_FOUND:
+            /* This is a totally new key.  Clone the current node,
+               add a new key/value to the cloned node. */
 
-                for (i = 0; i < Py_SIZE(self); i++) {
-                    Py_INCREF(self->c_array[i]);
-                    new_node->c_array[i] = self->c_array[i];
-                }
+            new_node = (MapNode_Collision *)map_node_collision_new(
+                map_state(self), self->c_hash, Py_SIZE(self) + 2, mutid);
+            if (new_node == NULL) {
+                return NULL;
+            }
 
-                Py_INCREF(key);
-                new_node->c_array[i] = key;
-                Py_INCREF(val);
-                new_node->c_array[i + 1] = val;
+            for (i = 0; i < Py_SIZE(self); i++) {
+                Py_INCREF(self->c_array[i]);
+                new_node->c_array[i] = self->c_array[i];
+                map_gc_track_if(new_node, new_node->c_array[i]);
+            }
 
-                *added_leaf = 1;
-                return (MapNode *)new_node;
+            Py_INCREF(key);
+            new_node->c_array[i] = key;
+            Py_INCREF(val);
+            new_node->c_array[i + 1] = val;
+            map_gc_track_if(new_node, key);
+            map_gc_track_if(new_node, val);
 
-            case F_FOUND:
-                /* There's a key which is equal to the key we are adding. */
+            *added_leaf = 1;
+            return (MapNode *)new_node;
 
-                assert(key_idx >= 0);
-                assert(key_idx < Py_SIZE(self));
-                Py_ssize_t val_idx = key_idx + 1;
+        case F_FOUND:
+            /* There's a key which is equal to the key we are adding. */
 
-                if (self->c_array[val_idx] == val) {
-                    /* We're setting a key/value pair that's already set. */
-                    Py_INCREF(self);
-                    return (MapNode *)self;
-                }
+            assert(key_idx >= 0);
+            assert(key_idx < Py_SIZE(self));
+            Py_ssize_t val_idx = key_idx + 1;
 
-                /* We need to replace old value for the key with
-                   a new value. */
+            if (self->c_array[val_idx] == val) {
+                /* We're setting a key/value pair that's already set. */
+                Py_INCREF(self);
+                return (MapNode *)self;
+            }
 
-                if (mutid != 0 && self->c_mutid == mutid) {
-                    new_node = self;
-                    Py_INCREF(self);
-                }
-                else {
-                    /* Create a new Collision node.*/
-                    new_node = (MapNode_Collision *)map_node_collision_new(
-                        self->c_hash, Py_SIZE(self), mutid);
-                    if (new_node == NULL) {
-                        return NULL;
-                    }
+            /* We need to replace old value for the key with
+               a new value. */
 
-                    /* Copy all elements of the old node to the new one. */
-                    for (i = 0; i < Py_SIZE(self); i++) {
-                        Py_INCREF(self->c_array[i]);
-                        new_node->c_array[i] = self->c_array[i];
-                    }
+            if (MAP_NODE_OWNED(self->c_mutid, mutid)) {
+                new_node = self;
+                Py_INCREF(self);
+                self->c_subtree_hash = HAMT_NO_HASH;
+            }
+            else {
+                /* Create a new Collision node.*/
+                new_node = (MapNode_Collision *)map_node_collision_new(
+                    map_state(self), self->c_hash, Py_SIZE(self), mutid);
+                if (new_node == NULL) {
+                    return NULL;
                 }
 
-                /* Replace the old value with the new value for the our key. */
-                Py_DECREF(new_node->c_array[val_idx]);
-                Py_INCREF(val);
-                new_node->c_array[val_idx] = val;
-
-                return (MapNode *)new_node;
-
-            default:
-                abort();
-        }
-    }
-    else {
-        /* The hash of the new key is different from the hash that
-           all keys of this Collision node have.
-
-           Create a Bitmap node inplace with two children:
-           key/value pair that we're adding, and the Collision node
-           we're replacing on this tree level.
-        */
+                /* Copy all elements of the old node to the new one. */
+                for (i = 0; i < Py_SIZE(self); i++) {
+                    Py_INCREF(self->c_array[i]);
+                    new_node->c_array[i] = self->c_array[i];
+                    map_gc_track_if(new_node, new_node->c_array[i]);
+                }
+            }
 
-        MapNode_Bitmap *new_node;
-        MapNode *assoc_res;
+            /* Replace the old value with the new value for the our key. */
+            Py_DECREF(new_node->c_array[val_idx]);
+            Py_INCREF(val);
+            new_node->c_array[val_idx] = val;
+            map_gc_track_if(new_node, val);
 
-        new_node = (MapNode_Bitmap *)map_node_bitmap_new(2, mutid);
-        if (new_node == NULL) {
-            return NULL;
-        }
-        new_node->b_bitmap = map_bitpos(self->c_hash, shift);
-        Py_INCREF(self);
-        new_node->b_array[1] = (PyObject*) self;
+            return (MapNode *)new_node;
 
-        assoc_res = map_node_bitmap_assoc(
-            new_node, shift, hash, key, val, added_leaf, mutid);
-        Py_DECREF(new_node);
-        return assoc_res;
+        default:
+            abort();
     }
 }
 
@@ -1522,14 +2385,12 @@ map_node_collision_count(MapNode_Collision *node)
 
 static map_without_t
 map_node_collision_without(MapNode_Collision *self,
-                           uint32_t shift, int32_t hash,
+                           uint32_t shift, Py_hash_t hash,
                            PyObject *key,
                            MapNode **new_node,
                            uint64_t mutid)
 {
-    if (hash != self->c_hash) {
-        return W_NOT_FOUND;
-    }
+    assert(hash == self->c_hash);
 
     Py_ssize_t key_idx = -1;
     map_find_t found = map_node_collision_find_index(self, key, &key_idx);
@@ -1559,29 +2420,22 @@ map_node_collision_without(MapNode_Collision *self,
                 /* The node has two keys, and after deletion the
                    new Collision node would have one.  Collision nodes
                    with one key shouldn't exist, so convert it to a
-                   Bitmap node.
+                   Bitmap node.  The parent Bitmap node inlines it
+                   right away, so the slot we pick doesn't matter
+                   (there are no hash bits left for this level anyway).
                 */
                 MapNode_Bitmap *node = (MapNode_Bitmap *)
-                    map_node_bitmap_new(2, mutid);
+                    map_node_bitmap_new(map_state(self), 1, 0, mutid);
                 if (node == NULL) {
                     return W_ERROR;
                 }
 
-                if (key_idx == 0) {
-                    Py_INCREF(self->c_array[2]);
-                    node->b_array[0] = self->c_array[2];
-                    Py_INCREF(self->c_array[3]);
-                    node->b_array[1] = self->c_array[3];
-                }
-                else {
-                    assert(key_idx == 2);
-                    Py_INCREF(self->c_array[0]);
-                    node->b_array[0] = self->c_array[0];
-                    Py_INCREF(self->c_array[1]);
-                    node->b_array[1] = self->c_array[1];
-                }
-
-                node->b_bitmap = map_bitpos(hash, shift);
+                Py_ssize_t keep_idx = key_idx == 0 ? 2 : 0;
+                assert(key_idx == 0 || key_idx == 2);
+                map_node_bitmap_set_pair(
+                    node, 0, hash,
+                    self->c_array[keep_idx], self->c_array[keep_idx + 1]);
+                node->b_datamap = 1;
 
                 *new_node = (MapNode *)node;
                 return W_NEWNODE;
@@ -1591,7 +2445,8 @@ map_node_collision_without(MapNode_Collision *self,
                less key/value pair */
             MapNode_Collision *new = (MapNode_Collision *)
                 map_node_collision_new(
-                    self->c_hash, Py_SIZE(self) - 2, mutid);
+                    map_state(self), self->c_hash, Py_SIZE(self) - 2,
+                    mutid);
             if (new == NULL) {
                 return W_ERROR;
             }
@@ -1601,10 +2456,12 @@ map_node_collision_without(MapNode_Collision *self,
             for (i = 0; i < key_idx; i++) {
                 Py_INCREF(self->c_array[i]);
                 new->c_array[i] = self->c_array[i];
+                map_gc_track_if(new, new->c_array[i]);
             }
             for (i = key_idx + 2; i < Py_SIZE(self); i++) {
                 Py_INCREF(self->c_array[i]);
                 new->c_array[i - 2] = self->c_array[i];
+                map_gc_track_if(new, new->c_array[i - 2]);
             }
 
             *new_node = (MapNode*)new;
@@ -1617,8 +2474,8 @@ map_node_collision_without(MapNode_Collision *self,
 
 static map_find_t
 map_node_collision_find(MapNode_Collision *self,
-                        uint32_t shift, int32_t hash,
-                        PyObject *key, PyObject **val)
+                        uint32_t shift, Py_hash_t hash,
+                        PyObject *key, PyObject **found_key, PyObject **val)
 {
     /* Lookup `key` in the Collision node `self`.  Set the value
        for the found key to 'val'. */
@@ -1626,6 +2483,8 @@ map_node_collision_find(MapNode_Collision *self,
     Py_ssize_t idx = -1;
     map_find_t res;
 
+    assert(hash == self->c_hash);
+
     res = map_node_collision_find_index(self, key, &idx);
     if (res == F_ERROR || res == F_NOT_FOUND) {
         return res;
@@ -1634,6 +2493,9 @@ map_node_collision_find(MapNode_Collision *self,
     assert(idx >= 0);
     assert(idx + 1 < Py_SIZE(self));
 
+    if (found_key != NULL) {
+        *found_key = self->c_array[idx];
+    }
     *val = self->c_array[idx + 1];
     assert(*val != NULL);
 
@@ -1641,6 +2503,66 @@ map_node_collision_find(MapNode_Collision *self,
 }
 
 
+static int
+map_node_collision_eq(MapNode_Collision *v, MapNode_Collision *w)
+{
+    /* Compare two Collision nodes.  Their keys can be stored in
+       any order, so every key of 'v' is looked up in 'w'. */
+
+    if (v->c_hash != w->c_hash || Py_SIZE(v) != Py_SIZE(w)) {
+        return 0;
+    }
+
+    for (Py_ssize_t i = 0; i < Py_SIZE(v); i += 2) {
+        Py_ssize_t idx;
+
+        switch (map_node_collision_find_index(w, v->c_array[i], &idx)) {
+            case F_ERROR:
+                return -1;
+
+            case F_NOT_FOUND:
+                return 0;
+
+            case F_FOUND: {
+                int cmp = PyObject_RichCompareBool(
+                    v->c_array[i + 1], w->c_array[idx + 1], Py_EQ);
+                if (cmp <= 0) {
+                    return cmp;
+                }
+                break;
+            }
+
+            default:
+                abort();
+        }
+    }
+
+    return 1;
+}
+
+static int
+map_node_collision_hash(MapNode_Collision *self, Py_uhash_t *hash)
+{
+    /* Compute (or return the memoized) hash of a Collision node. */
+
+    Py_uhash_t cached = MAP_LOAD_UHASH(self->c_subtree_hash);
+    if (cached != HAMT_NO_HASH) {
+        *hash = cached;
+        return 0;
+    }
+
+    Py_uhash_t h = 0;
+    for (Py_ssize_t i = 0; i < Py_SIZE(self); i += 2) {
+        if (map_hash_item(self->c_array[i], self->c_array[i + 1], &h)) {
+            return -1;
+        }
+    }
+
+    MAP_STORE_UHASH(self->c_subtree_hash, h);
+    *hash = h;
+    return 0;
+}
+
 static int
 map_node_collision_traverse(MapNode_Collision *self,
                             visitproc visit, void *arg)
@@ -1661,11 +2583,18 @@ map_node_collision_dealloc(MapNode_Collision *self)
 {
     /* Collision's tp_dealloc */
 
+    PyTypeObject *tp = Py_TYPE(self);
     Py_ssize_t len = Py_SIZE(self);
 
     PyObject_GC_UnTrack(self);
     Py_TRASHCAN_BEGIN(self, map_node_collision_dealloc)
 
+#ifdef MAP_NODE_FREELISTS
+    MapState *st = map_state(self);
+    int keep = len == MAP_COLLISION_FREELIST_SIZE &&
+        st->collision_numfree < MAP_COLLISION_FREELIST_MAX;
+#endif
+
     if (len > 0) {
 
         while (--len >= 0) {
@@ -1673,7 +2602,18 @@ map_node_collision_dealloc(MapNode_Collision *self)
         }
     }
 
-    Py_TYPE(self)->tp_free((PyObject *)self);
+#ifdef MAP_NODE_FREELISTS
+    if (keep) {
+        self->c_array[0] = (PyObject *)st->collision_freelist;
+        st->collision_freelist = self;
+        st->collision_numfree++;
+    }
+    else
+#endif
+    {
+        tp->tp_free((PyObject *)self);
+    }
+    Py_DECREF(tp);
     Py_TRASHCAN_END
 }
 
@@ -1718,14 +2658,24 @@ error:
 
 
 static MapNode *
-map_node_array_new(Py_ssize_t count, uint64_t mutid)
+map_node_array_new(MapState *st, Py_ssize_t count, uint64_t mutid)
 {
     Py_ssize_t i;
+    MapNode_Array *node;
 
-    MapNode_Array *node = PyObject_GC_New(
-        MapNode_Array, &_Map_ArrayNode_Type);
-    if (node == NULL) {
-        return NULL;
+#ifdef MAP_NODE_FREELISTS
+    if ((node = st->array_freelist) != NULL) {
+        st->array_freelist = (MapNode_Array *)node->a_array[0];
+        st->array_numfree--;
+        (void)PyObject_Init((PyObject *)node, st->ArrayNodeType);
+    }
+    else
+#endif
+    {
+        node = PyObject_GC_New(MapNode_Array, st->ArrayNodeType);
+        if (node == NULL) {
+            return NULL;
+        }
     }
 
     for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
@@ -1734,8 +2684,8 @@ map_node_array_new(Py_ssize_t count, uint64_t mutid)
 
     node->a_count = count;
     node->a_mutid = mutid;
+    node->a_subtree_hash = HAMT_NO_HASH;
 
-    PyObject_GC_Track(node);
     return (MapNode *)node;
 }
 
@@ -1749,15 +2699,19 @@ map_node_array_clone(MapNode_Array *node, uint64_t mutid)
     assert(node->a_count <= HAMT_ARRAY_NODE_SIZE);
 
     /* Create a new Array node. */
-    clone = (MapNode_Array *)map_node_array_new(node->a_count, mutid);
+    clone = (MapNode_Array *)map_node_array_new(
+        map_state(node), node->a_count, mutid);
     if (clone == NULL) {
         return NULL;
     }
 
     /* Copy all elements from the current Array node to the new one. */
     for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
-        Py_XINCREF(node->a_array[i]);
-        clone->a_array[i] = node->a_array[i];
+        if (node->a_array[i] != NULL) {
+            Py_INCREF(node->a_array[i]);
+            clone->a_array[i] = node->a_array[i];
+            map_gc_track_if(clone, (PyObject *)clone->a_array[i]);
+        }
     }
 
     clone->a_mutid = mutid;
@@ -1768,7 +2722,7 @@ map_node_array_clone(MapNode_Array *node, uint64_t mutid)
 
 static MapNode *
 map_node_array_assoc(MapNode_Array *self,
-                     uint32_t shift, int32_t hash,
+                     uint32_t shift, Py_hash_t hash,
                      PyObject *key, PyObject *val, int* added_leaf,
                      uint64_t mutid)
 {
@@ -1789,33 +2743,23 @@ map_node_array_assoc(MapNode_Array *self,
         /* There's no child node for the given hash.  Create a new
            Bitmap node for this key. */
 
-        MapNode_Bitmap *empty = NULL;
-
-        /* Get an empty Bitmap node to work with. */
-        empty = (MapNode_Bitmap *)map_node_bitmap_new(0, mutid);
-        if (empty == NULL) {
-            return NULL;
-        }
-
-        /* Set key/val to the newly created empty Bitmap, thus
-           creating a new Bitmap node with our key/value pair. */
-        child_node = map_node_bitmap_assoc(
-            empty,
-            shift + 5, hash, key, val, added_leaf, mutid);
-        Py_DECREF(empty);
+        child_node = map_node_bitmap_new_pair(
+            map_state(self), shift + 5, hash, key, val, mutid);
         if (child_node == NULL) {
             return NULL;
         }
+        *added_leaf = 1;
 
-        if (mutid != 0 && self->a_mutid == mutid) {
+        if (MAP_NODE_OWNED(self->a_mutid, mutid)) {
             new_node = self;
             self->a_count++;
+            self->a_subtree_hash = HAMT_NO_HASH;
             Py_INCREF(self);
         }
         else {
             /* Create a new Array node. */
             new_node = (MapNode_Array *)map_node_array_new(
-                self->a_count + 1, mutid);
+                map_state(self), self->a_count + 1, mutid);
             if (new_node == NULL) {
                 Py_DECREF(child_node);
                 return NULL;
@@ -1824,13 +2768,18 @@ map_node_array_assoc(MapNode_Array *self,
             /* Copy all elements from the current Array node to the
                new one. */
             for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
-                Py_XINCREF(self->a_array[i]);
-                new_node->a_array[i] = self->a_array[i];
+                if (self->a_array[i] != NULL) {
+                    Py_INCREF(self->a_array[i]);
+                    new_node->a_array[i] = self->a_array[i];
+                    map_gc_track_if(
+                        new_node, (PyObject *)new_node->a_array[i]);
+                }
             }
         }
 
         assert(new_node->a_array[idx] == NULL);
         new_node->a_array[idx] = child_node;  /* borrow */
+        map_gc_track_if(new_node, (PyObject *)child_node);
         VALIDATE_ARRAY_NODE(new_node)
     }
     else {
@@ -1847,8 +2796,9 @@ map_node_array_assoc(MapNode_Array *self,
             return (MapNode *)self;
         }
 
-        if (mutid != 0 && self->a_mutid == mutid) {
+        if (MAP_NODE_OWNED(self->a_mutid, mutid)) {
             new_node = self;
+            self->a_subtree_hash = HAMT_NO_HASH;
             Py_INCREF(self);
         }
         else {
@@ -1861,6 +2811,7 @@ map_node_array_assoc(MapNode_Array *self,
         }
 
         Py_SETREF(new_node->a_array[idx], child_node);  /* borrow */
+        map_gc_track_if(new_node, (PyObject *)child_node);
         VALIDATE_ARRAY_NODE(new_node)
     }
 
@@ -1869,7 +2820,7 @@ map_node_array_assoc(MapNode_Array *self,
 
 static map_without_t
 map_node_array_without(MapNode_Array *self,
-                       uint32_t shift, int32_t hash,
+                       uint32_t shift, Py_hash_t hash,
                        PyObject *key,
                        MapNode **new_node,
                        uint64_t mutid)
@@ -1899,8 +2850,9 @@ map_node_array_without(MapNode_Array *self,
             */
             assert(sub_node != NULL);
 
-            if (mutid != 0 && self->a_mutid == mutid) {
+            if (MAP_NODE_OWNED(self->a_mutid, mutid)) {
                 target = self;
+                target->a_subtree_hash = HAMT_NO_HASH;
                 Py_INCREF(self);
             }
             else {
@@ -1912,6 +2864,7 @@ map_node_array_without(MapNode_Array *self,
             }
 
             Py_SETREF(target->a_array[idx], sub_node);  /* borrow */
+            map_gc_track_if(target, (PyObject *)sub_node);
             *new_node = (MapNode*)target;  /* borrow */
             return W_NEWNODE;
         }
@@ -1927,16 +2880,17 @@ map_node_array_without(MapNode_Array *self,
                 return W_EMPTY;
             }
 
-            if (new_count >= 16) {
+            if (new_count > 16) {
                 /* We convert Bitmap nodes to Array nodes, when a
-                   Bitmap node needs to store more than 15 key/value
-                   pairs.  So we will create a new Array node if we
-                   the number of key/values after deletion is still
-                   greater than 15.
+                   Bitmap node needs to store more than 16 key/value
+                   pairs and sub-nodes.  So we keep an Array node if
+                   the number of sub-nodes after deletion is still
+                   greater than 16.
                 */
 
-                if (mutid != 0 && self->a_mutid == mutid) {
+                if (MAP_NODE_OWNED(self->a_mutid, mutid)) {
                     target = self;
+                    target->a_subtree_hash = HAMT_NO_HASH;
                     Py_INCREF(self);
                 }
                 else {
@@ -1953,20 +2907,31 @@ map_node_array_without(MapNode_Array *self,
                 return W_NEWNODE;
             }
 
-            /* New Array node would have less than 16 key/value
-               pairs.  We need to create a replacement Bitmap node. */
+            /* New Array node would have 16 or less sub-nodes.
+               We need to create a replacement Bitmap node.
+               Sub-nodes that are Bitmap nodes with one key/value
+               pair are inlined into it. */
+
+            Py_ssize_t data_count = 0;
+            uint32_t i;
 
-            Py_ssize_t bitmap_size = new_count * 2;
-            uint32_t bitmap = 0;
+            for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+                if (i != idx && self->a_array[i] != NULL &&
+                        map_node_bitmap_is_single_pair(self->a_array[i]))
+                {
+                    data_count++;
+                }
+            }
 
-            MapNode_Bitmap *new = (MapNode_Bitmap *)
-                map_node_bitmap_new(bitmap_size, mutid);
+            MapNode_Bitmap *new = (MapNode_Bitmap *)map_node_bitmap_new(
+                map_state(self), data_count, new_count - data_count, mutid);
             if (new == NULL) {
                 return W_ERROR;
             }
 
-            Py_ssize_t new_i = 0;
-            for (uint32_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+            Py_ssize_t data_i = 0;
+            Py_ssize_t node_i = 0;
+            for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
                 if (i == idx) {
                     /* Skip the node we are deleting. */
                     continue;
@@ -1978,35 +2943,17 @@ map_node_array_without(MapNode_Array *self,
                     continue;
                 }
 
-                bitmap |= 1u << i;
-
-                if (IS_BITMAP_NODE(node)) {
+                if (map_node_bitmap_is_single_pair(node)) {
+                    /* node is a Bitmap with one key/value pair, just
+                       merge it into the new Bitmap node we're building.
+                    */
                     MapNode_Bitmap *child = (MapNode_Bitmap *)node;
 
-                    if (map_node_bitmap_count(child) == 1 &&
-                            child->b_array[0] != NULL)
-                    {
-                        /* node is a Bitmap with one key/value pair, just
-                           merge it into the new Bitmap node we're building.
-
-                           Note that we don't inline Bitmap nodes that
-                           have a NULL key -- those nodes point to another
-                           tree level, and we cannot simply move tree levels
-                           up or down.
-                        */
-                        PyObject *key = child->b_array[0];
-                        PyObject *val = child->b_array[1];
-
-                        Py_INCREF(key);
-                        new->b_array[new_i] = key;
-                        Py_INCREF(val);
-                        new->b_array[new_i + 1] = val;
-                    }
-                    else {
-                        new->b_array[new_i] = NULL;
-                        Py_INCREF(node);
-                        new->b_array[new_i + 1] = (PyObject*)node;
-                    }
+                    map_node_bitmap_set_pair(
+                        new, data_i, BITMAP_HASHES(child)[0],
+                        child->b_array[0], child->b_array[1]);
+                    new->b_datamap |= 1u << i;
+                    data_i++;
                 }
                 else {
 
@@ -2017,20 +2964,20 @@ map_node_array_without(MapNode_Array *self,
                                 (MapNode_Collision*)node)) > 1);
                     }
                     else if (IS_ARRAY_NODE(node)) {
-                        assert(((MapNode_Array*)node)->a_count >= 16);
+                        assert(((MapNode_Array*)node)->a_count > 16);
                     }
 #endif
 
                     /* Just copy the node into our new Bitmap */
-                    new->b_array[new_i] = NULL;
                     Py_INCREF(node);
-                    new->b_array[new_i + 1] = (PyObject*)node;
+                    new->b_array[BITMAP_NODE_IDX(new, node_i)] =
+                        (PyObject *)node;
+                    map_gc_track_if(new, (PyObject *)node);
+                    new->b_nodemap |= 1u << i;
+                    node_i++;
                 }
-
-                new_i += 2;
             }
 
-            new->b_bitmap = bitmap;
             *new_node = (MapNode*)new;  /* borrow */
             return W_NEWNODE;
         }
@@ -2042,8 +2989,8 @@ map_node_array_without(MapNode_Array *self,
 
 static map_find_t
 map_node_array_find(MapNode_Array *self,
-                    uint32_t shift, int32_t hash,
-                    PyObject *key, PyObject **val)
+                    uint32_t shift, Py_hash_t hash,
+                    PyObject *key, PyObject **found_key, PyObject **val)
 {
     /* Lookup `key` in the Array node `self`.  Set the value
        for the found key to 'val'. */
@@ -2056,8 +3003,62 @@ map_node_array_find(MapNode_Array *self,
         return F_NOT_FOUND;
     }
 
-    /* Dispatch to the generic map_node_find */
-    return map_node_find(node, shift + 5, hash, key, val);
+    /* Dispatch to the generic map_node_find_item */
+    return map_node_find_item(node, shift + 5, hash, key, found_key, val);
+}
+
+static int
+map_node_array_eq(MapNode_Array *v, MapNode_Array *w)
+{
+    /* Compare two Array nodes at the same level of two trees. */
+
+    if (v->a_count != w->a_count) {
+        return 0;
+    }
+
+    for (Py_ssize_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        if ((v->a_array[i] == NULL) != (w->a_array[i] == NULL)) {
+            return 0;
+        }
+    }
+
+    for (Py_ssize_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        if (v->a_array[i] != NULL) {
+            int cmp = map_node_eq(v->a_array[i], w->a_array[i]);
+            if (cmp <= 0) {
+                return cmp;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static int
+map_node_array_hash(MapNode_Array *self, Py_uhash_t *hash)
+{
+    /* Compute (or return the memoized) hash of an Array node. */
+
+    Py_uhash_t cached = MAP_LOAD_UHASH(self->a_subtree_hash);
+    if (cached != HAMT_NO_HASH) {
+        *hash = cached;
+        return 0;
+    }
+
+    Py_uhash_t h = 0;
+    for (Py_ssize_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        if (self->a_array[i] != NULL) {
+            Py_uhash_t sub_hash;
+            if (map_node_hash(self->a_array[i], &sub_hash)) {
+                return -1;
+            }
+            h ^= sub_hash;
+        }
+    }
+
+    MAP_STORE_UHASH(self->a_subtree_hash, h);
+    *hash = h;
+    return 0;
 }
 
 static int
@@ -2080,6 +3081,7 @@ map_node_array_dealloc(MapNode_Array *self)
 {
     /* Array's tp_dealloc */
 
+    PyTypeObject *tp = Py_TYPE(self);
     Py_ssize_t i;
 
     PyObject_GC_UnTrack(self);
@@ -2089,7 +3091,19 @@ map_node_array_dealloc(MapNode_Array *self)
         Py_XDECREF(self->a_array[i]);
     }
 
-    Py_TYPE(self)->tp_free((PyObject *)self);
+#ifdef MAP_NODE_FREELISTS
+    MapState *st = map_state(self);
+    if (st->array_numfree < MAP_ARRAY_FREELIST_MAX) {
+        self->a_array[0] = (MapNode *)st->array_freelist;
+        st->array_freelist = self;
+        st->array_numfree++;
+    }
+    else
+#endif
+    {
+        tp->tp_free((PyObject *)self);
+    }
+    Py_DECREF(tp);
     Py_TRASHCAN_END
 }
 
@@ -2144,7 +3158,7 @@ error:
 
 static MapNode *
 map_node_assoc(MapNode *node,
-               uint32_t shift, int32_t hash,
+               uint32_t shift, Py_hash_t hash,
                PyObject *key, PyObject *val, int* added_leaf,
                uint64_t mutid)
 {
@@ -2161,6 +3175,11 @@ map_node_assoc(MapNode *node,
 
     *added_leaf = 0;
 
+    if (mutid == MAP_MUTID_UNIQUE && !MAP_IS_UNIQUE(node)) {
+        /* Nodes under a shared node are shared too. */
+        mutid = 0;
+    }
+
     if (IS_BITMAP_NODE(node)) {
         return map_node_bitmap_assoc(
             (MapNode_Bitmap *)node,
@@ -2181,11 +3200,15 @@ map_node_assoc(MapNode *node,
 
 static map_without_t
 map_node_without(MapNode *node,
-                 uint32_t shift, int32_t hash,
+                 uint32_t shift, Py_hash_t hash,
                  PyObject *key,
                  MapNode **new_node,
                  uint64_t mutid)
 {
+    if (mutid == MAP_MUTID_UNIQUE && !MAP_IS_UNIQUE(node)) {
+        mutid = 0;
+    }
+
     if (IS_BITMAP_NODE(node)) {
         return map_node_bitmap_without(
             (MapNode_Bitmap *)node,
@@ -2210,9 +3233,36 @@ map_node_without(MapNode *node,
     }
 }
 
+static map_find_t
+map_node_find_item(MapNode *node,
+                   uint32_t shift, Py_hash_t hash,
+                   PyObject *key, PyObject **found_key, PyObject **val)
+{
+    /* Like map_node_find(), but also set *found_key (unless it's
+       NULL) to the key stored in the tree, which can be a different
+       object equal to "key": 1 and True, for instance. */
+
+    if (IS_BITMAP_NODE(node)) {
+        return map_node_bitmap_find(
+            (MapNode_Bitmap *)node,
+            shift, hash, key, found_key, val);
+    }
+    else if (IS_ARRAY_NODE(node)) {
+        return map_node_array_find(
+            (MapNode_Array *)node,
+            shift, hash, key, found_key, val);
+    }
+    else {
+        assert(IS_COLLISION_NODE(node));
+        return map_node_collision_find(
+            (MapNode_Collision *)node,
+            shift, hash, key, found_key, val);
+    }
+}
+
 static map_find_t
 map_node_find(MapNode *node,
-              uint32_t shift, int32_t hash,
+              uint32_t shift, Py_hash_t hash,
               PyObject *key, PyObject **val)
 {
     /* Find the key in the node starting with the given shift/hash.
@@ -2228,23 +3278,7 @@ map_node_find(MapNode *node,
        map_node_{nodetype}_find method.
     */
 
-    if (IS_BITMAP_NODE(node)) {
-        return map_node_bitmap_find(
-            (MapNode_Bitmap *)node,
-            shift, hash, key, val);
-
-    }
-    else if (IS_ARRAY_NODE(node)) {
-        return map_node_array_find(
-            (MapNode_Array *)node,
-            shift, hash, key, val);
-    }
-    else {
-        assert(IS_COLLISION_NODE(node));
-        return map_node_collision_find(
-            (MapNode_Collision *)node,
-            shift, hash, key, val);
-    }
+    return map_node_find_item(node, shift, hash, key, NULL, val);
 }
 
 static int
@@ -2273,11 +3307,75 @@ map_node_dump(MapNode *node,
 }
 
 
+static int
+map_node_hash(MapNode *node, Py_uhash_t *hash)
+{
+    /* Set *hash to the XOR of _shuffle_bits() of hashes of all
+       keys and values in the subtree.
+
+       This method automatically dispatches to the suitable
+       map_node_{nodetype}_hash method.
+    */
+
+    if (IS_BITMAP_NODE(node)) {
+        return map_node_bitmap_hash((MapNode_Bitmap *)node, hash);
+    }
+    else if (IS_ARRAY_NODE(node)) {
+        return map_node_array_hash((MapNode_Array *)node, hash);
+    }
+    else {
+        assert(IS_COLLISION_NODE(node));
+        return map_node_collision_hash((MapNode_Collision *)node, hash);
+    }
+}
+
+
+static int
+map_node_eq(MapNode *v, MapNode *w)
+{
+    /* Compare two subtrees found at the same place of two trees.
+
+       Subtrees shared by both trees are equal; otherwise, since
+       trees are kept in a canonical shape, nodes of different
+       kinds can't hold equal items.
+
+       This method automatically dispatches to the suitable
+       map_node_{nodetype}_eq method.
+
+       Return: 1 if the subtrees are equal, 0 if they aren't,
+       -1 if an error occurred.
+    */
+
+    if (v == w) {
+        return 1;
+    }
+
+    if (Py_TYPE(v) != Py_TYPE(w)) {
+        return 0;
+    }
+
+    if (IS_BITMAP_NODE(v)) {
+        return map_node_bitmap_eq(
+            (MapNode_Bitmap *)v, (MapNode_Bitmap *)w);
+    }
+    else if (IS_ARRAY_NODE(v)) {
+        return map_node_array_eq(
+            (MapNode_Array *)v, (MapNode_Array *)w);
+    }
+    else {
+        assert(IS_COLLISION_NODE(v));
+        return map_node_collision_eq(
+            (MapNode_Collision *)v, (MapNode_Collision *)w);
+    }
+}
+
+
 /////////////////////////////////// Iterators: Machinery
 
 
 static map_iter_t
-map_iterator_next(MapIteratorState *iter, PyObject **key, PyObject **val);
+map_iterator_next_hashed(MapIteratorState *iter,
+                         PyObject **key, PyObject **val, Py_hash_t *hash);
 
 
 static void
@@ -2292,48 +3390,68 @@ map_iterator_init(MapIteratorState *iter, MapNode *root)
 
     /* Note: we don't incref/decref nodes in i_nodes. */
     iter->i_nodes[0] = root;
+
+    iter->i_entries = NULL;
+    iter->i_entries_count = 0;
+}
+
+static void
+map_iterator_init_map(MapIteratorState *iter, BaseMapObject *o)
+{
+    if (IS_SMALL_MAP(o)) {
+        assert(Map_Check(o) || o->b_count == 0);
+        map_iterator_init(iter, NULL);
+        iter->i_entries = ((MapObject *)o)->h_entries;
+        iter->i_entries_count = o->b_count;
+    }
+    else {
+        map_iterator_init(iter, o->b_root);
+    }
 }
 
 static map_iter_t
 map_iterator_bitmap_next(MapIteratorState *iter,
-                         PyObject **key, PyObject **val)
+                         PyObject **key, PyObject **val, Py_hash_t *hash)
 {
     int8_t level = iter->i_level;
 
     MapNode_Bitmap *node = (MapNode_Bitmap *)(iter->i_nodes[level]);
     Py_ssize_t pos = iter->i_pos[level];
+    Py_ssize_t data_count = map_node_bitmap_data_count(node);
 
-    if (pos + 1 >= Py_SIZE(node)) {
+    /* Key/value pairs are yielded first, then sub-nodes are visited. */
+
+    if (pos < data_count) {
+        *key = node->b_array[2 * pos];
+        *val = node->b_array[2 * pos + 1];
+        *hash = BITMAP_HASHES(node)[pos];
+        iter->i_pos[level] = pos + 1;
+        return I_ITEM;
+    }
+
+    if (pos >= data_count + map_node_bitmap_node_count(node)) {
 #if !defined(NDEBUG)
         assert(iter->i_level >= 0);
         iter->i_nodes[iter->i_level] = NULL;
 #endif
         iter->i_level--;
-        return map_iterator_next(iter, key, val);
+        return map_iterator_next_hashed(iter, key, val, hash);
     }
 
-    if (node->b_array[pos] == NULL) {
-        iter->i_pos[level] = pos + 2;
-
-        assert(level + 1 < _Py_HAMT_MAX_TREE_DEPTH);
-        int8_t next_level = (int8_t)(level + 1);
-        iter->i_level = next_level;
-        iter->i_pos[next_level] = 0;
-        iter->i_nodes[next_level] = (MapNode *)
-            node->b_array[pos + 1];
+    iter->i_pos[level] = pos + 1;
 
-        return map_iterator_next(iter, key, val);
-    }
+    assert(level + 1 < _Py_HAMT_MAX_TREE_DEPTH);
+    int8_t next_level = (int8_t)(level + 1);
+    iter->i_level = next_level;
+    iter->i_pos[next_level] = 0;
+    iter->i_nodes[next_level] = BITMAP_NODE(node, pos - data_count);
 
-    *key = node->b_array[pos];
-    *val = node->b_array[pos + 1];
-    iter->i_pos[level] = pos + 2;
-    return I_ITEM;
+    return map_iterator_next_hashed(iter, key, val, hash);
 }
 
 static map_iter_t
 map_iterator_collision_next(MapIteratorState *iter,
-                            PyObject **key, PyObject **val)
+                            PyObject **key, PyObject **val, Py_hash_t *hash)
 {
     int8_t level = iter->i_level;
 
@@ -2346,18 +3464,19 @@ map_iterator_collision_next(MapIteratorState *iter,
         iter->i_nodes[iter->i_level] = NULL;
 #endif
         iter->i_level--;
-        return map_iterator_next(iter, key, val);
+        return map_iterator_next_hashed(iter, key, val, hash);
     }
 
     *key = node->c_array[pos];
     *val = node->c_array[pos + 1];
+    *hash = node->c_hash;
     iter->i_pos[level] = pos + 2;
     return I_ITEM;
 }
 
 static map_iter_t
 map_iterator_array_next(MapIteratorState *iter,
-                        PyObject **key, PyObject **val)
+                        PyObject **key, PyObject **val, Py_hash_t *hash)
 {
     int8_t level = iter->i_level;
 
@@ -2370,7 +3489,7 @@ map_iterator_array_next(MapIteratorState *iter,
         iter->i_nodes[iter->i_level] = NULL;
 #endif
         iter->i_level--;
-        return map_iterator_next(iter, key, val);
+        return map_iterator_next_hashed(iter, key, val, hash);
     }
 
     for (Py_ssize_t i = pos; i < HAMT_ARRAY_NODE_SIZE; i++) {
@@ -2383,7 +3502,7 @@ map_iterator_array_next(MapIteratorState *iter,
             iter->i_nodes[next_level] = node->a_array[i];
             iter->i_level = next_level;
 
-            return map_iterator_next(iter, key, val);
+            return map_iterator_next_hashed(iter, key, val, hash);
         }
     }
 
@@ -2393,12 +3512,28 @@ map_iterator_array_next(MapIteratorState *iter,
 #endif
 
     iter->i_level--;
-    return map_iterator_next(iter, key, val);
+    return map_iterator_next_hashed(iter, key, val, hash);
 }
 
 static map_iter_t
-map_iterator_next(MapIteratorState *iter, PyObject **key, PyObject **val)
+map_iterator_next_hashed(MapIteratorState *iter,
+                         PyObject **key, PyObject **val, Py_hash_t *hash)
 {
+    /* Like map_iterator_next, but also returns the hash of the key
+       (as computed by map_hash) in *hash. */
+
+    if (iter->i_entries != NULL) {
+        Py_ssize_t pos = iter->i_pos[0];
+        if (pos >= iter->i_entries_count) {
+            return I_END;
+        }
+        *key = iter->i_entries[pos].e_key;
+        *val = iter->i_entries[pos].e_val;
+        *hash = iter->i_entries[pos].e_hash;
+        iter->i_pos[0] = pos + 1;
+        return I_ITEM;
+    }
+
     if (iter->i_level < 0) {
         return I_END;
     }
@@ -2408,1763 +3543,9627 @@ map_iterator_next(MapIteratorState *iter, PyObject **key, PyObject **val)
     MapNode *current = iter->i_nodes[iter->i_level];
 
     if (IS_BITMAP_NODE(current)) {
-        return map_iterator_bitmap_next(iter, key, val);
+        return map_iterator_bitmap_next(iter, key, val, hash);
     }
     else if (IS_ARRAY_NODE(current)) {
-        return map_iterator_array_next(iter, key, val);
+        return map_iterator_array_next(iter, key, val, hash);
     }
     else {
         assert(IS_COLLISION_NODE(current));
-        return map_iterator_collision_next(iter, key, val);
+        return map_iterator_collision_next(iter, key, val, hash);
     }
 }
 
+static map_iter_t
+map_iterator_next(MapIteratorState *iter, PyObject **key, PyObject **val)
+{
+    Py_hash_t hash;
+    return map_iterator_next_hashed(iter, key, val, &hash);
+}
+
 
-/////////////////////////////////// HAMT high-level functions
+/////////////////////////////////// Small Maps
 
 
-static MapObject *
-map_assoc(MapObject *o, PyObject *key, PyObject *val)
+static inline int
+map_small_before(Py_hash_t a, Py_hash_t b)
 {
-    int32_t key_hash;
-    int added_leaf = 0;
-    MapNode *new_root;
-    MapObject *new_o;
+    /* Entries of small maps are sorted by their unsigned hash. */
+    return (Py_uhash_t)a < (Py_uhash_t)b;
+}
 
-    key_hash = map_hash(key);
-    if (key_hash == -1) {
-        return NULL;
+static Py_ssize_t
+map_small_insert_pos(MapEntry *entries, Py_ssize_t count, Py_hash_t hash)
+{
+    /* Return the index at which an entry with the given hash has
+       to be inserted; entries with equal hashes keep their order. */
+    Py_ssize_t i = count;
+    while (i > 0 && map_small_before(hash, entries[i - 1].e_hash)) {
+        i--;
     }
+    return i;
+}
 
-    new_root = map_node_assoc(
-        (MapNode *)(o->h_root),
-        0, key_hash, key, val, &added_leaf,
-        0);
-    if (new_root == NULL) {
-        return NULL;
+static Py_ssize_t
+map_small_find_index(MapObject *o, Py_hash_t hash, PyObject *key)
+{
+    /* Return the index of "key" in the small map "o", or:
+       - -1 if the key isn't there;
+       - -2 if an error occurred.
+    */
+    assert(IS_SMALL_MAP(o));
+
+    MapEntry *entries = o->h_entries;
+    for (Py_ssize_t i = 0; i < o->h_count; i++) {
+        if (entries[i].e_hash == hash) {
+            int cmp = PyObject_RichCompareBool(key, entries[i].e_key, Py_EQ);
+            if (cmp < 0) {
+                return -2;
+            }
+            if (cmp == 1) {
+                return i;
+            }
+        }
+        else if (map_small_before(hash, entries[i].e_hash)) {
+            break;
+        }
     }
+    return -1;
+}
 
-    if (new_root == o->h_root) {
-        Py_DECREF(new_root);
-        Py_INCREF(o);
-        return o;
+static map_find_t
+map_small_find(MapObject *o, Py_hash_t hash, PyObject *key, PyObject **val)
+{
+    Py_ssize_t idx = map_small_find_index(o, hash, key);
+    if (idx == -2) {
+        return F_ERROR;
     }
-
-    new_o = map_alloc();
-    if (new_o == NULL) {
-        Py_DECREF(new_root);
-        return NULL;
+    if (idx == -1) {
+        return F_NOT_FOUND;
     }
-
-    new_o->h_root = new_root;  /* borrow */
-    new_o->h_count = added_leaf ? o->h_count + 1 : o->h_count;
-
-    return new_o;
+    *val = o->h_entries[idx].e_val;
+    return F_FOUND;
 }
 
-static MapObject *
-map_without(MapObject *o, PyObject *key)
+static void
+map_small_set_entry(MapObject *o, Py_ssize_t idx,
+                    Py_hash_t hash, PyObject *key, PyObject *val)
 {
-    int32_t key_hash = map_hash(key);
-    if (key_hash == -1) {
-        return NULL;
-    }
-
-    MapNode *new_root = NULL;
-
-    map_without_t res = map_node_without(
-        (MapNode *)(o->h_root),
-        0, key_hash, key,
-        &new_root,
-        0);
-
-    switch (res) {
-        case W_ERROR:
-            return NULL;
-        case W_EMPTY:
-            return map_new();
-        case W_NOT_FOUND:
-            PyErr_SetObject(PyExc_KeyError, key);
-            return NULL;
-        case W_NEWNODE: {
-            assert(new_root != NULL);
+    MapEntry *entry = &o->h_entries[idx];
+    Py_INCREF(key);
+    entry->e_key = key;
+    Py_INCREF(val);
+    entry->e_val = val;
+    entry->e_hash = hash;
+    map_gc_track_if(o, key);
+    map_gc_track_if(o, val);
+}
 
-            MapObject *new_o = map_alloc();
-            if (new_o == NULL) {
-                Py_DECREF(new_root);
-                return NULL;
-            }
+static void
+map_small_copy_entries(MapObject *dst, Py_ssize_t dst_idx,
+                       MapObject *src, Py_ssize_t src_idx,
+                       Py_ssize_t count)
+{
+    /* Copy 'count' entries from 'src' to 'dst'. */
 
-            new_o->h_root = new_root;  /* borrow */
-            new_o->h_count = o->h_count - 1;
-            assert(new_o->h_count >= 0);
-            return new_o;
-        }
-        default:
-            abort();
+    for (Py_ssize_t i = 0; i < count; i++) {
+        MapEntry *entry = &src->h_entries[src_idx + i];
+        map_small_set_entry(dst, dst_idx + i,
+                            entry->e_hash, entry->e_key, entry->e_val);
     }
 }
 
-static map_find_t
-map_find(BaseMapObject *o, PyObject *key, PyObject **val)
+static MapNode *
+map_small_to_root(MapObject *o, uint64_t mutid)
 {
-    if (o->b_count == 0) {
-        return F_NOT_FOUND;
+    /* Build a tree out of items of the small map "o".
+
+       Nodes of the tree are owned by "mutid", so the caller can
+       keep updating them in place.
+    */
+    assert(IS_SMALL_MAP(o));
+
+    MapNode *root = map_node_bitmap_new(map_state(o), 0, 0, mutid);
+    if (root == NULL) {
+        return NULL;
     }
 
-    int32_t key_hash = map_hash(key);
-    if (key_hash == -1) {
-        return F_ERROR;
+    for (Py_ssize_t i = 0; i < o->h_count; i++) {
+        MapEntry *entry = &o->h_entries[i];
+        int added_leaf;
+
+        MapNode *new_root = map_node_assoc(
+            root, 0, entry->e_hash, entry->e_key, entry->e_val,
+            &added_leaf, mutid);
+        if (new_root == NULL) {
+            Py_DECREF(root);
+            return NULL;
+        }
+        assert(added_leaf);
+        Py_SETREF(root, new_root);
     }
 
-    return map_node_find(o->b_root, 0, key_hash, key, val);
+    return root;
 }
 
-static int
-map_eq(BaseMapObject *v, BaseMapObject *w)
+static MapObject *
+map_new_from_root(MapState *st, MapNode *root, Py_ssize_t count)
 {
-    if (v == w) {
-        return 1;
+    /* Create a new Map out of a tree with "count" items.  Steals
+       the reference to "root".
+
+       Maps that are small enough get their items copied out of
+       the tree, and the tree is released.
+    */
+    MapObject *o;
+
+    if (count > MAP_SMALL_MAX_COUNT) {
+        o = map_alloc(st, 0);
+        if (o == NULL) {
+            Py_DECREF(root);
+            return NULL;
+        }
+        o->h_root = root;  /* borrow */
+        o->h_count = count;
+        map_gc_track_if(o, (PyObject *)root);
+        return o;
     }
 
-    if (v->b_count != w->b_count) {
-        return 0;
+    o = map_alloc(st, count);
+    if (o == NULL) {
+        Py_DECREF(root);
+        return NULL;
     }
 
     MapIteratorState iter;
     map_iter_t iter_res;
-    map_find_t find_res;
-    PyObject *v_key;
-    PyObject *v_val;
-    PyObject *w_val;
-
-    map_iterator_init(&iter, v->b_root);
+    Py_ssize_t n = 0;
 
+    map_iterator_init(&iter, root);
     do {
-        iter_res = map_iterator_next(&iter, &v_key, &v_val);
-        if (iter_res == I_ITEM) {
-            find_res = map_find(w, v_key, &w_val);
-            switch (find_res) {
-                case F_ERROR:
-                    return -1;
-
-                case F_NOT_FOUND:
-                    return 0;
+        PyObject *key;
+        PyObject *val;
+        Py_hash_t hash;
 
-                case F_FOUND: {
-                    int cmp = PyObject_RichCompareBool(v_val, w_val, Py_EQ);
-                    if (cmp < 0) {
-                        return -1;
-                    }
-                    if (cmp == 0) {
-                        return 0;
-                    }
-                }
-            }
+        iter_res = map_iterator_next_hashed(&iter, &key, &val, &hash);
+        if (iter_res == I_ITEM) {
+            assert(n < count);
+            Py_ssize_t pos = map_small_insert_pos(o->h_entries, n, hash);
+            memmove(&o->h_entries[pos + 1], &o->h_entries[pos],
+                    (size_t)(n - pos) * sizeof(MapEntry));
+            map_small_set_entry(o, pos, hash, key, val);
+            n++;
+            o->h_count = n;
         }
     } while (iter_res != I_END);
 
-    return 1;
-}
-
-static Py_ssize_t
-map_len(BaseMapObject *o)
-{
-    return o->b_count;
+    assert(n == count);
+    Py_DECREF(root);
+    return o;
 }
 
 static MapObject *
-map_alloc(void)
+map_small_assoc(MapObject *o, Py_hash_t hash, PyObject *key, PyObject *val)
 {
-    MapObject *o;
-    o = PyObject_GC_New(MapObject, &_Map_Type);
-    if (o == NULL) {
+    assert(IS_SMALL_MAP(o));
+
+    Py_ssize_t count = o->h_count;
+    MapObject *new_o;
+
+    Py_ssize_t idx = map_small_find_index(o, hash, key);
+    if (idx == -2) {
         return NULL;
     }
-    o->h_weakreflist = NULL;
-    o->h_hash = -1;
-    o->h_count = 0;
-    o->h_root = NULL;
-    PyObject_GC_Track(o);
-    return o;
-}
 
-static MapObject *
-map_new(void)
-{
-    MapObject *o = map_alloc();
-    if (o == NULL) {
+    if (idx >= 0) {
+        /* The key is already there; replace its value. */
+        if (o->h_entries[idx].e_val == val) {
+            Py_INCREF(o);
+            return o;
+        }
+
+        new_o = map_alloc(map_state(o), count);
+        if (new_o == NULL) {
+            return NULL;
+        }
+        map_small_copy_entries(new_o, 0, o, 0, count);
+        Py_INCREF(val);
+        Py_SETREF(new_o->h_entries[idx].e_val, val);
+        map_gc_track_if(new_o, val);
+        new_o->h_count = count;
+        return new_o;
+    }
+
+    if (count < MAP_SMALL_MAX_COUNT) {
+        Py_ssize_t pos = map_small_insert_pos(o->h_entries, count, hash);
+
+        new_o = map_alloc(map_state(o), count + 1);
+        if (new_o == NULL) {
+            return NULL;
+        }
+        map_small_copy_entries(new_o, 0, o, 0, pos);
+        map_small_set_entry(new_o, pos, hash, key, val);
+        map_small_copy_entries(new_o, pos + 1, o, pos, count - pos);
+        new_o->h_count = count + 1;
+        return new_o;
+    }
+
+    /* The map is too big to stay small: build a tree. */
+
+    MapState *st = map_state(o);
+    uint64_t mutid = map_new_mutid(st);
+    int added_leaf;
+
+    MapNode *root = map_small_to_root(o, mutid);
+    if (root == NULL) {
         return NULL;
     }
 
-    o->h_root = map_node_bitmap_new(0, 0);
-    if (o->h_root == NULL) {
-        Py_DECREF(o);
+    MapNode *new_root = map_node_assoc(
+        root, 0, hash, key, val, &added_leaf, mutid);
+    Py_DECREF(root);
+    if (new_root == NULL) {
         return NULL;
     }
+    assert(added_leaf);
 
-    return o;
+    return map_new_from_root(st, new_root, count + 1);
 }
 
-static PyObject *
-map_dump(MapObject *self)
+static MapObject *
+map_small_without(MapObject *o, Py_hash_t hash, PyObject *key)
 {
-    _PyUnicodeWriter writer;
+    assert(IS_SMALL_MAP(o));
 
-    _PyUnicodeWriter_Init(&writer);
+    Py_ssize_t count = o->h_count;
 
-    if (_map_dump_format(&writer, "HAMT(len=%zd):\n", self->h_count)) {
-        goto error;
+    Py_ssize_t idx = map_small_find_index(o, hash, key);
+    if (idx == -2) {
+        return NULL;
+    }
+    if (idx == -1) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
     }
 
-    if (map_node_dump(self->h_root, &writer, 0)) {
-        goto error;
+    MapObject *new_o = map_alloc(map_state(o), count - 1);
+    if (new_o == NULL) {
+        return NULL;
     }
+    map_small_copy_entries(new_o, 0, o, 0, idx);
+    map_small_copy_entries(new_o, idx, o, idx + 1, count - idx - 1);
+    new_o->h_count = count - 1;
+    return new_o;
+}
 
-    return _PyUnicodeWriter_Finish(&writer);
+static int
+map_small_dump(MapObject *o, _PyUnicodeWriter *writer)
+{
+    /* Debug build: __dump__() method implementation for small maps. */
 
-error:
-    _PyUnicodeWriter_Dealloc(&writer);
-    return NULL;
-}
+    if (_map_dump_ident(writer, 1)) {
+        return -1;
+    }
 
+    if (_map_dump_format(writer, "SmallMap(count=%zd id=%p):\n",
+                         o->h_count, o))
+    {
+        return -1;
+    }
 
-/////////////////////////////////// Iterators: Shared Iterator Implementation
+    for (Py_ssize_t i = 0; i < o->h_count; i++) {
+        if (_map_dump_ident(writer, 2)) {
+            return -1;
+        }
 
+        if (_map_dump_format(writer, "%R: %R\n",
+                             o->h_entries[i].e_key,
+                             o->h_entries[i].e_val))
+        {
+            return -1;
+        }
+    }
 
-static int
-map_baseiter_tp_clear(MapIterator *it)
-{
-    Py_CLEAR(it->mi_obj);
     return 0;
 }
 
-static void
-map_baseiter_tp_dealloc(MapIterator *it)
-{
-    PyObject_GC_UnTrack(it);
-    (void)map_baseiter_tp_clear(it);
-    PyObject_GC_Del(it);
-}
 
-static int
-map_baseiter_tp_traverse(MapIterator *it, visitproc visit, void *arg)
-{
-    Py_VISIT(it->mi_obj);
-    return 0;
-}
+/////////////////////////////////// Diff
 
-static PyObject *
-map_baseiter_tp_iternext(MapIterator *it)
-{
-    PyObject *key;
-    PyObject *val;
-    map_iter_t res = map_iterator_next(&it->mi_iter, &key, &val);
 
-    switch (res) {
-        case I_END:
-            PyErr_SetNone(PyExc_StopIteration);
-            return NULL;
+/* Kinds of items map_diff() collects; also indexes of MapDiff.d_roots. */
+typedef enum {D_ADDED, D_REMOVED, D_CHANGED} map_diff_t;
 
-        case I_ITEM: {
-            return (*(it->mi_yield))(key, val);
-        }
+typedef struct {
+    /* Trees of added, removed and changed items; all of their
+       nodes are owned by "d_mutid" and are updated in place. */
+    MapNode *d_roots[3];
+    Py_ssize_t d_counts[3];
+    MapState *d_state;
+    uint64_t d_mutid;
+    /* Unless NULL, lists that map_make_patch() collects removed keys
+       and new items of added and changed keys into instead. */
+    PyObject *d_removed;
+    PyObject *d_kv;
+} MapDiffState;
 
-        default: {
-            abort();
-        }
-    }
-}
 
 static int
-map_baseview_tp_clear(MapView *view)
-{
-    Py_CLEAR(view->mv_obj);
-    Py_CLEAR(view->mv_itertype);
-    return 0;
-}
+map_node_diff(MapDiffState *diff, MapNode *v, MapNode *w, uint32_t shift);
 
-static void
-map_baseview_tp_dealloc(MapView *view)
-{
-    PyObject_GC_UnTrack(view);
-    (void)map_baseview_tp_clear(view);
-    PyObject_GC_Del(view);
-}
 
 static int
-map_baseview_tp_traverse(MapView *view, visitproc visit, void *arg)
+map_diff_add(MapDiffState *diff, map_diff_t kind,
+             Py_hash_t hash, PyObject *key, PyObject *val)
 {
-    Py_VISIT(view->mv_obj);
+    int added_leaf = 0;
+
+    if (diff->d_kv != NULL) {
+        diff->d_counts[kind]++;
+        if (kind == D_REMOVED) {
+            return PyList_Append(diff->d_removed, key);
+        }
+        return PyList_Append(diff->d_kv, key) ||
+               PyList_Append(diff->d_kv, val);
+    }
+
+    MapNode *new_root = map_node_assoc(
+        diff->d_roots[kind], 0, hash, key, val, &added_leaf,
+        diff->d_mutid);
+    if (new_root == NULL) {
+        return -1;
+    }
+    Py_SETREF(diff->d_roots[kind], new_root);
+
+    assert(added_leaf);
+    diff->d_counts[kind]++;
     return 0;
 }
 
-static Py_ssize_t
-map_baseview_tp_len(MapView *view)
+static int
+map_diff_values(MapDiffState *diff, Py_hash_t hash, PyObject *key,
+                PyObject *v_val, PyObject *w_val)
 {
-    return view->mv_obj->h_count;
-}
-
-static PyMappingMethods MapView_as_mapping = {
-    (lenfunc)map_baseview_tp_len,
-};
+    /* Record "key" as changed unless "v_val" and "w_val" are equal. */
 
-static PyObject *
-map_baseview_newiter(PyTypeObject *type, binaryfunc yield, MapObject *map)
-{
-    MapIterator *iter = PyObject_GC_New(MapIterator, type);
-    if (iter == NULL) {
-        return NULL;
+    int cmp = PyObject_RichCompareBool(v_val, w_val, Py_EQ);
+    if (cmp < 0) {
+        return -1;
+    }
+    if (cmp == 1) {
+        return 0;
     }
 
-    Py_INCREF(map);
-    iter->mi_obj = map;
-    iter->mi_yield = yield;
-    map_iterator_init(&iter->mi_iter, map->h_root);
+    if (diff->d_kv != NULL) {
+        return map_diff_add(diff, D_CHANGED, hash, key, w_val);
+    }
 
-    PyObject_GC_Track(iter);
-    return (PyObject *)iter;
+    PyObject *pair = PyTuple_Pack(2, v_val, w_val);
+    if (pair == NULL) {
+        return -1;
+    }
+    int res = map_diff_add(diff, D_CHANGED, hash, key, pair);
+    Py_DECREF(pair);
+    return res;
 }
 
-static PyObject *
-map_baseview_iter(MapView *view)
+static int
+map_diff_lookup(MapDiffState *diff, MapNode *v, MapNode *w, uint32_t shift)
 {
-    return map_baseview_newiter(
-        view->mv_itertype, view->mv_yield, view->mv_obj);
-}
+    /* Diff two subtrees found at "shift" of two trees by looking
+       up keys of each of them in the other one.  This is what we
+       fall back to when the subtrees have different shapes.
 
-static PyObject *
-map_baseview_new(PyTypeObject *type, binaryfunc yield,
-                 MapObject *o, PyTypeObject *itertype)
-{
-    MapView *view = PyObject_GC_New(MapView, type);
-    if (view == NULL) {
-        return NULL;
-    }
+       Either subtree can be NULL, which stands for an empty one.
+    */
 
-    Py_INCREF(o);
-    view->mv_obj = o;
-    view->mv_yield = yield;
+    MapIteratorState iter;
+    map_iter_t iter_res;
+    map_find_t find_res;
+    PyObject *key;
+    PyObject *val;
+    PyObject *other_val;
+    Py_hash_t hash;
 
-    Py_INCREF(itertype);
-    view->mv_itertype = itertype;
+    if (v != NULL) {
+        map_iterator_init(&iter, v);
+        while ((iter_res = map_iterator_next_hashed(
+                    &iter, &key, &val, &hash)) == I_ITEM)
+        {
+            find_res = F_NOT_FOUND;
+            if (w != NULL) {
+                find_res = map_node_find(w, shift, hash, key, &other_val);
+            }
 
-    PyObject_GC_Track(view);
-    return (PyObject *)view;
-}
+            switch (find_res) {
+                case F_ERROR:
+                    return -1;
 
-#define ITERATOR_TYPE_SHARED_SLOTS                              \
-    .tp_basicsize = sizeof(MapIterator),                        \
-    .tp_itemsize = 0,                                           \
-    .tp_dealloc = (destructor)map_baseiter_tp_dealloc,          \
-    .tp_getattro = PyObject_GenericGetAttr,                     \
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,        \
-    .tp_traverse = (traverseproc)map_baseiter_tp_traverse,      \
-    .tp_clear = (inquiry)map_baseiter_tp_clear,                 \
-    .tp_iter = PyObject_SelfIter,                               \
-    .tp_iternext = (iternextfunc)map_baseiter_tp_iternext,
+                case F_NOT_FOUND:
+                    if (map_diff_add(diff, D_REMOVED, hash, key, val)) {
+                        return -1;
+                    }
+                    break;
 
+                case F_FOUND:
+                    if (map_diff_values(diff, hash, key, val, other_val)) {
+                        return -1;
+                    }
+                    break;
+            }
+        }
+    }
 
-#define VIEW_TYPE_SHARED_SLOTS                                  \
-    .tp_basicsize = sizeof(MapView),                            \
-    .tp_itemsize = 0,                                           \
-    .tp_as_mapping = &MapView_as_mapping,                       \
-    .tp_dealloc = (destructor)map_baseview_tp_dealloc,          \
-    .tp_getattro = PyObject_GenericGetAttr,                     \
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,        \
-    .tp_traverse = (traverseproc)map_baseview_tp_traverse,      \
-    .tp_clear = (inquiry)map_baseview_tp_clear,                 \
-    .tp_iter = (getiterfunc)map_baseview_iter,                  \
+    if (w != NULL) {
+        map_iterator_init(&iter, w);
+        while ((iter_res = map_iterator_next_hashed(
+                    &iter, &key, &val, &hash)) == I_ITEM)
+        {
+            /* Keys found in "v" were dealt with above. */
+            find_res = F_NOT_FOUND;
+            if (v != NULL) {
+                find_res = map_node_find(v, shift, hash, key, &other_val);
+            }
 
+            if (find_res == F_ERROR) {
+                return -1;
+            }
+            if (find_res == F_NOT_FOUND &&
+                    map_diff_add(diff, D_ADDED, hash, key, val))
+            {
+                return -1;
+            }
+        }
+    }
 
-/////////////////////////////////// _MapItems_Type
+    return 0;
+}
 
+static int
+map_diff_pair_node(MapDiffState *diff,
+                   Py_hash_t hash, PyObject *key, PyObject *val,
+                   MapNode *node, int node_is_new)
+{
+    /* Diff a key/value pair of one tree with the sub-node found
+       in the same slot of the other tree.  "node_is_new" tells
+       whether the sub-node belongs to the new ("w") tree.
+    */
 
-PyTypeObject _MapItems_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "items",
-    VIEW_TYPE_SHARED_SLOTS
-};
+    MapIteratorState iter;
+    map_iter_t iter_res;
+    PyObject *node_key;
+    PyObject *node_val;
+    Py_hash_t node_hash;
+    int found = 0;
+
+    map_iterator_init(&iter, node);
+    while ((iter_res = map_iterator_next_hashed(
+                &iter, &node_key, &node_val, &node_hash)) == I_ITEM)
+    {
+        if (!found && node_hash == hash) {
+            int cmp = PyObject_RichCompareBool(key, node_key, Py_EQ);
+            if (cmp < 0) {
+                return -1;
+            }
+            if (cmp == 1) {
+                found = 1;
+                if (node_is_new
+                        ? map_diff_values(diff, hash, key, val, node_val)
+                        : map_diff_values(diff, hash, node_key,
+                                          node_val, val))
+                {
+                    return -1;
+                }
+                continue;
+            }
+        }
 
-PyTypeObject _MapItemsIter_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "items_iterator",
-    ITERATOR_TYPE_SHARED_SLOTS
-};
+        if (map_diff_add(diff, node_is_new ? D_ADDED : D_REMOVED,
+                         node_hash, node_key, node_val))
+        {
+            return -1;
+        }
+    }
 
-static PyObject *
-map_iter_yield_items(PyObject *key, PyObject *val)
-{
-    return PyTuple_Pack(2, key, val);
+    if (!found) {
+        return map_diff_add(diff, node_is_new ? D_REMOVED : D_ADDED,
+                            hash, key, val);
+    }
+    return 0;
 }
 
-static PyObject *
-map_new_items_view(MapObject *o)
+static int
+map_node_bitmap_diff(MapDiffState *diff,
+                     MapNode_Bitmap *v, MapNode_Bitmap *w, uint32_t shift)
 {
-    return map_baseview_new(
-        &_MapItems_Type, map_iter_yield_items, o,
-        &_MapItemsIter_Type);
-}
+    /* Diff two Bitmap nodes at the same level of two trees slot
+       by slot; items of a key/value pair and a sub-node sharing a
+       slot are the only ones that need lookups.
+    */
 
+    uint32_t slots = v->b_datamap | v->b_nodemap |
+                     w->b_datamap | w->b_nodemap;
 
-/////////////////////////////////// _MapKeys_Type
+    while (slots) {
+        uint32_t bit = slots & (~slots + 1);
+        slots &= ~bit;
 
+        PyObject *v_key = NULL, *v_val = NULL;
+        PyObject *w_key = NULL, *w_val = NULL;
+        Py_hash_t v_hash = 0, w_hash = 0;
+        MapNode *v_node = NULL, *w_node = NULL;
+        int res;
 
-static int
-map_tp_contains(BaseMapObject *self, PyObject *key);
+        if (v->b_datamap & bit) {
+            Py_ssize_t idx = map_bitindex(v->b_datamap, bit);
+            v_key = v->b_array[2 * idx];
+            v_val = v->b_array[2 * idx + 1];
+            v_hash = BITMAP_HASHES(v)[idx];
+        }
+        else if (v->b_nodemap & bit) {
+            v_node = BITMAP_NODE(v, map_bitindex(v->b_nodemap, bit));
+        }
+
+        if (w->b_datamap & bit) {
+            Py_ssize_t idx = map_bitindex(w->b_datamap, bit);
+            w_key = w->b_array[2 * idx];
+            w_val = w->b_array[2 * idx + 1];
+            w_hash = BITMAP_HASHES(w)[idx];
+        }
+        else if (w->b_nodemap & bit) {
+            w_node = BITMAP_NODE(w, map_bitindex(w->b_nodemap, bit));
+        }
+
+        if (v_key != NULL && w_key != NULL) {
+            int cmp = 0;
+            if (v_hash == w_hash) {
+                cmp = PyObject_RichCompareBool(v_key, w_key, Py_EQ);
+                if (cmp < 0) {
+                    return -1;
+                }
+            }
+            if (cmp == 1) {
+                res = map_diff_values(diff, v_hash, v_key, v_val, w_val);
+            }
+            else {
+                res = map_diff_add(diff, D_REMOVED, v_hash, v_key, v_val) ||
+                      map_diff_add(diff, D_ADDED, w_hash, w_key, w_val);
+            }
+        }
+        else if (v_key != NULL) {
+            if (w_node != NULL) {
+                res = map_diff_pair_node(
+                    diff, v_hash, v_key, v_val, w_node, 1);
+            }
+            else {
+                res = map_diff_add(diff, D_REMOVED, v_hash, v_key, v_val);
+            }
+        }
+        else if (w_key != NULL) {
+            if (v_node != NULL) {
+                res = map_diff_pair_node(
+                    diff, w_hash, w_key, w_val, v_node, 0);
+            }
+            else {
+                res = map_diff_add(diff, D_ADDED, w_hash, w_key, w_val);
+            }
+        }
+        else if (v_node != NULL && w_node != NULL) {
+            res = map_node_diff(diff, v_node, w_node, shift + 5);
+        }
+        else {
+            res = map_diff_lookup(diff, v_node, w_node, shift + 5);
+        }
+
+        if (res) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
 
 static int
-_map_keys_tp_contains(MapView *self, PyObject *key)
+map_node_array_diff(MapDiffState *diff,
+                    MapNode_Array *v, MapNode_Array *w, uint32_t shift)
 {
-	return map_tp_contains((BaseMapObject *)self->mv_obj, key);
-}
+    /* Diff two Array nodes at the same level of two trees. */
 
-static PySequenceMethods _MapKeys_as_sequence = {
-    .sq_contains = (objobjproc)_map_keys_tp_contains,
-};
+    for (Py_ssize_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        MapNode *v_node = v->a_array[i];
+        MapNode *w_node = w->a_array[i];
+        int res;
 
-PyTypeObject _MapKeys_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "keys",
-    .tp_as_sequence = &_MapKeys_as_sequence,
-    VIEW_TYPE_SHARED_SLOTS
-};
+        if (v_node == NULL && w_node == NULL) {
+            continue;
+        }
 
-PyTypeObject _MapKeysIter_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "keys_iterator",
-    ITERATOR_TYPE_SHARED_SLOTS
-};
+        if (v_node != NULL && w_node != NULL) {
+            res = map_node_diff(diff, v_node, w_node, shift + 5);
+        }
+        else {
+            res = map_diff_lookup(diff, v_node, w_node, shift + 5);
+        }
 
-static PyObject *
-map_iter_yield_keys(PyObject *key, PyObject *val)
+        if (res) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+map_node_diff(MapDiffState *diff, MapNode *v, MapNode *w, uint32_t shift)
 {
-    Py_INCREF(key);
-    return key;
+    /* Diff two subtrees found at the same place of two trees.
+
+       Subtrees shared by both trees are skipped, so the cost of
+       diffing two versions of a map derived from one another is
+       proportional to the number of edits between them rather
+       than to the size of the maps.
+    */
+
+    if (v == w) {
+        return 0;
+    }
+
+    if (IS_BITMAP_NODE(v) && IS_BITMAP_NODE(w)) {
+        return map_node_bitmap_diff(
+            diff, (MapNode_Bitmap *)v, (MapNode_Bitmap *)w, shift);
+    }
+    else if (IS_ARRAY_NODE(v) && IS_ARRAY_NODE(w)) {
+        return map_node_array_diff(
+            diff, (MapNode_Array *)v, (MapNode_Array *)w, shift);
+    }
+    else {
+        return map_diff_lookup(diff, v, w, shift);
+    }
 }
 
-static PyObject *
-map_new_keys_iter(MapObject *o)
+static MapNode *
+map_diff_root(MapObject *o, uint64_t mutid)
 {
-    return map_baseview_newiter(
-        &_MapKeysIter_Type, map_iter_yield_keys, o);
+    /* Return a new reference to the tree of "o"; small maps get a
+       temporary one. */
+
+    if (IS_SMALL_MAP(o)) {
+        return map_small_to_root(o, mutid);
+    }
+    Py_INCREF(o->h_root);
+    return o->h_root;
 }
 
 static PyObject *
-map_new_keys_view(MapObject *o)
+map_diff(MapObject *v, MapObject *w)
 {
-    return map_baseview_new(
-        &_MapKeys_Type, map_iter_yield_keys, o,
-        &_MapKeysIter_Type);
-}
+    /* Return an (added, removed, changed) tuple of Maps:
 
-/////////////////////////////////// _MapValues_Type
+       - "added" has items of "w" whose keys aren't in "v";
+       - "removed" has items of "v" whose keys aren't in "w";
+       - "changed" maps keys found in both maps with unequal values
+         to (value in "v", value in "w") tuples.
+    */
 
+    MapDiffState diff;
+    MapNode *v_root = NULL;
+    MapNode *w_root = NULL;
+    PyObject *result = NULL;
+    int i;
+
+    diff.d_state = map_state(v);
+    diff.d_mutid = map_new_mutid(diff.d_state);
+    diff.d_removed = NULL;
+    diff.d_kv = NULL;
+    for (i = 0; i < 3; i++) {
+        diff.d_roots[i] = NULL;
+        diff.d_counts[i] = 0;
+    }
+
+    for (i = 0; i < 3; i++) {
+        diff.d_roots[i] = map_node_bitmap_new(
+            diff.d_state, 0, 0, diff.d_mutid);
+        if (diff.d_roots[i] == NULL) {
+            goto error;
+        }
+    }
 
-PyTypeObject _MapValues_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "values",
-    VIEW_TYPE_SHARED_SLOTS
-};
+    v_root = map_diff_root(v, diff.d_mutid);
+    if (v_root == NULL) {
+        goto error;
+    }
+    w_root = map_diff_root(w, diff.d_mutid);
+    if (w_root == NULL) {
+        goto error;
+    }
 
-PyTypeObject _MapValuesIter_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "values_iterator",
-    ITERATOR_TYPE_SHARED_SLOTS
-};
+    if (map_node_diff(&diff, v_root, w_root, 0)) {
+        goto error;
+    }
 
-static PyObject *
-map_iter_yield_values(PyObject *key, PyObject *val)
-{
-    Py_INCREF(val);
-    return val;
-}
+    result = PyTuple_New(3);
+    if (result == NULL) {
+        goto error;
+    }
+    for (i = 0; i < 3; i++) {
+        MapNode *root = diff.d_roots[i];
+        diff.d_roots[i] = NULL;
 
-static PyObject *
-map_new_values_view(MapObject *o)
-{
-    return map_baseview_new(
-        &_MapValues_Type, map_iter_yield_values, o,
-        &_MapValuesIter_Type);
+        MapObject *o = map_new_from_root(
+            diff.d_state, root, diff.d_counts[i]);
+        if (o == NULL) {
+            Py_CLEAR(result);
+            goto error;
+        }
+        PyTuple_SET_ITEM(result, i, (PyObject *)o);
+    }
+
+error:
+    Py_XDECREF(v_root);
+    Py_XDECREF(w_root);
+    for (i = 0; i < 3; i++) {
+        Py_XDECREF(diff.d_roots[i]);
+    }
+    return result;
 }
 
 
-/////////////////////////////////// _Map_Type
+/////////////////////////////////// Merge
 
 
-static PyObject *
-map_dump(MapObject *self);
+/* A slot of a Bitmap or an Array node: either a key/value pair, or
+   a sub-node, or nothing at all.  References are borrowed, unless
+   "s_owned" is set: then "s_val" or "s_node" is a new reference. */
+typedef struct {
+    PyObject *s_key;
+    PyObject *s_val;
+    Py_hash_t s_hash;
+    MapNode *s_node;
+    int s_owned;
+} MapMergeSlot;
 
+typedef struct {
+    /* Called as resolve(key, value in "v", value in "w") for keys
+       found in both trees, with the key object of "w"; if NULL,
+       values of "w" win.  The merged tree keeps key objects of "v",
+       like dict.update() does. */
+    PyObject *m_resolve;
+    /* Number of keys found in both trees. */
+    Py_ssize_t m_dups;
+    MapState *m_state;
+    uint64_t m_mutid;
+} MapMergeState;
 
-static PyObject *
-map_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-    return (PyObject*)map_new();
-}
 
+static MapNode *
+map_node_merge(MapMergeState *merge, MapNode *v, MapNode *w, uint32_t shift);
 
-static int
-map_tp_init(MapObject *self, PyObject *args, PyObject *kwds)
-{
-    PyObject *arg = NULL;
-    uint64_t mutid = 0;
 
-    if (!PyArg_UnpackTuple(args, "immutables.Map", 0, 1, &arg)) {
-        return -1;
-    }
+static Py_ssize_t
+map_node_count(MapNode *node)
+{
+    /* Return the number of items in a subtree.  Only nodes are
+       visited, keys and values are not touched. */
 
-    if (arg != NULL) {
-        if (Map_Check(arg)) {
-            MapObject *other = (MapObject *)arg;
+    Py_ssize_t count = 0;
 
-            Py_INCREF(other->h_root);
-            Py_SETREF(self->h_root, other->h_root);
+    if (IS_BITMAP_NODE(node)) {
+        MapNode_Bitmap *b = (MapNode_Bitmap *)node;
+        Py_ssize_t node_count = map_node_bitmap_node_count(b);
 
-            self->h_count = other->h_count;
-            self->h_hash = other->h_hash;
-        }
-        else if (MapMutation_Check(arg)) {
-            PyErr_Format(
-                PyExc_TypeError,
-                "cannot create Maps from MapMutations");
-            return -1;
+        count = map_node_bitmap_data_count(b);
+        for (Py_ssize_t i = 0; i < node_count; i++) {
+            count += map_node_count(BITMAP_NODE(b, i));
         }
-        else {
-            mutid = mutid_counter++;
-            if (map_update_inplace(mutid, (BaseMapObject *)self, arg)) {
-                return -1;
+    }
+    else if (IS_ARRAY_NODE(node)) {
+        MapNode_Array *a = (MapNode_Array *)node;
+        for (Py_ssize_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+            if (a->a_array[i] != NULL) {
+                count += map_node_count(a->a_array[i]);
             }
         }
     }
-
-    if (kwds != NULL) {
-        if (!PyArg_ValidateKeywordArguments(kwds)) {
-            return -1;
-        }
-
-        if (!mutid) {
-            mutid = mutid_counter++;
-        }
-
-        if (map_update_inplace(mutid, (BaseMapObject *)self, kwds)) {
-            return -1;
-        }
+    else {
+        assert(IS_COLLISION_NODE(node));
+        count = map_node_collision_count((MapNode_Collision *)node);
     }
 
-    return 0;
+    return count;
 }
 
-
 static int
-map_tp_clear(BaseMapObject *self)
+map_merge_values(MapMergeState *merge, PyObject *key,
+                 PyObject *v_val, PyObject *w_val, PyObject **val)
 {
-    Py_CLEAR(self->b_root);
-    return 0;
-}
+    /* Set *val to a new reference to the value "key", found in both
+       trees, gets in the merged one. */
 
+    merge->m_dups++;
 
-static int
-map_tp_traverse(BaseMapObject *self, visitproc visit, void *arg)
-{
-    Py_VISIT(self->b_root);
-    return 0;
+    if (merge->m_resolve == NULL) {
+        Py_INCREF(w_val);
+        *val = w_val;
+        return 0;
+    }
+
+    *val = PyObject_CallFunctionObjArgs(
+        merge->m_resolve, key, v_val, w_val, NULL);
+    return *val == NULL ? -1 : 0;
 }
 
-static void
-map_tp_dealloc(BaseMapObject *self)
+static MapNode *
+map_merge_lookup(MapMergeState *merge, MapNode *v, MapNode *w, uint32_t shift)
 {
-    PyObject_GC_UnTrack(self);
-    if (self->b_weakreflist != NULL) {
-        PyObject_ClearWeakRefs((PyObject*)self);
-    }
-    (void)map_tp_clear(self);
-    Py_TYPE(self)->tp_free(self);
-}
+    /* Merge two subtrees found at "shift" of two trees by adding
+       items of "w" to "v" one by one.  This is what we fall back
+       to for Collision nodes. */
 
+    MapIteratorState iter;
+    map_iter_t iter_res;
+    PyObject *key;
+    PyObject *val;
+    Py_hash_t hash;
 
-static PyObject *
-map_tp_richcompare(PyObject *v, PyObject *w, int op)
-{
-    if (!Map_Check(v) || !Map_Check(w) || (op != Py_EQ && op != Py_NE)) {
-        Py_RETURN_NOTIMPLEMENTED;
-    }
+    Py_INCREF(v);
+    MapNode *res = v;
 
-    int res = map_eq((BaseMapObject *)v, (BaseMapObject *)w);
-    if (res < 0) {
-        return NULL;
-    }
+    map_iterator_init(&iter, w);
+    while ((iter_res = map_iterator_next_hashed(
+                &iter, &key, &val, &hash)) == I_ITEM)
+    {
+        PyObject *v_val;
+        PyObject *new_val;
+        int added_leaf = 0;
 
-    if (op == Py_NE) {
-        res = !res;
+        switch (map_node_find(res, shift, hash, key, &v_val)) {
+            case F_ERROR:
+                goto error;
+
+            case F_NOT_FOUND:
+                Py_INCREF(val);
+                new_val = val;
+                break;
+
+            case F_FOUND:
+                if (map_merge_values(merge, key, v_val, val, &new_val)) {
+                    goto error;
+                }
+                break;
+
+            default:
+                abort();
+        }
+
+        MapNode *new_res = map_node_assoc(
+            res, shift, hash, key, new_val, &added_leaf, merge->m_mutid);
+        Py_DECREF(new_val);
+        if (new_res == NULL) {
+            goto error;
+        }
+        Py_SETREF(res, new_res);
     }
 
-    if (res) {
-        Py_RETURN_TRUE;
+    return res;
+
+error:
+    Py_DECREF(res);
+    return NULL;
+}
+
+static inline void
+map_merge_load_slot(MapNode *node, uint32_t bit, MapMergeSlot *slot)
+{
+    /* Fill "slot" with borrowed references to the contents of the
+       slot of "node" at "bit". */
+
+    slot->s_key = NULL;
+    slot->s_val = NULL;
+    slot->s_hash = 0;
+    slot->s_node = NULL;
+    slot->s_owned = 0;
+
+    if (IS_BITMAP_NODE(node)) {
+        MapNode_Bitmap *b = (MapNode_Bitmap *)node;
+        if (b->b_datamap & bit) {
+            Py_ssize_t idx = map_bitindex(b->b_datamap, bit);
+            slot->s_key = b->b_array[2 * idx];
+            slot->s_val = b->b_array[2 * idx + 1];
+            slot->s_hash = BITMAP_HASHES(b)[idx];
+        }
+        else if (b->b_nodemap & bit) {
+            slot->s_node = BITMAP_NODE(b, map_bitindex(b->b_nodemap, bit));
+        }
     }
     else {
-        Py_RETURN_FALSE;
+        assert(IS_ARRAY_NODE(node));
+        slot->s_node = ((MapNode_Array *)node)->a_array[map_bitcount(bit - 1)];
     }
 }
 
-static int
-map_tp_contains(BaseMapObject *self, PyObject *key)
+static inline int
+map_merge_slot_is_empty(MapMergeSlot *slot)
 {
-    PyObject *val;
-    map_find_t res = map_find(self, key, &val);
-    switch (res) {
-        case F_ERROR:
-            return -1;
-        case F_NOT_FOUND:
-            return 0;
-        case F_FOUND:
-            return 1;
-        default:
-            abort();
-    }
+    return slot->s_key == NULL && slot->s_node == NULL;
 }
 
-static PyObject *
-map_tp_subscript(BaseMapObject *self, PyObject *key)
+static inline int
+map_merge_slot_is(MapMergeSlot *a, MapMergeSlot *b)
 {
-    PyObject *val;
-    map_find_t res = map_find(self, key, &val);
-    switch (res) {
-        case F_ERROR:
-            return NULL;
-        case F_FOUND:
-            Py_INCREF(val);
-            return val;
-        case F_NOT_FOUND:
-            PyErr_SetObject(PyExc_KeyError, key);
-            return NULL;
-        default:
-            abort();
-    }
+    return a->s_key == b->s_key && a->s_val == b->s_val &&
+           a->s_node == b->s_node;
 }
 
-static Py_ssize_t
-map_tp_len(BaseMapObject *self)
+static inline void
+map_merge_slot_clear(MapMergeSlot *slot)
 {
-    return map_len(self);
+    if (slot->s_owned) {
+        Py_CLEAR(slot->s_val);
+        Py_CLEAR(slot->s_node);
+        slot->s_owned = 0;
+    }
 }
 
-static PyObject *
-map_tp_iter(MapObject *self)
+static inline uint32_t
+map_merge_occupied(MapNode *node)
 {
-    return map_new_keys_iter(self);
+    /* Return the bitmap of occupied slots of "node". */
+
+    if (IS_BITMAP_NODE(node)) {
+        MapNode_Bitmap *b = (MapNode_Bitmap *)node;
+        return b->b_datamap | b->b_nodemap;
+    }
+
+    assert(IS_ARRAY_NODE(node));
+    MapNode_Array *a = (MapNode_Array *)node;
+    uint32_t bitmap = 0;
+    for (uint32_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        if (a->a_array[i] != NULL) {
+            bitmap |= (uint32_t)1 << i;
+        }
+    }
+    return bitmap;
 }
 
-static PyObject *
-map_py_set(MapObject *self, PyObject *args)
+static int
+map_merge_slots(MapMergeState *merge,
+                MapMergeSlot *v, MapMergeSlot *w, uint32_t shift,
+                MapMergeSlot *out)
 {
-    PyObject *key;
+    /* Merge two non-empty slots found at the same place of two
+       trees into "out"; "shift" is the level below the slots. */
+
     PyObject *val;
+    MapNode *node;
+    MapNode *new_node;
+    int added_leaf = 0;
 
-    if (!PyArg_UnpackTuple(args, "set", 2, 2, &key, &val)) {
-        return NULL;
+    out->s_key = NULL;
+    out->s_val = NULL;
+    out->s_hash = 0;
+    out->s_node = NULL;
+    out->s_owned = 1;
+
+    if (v->s_node != NULL && w->s_node != NULL) {
+        out->s_node = map_node_merge(merge, v->s_node, w->s_node, shift);
+        return out->s_node == NULL ? -1 : 0;
     }
 
-    return (PyObject *)map_assoc(self, key, val);
-}
+    if (v->s_node == NULL && w->s_node == NULL) {
+        int cmp = 0;
+        if (v->s_hash == w->s_hash) {
+            cmp = PyObject_RichCompareBool(v->s_key, w->s_key, Py_EQ);
+            if (cmp < 0) {
+                return -1;
+            }
+        }
 
-static PyObject *
-map_py_get(BaseMapObject *self, PyObject *args)
-{
-    PyObject *key;
-    PyObject *def = NULL;
+        if (cmp == 1) {
+            if (map_merge_values(merge, w->s_key, v->s_val, w->s_val, &val)) {
+                return -1;
+            }
+            out->s_key = v->s_key;
+            out->s_val = val;
+            out->s_hash = v->s_hash;
+            return 0;
+        }
 
-    if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &def)) {
-        return NULL;
+        out->s_node = map_node_new_bitmap_or_collision(
+            merge->m_state,
+            shift,
+            v->s_hash, v->s_key, v->s_val,
+            w->s_hash, w->s_key, w->s_val,
+            merge->m_mutid);
+        return out->s_node == NULL ? -1 : 0;
     }
 
-    PyObject *val = NULL;
-    map_find_t res = map_find(self, key, &val);
-    switch (res) {
+    /* A key/value pair on one side, a sub-node on the other: look
+       the key up in the sub-node, and add the pair to it. */
+
+    MapMergeSlot *pair = v->s_node == NULL ? v : w;
+    node = v->s_node == NULL ? w->s_node : v->s_node;
+    PyObject *found_key;
+    PyObject *found_val;
+
+    switch (map_node_find_item(node, shift, pair->s_hash, pair->s_key,
+                               &found_key, &found_val))
+    {
         case F_ERROR:
-            return NULL;
-        case F_FOUND:
-            Py_INCREF(val);
-            return val;
+            return -1;
+
         case F_NOT_FOUND:
-            if (def == NULL) {
-                Py_RETURN_NONE;
+            Py_INCREF(pair->s_val);
+            val = pair->s_val;
+            break;
+
+        case F_FOUND:
+            if (pair == v
+                    ? map_merge_values(merge, found_key,
+                                       pair->s_val, found_val, &val)
+                    : map_merge_values(merge, pair->s_key,
+                                       found_val, pair->s_val, &val))
+            {
+                return -1;
             }
-            Py_INCREF(def);
-            return def;
+            if (pair == v && found_key != pair->s_key) {
+                /* map_node_assoc() would keep the key object of "w";
+                   take it out first, so that the one of "v" goes in. */
+                switch (map_node_without(node, shift, pair->s_hash,
+                                         found_key, &new_node,
+                                         merge->m_mutid))
+                {
+                    case W_NEWNODE:
+                        break;
+                    case W_EMPTY:
+                        /* A child of an Array node with a single pair. */
+                        out->s_key = pair->s_key;
+                        out->s_val = val;
+                        out->s_hash = pair->s_hash;
+                        return 0;
+                    case W_ERROR:
+                        Py_DECREF(val);
+                        return -1;
+                    default:
+                        abort();
+                }
+                out->s_node = map_node_assoc(
+                    new_node, shift, pair->s_hash, pair->s_key, val,
+                    &added_leaf, merge->m_mutid);
+                Py_DECREF(new_node);
+                Py_DECREF(val);
+                return out->s_node == NULL ? -1 : 0;
+            }
+            break;
+
         default:
             abort();
     }
-}
-
-static PyObject *
-map_py_delete(MapObject *self, PyObject *key)
-{
-    return (PyObject *)map_without(self, key);
-}
-
-static PyObject *
-map_py_mutate(MapObject *self, PyObject *args)
-{
 
-    MapMutationObject *o;
-    o = PyObject_GC_New(MapMutationObject, &_MapMutation_Type);
-    if (o == NULL) {
-        return NULL;
+    new_node = map_node_assoc(
+        node, shift, pair->s_hash, pair->s_key, val,
+        &added_leaf, merge->m_mutid);
+    Py_DECREF(val);
+    if (new_node == NULL) {
+        return -1;
     }
-    o->m_weakreflist = NULL;
-    o->m_count = self->h_count;
-
-    Py_INCREF(self->h_root);
-    o->m_root = self->h_root;
 
-    o->m_mutid = mutid_counter++;
-
-    PyObject_GC_Track(o);
-    return (PyObject *)o;
+    out->s_node = new_node;
+    return 0;
 }
 
-static PyObject *
-map_py_update(MapObject *self, PyObject *args, PyObject *kwds)
+static void
+map_merge_touch(MapMergeState *merge, MapNode *node)
 {
-    PyObject *arg = NULL;
-    MapObject *new = NULL;
-    uint64_t mutid = 0;
+    /* "node" is kept as it is, but if it's owned by the mutation,
+       its sub-nodes might have been updated in place. */
 
-    if (!PyArg_UnpackTuple(args, "update", 0, 1, &arg)) {
-        return NULL;
+    if (merge->m_mutid == 0) {
+        return;
     }
 
-    if (arg != NULL) {
-        mutid = mutid_counter++;
-        new = map_update(mutid, self, arg);
-        if (new == NULL) {
-            return NULL;
+    if (IS_BITMAP_NODE(node)) {
+        MapNode_Bitmap *b = (MapNode_Bitmap *)node;
+        if (b->b_mutid == merge->m_mutid) {
+            Py_ssize_t node_count = map_node_bitmap_node_count(b);
+            for (Py_ssize_t i = 0; i < node_count; i++) {
+                map_gc_track_if(b, (PyObject *)BITMAP_NODE(b, i));
+            }
+            b->b_subtree_hash = HAMT_NO_HASH;
         }
     }
     else {
-        Py_INCREF(self);
-        new = self;
-    }
-
-    if (kwds != NULL) {
-        if (!PyArg_ValidateKeywordArguments(kwds)) {
-            Py_DECREF(new);
-            return NULL;
+        MapNode_Array *a = (MapNode_Array *)node;
+        if (a->a_mutid == merge->m_mutid) {
+            for (Py_ssize_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+                if (a->a_array[i] != NULL) {
+                    map_gc_track_if(a, (PyObject *)a->a_array[i]);
+                }
+            }
+            a->a_subtree_hash = HAMT_NO_HASH;
         }
+    }
+}
 
-        if (!mutid) {
-            mutid = mutid_counter++;
-        }
+static inline int
+map_merge_slot_pair(MapMergeSlot *slot,
+                    Py_hash_t *hash, PyObject **key, PyObject **val)
+{
+    /* Return 1 and the key/value pair if "slot" holds a single pair,
+       either inline or in a Bitmap node of its own (as children of
+       Array nodes do); return 0 otherwise. */
+
+    if (slot->s_key != NULL) {
+        *hash = slot->s_hash;
+        *key = slot->s_key;
+        *val = slot->s_val;
+        return 1;
+    }
 
-        MapObject *new2 = map_update(mutid, new, kwds);
-        Py_DECREF(new);
-        if (new2 == NULL) {
-            return NULL;
-        }
-        new = new2;
+    if (slot->s_node != NULL &&
+            map_node_bitmap_is_single_pair(slot->s_node))
+    {
+        MapNode_Bitmap *b = (MapNode_Bitmap *)slot->s_node;
+        *hash = BITMAP_HASHES(b)[0];
+        *key = b->b_array[0];
+        *val = b->b_array[1];
+        return 1;
     }
 
-    return (PyObject *)new;
+    return 0;
 }
 
-static PyObject *
-map_py_items(MapObject *self, PyObject *args)
+static MapNode *
+map_merge_new_node(MapState *st, uint64_t mutid, MapMergeSlot *slots,
+                   uint32_t bitmap, uint32_t shift)
 {
-    return map_new_items_view(self);
-}
+    /* Create a node at "shift" out of the slots set in "bitmap".
+       Key/value pairs are inlined into Bitmap nodes and wrapped
+       into nodes of their own for Array nodes. */
 
-static PyObject *
-map_py_values(MapObject *self, PyObject *args)
-{
-    return map_new_values_view(self);
-}
+    Py_hash_t hash = 0;
+    PyObject *key = NULL;
+    PyObject *val = NULL;
+    uint32_t count = map_bitcount(bitmap);
+    uint32_t i;
 
-static PyObject *
-map_py_keys(MapObject *self, PyObject *args)
-{
-    return map_new_keys_view(self);
-}
+    if (count > 16) {
+        MapNode_Array *node = (MapNode_Array *)map_node_array_new(
+            st, count, mutid);
+        if (node == NULL) {
+            return NULL;
+        }
 
-static PyObject *
-map_py_dump(MapObject *self, PyObject *args)
-{
-    return map_dump(self);
-}
+        for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+            MapMergeSlot *slot = &slots[i];
+            MapNode *child;
 
+            if (!(bitmap & ((uint32_t)1 << i))) {
+                continue;
+            }
 
-static PyObject *
-map_py_repr(BaseMapObject *m)
-{
-    Py_ssize_t i;
-    _PyUnicodeWriter writer;
+            if (slot->s_node != NULL) {
+                Py_INCREF(slot->s_node);
+                child = slot->s_node;
+            }
+            else {
+                /* Every key/value pair gets a Bitmap node of its own. */
+                child = map_node_bitmap_new_pair(
+                    st, shift + 5, slot->s_hash, slot->s_key, slot->s_val,
+                    mutid);
+                if (child == NULL) {
+                    Py_DECREF(node);
+                    return NULL;
+                }
+            }
 
+            node->a_array[i] = child;
+            map_gc_track_if(node, (PyObject *)child);
+        }
 
-    i = Py_ReprEnter((PyObject *)m);
-    if (i != 0) {
-        return i > 0 ? PyUnicode_FromString("{...}") : NULL;
+        return (MapNode *)node;
     }
 
-    _PyUnicodeWriter_Init(&writer);
+    uint32_t datamap = 0;
+    uint32_t nodemap = 0;
 
-    if (MapMutation_Check(m)) {
-        if (_PyUnicodeWriter_WriteASCIIString(
-                &writer, "immutables.MapMutation({", 24) < 0)
-        {
-            goto error;
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        if (bitmap & ((uint32_t)1 << i)) {
+            if (map_merge_slot_pair(&slots[i], &hash, &key, &val)) {
+                datamap |= (uint32_t)1 << i;
+            }
+            else {
+                nodemap |= (uint32_t)1 << i;
+            }
         }
     }
-    else {
-        if (_PyUnicodeWriter_WriteASCIIString(
-                &writer, "immutables.Map({", 16) < 0)
-        {
-            goto error;
-        }
+
+    MapNode_Bitmap *node = (MapNode_Bitmap *)map_node_bitmap_new(
+        st, map_bitcount(datamap), map_bitcount(nodemap), mutid);
+    if (node == NULL) {
+        return NULL;
     }
 
-    MapIteratorState iter;
-    map_iter_t iter_res;
-    map_iterator_init(&iter, m->b_root);
-    int second = 0;
-    do {
-        PyObject *v_key;
-        PyObject *v_val;
-
-        iter_res = map_iterator_next(&iter, &v_key, &v_val);
-        if (iter_res == I_ITEM) {
-            if (second) {
-                if (_PyUnicodeWriter_WriteASCIIString(&writer, ", ", 2) < 0) {
-                    goto error;
-                }
-            }
-
-            PyObject *s = PyObject_Repr(v_key);
-            if (s == NULL) {
-                goto error;
-            }
-            if (_PyUnicodeWriter_WriteStr(&writer, s) < 0) {
-                Py_DECREF(s);
-                goto error;
-            }
-            Py_DECREF(s);
+    Py_ssize_t data_idx = 0;
+    Py_ssize_t node_idx = 0;
 
-            if (_PyUnicodeWriter_WriteASCIIString(&writer, ": ", 2) < 0) {
-                goto error;
-            }
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        MapMergeSlot *slot = &slots[i];
+        uint32_t bit = (uint32_t)1 << i;
 
-            s = PyObject_Repr(v_val);
-            if (s == NULL) {
-                goto error;
-            }
-            if (_PyUnicodeWriter_WriteStr(&writer, s) < 0) {
-                Py_DECREF(s);
-                goto error;
-            }
-            Py_DECREF(s);
+        if (datamap & bit) {
+            map_merge_slot_pair(slot, &hash, &key, &val);
+            map_node_bitmap_set_pair(node, data_idx++, hash, key, val);
+        }
+        else if (nodemap & bit) {
+            Py_INCREF(slot->s_node);
+            node->b_array[BITMAP_NODE_IDX(node, node_idx++)] =
+                (PyObject *)slot->s_node;
+            map_gc_track_if(node, (PyObject *)slot->s_node);
         }
-
-        second = 1;
-    } while (iter_res != I_END);
-
-    if (_PyUnicodeWriter_WriteASCIIString(&writer, "})", 2) < 0) {
-        goto error;
     }
 
-    Py_ReprLeave((PyObject *)m);
-    return _PyUnicodeWriter_Finish(&writer);
-
-error:
-    _PyUnicodeWriter_Dealloc(&writer);
-    Py_ReprLeave((PyObject *)m);
-    return NULL;
-}
-
-
-static Py_uhash_t
-_shuffle_bits(Py_uhash_t h)
-{
-    return ((h ^ 89869747UL) ^ (h << 16)) * 3644798167UL;
+    node->b_datamap = datamap;
+    node->b_nodemap = nodemap;
+    return (MapNode *)node;
 }
 
-
-static Py_hash_t
-map_py_hash(MapObject *self)
+static MapNode *
+map_node_merge(MapMergeState *merge, MapNode *v, MapNode *w, uint32_t shift)
 {
-    /* Adapted version of frozenset.__hash__: it's important
-       that Map.__hash__ is independant of key/values order.
+    /* Merge two subtrees found at the same place of two trees.
 
-       Optimization idea: compute and memoize intermediate
-       hash values for HAMT nodes.
+       Slots that only one of the subtrees has are grafted into the
+       result as they are, so only the parts of the trees that
+       overlap are visited.  Subtrees shared by both trees are
+       reused too, unless values of their keys have to be resolved.
     */
 
-    if (self->h_hash != -1) {
-        return self->h_hash;
+    if (v == w && merge->m_resolve == NULL) {
+        merge->m_dups += map_node_count(v);
+        Py_INCREF(v);
+        return v;
     }
 
-    Py_uhash_t hash = 0;
+    if (IS_COLLISION_NODE(v) || IS_COLLISION_NODE(w)) {
+        return map_merge_lookup(merge, v, w, shift);
+    }
 
-    MapIteratorState iter;
-    map_iter_t iter_res;
-    map_iterator_init(&iter, self->h_root);
-    do {
-        PyObject *v_key;
-        PyObject *v_val;
+    MapMergeSlot slots[HAMT_ARRAY_NODE_SIZE];
+    MapNode *res = NULL;
+    uint32_t v_bitmap = map_merge_occupied(v);
+    uint32_t w_bitmap = map_merge_occupied(w);
+    uint32_t bitmap = v_bitmap | w_bitmap;
+    uint32_t filled = 0;
+    int same_as_v = (w_bitmap & ~v_bitmap) == 0;
+    int same_as_w = (v_bitmap & ~w_bitmap) == 0;
 
-        iter_res = map_iterator_next(&iter, &v_key, &v_val);
-        if (iter_res == I_ITEM) {
-            Py_hash_t vh = PyObject_Hash(v_key);
-            if (vh == -1) {
-                return -1;
-            }
-            hash ^= _shuffle_bits((Py_uhash_t)vh);
+    for (uint32_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        MapMergeSlot v_slot;
+        MapMergeSlot w_slot;
+        MapMergeSlot *out = &slots[i];
+        uint32_t bit = (uint32_t)1 << i;
 
-            vh = PyObject_Hash(v_val);
-            if (vh == -1) {
-                return -1;
-            }
-            hash ^= _shuffle_bits((Py_uhash_t)vh);
+        if (!(bitmap & bit)) {
+            continue;
         }
-    } while (iter_res != I_END);
 
-    hash ^= ((Py_uhash_t)self->h_count * 2 + 1) * 1927868237UL;
+        map_merge_load_slot(v, bit, &v_slot);
+        map_merge_load_slot(w, bit, &w_slot);
 
-    hash ^= (hash >> 11) ^ (hash >> 25);
-    hash = hash * 69069U + 907133923UL;
+        if (map_merge_slot_is_empty(&w_slot)) {
+            *out = v_slot;
+        }
+        else if (map_merge_slot_is_empty(&v_slot)) {
+            *out = w_slot;
+        }
+        else if (map_merge_slots(merge, &v_slot, &w_slot, shift + 5, out)) {
+            goto done;
+        }
+        filled |= bit;
 
-    self->h_hash = (Py_hash_t)hash;
-    if (self->h_hash == -1) {
-        self->h_hash = 1;
+        same_as_v = same_as_v && map_merge_slot_is(out, &v_slot);
+        same_as_w = same_as_w && map_merge_slot_is(out, &w_slot);
     }
-    return self->h_hash;
-}
-
-static PyObject *
-map_reduce(MapObject *self)
-{
-    MapIteratorState iter;
-    map_iter_t iter_res;
 
-    PyObject *dict = PyDict_New();
-    if (dict == NULL) {
-        return NULL;
+    if (same_as_v) {
+        map_merge_touch(merge, v);
+        Py_INCREF(v);
+        res = v;
+    }
+    else if (same_as_w) {
+        Py_INCREF(w);
+        res = w;
+    }
+    else {
+        res = map_merge_new_node(
+            merge->m_state, merge->m_mutid, slots, bitmap, shift);
     }
 
-    map_iterator_init(&iter, self->h_root);
-    do {
-        PyObject *key;
-        PyObject *val;
-
-        iter_res = map_iterator_next(&iter, &key, &val);
-        if (iter_res == I_ITEM) {
-            if (PyDict_SetItem(dict, key, val) < 0) {
-                Py_DECREF(dict);
-                return NULL;
-            }
+done:
+    for (uint32_t i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        if (filled & ((uint32_t)1 << i)) {
+            map_merge_slot_clear(&slots[i]);
         }
-    } while (iter_res != I_END);
-
-    PyObject *args = PyTuple_Pack(1, dict);
-    Py_DECREF(dict);
-    if (args == NULL) {
-        return NULL;
     }
-
-    PyObject *tup = PyTuple_Pack(2, Py_TYPE(self), args);
-    Py_DECREF(args);
-    return tup;
+    return res;
 }
 
-#if PY_VERSION_HEX < 0x030900A6
-static PyObject *
-map_py_class_getitem(PyObject *type, PyObject *item)
+static int
+map_merge_trees(uint64_t mutid, PyObject *resolve,
+                MapNode *root, Py_ssize_t count,
+                MapNode *other_root, Py_ssize_t other_count,
+                MapNode **new_root, Py_ssize_t *new_count)
 {
-    Py_INCREF(type);
-    return type;
-}
-#endif
+    /* Merge the tree "other_root" into "root"; nodes created along
+       the way are owned by "mutid". */
 
-static PyMethodDef Map_methods[] = {
-    {"set", (PyCFunction)map_py_set, METH_VARARGS, NULL},
-    {"get", (PyCFunction)map_py_get, METH_VARARGS, NULL},
-    {"delete", (PyCFunction)map_py_delete, METH_O, NULL},
-    {"mutate", (PyCFunction)map_py_mutate, METH_NOARGS, NULL},
-    {"items", (PyCFunction)map_py_items, METH_NOARGS, NULL},
-    {"keys", (PyCFunction)map_py_keys, METH_NOARGS, NULL},
-    {"values", (PyCFunction)map_py_values, METH_NOARGS, NULL},
-    {"update", (PyCFunction)map_py_update, METH_VARARGS | METH_KEYWORDS, NULL},
-    {"__reduce__", (PyCFunction)map_reduce, METH_NOARGS, NULL},
-    {"__dump__", (PyCFunction)map_py_dump, METH_NOARGS, NULL},
-    {
-        "__class_getitem__",
-#if PY_VERSION_HEX < 0x030900A6
-        (PyCFunction)map_py_class_getitem,
-#else
-        Py_GenericAlias,
-#endif
-        METH_O|METH_CLASS,
-        "See PEP 585"
-    },
-    {NULL, NULL}
-};
+    MapMergeState merge;
+    merge.m_resolve = resolve;
+    merge.m_dups = 0;
+    merge.m_state = map_state(root);
+    merge.m_mutid = mutid;
 
-static PySequenceMethods Map_as_sequence = {
-    0,                                /* sq_length */
-    0,                                /* sq_concat */
-    0,                                /* sq_repeat */
-    0,                                /* sq_item */
-    0,                                /* sq_slice */
-    0,                                /* sq_ass_item */
-    0,                                /* sq_ass_slice */
-    (objobjproc)map_tp_contains,      /* sq_contains */
-    0,                                /* sq_inplace_concat */
-    0,                                /* sq_inplace_repeat */
-};
+    MapNode *res = map_node_merge(&merge, root, other_root, 0);
+    if (res == NULL) {
+        return -1;
+    }
 
-static PyMappingMethods Map_as_mapping = {
-    (lenfunc)map_tp_len,             /* mp_length */
-    (binaryfunc)map_tp_subscript,    /* mp_subscript */
-};
+    *new_root = res;
+    *new_count = count + other_count - merge.m_dups;
+    return 0;
+}
 
-PyTypeObject _Map_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "immutables._map.Map",
-    sizeof(MapObject),
-    .tp_methods = Map_methods,
-    .tp_as_mapping = &Map_as_mapping,
-    .tp_as_sequence = &Map_as_sequence,
-    .tp_iter = (getiterfunc)map_tp_iter,
-    .tp_dealloc = (destructor)map_tp_dealloc,
-    .tp_getattro = PyObject_GenericGetAttr,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC
-    #ifdef Py_TPFLAGS_MAPPING
-        | Py_TPFLAGS_MAPPING
-    #endif
-    ,
-    .tp_richcompare = map_tp_richcompare,
-    .tp_traverse = (traverseproc)map_tp_traverse,
-    .tp_clear = (inquiry)map_tp_clear,
-    .tp_new = map_tp_new,
-    .tp_init = (initproc)map_tp_init,
-    .tp_weaklistoffset = offsetof(MapObject, h_weakreflist),
-    .tp_hash = (hashfunc)map_py_hash,
-    .tp_repr = (reprfunc)map_py_repr,
-};
+static int
+map_node_merge_map(uint64_t mutid, MapObject *map, PyObject *resolve,
+                   MapNode *root, Py_ssize_t count,
+                   MapNode **new_root, Py_ssize_t *new_count)
+{
+    /* Merge items of "map" into the tree "root". */
 
+    MapNode *other_root;
 
-/////////////////////////////////// MapMutation
+    if (IS_SMALL_MAP(map)) {
+        other_root = map_small_to_root(map, 0);
+        if (other_root == NULL) {
+            return -1;
+        }
+    }
+    else {
+        Py_INCREF(map->h_root);
+        other_root = map->h_root;
+    }
 
+    int res = map_merge_trees(mutid, resolve, root, count,
+                              other_root, map->h_count,
+                              new_root, new_count);
+    Py_DECREF(other_root);
+    return res;
+}
 
-static int
-map_node_update_from_map(uint64_t mutid,
-                         MapObject *map,
-                         MapNode *root, Py_ssize_t count,
-                         MapNode **new_root, Py_ssize_t *new_count)
+static MapObject *
+map_merge(MapObject *o, MapObject *other, PyObject *resolve)
 {
-    assert(Map_Check(map));
+    /* Return a new Map with items of both "o" and "other"; "resolve"
+       (if not NULL) decides the values of keys found in both. */
 
-    MapIteratorState iter;
-    map_iter_t iter_res;
+    MapNode *root;
+    MapNode *new_root = NULL;
+    Py_ssize_t new_count;
+    MapState *st = map_state(o);
+    uint64_t mutid = map_new_mutid(st);
 
-    MapNode *last_root;
-    Py_ssize_t last_count;
+    if (IS_SMALL_MAP(o)) {
+        root = map_small_to_root(o, mutid);
+        if (root == NULL) {
+            return NULL;
+        }
+    }
+    else {
+        Py_INCREF(o->h_root);
+        root = o->h_root;
+    }
 
-    Py_INCREF(root);
-    last_root = root;
-    last_count = count;
+    int ret = map_node_merge_map(
+        mutid, other, resolve, root, o->h_count, &new_root, &new_count);
+    Py_DECREF(root);
+    if (ret) {
+        return NULL;
+    }
 
-    map_iterator_init(&iter, map->h_root);
-    do {
-        PyObject *key;
-        PyObject *val;
-        int32_t key_hash;
-        int added_leaf;
+    if (new_root == o->h_root || new_root == other->h_root) {
+        MapObject *same = new_root == o->h_root ? o : other;
+        Py_DECREF(new_root);
+        Py_INCREF(same);
+        return same;
+    }
 
-        iter_res = map_iterator_next(&iter, &key, &val);
-        if (iter_res == I_ITEM) {
-            key_hash = map_hash(key);
-            if (key_hash == -1) {
-                goto err;
-            }
+    return map_new_from_root(st, new_root, new_count);
+}
 
-            MapNode *iter_root = map_node_assoc(
-                last_root,
-                0, key_hash, key, val, &added_leaf,
-                mutid);
 
-            if (iter_root == NULL) {
-                goto err;
-            }
+/////////////////////////////////// Set Operations
 
-            if (added_leaf) {
-                last_count++;
-            }
 
-            Py_SETREF(last_root, iter_root);
-        }
-    } while (iter_res != I_END);
+typedef enum {
+    S_INTERSECTION,          /* items of "v" with keys in "w" */
+    S_DIFFERENCE,            /* items of "v" with keys not in "w" */
+    S_SYMMETRIC_DIFFERENCE   /* items with keys in only one of them */
+} map_setop_t;
 
-    *new_root = last_root;
-    *new_count = last_count;
+typedef struct {
+    map_setop_t s_op;
+    /* Number of keys found in both trees. */
+    Py_ssize_t s_dups;
+    MapState *s_state;
+    uint64_t s_mutid;
+} MapSetOpState;
 
-    return 0;
 
-err:
-    Py_DECREF(last_root);
-    return -1;
-}
+static int
+map_node_setop(MapSetOpState *setop, MapNode *v, MapNode *w, uint32_t shift,
+               MapMergeSlot *out);
 
 
-static int
-map_node_update_from_dict(uint64_t mutid,
-                          PyObject *dct,
-                          MapNode *root, Py_ssize_t count,
-                          MapNode **new_root, Py_ssize_t *new_count)
+static void
+map_setop_set_node(MapMergeSlot *out, MapNode *node)
 {
-    assert(PyDict_Check(dct));
+    /* Put "node" (stealing the reference) into "out".  A node left
+       with a single key/value pair is put in as that pair: the pair
+       stays alive, as it's also in one of the trees we started with. */
 
-    PyObject *it = PyObject_GetIter(dct);
-    if (it == NULL) {
-        return -1;
-    }
+    Py_hash_t hash;
+    PyObject *key;
+    PyObject *val;
 
-    MapNode *last_root;
-    Py_ssize_t last_count;
+    out->s_owned = 1;
+    out->s_node = node;
 
-    Py_INCREF(root);
-    last_root = root;
-    last_count = count;
+    if (map_merge_slot_pair(out, &hash, &key, &val)) {
+        map_merge_slot_clear(out);
+        out->s_key = key;
+        out->s_val = val;
+        out->s_hash = hash;
+    }
+}
 
-    PyObject *key;
+static int
+map_setop_add(MapSetOpState *setop, MapMergeSlot *acc, uint32_t shift,
+              Py_hash_t hash, PyObject *key, PyObject *val)
+{
+    /* Add a key/value pair to the subtree at "shift" being built in
+       "acc"; keys added must be distinct. */
 
-    while ((key = PyIter_Next(it))) {
-        PyObject *val;
-        int added_leaf;
-        int32_t key_hash;
+    MapNode *node;
+    int added_leaf = 0;
 
-        key_hash = map_hash(key);
-        if (key_hash == -1) {
-            Py_DECREF(key);
-            goto err;
-        }
+    if (map_merge_slot_is_empty(acc)) {
+        acc->s_key = key;
+        acc->s_val = val;
+        acc->s_hash = hash;
+        return 0;
+    }
 
-        val = PyDict_GetItemWithError(dct, key);
-        if (val == NULL) {
-            Py_DECREF(key);
-            goto err;
+    if (acc->s_node == NULL) {
+        node = map_node_new_bitmap_or_collision(
+            setop->s_state,
+            shift,
+            acc->s_hash, acc->s_key, acc->s_val,
+            hash, key, val,
+            setop->s_mutid);
+        if (node == NULL) {
+            return -1;
         }
+        acc->s_key = NULL;
+        acc->s_val = NULL;
+        acc->s_node = node;
+        acc->s_owned = 1;
+        return 0;
+    }
 
-        MapNode *iter_root = map_node_assoc(
-            last_root,
-            0, key_hash, key, val, &added_leaf,
-            mutid);
+    node = map_node_assoc(
+        acc->s_node, shift, hash, key, val, &added_leaf, setop->s_mutid);
+    if (node == NULL) {
+        return -1;
+    }
+    assert(added_leaf);
+    Py_SETREF(acc->s_node, node);
+    return 0;
+}
 
-        Py_DECREF(key);
+static int
+map_setop_lookup(MapSetOpState *setop, MapNode *v, MapNode *w,
+                 uint32_t shift, MapMergeSlot *out)
+{
+    /* Apply a set operation to two subtrees found at "shift" of two
+       trees by looking up keys of each of them in the other one.
+       This is what we fall back to for Collision nodes. */
 
-        if (iter_root == NULL) {
-            goto err;
+    MapIteratorState iter;
+    map_iter_t iter_res;
+    PyObject *key;
+    PyObject *val;
+    PyObject *other_val;
+    Py_hash_t hash;
+    Py_ssize_t v_count = 0;
+    Py_ssize_t v_kept = 0;
+
+    map_iterator_init(&iter, v);
+    while ((iter_res = map_iterator_next_hashed(
+                &iter, &key, &val, &hash)) == I_ITEM)
+    {
+        map_find_t found = map_node_find(w, shift, hash, key, &other_val);
+        if (found == F_ERROR) {
+            goto error;
         }
 
-        if (added_leaf) {
-            last_count++;
+        v_count++;
+        if (found == F_FOUND) {
+            setop->s_dups++;
+        }
+        if ((found == F_FOUND) == (setop->s_op == S_INTERSECTION)) {
+            v_kept++;
+            if (map_setop_add(setop, out, shift, hash, key, val)) {
+                goto error;
+            }
         }
-
-        Py_SETREF(last_root, iter_root);
     }
 
-    if (key == NULL && PyErr_Occurred()) {
-        goto err;
+    if (setop->s_op == S_SYMMETRIC_DIFFERENCE) {
+        map_iterator_init(&iter, w);
+        while ((iter_res = map_iterator_next_hashed(
+                    &iter, &key, &val, &hash)) == I_ITEM)
+        {
+            map_find_t found = map_node_find(v, shift, hash, key, &other_val);
+            if (found == F_ERROR) {
+                goto error;
+            }
+            if (found == F_NOT_FOUND &&
+                    map_setop_add(setop, out, shift, hash, key, val))
+            {
+                goto error;
+            }
+        }
+    }
+    else if (v_kept == v_count) {
+        /* Nothing was dropped; reuse "v". */
+        map_merge_slot_clear(out);
+        out->s_node = v;
     }
-
-    Py_DECREF(it);
-
-    *new_root = last_root;
-    *new_count = last_count;
 
     return 0;
 
-err:
-    Py_DECREF(it);
-    Py_DECREF(last_root);
+error:
+    map_merge_slot_clear(out);
     return -1;
 }
 
-
 static int
-map_node_update_from_seq(uint64_t mutid,
-                         PyObject *seq,
-                         MapNode *root, Py_ssize_t count,
-                         MapNode **new_root, Py_ssize_t *new_count)
+map_setop_pair_node(MapSetOpState *setop,
+                    MapMergeSlot *pair, MapNode *node, int pair_in_v,
+                    uint32_t shift, MapMergeSlot *out)
 {
-    PyObject *it;
-    Py_ssize_t i;
-    PyObject *item = NULL;
-    PyObject *fast = NULL;
+    /* Apply a set operation to a key/value pair of one tree and the
+       sub-node found in the same slot of the other tree. */
 
-    MapNode *last_root;
-    Py_ssize_t last_count;
+    PyObject *node_key;
+    PyObject *node_val;
+    MapNode *new_node;
+    int added_leaf = 0;
 
-    it = PyObject_GetIter(seq);
-    if (it == NULL) {
-        return -1;
-    }
+    map_find_t found = map_node_find_item(
+        node, shift, pair->s_hash, pair->s_key, &node_key, &node_val);
 
-    Py_INCREF(root);
-    last_root = root;
-    last_count = count;
+    switch (found) {
+        case F_ERROR:
+            return -1;
 
-    for (i = 0; ; i++) {
-        PyObject *key, *val;
-        Py_ssize_t n;
-        int32_t key_hash;
-        int added_leaf;
+        case F_NOT_FOUND:
+            if (setop->s_op == S_INTERSECTION) {
+                return 0;
+            }
+            if (setop->s_op == S_DIFFERENCE) {
+                if (pair_in_v) {
+                    *out = *pair;
+                }
+                else {
+                    out->s_node = node;
+                }
+                return 0;
+            }
+            new_node = map_node_assoc(
+                node, shift, pair->s_hash, pair->s_key, pair->s_val,
+                &added_leaf, setop->s_mutid);
+            if (new_node == NULL) {
+                return -1;
+            }
+            map_setop_set_node(out, new_node);
+            return 0;
 
-        item = PyIter_Next(it);
-        if (item == NULL) {
-            if (PyErr_Occurred()) {
-                goto err;
+        case F_FOUND:
+            setop->s_dups++;
+            if (setop->s_op == S_INTERSECTION) {
+                *out = *pair;
+                if (!pair_in_v) {
+                    /* Items of "v" are kept, with their key objects. */
+                    out->s_key = node_key;
+                    out->s_val = node_val;
+                }
+                return 0;
+            }
+            if (setop->s_op == S_DIFFERENCE && pair_in_v) {
+                return 0;
+            }
+            switch (map_node_without(node, shift, pair->s_hash, pair->s_key,
+                                     &new_node, setop->s_mutid))
+            {
+                case W_ERROR:
+                    return -1;
+                case W_EMPTY:
+                    return 0;
+                case W_NEWNODE:
+                    map_setop_set_node(out, new_node);
+                    return 0;
+                default:
+                    abort();
             }
-            break;
-        }
 
-        fast = PySequence_Fast(item, "");
-        if (fast == NULL) {
-            if (PyErr_ExceptionMatches(PyExc_TypeError))
-                PyErr_Format(PyExc_TypeError,
-                    "cannot convert map update "
-                    "sequence element #%zd to a sequence",
-                    i);
-            goto err;
-        }
+        default:
+            abort();
+    }
+}
 
-        n = PySequence_Fast_GET_SIZE(fast);
-        if (n != 2) {
-            PyErr_Format(PyExc_ValueError,
-                         "map update sequence element #%zd "
-                         "has length %zd; 2 is required",
-                         i, n);
-            goto err;
+static int
+map_setop_slots(MapSetOpState *setop,
+                MapMergeSlot *v, MapMergeSlot *w, uint32_t shift,
+                MapMergeSlot *out)
+{
+    /* Apply a set operation to two non-empty slots found at the same
+       place of two trees; "shift" is the level below the slots. */
+
+    out->s_key = NULL;
+    out->s_val = NULL;
+    out->s_hash = 0;
+    out->s_node = NULL;
+    out->s_owned = 0;
+
+    if (v->s_node != NULL && w->s_node != NULL) {
+        return map_node_setop(setop, v->s_node, w->s_node, shift, out);
+    }
+
+    if (v->s_node != NULL) {
+        return map_setop_pair_node(setop, w, v->s_node, 0, shift, out);
+    }
+
+    if (w->s_node != NULL) {
+        return map_setop_pair_node(setop, v, w->s_node, 1, shift, out);
+    }
+
+    int cmp = 0;
+    if (v->s_hash == w->s_hash) {
+        cmp = PyObject_RichCompareBool(v->s_key, w->s_key, Py_EQ);
+        if (cmp < 0) {
+            return -1;
         }
+    }
 
-        key = PySequence_Fast_GET_ITEM(fast, 0);
-        val = PySequence_Fast_GET_ITEM(fast, 1);
-        Py_INCREF(key);
-        Py_INCREF(val);
+    if (cmp == 1) {
+        setop->s_dups++;
+        if (setop->s_op == S_INTERSECTION) {
+            *out = *v;
+        }
+        return 0;
+    }
 
-        key_hash = map_hash(key);
-        if (key_hash == -1) {
-            Py_DECREF(key);
-            Py_DECREF(val);
-            goto err;
+    if (setop->s_op == S_DIFFERENCE) {
+        *out = *v;
+    }
+    else if (setop->s_op == S_SYMMETRIC_DIFFERENCE) {
+        MapNode *node = map_node_new_bitmap_or_collision(
+            setop->s_state,
+            shift,
+            v->s_hash, v->s_key, v->s_val,
+            w->s_hash, w->s_key, w->s_val,
+            setop->s_mutid);
+        if (node == NULL) {
+            return -1;
         }
+        out->s_node = node;
+        out->s_owned = 1;
+    }
+    return 0;
+}
 
-        MapNode *iter_root = map_node_assoc(
-            last_root,
-            0, key_hash, key, val, &added_leaf,
-            mutid);
+static int
+map_node_setop(MapSetOpState *setop, MapNode *v, MapNode *w, uint32_t shift,
+               MapMergeSlot *out)
+{
+    /* Apply a set operation to two subtrees found at the same place
+       of two trees, and put the result into "out": nothing, a single
+       key/value pair that the parent node has to inline, or a node.
+
+       Bitmaps of occupied slots tell which slots can be skipped or
+       reused as they are (bitwise AND for intersections, AND NOT for
+       items that are only in one of the trees), so keys are only
+       compared where both trees have something in the same slot.
+    */
 
-        Py_DECREF(key);
-        Py_DECREF(val);
+    out->s_key = NULL;
+    out->s_val = NULL;
+    out->s_hash = 0;
+    out->s_node = NULL;
+    out->s_owned = 0;
 
-        if (iter_root == NULL) {
-            goto err;
+    if (v == w) {
+        setop->s_dups += map_node_count(v);
+        if (setop->s_op == S_INTERSECTION) {
+            out->s_node = v;
         }
+        return 0;
+    }
 
-        if (added_leaf) {
-            last_count++;
-        }
+    if (IS_COLLISION_NODE(v) || IS_COLLISION_NODE(w)) {
+        return map_setop_lookup(setop, v, w, shift, out);
+    }
 
-        Py_SETREF(last_root, iter_root);
+    MapMergeSlot slots[HAMT_ARRAY_NODE_SIZE];
+    uint32_t v_bitmap = map_merge_occupied(v);
+    uint32_t w_bitmap = map_merge_occupied(w);
+    uint32_t bitmap;
+    uint32_t result = 0;
+    uint32_t i;
+    int same_as_v;
+    int ret = -1;
 
-        Py_DECREF(fast);
-        Py_DECREF(item);
+    switch (setop->s_op) {
+        case S_INTERSECTION:
+            bitmap = v_bitmap & w_bitmap;
+            same_as_v = (v_bitmap & ~w_bitmap) == 0;
+            break;
+        case S_DIFFERENCE:
+            bitmap = v_bitmap;
+            same_as_v = 1;
+            break;
+        case S_SYMMETRIC_DIFFERENCE:
+            bitmap = v_bitmap | w_bitmap;
+            same_as_v = (w_bitmap & ~v_bitmap) == 0;
+            break;
+        default:
+            abort();
     }
 
-    Py_DECREF(it);
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        MapMergeSlot v_slot;
+        MapMergeSlot w_slot;
+        uint32_t bit = (uint32_t)1 << i;
 
-    *new_root = last_root;
-    *new_count = last_count;
+        if (!(bitmap & bit)) {
+            continue;
+        }
 
-    return 0;
+        map_merge_load_slot(v, bit, &v_slot);
+        map_merge_load_slot(w, bit, &w_slot);
 
-err:
-    Py_DECREF(last_root);
-    Py_XDECREF(item);
-    Py_XDECREF(fast);
-    Py_DECREF(it);
-    return -1;
-}
+        if (map_merge_slot_is_empty(&w_slot)) {
+            slots[i] = v_slot;
+        }
+        else if (map_merge_slot_is_empty(&v_slot)) {
+            slots[i] = w_slot;
+        }
+        else if (map_setop_slots(setop, &v_slot, &w_slot, shift + 5,
+                                 &slots[i]))
+        {
+            goto done;
+        }
 
+        if (!map_merge_slot_is_empty(&slots[i])) {
+            result |= bit;
+        }
+        same_as_v = same_as_v && map_merge_slot_is(&slots[i], &v_slot);
+    }
 
-static int
-map_node_update(uint64_t mutid,
-                PyObject *src,
-                MapNode *root, Py_ssize_t count,
-                MapNode **new_root, Py_ssize_t *new_count)
-{
-    if (Map_Check(src)) {
-        return map_node_update_from_map(
-            mutid, (MapObject *)src, root, count, new_root, new_count);
+    if (same_as_v) {
+        out->s_node = v;
     }
-    else if (PyDict_Check(src)) {
-        return map_node_update_from_dict(
-            mutid, src, root, count, new_root, new_count);
+    else if (result != 0) {
+        Py_hash_t hash;
+        PyObject *key;
+        PyObject *val;
+
+        if (map_bitcount(result) == 1 &&
+            map_merge_slot_pair(&slots[map_bitcount(result - 1)],
+                                &hash, &key, &val))
+        {
+            out->s_key = key;
+            out->s_val = val;
+            out->s_hash = hash;
+        }
+        else {
+            MapNode *node = map_merge_new_node(
+                setop->s_state, setop->s_mutid, slots, result, shift);
+            if (node == NULL) {
+                goto done;
+            }
+            out->s_node = node;
+            out->s_owned = 1;
+        }
     }
-    else {
-        return map_node_update_from_seq(
-            mutid, src, root, count, new_root, new_count);
+
+    ret = 0;
+
+done:
+    for (uint32_t j = 0; j < i; j++) {
+        if (bitmap & ((uint32_t)1 << j)) {
+            map_merge_slot_clear(&slots[j]);
+        }
     }
+    return ret;
 }
 
+static MapNode *
+map_setop_root(MapObject *o)
+{
+    /* Return a new reference to the tree of "o"; small maps get a
+       temporary one. */
 
-static int
-map_update_inplace(uint64_t mutid, BaseMapObject *o, PyObject *src)
+    if (IS_SMALL_MAP(o)) {
+        return map_small_to_root(o, 0);
+    }
+    Py_INCREF(o->h_root);
+    return o->h_root;
+}
+
+static MapObject *
+map_setop(MapObject *v, MapObject *w, map_setop_t op)
 {
-    MapNode *new_root = NULL;
-    Py_ssize_t new_count;
+    MapSetOpState setop;
+    MapMergeSlot out;
+    MapNode *v_root = NULL;
+    MapNode *w_root = NULL;
+    MapNode *root = NULL;
+    MapObject *res = NULL;
+    Py_ssize_t count;
 
-    int ret = map_node_update(
-        mutid, src,
-        o->b_root, o->b_count,
-        &new_root, &new_count);
+    setop.s_op = op;
+    setop.s_dups = 0;
+    setop.s_state = map_state(v);
+    setop.s_mutid = map_new_mutid(setop.s_state);
 
-    if (ret) {
-        return -1;
+    v_root = map_setop_root(v);
+    if (v_root == NULL) {
+        goto done;
+    }
+    w_root = map_setop_root(w);
+    if (w_root == NULL) {
+        goto done;
     }
 
-    assert(new_root);
+    if (map_node_setop(&setop, v_root, w_root, 0, &out)) {
+        goto done;
+    }
 
-    Py_SETREF(o->b_root, new_root);
-    o->b_count = new_count;
+    switch (op) {
+        case S_INTERSECTION:
+            count = setop.s_dups;
+            break;
+        case S_DIFFERENCE:
+            count = v->h_count - setop.s_dups;
+            break;
+        case S_SYMMETRIC_DIFFERENCE:
+            count = v->h_count + w->h_count - 2 * setop.s_dups;
+            break;
+        default:
+            abort();
+    }
 
-    return 0;
-}
+    if (out.s_node != NULL) {
+        root = out.s_node;
+        if (!out.s_owned) {
+            Py_INCREF(root);
+        }
+    }
+    else if (out.s_key != NULL) {
+        root = map_node_bitmap_new_pair(
+            setop.s_state, 0, out.s_hash, out.s_key, out.s_val, 0);
+        if (root == NULL) {
+            goto done;
+        }
+    }
+    else {
+        res = map_new(setop.s_state);
+        goto done;
+    }
 
+    if (root == v->h_root || root == w->h_root) {
+        res = root == v->h_root ? v : w;
+        Py_INCREF(res);
+        Py_DECREF(root);
+        goto done;
+    }
+
+    res = map_new_from_root(setop.s_state, root, count);
+
+done:
+    Py_XDECREF(v_root);
+    Py_XDECREF(w_root);
+    return res;
+}
 
 static MapObject *
-map_update(uint64_t mutid, MapObject *o, PyObject *src)
+map_restrict(MapObject *o, PyObject *keys)
 {
-    MapNode *new_root = NULL;
-    Py_ssize_t new_count;
+    /* Return a new Map with items of "o" whose keys are in the
+       iterable "keys". */
 
-    int ret = map_node_update(
-        mutid, src,
-        o->h_root, o->h_count,
-        &new_root, &new_count);
+    MapState *st = map_state(o);
+    uint64_t mutid = map_new_mutid(st);
+    Py_ssize_t count = 0;
+    PyObject *key;
 
-    if (ret) {
+    PyObject *it = PyObject_GetIter(keys);
+    if (it == NULL) {
         return NULL;
     }
 
-    assert(new_root);
-
-    MapObject *new = map_alloc();
-    if (new == NULL) {
-        Py_DECREF(new_root);
+    MapNode *root = map_node_bitmap_new(st, 0, 0, mutid);
+    if (root == NULL) {
+        Py_DECREF(it);
         return NULL;
     }
 
-    Py_XSETREF(new->h_root, new_root);
-    new->h_count = new_count;
+    while ((key = PyIter_Next(it))) {
+        PyObject *val;
+        int added_leaf = 0;
+
+        Py_hash_t key_hash = map_hash(key);
+        if (key_hash == -1) {
+            Py_DECREF(key);
+            goto err;
+        }
 
-    return new;
+        map_find_t found;
+        if (IS_SMALL_MAP(o)) {
+            found = map_small_find(o, key_hash, key, &val);
+        }
+        else {
+            found = map_node_find(o->h_root, 0, key_hash, key, &val);
+        }
+        if (found == F_ERROR) {
+            Py_DECREF(key);
+            goto err;
+        }
+
+        if (found == F_FOUND) {
+            MapNode *new_root = map_node_assoc(
+                root, 0, key_hash, key, val, &added_leaf, mutid);
+            if (new_root == NULL) {
+                Py_DECREF(key);
+                goto err;
+            }
+            Py_SETREF(root, new_root);
+            count += added_leaf;
+        }
+
+        Py_DECREF(key);
+    }
+
+    if (PyErr_Occurred()) {
+        goto err;
+    }
+
+    Py_DECREF(it);
+    return map_new_from_root(st, root, count);
+
+err:
+    Py_DECREF(it);
+    Py_DECREF(root);
+    return NULL;
+}
+
+
+/////////////////////////////////// Bulk Construction
+
+
+/* Trees are built bottom-up out of an array of hashed key/value
+   pairs: the pairs are partitioned by the hash bits of every level
+   of the tree, so that every node is allocated once, at its final
+   size, instead of being copied on every insertion.
+
+   Entries keep the order in which the pairs were added; of the pairs
+   with equal keys the first key and the last value win, like they
+   do when the pairs are inserted one by one.
+
+   Free-threaded builds build large trees on several threads: the
+   keys are hashed in chunks, one per thread, and the subtrees of the
+   root are built by whichever thread is free.  The pairs are only
+   hashed then, once they all have been added. */
+
+#if defined(Py_GIL_DISABLED) && !defined(MAP_BULK_PARALLEL)
+#  define MAP_BULK_PARALLEL
+#endif
+
+#ifdef MAP_BULK_PARALLEL
+/* Pairs every thread hashes and builds subtrees of, at least. */
+#  define MAP_BULK_THREAD_MIN 32768
+#  define MAP_BULK_MAX_THREADS 16
+#endif
+
+typedef struct {
+    /* Array of "b_count" entries; keys and values are strong
+       references. */
+    MapEntry *b_entries;
+    Py_ssize_t b_count;
+    Py_ssize_t b_allocated;
+    /* Number of pairs whose keys were already in the array. */
+    Py_ssize_t b_dups;
+    /* Whether pairs are added unhashed, with an "e_hash" of -1, to
+       be hashed by map_bulk_build(). */
+    int b_hash_later;
+    MapState *b_state;
+    uint64_t b_mutid;
+} MapBulk;
+
+
+static void
+map_bulk_init(MapBulk *bulk, MapState *st, uint64_t mutid)
+{
+    bulk->b_entries = NULL;
+    bulk->b_count = 0;
+    bulk->b_allocated = 0;
+    bulk->b_dups = 0;
+    bulk->b_hash_later = 0;
+    bulk->b_state = st;
+    bulk->b_mutid = mutid;
+}
+
+static void
+map_bulk_clear(MapBulk *bulk)
+{
+    for (Py_ssize_t i = 0; i < bulk->b_count; i++) {
+        Py_DECREF(bulk->b_entries[i].e_key);
+        Py_DECREF(bulk->b_entries[i].e_val);
+    }
+    PyMem_Free(bulk->b_entries);
+    bulk->b_entries = NULL;
+    bulk->b_count = 0;
+    bulk->b_allocated = 0;
+    bulk->b_hash_later = 0;
 }
 
 static int
-mapmut_check_finalized(MapMutationObject *o)
+map_bulk_reserve(MapBulk *bulk, Py_ssize_t size)
 {
-    if (o->m_mutid == 0) {
-        PyErr_Format(
-            PyExc_ValueError,
-            "mutation %R has been finished",
-            o, NULL);
+#ifdef MAP_BULK_PARALLEL
+    if (size >= 2 * MAP_BULK_THREAD_MIN) {
+        bulk->b_hash_later = 1;
+    }
+#endif
+
+    if (size <= bulk->b_allocated) {
+        return 0;
+    }
+
+    if ((size_t)size > PY_SSIZE_T_MAX / sizeof(MapEntry)) {
+        PyErr_NoMemory();
         return -1;
     }
 
+    MapEntry *entries = (MapEntry *)PyMem_Realloc(
+        bulk->b_entries, (size_t)size * sizeof(MapEntry));
+    if (entries == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    bulk->b_entries = entries;
+    bulk->b_allocated = size;
     return 0;
 }
 
 static int
-mapmut_delete(MapMutationObject *o, PyObject *key, int32_t key_hash)
+map_bulk_add(MapBulk *bulk, PyObject *key, PyObject *val)
 {
-    MapNode *new_root = NULL;
+    /* Hash "key", unless it is to be hashed later, and append the
+       pair; "key" and "val" are borrowed. */
 
-    assert(key_hash != -1);
-    map_without_t res = map_node_without(
-        (MapNode *)(o->m_root),
-        0, key_hash, key,
-        &new_root,
-        o->m_mutid);
+    if (bulk->b_count == bulk->b_allocated) {
+        Py_ssize_t size = bulk->b_allocated;
+        size = size < 8 ? 8 : size + (size >> 1);
+        if (map_bulk_reserve(bulk, size)) {
+            return -1;
+        }
+    }
 
-    switch (res) {
-        case W_ERROR:
+    /* The key can run arbitrary code while being hashed: hold on to
+       both objects first. */
+    Py_INCREF(key);
+    Py_INCREF(val);
+
+    Py_hash_t hash = -1;
+    if (!bulk->b_hash_later && (hash = map_hash(key)) == -1) {
+        Py_DECREF(key);
+        Py_DECREF(val);
+        return -1;
+    }
+
+    MapEntry *entry = &bulk->b_entries[bulk->b_count++];
+    entry->e_key = key;
+    entry->e_val = val;
+    entry->e_hash = hash;
+    return 0;
+}
+
+static int
+map_bulk_add_dict(MapBulk *bulk, PyObject *dct)
+{
+    assert(PyDict_Check(dct));
+
+    Py_ssize_t size = PyDict_GET_SIZE(dct);
+    if (map_bulk_reserve(bulk, bulk->b_count + size)) {
+        return -1;
+    }
+
+    if (!PyDict_CheckExact(dct)) {
+        /* Subclasses may override __iter__(). */
+        PyObject *it = PyObject_GetIter(dct);
+        if (it == NULL) {
             return -1;
+        }
 
-        case W_EMPTY:
-            new_root = map_node_bitmap_new(0, o->m_mutid);
-            if (new_root == NULL) {
+        PyObject *key;
+        while ((key = PyIter_Next(it))) {
+            PyObject *val = PyDict_GetItemWithError(dct, key);
+            if (val == NULL || map_bulk_add(bulk, key, val)) {
+                if (val == NULL && !PyErr_Occurred()) {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                }
+                Py_DECREF(key);
+                Py_DECREF(it);
                 return -1;
             }
-            Py_SETREF(o->m_root, new_root);
-            o->m_count = 0;
-            return 0;
+            Py_DECREF(key);
+        }
 
-        case W_NOT_FOUND:
-            PyErr_SetObject(PyExc_KeyError, key);
+        Py_DECREF(it);
+        return PyErr_Occurred() ? -1 : 0;
+    }
+
+    Py_ssize_t pos = 0;
+    PyObject *key;
+    PyObject *val;
+
+    while (PyDict_Next(dct, &pos, &key, &val)) {
+        if (map_bulk_add(bulk, key, val)) {
+            return -1;
+        }
+        if (PyDict_GET_SIZE(dct) != size) {
+            PyErr_SetString(
+                PyExc_RuntimeError,
+                "dictionary changed size during iteration");
             return -1;
+        }
+    }
 
-        case W_NEWNODE: {
-            assert(new_root != NULL);
-            Py_SETREF(o->m_root, new_root);
-            o->m_count--;
-            return 0;
+    return 0;
+}
+
+static int
+map_bulk_add_seq(MapBulk *bulk, PyObject *seq)
+{
+    /* Add the key/value pairs "seq" yields. */
+
+    Py_ssize_t hint = PyObject_LengthHint(seq, 0);
+    if (hint < 0 || map_bulk_reserve(bulk, bulk->b_count + hint)) {
+        return -1;
+    }
+
+    PyObject *it = PyObject_GetIter(seq);
+    if (it == NULL) {
+        return -1;
+    }
+
+    PyObject *item;
+    Py_ssize_t i;
+
+    for (i = 0; (item = PyIter_Next(it)) != NULL; i++) {
+        PyObject *fast;
+        int ret;
+
+        if (PyTuple_CheckExact(item) && PyTuple_GET_SIZE(item) == 2) {
+            ret = map_bulk_add(
+                bulk, PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1));
+            Py_DECREF(item);
+            if (ret) {
+                goto err;
+            }
+            continue;
+        }
+
+        fast = PySequence_Fast(item, "");
+        Py_DECREF(item);
+        if (fast == NULL) {
+            if (PyErr_ExceptionMatches(PyExc_TypeError))
+                PyErr_Format(PyExc_TypeError,
+                    "cannot convert map update "
+                    "sequence element #%zd to a sequence",
+                    i);
+            goto err;
+        }
+
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(fast);
+        if (n != 2) {
+            PyErr_Format(PyExc_ValueError,
+                         "map update sequence element #%zd "
+                         "has length %zd; 2 is required",
+                         i, n);
+            Py_DECREF(fast);
+            goto err;
+        }
+
+        ret = map_bulk_add(
+            bulk,
+            PySequence_Fast_GET_ITEM(fast, 0),
+            PySequence_Fast_GET_ITEM(fast, 1));
+        Py_DECREF(fast);
+        if (ret) {
+            goto err;
+        }
+    }
+
+    if (PyErr_Occurred()) {
+        goto err;
+    }
+
+    Py_DECREF(it);
+    return 0;
+
+err:
+    Py_DECREF(it);
+    return -1;
+}
+
+static int
+map_bulk_add_keys(MapBulk *bulk, PyObject *keys, PyObject *val)
+{
+    /* Add a "val" pair for every key "keys" yields. */
+
+    Py_ssize_t hint = PyObject_LengthHint(keys, 0);
+    if (hint < 0 || map_bulk_reserve(bulk, bulk->b_count + hint)) {
+        return -1;
+    }
+
+    PyObject *it = PyObject_GetIter(keys);
+    if (it == NULL) {
+        return -1;
+    }
+
+    PyObject *key;
+    while ((key = PyIter_Next(it))) {
+        int ret = map_bulk_add(bulk, key, val);
+        Py_DECREF(key);
+        if (ret) {
+            Py_DECREF(it);
+            return -1;
+        }
+    }
+
+    Py_DECREF(it);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static int
+map_bulk_collision(MapBulk *bulk, MapEntry *entries, Py_ssize_t n,
+                   uint32_t shift, MapMergeSlot *out)
+{
+    /* Build the subtree at "shift" out of "n" entries with equal
+       hashes: pairs with equal keys are folded together, and the
+       rest goes into a Collision node below a chain of Bitmap nodes
+       with a single sub-node each. */
+
+    Py_hash_t hash = entries[0].e_hash;
+    Py_ssize_t kept = 1;
+
+    for (Py_ssize_t i = 1; i < n; i++) {
+        Py_ssize_t j;
+
+        for (j = 0; j < kept; j++) {
+            int cmp = PyObject_RichCompareBool(
+                entries[j].e_key, entries[i].e_key, Py_EQ);
+            if (cmp < 0) {
+                return -1;
+            }
+            if (cmp) {
+                break;
+            }
+        }
+
+        /* Entries are only ever swapped: the array owns them. */
+        if (j < kept) {
+            PyObject *val = entries[j].e_val;
+            entries[j].e_val = entries[i].e_val;
+            entries[i].e_val = val;
+            bulk->b_dups++;
+        }
+        else {
+            MapEntry entry = entries[kept];
+            entries[kept++] = entries[i];
+            entries[i] = entry;
+        }
+    }
+
+    out->s_node = NULL;
+    out->s_owned = 0;
+
+    if (kept == 1) {
+        out->s_key = entries[0].e_key;
+        out->s_val = entries[0].e_val;
+        out->s_hash = hash;
+        return 0;
+    }
+
+    MapNode_Collision *coll = (MapNode_Collision *)map_node_collision_new(
+        bulk->b_state, hash, kept * 2, bulk->b_mutid);
+    if (coll == NULL) {
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < kept; i++) {
+        Py_INCREF(entries[i].e_key);
+        coll->c_array[2 * i] = entries[i].e_key;
+        Py_INCREF(entries[i].e_val);
+        coll->c_array[2 * i + 1] = entries[i].e_val;
+        map_gc_track_if(coll, entries[i].e_key);
+        map_gc_track_if(coll, entries[i].e_val);
+    }
+
+    MapNode *node = (MapNode *)coll;
+    /* The deepest level that still has hash bits to look at. */
+    int64_t last = (HAMT_HASH_BITS - 1) / 5 * 5;
+
+    for (int64_t s = last; s >= (int64_t)shift; s -= 5) {
+        MapNode_Bitmap *parent = (MapNode_Bitmap *)map_node_bitmap_new(
+            bulk->b_state, 0, 1, bulk->b_mutid);
+        if (parent == NULL) {
+            Py_DECREF(node);
+            return -1;
+        }
+
+        parent->b_array[BITMAP_NODE_IDX(parent, 0)] = (PyObject *)node;
+        parent->b_nodemap = map_bitpos(hash, (uint32_t)s);
+        map_gc_track_if(parent, (PyObject *)node);
+        node = (MapNode *)parent;
+    }
+
+    out->s_key = NULL;
+    out->s_val = NULL;
+    out->s_node = node;
+    out->s_owned = 1;
+    return 0;
+}
+
+static uint32_t
+map_bulk_partition(MapEntry *entries, MapEntry *tmp, Py_ssize_t n,
+                   uint32_t shift, Py_ssize_t *offsets)
+{
+    /* Partition "n" entries by their hash bits at "shift", using
+       "tmp" as scratch space, and set "offsets" (of
+       HAMT_ARRAY_NODE_SIZE + 1 items) to where the entries of every
+       slot start.  Returns the bitmap of the slots in use, or 0 if
+       all the entries have the same hash and were left as they are. */
+
+    int same = 1;
+    Py_ssize_t i;
+
+    memset(offsets, 0, (HAMT_ARRAY_NODE_SIZE + 1) * sizeof(Py_ssize_t));
+    for (i = 0; i < n; i++) {
+        offsets[map_mask(entries[i].e_hash, shift) + 1]++;
+        same &= entries[i].e_hash == entries[0].e_hash;
+    }
+
+    if (same) {
+        return 0;
+    }
+
+    uint32_t bitmap = 0;
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        if (offsets[i + 1]) {
+            bitmap |= (uint32_t)1 << i;
+        }
+        offsets[i + 1] += offsets[i];
+    }
+
+    /* This is stable, so equal keys keep their order. */
+    Py_ssize_t pos[HAMT_ARRAY_NODE_SIZE];
+    memcpy(pos, offsets, sizeof(pos));
+    for (i = 0; i < n; i++) {
+        tmp[pos[map_mask(entries[i].e_hash, shift)]++] = entries[i];
+    }
+    memcpy(entries, tmp, (size_t)n * sizeof(MapEntry));
+    return bitmap;
+}
+
+static int
+map_bulk_node(MapBulk *bulk, MapEntry *entries, MapEntry *tmp, Py_ssize_t n,
+              uint32_t shift, MapMergeSlot *out)
+{
+    /* Build the subtree at "shift" out of "n" entries of "entries",
+       using "tmp" (of "n" entries too) as scratch space; the entries
+       are reordered in place.  The result is a single key/value pair,
+       or a new node. */
+
+    assert(n > 0);
+
+    if (n == 1) {
+        out->s_key = entries[0].e_key;
+        out->s_val = entries[0].e_val;
+        out->s_hash = entries[0].e_hash;
+        out->s_node = NULL;
+        out->s_owned = 0;
+        return 0;
+    }
+
+    if (shift >= HAMT_HASH_BITS) {
+        return map_bulk_collision(bulk, entries, n, shift, out);
+    }
+
+    Py_ssize_t offsets[HAMT_ARRAY_NODE_SIZE + 1];
+    uint32_t bitmap = map_bulk_partition(entries, tmp, n, shift, offsets);
+    if (bitmap == 0) {
+        return map_bulk_collision(bulk, entries, n, shift, out);
+    }
+
+    MapMergeSlot slots[HAMT_ARRAY_NODE_SIZE];
+    MapNode *node = NULL;
+    uint32_t b;
+
+    for (b = 0; b < HAMT_ARRAY_NODE_SIZE; b++) {
+        slots[b].s_key = NULL;
+        slots[b].s_val = NULL;
+        slots[b].s_node = NULL;
+        slots[b].s_owned = 0;
+    }
+
+    for (b = 0; b < HAMT_ARRAY_NODE_SIZE; b++) {
+        if (bitmap & ((uint32_t)1 << b)) {
+            Py_ssize_t start = offsets[b];
+            if (map_bulk_node(bulk, entries + start, tmp + start,
+                              offsets[b + 1] - start, shift + 5,
+                              &slots[b]))
+            {
+                goto done;
+            }
+        }
+    }
+
+    node = map_merge_new_node(
+        bulk->b_state, bulk->b_mutid, slots, bitmap, shift);
+
+done:
+    for (b = 0; b < HAMT_ARRAY_NODE_SIZE; b++) {
+        map_merge_slot_clear(&slots[b]);
+    }
+
+    if (node == NULL) {
+        return -1;
+    }
+
+    out->s_key = NULL;
+    out->s_val = NULL;
+    out->s_node = node;
+    out->s_owned = 1;
+    return 0;
+}
+
+#ifdef MAP_BULK_PARALLEL
+
+typedef struct MapBulkJob MapBulkJob;
+
+typedef struct {
+    MapBulkJob *w_job;
+    int w_index;
+    /* Whether the share of this thread is done; threads that could
+       not be started leave it to the calling thread. */
+    int w_done;
+    Py_ssize_t w_dups;
+    /* The first error of the thread: the entry or the root slot it
+       failed at, and the exception. */
+    Py_ssize_t w_error_pos;
+    PyObject *w_exc_type;
+    PyObject *w_exc_val;
+    PyObject *w_exc_tb;
+} MapBulkWorker;
+
+struct MapBulkJob {
+    MapBulk *j_bulk;
+    MapEntry *j_tmp;
+    PyInterpreterState *j_interp;
+    int j_threads;
+    /* 0 while the keys are hashed, 1 while the subtrees are built. */
+    int j_phase;
+    /* The root slots and where their entries start. */
+    Py_ssize_t j_offsets[HAMT_ARRAY_NODE_SIZE + 1];
+    MapMergeSlot j_slots[HAMT_ARRAY_NODE_SIZE];
+    uint32_t j_bitmap;
+    /* The next root slot to build, and the number of threads still
+       running, the calling one included: the last one to stop
+       releases "j_done".  Both are guarded by "j_lock". */
+    uint32_t j_next_slot;
+    int j_running;
+    PyThread_type_lock j_lock;
+    PyThread_type_lock j_done;
+    MapBulkWorker j_workers[MAP_BULK_MAX_THREADS];
+};
+
+
+static int
+map_bulk_threads(Py_ssize_t count)
+{
+    /* The number of threads to build a tree of "count" pairs on. */
+
+    Py_ssize_t threads = count / MAP_BULK_THREAD_MIN;
+    if (threads < 2) {
+        return 1;
+    }
+    if (threads > MAP_BULK_MAX_THREADS) {
+        threads = MAP_BULK_MAX_THREADS;
+    }
+
+    PyObject *os = PyImport_ImportModule("os");
+    if (os == NULL) {
+        PyErr_Clear();
+        return 1;
+    }
+    /* process_cpu_count() (3.13+) only counts the CPUs this process
+       may run on. */
+    PyObject *res = PyObject_CallMethod(
+        os,
+        PyObject_HasAttrString(os, "process_cpu_count")
+            ? "process_cpu_count" : "cpu_count",
+        NULL);
+    Py_DECREF(os);
+    if (res == NULL) {
+        PyErr_Clear();
+        return 1;
+    }
+
+    Py_ssize_t cpus = res == Py_None ? 1 : PyLong_AsSsize_t(res);
+    Py_DECREF(res);
+    if (cpus == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        return 1;
+    }
+
+    if (cpus < threads) {
+        threads = cpus < 1 ? 1 : cpus;
+    }
+    return (int)threads;
+}
+
+static void
+map_bulk_fail(MapBulkWorker *w, Py_ssize_t pos)
+{
+    w->w_error_pos = pos;
+    PyErr_Fetch(&w->w_exc_type, &w->w_exc_val, &w->w_exc_tb);
+}
+
+static void
+map_bulk_work(MapBulkWorker *w)
+{
+    /* Do the share of "w" of the current phase of the job. */
+
+    MapBulkJob *job = w->w_job;
+    MapEntry *entries = job->j_bulk->b_entries;
+
+    if (job->j_phase == 0) {
+        /* The keys are hashed in chunks of the same size. */
+        Py_ssize_t n = job->j_bulk->b_count;
+        Py_ssize_t end = n / job->j_threads * (w->w_index + 1);
+        if (w->w_index == job->j_threads - 1) {
+            end = n;
+        }
+
+        for (Py_ssize_t i = n / job->j_threads * w->w_index; i < end; i++) {
+            if (entries[i].e_hash == -1) {
+                entries[i].e_hash = map_hash(entries[i].e_key);
+                if (entries[i].e_hash == -1) {
+                    map_bulk_fail(w, i);
+                    break;
+                }
+            }
         }
+    }
+    else {
+        /* Subtrees can be of any size, so they are taken one at a
+           time by the threads that are done with the previous one. */
+        MapBulk bulk = *job->j_bulk;
+        bulk.b_dups = 0;
+
+        for (;;) {
+            PyThread_acquire_lock(job->j_lock, WAIT_LOCK);
+            uint32_t b = job->j_next_slot++;
+            PyThread_release_lock(job->j_lock);
+
+            if (b >= HAMT_ARRAY_NODE_SIZE) {
+                break;
+            }
+            if (!(job->j_bitmap & ((uint32_t)1 << b))) {
+                continue;
+            }
+
+            Py_ssize_t start = job->j_offsets[b];
+            if (map_bulk_node(&bulk, entries + start, job->j_tmp + start,
+                              job->j_offsets[b + 1] - start, 5,
+                              &job->j_slots[b]))
+            {
+                map_bulk_fail(w, b);
+                break;
+            }
+        }
+
+        w->w_dups += bulk.b_dups;
+    }
+
+    w->w_done = 1;
+}
+
+static int
+map_bulk_stop(MapBulkJob *job)
+{
+    /* Returns 1 if the calling thread is the last one running. */
+
+    PyThread_acquire_lock(job->j_lock, WAIT_LOCK);
+    int last = --job->j_running == 0;
+    PyThread_release_lock(job->j_lock);
+    return last;
+}
+
+static void
+map_bulk_thread(void *arg)
+{
+    MapBulkWorker *w = (MapBulkWorker *)arg;
+    MapBulkJob *job = w->w_job;
+
+    PyThreadState *tstate = PyThreadState_New(job->j_interp);
+    if (tstate != NULL) {
+        PyEval_RestoreThread(tstate);
+        map_bulk_work(w);
+        PyThreadState_Clear(tstate);
+        PyThreadState_DeleteCurrent();
+    }
+
+    /* "job" can be gone as soon as "j_done" is released. */
+    if (map_bulk_stop(job)) {
+        PyThread_release_lock(job->j_done);
+    }
+}
+
+static int
+map_bulk_run(MapBulkJob *job, int phase)
+{
+    /* Run a phase of the job on all its threads.  On errors, the one
+       of the first entry or root slot is raised. */
+
+    MapBulkWorker *error = NULL;
+    int i;
+
+    job->j_phase = phase;
+    job->j_next_slot = 0;
+    job->j_running = 1;
+    for (i = 0; i < job->j_threads; i++) {
+        job->j_workers[i].w_done = 0;
+    }
+
+    for (i = 1; i < job->j_threads; i++) {
+        PyThread_acquire_lock(job->j_lock, WAIT_LOCK);
+        job->j_running++;
+        PyThread_release_lock(job->j_lock);
+
+        if (PyThread_start_new_thread(map_bulk_thread, &job->j_workers[i])
+                == PYTHREAD_INVALID_THREAD_ID)
+        {
+            map_bulk_stop(job);
+        }
+    }
+
+    map_bulk_work(&job->j_workers[0]);
+
+    if (!map_bulk_stop(job)) {
+        /* Other threads can't stop the world while this one waits. */
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(job->j_done, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+
+    for (i = 0; i < job->j_threads; i++) {
+        MapBulkWorker *w = &job->j_workers[i];
+        if (!w->w_done) {
+            map_bulk_work(w);
+        }
+        if (w->w_exc_type == NULL) {
+            continue;
+        }
+        if (error == NULL || w->w_error_pos < error->w_error_pos) {
+            error = w;
+        }
+    }
+
+    if (error == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < job->j_threads; i++) {
+        MapBulkWorker *w = &job->j_workers[i];
+        if (w == error) {
+            PyErr_Restore(w->w_exc_type, w->w_exc_val, w->w_exc_tb);
+        }
+        else {
+            Py_XDECREF(w->w_exc_type);
+            Py_XDECREF(w->w_exc_val);
+            Py_XDECREF(w->w_exc_tb);
+        }
+        w->w_exc_type = w->w_exc_val = w->w_exc_tb = NULL;
+    }
+    return -1;
+}
+
+static int
+map_bulk_root(MapBulk *bulk, MapEntry *tmp, MapMergeSlot *out)
+{
+    /* Build the whole tree, like map_bulk_node() at shift 0 does,
+       on several threads if there are enough pairs. */
+
+    MapEntry *entries = bulk->b_entries;
+    Py_ssize_t n = bulk->b_count;
+    int threads = map_bulk_threads(n);
+    int ret = -1;
+    Py_ssize_t i;
+
+    if (threads == 1) {
+        if (bulk->b_hash_later) {
+            for (i = 0; i < n; i++) {
+                if (entries[i].e_hash == -1) {
+                    entries[i].e_hash = map_hash(entries[i].e_key);
+                    if (entries[i].e_hash == -1) {
+                        return -1;
+                    }
+                }
+            }
+        }
+        return map_bulk_node(bulk, entries, tmp, n, 0, out);
+    }
+
+    MapBulkJob job;
+    job.j_bulk = bulk;
+    job.j_tmp = tmp;
+    job.j_interp = PyInterpreterState_Get();
+    job.j_threads = threads;
+    job.j_bitmap = 0;
+    for (i = 0; i < threads; i++) {
+        MapBulkWorker *w = &job.j_workers[i];
+        w->w_job = &job;
+        w->w_index = (int)i;
+        w->w_dups = 0;
+        w->w_exc_type = w->w_exc_val = w->w_exc_tb = NULL;
+    }
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        job.j_slots[i].s_key = NULL;
+        job.j_slots[i].s_val = NULL;
+        job.j_slots[i].s_node = NULL;
+        job.j_slots[i].s_owned = 0;
+    }
+
+    job.j_lock = PyThread_allocate_lock();
+    job.j_done = PyThread_allocate_lock();
+    if (job.j_lock == NULL || job.j_done == NULL) {
+        if (job.j_lock != NULL) {
+            PyThread_free_lock(job.j_lock);
+        }
+        if (job.j_done != NULL) {
+            PyThread_free_lock(job.j_done);
+        }
+        PyErr_NoMemory();
+        return -1;
+    }
+    /* Held by this thread, except while it waits for the others. */
+    PyThread_acquire_lock(job.j_done, WAIT_LOCK);
+
+    if (bulk->b_hash_later && map_bulk_run(&job, 0)) {
+        goto done;
+    }
+
+    job.j_bitmap = map_bulk_partition(entries, tmp, n, 0, job.j_offsets);
+    if (map_bitcount(job.j_bitmap) < 2) {
+        /* All the pairs are in the same subtree. */
+        ret = map_bulk_node(bulk, entries, tmp, n, 0, out);
+        goto done;
+    }
+
+    if (map_bulk_run(&job, 1)) {
+        goto done;
+    }
+
+    MapNode *node = map_merge_new_node(
+        bulk->b_state, bulk->b_mutid, job.j_slots, job.j_bitmap, 0);
+    if (node == NULL) {
+        goto done;
+    }
+
+    for (i = 0; i < threads; i++) {
+        bulk->b_dups += job.j_workers[i].w_dups;
+    }
+    out->s_key = NULL;
+    out->s_val = NULL;
+    out->s_node = node;
+    out->s_owned = 1;
+    ret = 0;
+
+done:
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        map_merge_slot_clear(&job.j_slots[i]);
+    }
+    PyThread_free_lock(job.j_lock);
+    PyThread_release_lock(job.j_done);
+    PyThread_free_lock(job.j_done);
+    return ret;
+}
+
+#endif  /* MAP_BULK_PARALLEL */
+
+static int
+map_bulk_build(MapBulk *bulk, MapNode **root, Py_ssize_t *count)
+{
+    /* Build a tree out of the pairs added to "bulk" and clear it. */
+
+    MapEntry *tmp = NULL;
+    MapMergeSlot out;
+    int ret = -1;
+
+    bulk->b_dups = 0;
+
+    if (bulk->b_count == 0) {
+        *root = map_node_bitmap_new(bulk->b_state, 0, 0, bulk->b_mutid);
+        if (*root == NULL) {
+            goto done;
+        }
+        *count = 0;
+        ret = 0;
+        goto done;
+    }
+
+    tmp = (MapEntry *)PyMem_Malloc(
+        (size_t)bulk->b_count * sizeof(MapEntry));
+    if (tmp == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+#ifdef MAP_BULK_PARALLEL
+    if (map_bulk_root(bulk, tmp, &out)) {
+        goto done;
+    }
+#else
+    if (map_bulk_node(bulk, bulk->b_entries, tmp, bulk->b_count, 0, &out)) {
+        goto done;
+    }
+#endif
+
+    if (out.s_node == NULL) {
+        *root = map_node_bitmap_new_pair(
+            bulk->b_state, 0, out.s_hash, out.s_key, out.s_val,
+            bulk->b_mutid);
+        if (*root == NULL) {
+            goto done;
+        }
+    }
+    else {
+        assert(out.s_owned);
+        *root = out.s_node;
+    }
+
+    *count = bulk->b_count - bulk->b_dups;
+    ret = 0;
+
+done:
+    PyMem_Free(tmp);
+    map_bulk_clear(bulk);
+    return ret;
+}
+
+static int
+map_node_update_from_bulk(uint64_t mutid, MapBulk *bulk,
+                          MapNode *root, Py_ssize_t count,
+                          MapNode **new_root, Py_ssize_t *new_count)
+{
+    /* Build a tree out of the pairs added to "bulk" and merge it
+       into "root".  Clears "bulk". */
+
+    MapNode *other_root;
+    Py_ssize_t other_count;
+
+    if (count != 0) {
+        /* The new tree is only there to be merged into "root". */
+        bulk->b_mutid = 0;
+    }
+
+    if (map_bulk_build(bulk, &other_root, &other_count)) {
+        return -1;
+    }
+
+    if (count == 0) {
+        *new_root = other_root;
+        *new_count = other_count;
+        return 0;
+    }
+
+    int ret = map_merge_trees(mutid, NULL, root, count,
+                              other_root, other_count,
+                              new_root, new_count);
+    Py_DECREF(other_root);
+    return ret;
+}
+
+static MapObject *
+map_fromkeys(MapState *st, PyObject *keys, PyObject *val)
+{
+    MapBulk bulk;
+    MapNode *root;
+    Py_ssize_t count;
+
+    map_bulk_init(&bulk, st, map_new_mutid(st));
+
+    if (map_bulk_add_keys(&bulk, keys, val)) {
+        map_bulk_clear(&bulk);
+        return NULL;
+    }
+
+    if (map_bulk_build(&bulk, &root, &count)) {
+        return NULL;
+    }
+
+    return map_new_from_root(st, root, count);
+}
+
+
+/////////////////////////////////// Pickling
+
+
+/* Maps are pickled as a buffer describing the shape of the tree and
+   a tuple of keys and values.  The buffer holds a header:
+
+       version        1 byte  (MAP_PICKLE_VERSION)
+       hash size      1 byte  (sizeof(Py_hash_t))
+       flags          1 byte  (MAP_PICKLE_SHAPE, MAP_PICKLE_NONE)
+       fingerprint    8 bytes (hash of MAP_PICKLE_PROBE)
+       count          8 bytes
+
+   followed, if the MAP_PICKLE_SHAPE flag is set, by the nodes of the
+   tree in depth-first order, slots in ascending order:
+
+       'B' datamap nodemap hash*    Bitmap node and its key hashes
+       'A' bitmap                   Array node and its occupied slots
+       'C' hash count               Collision node
+
+   (bitmaps are 4 bytes, hashes and counts 8, all little-endian).
+   Keys and values are in the tuple in the same order, interleaved.
+
+   Hashes of str and bytes objects differ from process to process
+   unless PYTHONHASHSEED is set, and hashes of most other objects can
+   be anything, so the shape is only recorded if all keys are of
+   types whose hashes depend on nothing but the hash seed, and is
+   only used if the fingerprint of the hash seed matches.  Then the
+   tree is rebuilt as it was, without hashing or comparing the keys;
+   otherwise it is rebuilt from the keys and values.
+
+   NaNs hash by identity since Python 3.10, and None by address up
+   to 3.11, so keys holding a NaN are never portable, and keys holding
+   None only are since 3.12.  Their shape carries MAP_PICKLE_NONE,
+   which makes older versions rebuild the tree instead. */
+
+#define MAP_PICKLE_VERSION  1
+#define MAP_PICKLE_SHAPE    0x1
+#define MAP_PICKLE_NONE     0x2
+#define MAP_PICKLE_PROBE    "immutables.Map"
+#define MAP_PICKLE_HEADER   19
+
+
+typedef struct {
+    unsigned char *w_buf;
+    Py_ssize_t w_len;
+    Py_ssize_t w_allocated;
+    PyObject *w_kv;
+    Py_ssize_t w_kv_len;
+    int w_portable;
+    /* Set once a key that is or holds None is written. */
+    int w_none;
+} MapPickleWriter;
+
+typedef struct {
+    const unsigned char *r_buf;
+    Py_ssize_t r_pos;
+    Py_ssize_t r_len;
+    PyObject *r_kv;
+    Py_ssize_t r_kv_pos;
+    MapState *r_state;
+} MapPickleReader;
+
+
+static int
+map_pickle_fingerprint(uint64_t *fingerprint)
+{
+    PyObject *probe = PyUnicode_FromString(MAP_PICKLE_PROBE);
+    if (probe == NULL) {
+        return -1;
+    }
+
+    Py_hash_t hash = PyObject_Hash(probe);
+    Py_DECREF(probe);
+    if (hash == -1) {
+        return -1;
+    }
+
+    *fingerprint = (uint64_t)(Py_uhash_t)hash;
+    return 0;
+}
+
+static int
+map_pickle_is_portable(MapPickleWriter *w, PyObject *key)
+{
+    /* Return 1 if the hash of "key" only depends on the hash seed. */
+
+    PyTypeObject *type = Py_TYPE(key);
+
+    if (type == &PyUnicode_Type || type == &PyBytes_Type ||
+            type == &PyLong_Type || type == &PyBool_Type)
+    {
+        return 1;
+    }
+
+    if (type == &PyFloat_Type) {
+        return !isnan(PyFloat_AS_DOUBLE(key));
+    }
+
+    if (key == Py_None) {
+#if PY_VERSION_HEX >= 0x030C0000
+        w->w_none = 1;
+        return 1;
+#else
+        return 0;
+#endif
+    }
+
+    if (type == &PyTuple_Type) {
+        for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(key); i++) {
+            if (!map_pickle_is_portable(w, PyTuple_GET_ITEM(key, i))) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+map_pickle_put(MapPickleWriter *w, uint64_t v, Py_ssize_t size)
+{
+    if (w->w_len + size > w->w_allocated) {
+        Py_ssize_t allocated = w->w_allocated * 2 + size;
+        unsigned char *buf = (unsigned char *)PyMem_Realloc(
+            w->w_buf, (size_t)allocated);
+        if (buf == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        w->w_buf = buf;
+        w->w_allocated = allocated;
+    }
+
+    for (Py_ssize_t i = 0; i < size; i++) {
+        w->w_buf[w->w_len++] = (unsigned char)(v >> (8 * i));
+    }
+    return 0;
+}
+
+static int
+map_pickle_put_pair(MapPickleWriter *w, PyObject *key, PyObject *val)
+{
+    assert(w->w_kv_len + 2 <= PyTuple_GET_SIZE(w->w_kv));
+
+    if (w->w_portable && !map_pickle_is_portable(w, key)) {
+        w->w_portable = 0;
+    }
+
+    Py_INCREF(key);
+    PyTuple_SET_ITEM(w->w_kv, w->w_kv_len++, key);
+    Py_INCREF(val);
+    PyTuple_SET_ITEM(w->w_kv, w->w_kv_len++, val);
+    return 0;
+}
+
+static int
+map_pickle_node(MapPickleWriter *w, MapNode *node)
+{
+    if (IS_BITMAP_NODE(node)) {
+        MapNode_Bitmap *b = (MapNode_Bitmap *)node;
+        Py_ssize_t data_count = map_node_bitmap_data_count(b);
+        Py_ssize_t node_count = map_node_bitmap_node_count(b);
+
+        if (map_pickle_put(w, 'B', 1) ||
+                map_pickle_put(w, b->b_datamap, 4) ||
+                map_pickle_put(w, b->b_nodemap, 4))
+        {
+            return -1;
+        }
+
+        for (Py_ssize_t i = 0; i < data_count; i++) {
+            if (map_pickle_put(
+                    w, (uint64_t)(Py_uhash_t)BITMAP_HASHES(b)[i], 8) ||
+                map_pickle_put_pair(w, b->b_array[2 * i],
+                                    b->b_array[2 * i + 1]))
+            {
+                return -1;
+            }
+        }
+
+        for (Py_ssize_t i = 0; i < node_count; i++) {
+            if (map_pickle_node(w, BITMAP_NODE(b, i))) {
+                return -1;
+            }
+        }
+    }
+    else if (IS_ARRAY_NODE(node)) {
+        MapNode_Array *a = (MapNode_Array *)node;
+        uint32_t bitmap = 0;
+        Py_ssize_t i;
+
+        for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+            if (a->a_array[i] != NULL) {
+                bitmap |= (uint32_t)1 << i;
+            }
+        }
+
+        if (map_pickle_put(w, 'A', 1) || map_pickle_put(w, bitmap, 4)) {
+            return -1;
+        }
+
+        for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+            if (a->a_array[i] != NULL &&
+                    map_pickle_node(w, a->a_array[i]))
+            {
+                return -1;
+            }
+        }
+    }
+    else {
+        MapNode_Collision *c = (MapNode_Collision *)node;
+        Py_ssize_t count = map_node_collision_count(c);
+
+        assert(IS_COLLISION_NODE(node));
+
+        if (map_pickle_put(w, 'C', 1) ||
+                map_pickle_put(w, (uint64_t)(Py_uhash_t)c->c_hash, 8) ||
+                map_pickle_put(w, (uint64_t)count, 8))
+        {
+            return -1;
+        }
+
+        for (Py_ssize_t i = 0; i < count; i++) {
+            if (map_pickle_put_pair(w, c->c_array[2 * i],
+                                    c->c_array[2 * i + 1]))
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int
+map_pickle(MapObject *o, PyObject **shape, PyObject **kv)
+{
+    /* Set *shape to a new bytes object with the shape of the tree
+       of "o", and *kv to a new tuple with its keys and values. */
+
+    MapPickleWriter w;
+    MapNode *root;
+    uint64_t fingerprint;
+    int ret = -1;
+
+    if (map_pickle_fingerprint(&fingerprint)) {
+        return -1;
+    }
+
+    if (IS_SMALL_MAP(o)) {
+        root = map_small_to_root(o, 0);
+        if (root == NULL) {
+            return -1;
+        }
+    }
+    else {
+        Py_INCREF(o->h_root);
+        root = o->h_root;
+    }
+
+    /* Roughly the size of the shape of a tree of str keys. */
+    w.w_allocated = MAP_PICKLE_HEADER + o->h_count * 12;
+    w.w_buf = (unsigned char *)PyMem_Malloc((size_t)w.w_allocated);
+    if (w.w_buf == NULL) {
+        Py_DECREF(root);
+        PyErr_NoMemory();
+        return -1;
+    }
+    w.w_len = 0;
+    w.w_kv_len = 0;
+    w.w_portable = 1;
+    w.w_none = 0;
+    w.w_kv = PyTuple_New(o->h_count * 2);
+    if (w.w_kv == NULL) {
+        goto done;
+    }
+
+    if (map_pickle_put(&w, MAP_PICKLE_VERSION, 1) ||
+            map_pickle_put(&w, sizeof(Py_hash_t), 1) ||
+            map_pickle_put(&w, 0, 1) ||
+            map_pickle_put(&w, fingerprint, 8) ||
+            map_pickle_put(&w, (uint64_t)o->h_count, 8))
+    {
+        goto done;
+    }
+
+    if (o->h_count > 0 && map_pickle_node(&w, root)) {
+        goto done;
+    }
+    assert(w.w_kv_len == o->h_count * 2);
+
+    if (w.w_portable && o->h_count > 0) {
+        w.w_buf[2] = MAP_PICKLE_SHAPE | (w.w_none ? MAP_PICKLE_NONE : 0);
+    }
+    else {
+        /* The shape is of no use. */
+        w.w_len = MAP_PICKLE_HEADER;
+    }
+
+    *shape = PyBytes_FromStringAndSize((char *)w.w_buf, w.w_len);
+    if (*shape == NULL) {
+        goto done;
+    }
+
+    *kv = w.w_kv;
+    w.w_kv = NULL;
+    ret = 0;
+
+done:
+    PyMem_Free(w.w_buf);
+    Py_XDECREF(w.w_kv);
+    Py_DECREF(root);
+    return ret;
+}
+
+static int
+map_unpickle_error(void)
+{
+    PyErr_SetString(PyExc_ValueError, "invalid pickled Map data");
+    return -1;
+}
+
+static int
+map_unpickle_get(MapPickleReader *r, Py_ssize_t size, uint64_t *v)
+{
+    if (r->r_len - r->r_pos < size) {
+        return map_unpickle_error();
+    }
+
+    *v = 0;
+    for (Py_ssize_t i = 0; i < size; i++) {
+        *v |= (uint64_t)r->r_buf[r->r_pos++] << (8 * i);
+    }
+    return 0;
+}
+
+static int
+map_unpickle_check_hash(Py_hash_t hash, uint32_t shift, uint64_t prefix)
+{
+    /* Check that "hash" belongs where the tree puts it: its lowest
+       "shift" bits have to be "prefix". */
+
+    uint64_t mask;
+
+    if (shift >= 64) {
+        mask = ~(uint64_t)0;
+    }
+    else {
+        mask = ((uint64_t)1 << shift) - 1;
+    }
+
+    if (((uint64_t)(Py_uhash_t)hash & mask) != prefix) {
+        return map_unpickle_error();
+    }
+    return 0;
+}
+
+static int
+map_unpickle_check_bitmap(uint32_t bitmap, uint32_t shift)
+{
+    /* Check that the level at "shift" has the slots of "bitmap": the
+       deepest one has fewer than 32. */
+
+    uint32_t bits = HAMT_HASH_BITS - shift;
+
+    if (bits < 5 && (bitmap >> ((uint32_t)1 << bits)) != 0) {
+        return map_unpickle_error();
+    }
+    return 0;
+}
+
+static int
+map_unpickle_pair(MapPickleReader *r, PyObject **key, PyObject **val)
+{
+    if (PyTuple_GET_SIZE(r->r_kv) - r->r_kv_pos < 2) {
+        return map_unpickle_error();
+    }
+
+    *key = PyTuple_GET_ITEM(r->r_kv, r->r_kv_pos++);
+    *val = PyTuple_GET_ITEM(r->r_kv, r->r_kv_pos++);
+    return 0;
+}
+
+static MapNode *
+map_unpickle_node(MapPickleReader *r, uint32_t shift, uint64_t prefix,
+                  Py_ssize_t *count)
+{
+    /* Rebuild the node at "shift" whose keys' hashes start with
+       "prefix".  Only trees of the shape Map builds are accepted:
+       nodes are Array nodes if and only if they have more than 16
+       slots, and Collision nodes are only found below all the
+       levels of the tree. */
+
+    uint64_t tag;
+    uint64_t v;
+    Py_ssize_t i;
+
+    *count = 0;
+
+    if (map_unpickle_get(r, 1, &tag)) {
+        return NULL;
+    }
+
+    if (tag == 'C') {
+        uint64_t hash;
+        uint64_t size;
+
+        if (shift < HAMT_HASH_BITS ||
+                map_unpickle_get(r, 8, &hash) ||
+                map_unpickle_get(r, 8, &size) ||
+                map_unpickle_check_hash(
+                    (Py_hash_t)(Py_uhash_t)hash, shift, prefix))
+        {
+            if (!PyErr_Occurred()) {
+                map_unpickle_error();
+            }
+            return NULL;
+        }
+
+        if (size < 2 ||
+                size > (uint64_t)(PyTuple_GET_SIZE(r->r_kv) / 2))
+        {
+            map_unpickle_error();
+            return NULL;
+        }
+
+        MapNode_Collision *c = (MapNode_Collision *)map_node_collision_new(
+            r->r_state, (Py_hash_t)(Py_uhash_t)hash, (Py_ssize_t)size * 2, 0);
+        if (c == NULL) {
+            return NULL;
+        }
+
+        for (i = 0; i < (Py_ssize_t)size; i++) {
+            PyObject *key;
+            PyObject *val;
+
+            if (map_unpickle_pair(r, &key, &val)) {
+                Py_DECREF(c);
+                return NULL;
+            }
+
+            Py_INCREF(key);
+            c->c_array[2 * i] = key;
+            Py_INCREF(val);
+            c->c_array[2 * i + 1] = val;
+            map_gc_track_if(c, key);
+            map_gc_track_if(c, val);
+        }
+
+        *count = (Py_ssize_t)size;
+        return (MapNode *)c;
+    }
+
+    if (shift >= HAMT_HASH_BITS) {
+        map_unpickle_error();
+        return NULL;
+    }
+
+    if (tag == 'A') {
+        if (map_unpickle_get(r, 4, &v)) {
+            return NULL;
+        }
+
+        uint32_t bitmap = (uint32_t)v;
+        if (map_bitcount(bitmap) <= 16 ||
+                map_unpickle_check_bitmap(bitmap, shift))
+        {
+            if (!PyErr_Occurred()) {
+                map_unpickle_error();
+            }
+            return NULL;
+        }
+
+        MapNode_Array *a = (MapNode_Array *)map_node_array_new(
+            r->r_state, map_bitcount(bitmap), 0);
+        if (a == NULL) {
+            return NULL;
+        }
+
+        for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+            Py_ssize_t child_count;
+
+            if (!(bitmap & ((uint32_t)1 << i))) {
+                continue;
+            }
+
+            MapNode *child = map_unpickle_node(
+                r, shift + 5, prefix | ((uint64_t)i << shift),
+                &child_count);
+            if (child == NULL) {
+                Py_DECREF(a);
+                return NULL;
+            }
+
+            a->a_array[i] = child;
+            map_gc_track_if(a, (PyObject *)child);
+
+            /* Children of Array nodes hold one key at least, in a
+               Bitmap node of its own if it's the only one. */
+            if (child_count == 1 &&
+                    !map_node_bitmap_is_single_pair(child))
+            {
+                Py_DECREF(a);
+                map_unpickle_error();
+                return NULL;
+            }
+
+            *count += child_count;
+        }
+
+        return (MapNode *)a;
+    }
+
+    if (tag != 'B') {
+        map_unpickle_error();
+        return NULL;
+    }
+
+    uint64_t datamap;
+    uint64_t nodemap;
+
+    if (map_unpickle_get(r, 4, &datamap) ||
+            map_unpickle_get(r, 4, &nodemap))
+    {
+        return NULL;
+    }
+
+    if ((datamap & nodemap) ||
+            map_bitcount((uint32_t)(datamap | nodemap)) > 16 ||
+            map_unpickle_check_bitmap((uint32_t)(datamap | nodemap), shift))
+    {
+        if (!PyErr_Occurred()) {
+            map_unpickle_error();
+        }
+        return NULL;
+    }
+
+    MapNode_Bitmap *b = (MapNode_Bitmap *)map_node_bitmap_new(
+        r->r_state,
+        map_bitcount((uint32_t)datamap), map_bitcount((uint32_t)nodemap), 0);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    /* The bitmaps are set last: until then, the node can be freed
+       whatever slots are set. */
+    Py_ssize_t data_idx = 0;
+    Py_ssize_t node_idx = 0;
+
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        uint32_t bit = (uint32_t)1 << i;
+        uint64_t child_prefix = prefix | ((uint64_t)i << shift);
+
+        if (datamap & bit) {
+            PyObject *key;
+            PyObject *val;
+
+            if (map_unpickle_get(r, 8, &v) ||
+                    map_unpickle_check_hash(
+                        (Py_hash_t)(Py_uhash_t)v, shift + 5, child_prefix) ||
+                    map_unpickle_pair(r, &key, &val))
+            {
+                Py_DECREF(b);
+                return NULL;
+            }
+
+            map_node_bitmap_set_pair(
+                b, data_idx++, (Py_hash_t)(Py_uhash_t)v, key, val);
+            *count += 1;
+        }
+    }
+
+    /* Sub-nodes come after the key hashes, in ascending order of
+       their slots; they are stored in the node in reverse order. */
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        Py_ssize_t child_count;
+
+        if (!(nodemap & ((uint32_t)1 << i))) {
+            continue;
+        }
+
+        MapNode *child = map_unpickle_node(
+            r, shift + 5, prefix | ((uint64_t)i << shift), &child_count);
+        if (child == NULL) {
+            Py_DECREF(b);
+            return NULL;
+        }
+
+        b->b_array[BITMAP_NODE_IDX(b, node_idx++)] = (PyObject *)child;
+        map_gc_track_if(b, (PyObject *)child);
+
+        /* A key that has a slot of its own is inlined. */
+        if (child_count < 2) {
+            Py_DECREF(b);
+            map_unpickle_error();
+            return NULL;
+        }
+
+        *count += child_count;
+    }
+
+    b->b_datamap = (uint32_t)datamap;
+    b->b_nodemap = (uint32_t)nodemap;
+    return (MapNode *)b;
+}
+
+static MapObject *
+map_unpickle(MapState *st, PyObject *shape, PyObject *kv)
+{
+    /* Rebuild a Map pickled by map_pickle(). */
+
+    MapPickleReader r;
+    Py_buffer view;
+    MapObject *res = NULL;
+    uint64_t version, hash_size, flags, fingerprint, count;
+
+    if (!PyTuple_Check(kv)) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "expected a tuple of keys and values, got %.200s",
+            Py_TYPE(kv)->tp_name);
+        return NULL;
+    }
+
+    if (PyObject_GetBuffer(shape, &view, PyBUF_SIMPLE)) {
+        return NULL;
+    }
+
+    r.r_buf = (const unsigned char *)view.buf;
+    r.r_pos = 0;
+    r.r_len = view.len;
+    r.r_kv = kv;
+    r.r_kv_pos = 0;
+    r.r_state = st;
+
+    if (map_unpickle_get(&r, 1, &version) ||
+            map_unpickle_get(&r, 1, &hash_size) ||
+            map_unpickle_get(&r, 1, &flags) ||
+            map_unpickle_get(&r, 8, &fingerprint) ||
+            map_unpickle_get(&r, 8, &count))
+    {
+        goto done;
+    }
+
+    if (version != MAP_PICKLE_VERSION ||
+            count != (uint64_t)(PyTuple_GET_SIZE(kv) / 2) ||
+            PyTuple_GET_SIZE(kv) % 2)
+    {
+        map_unpickle_error();
+        goto done;
+    }
+
+    uint64_t our_fingerprint;
+    if (map_pickle_fingerprint(&our_fingerprint)) {
+        goto done;
+    }
+
+#if PY_VERSION_HEX < 0x030C0000
+    if (flags & MAP_PICKLE_NONE) {
+        /* Pickled by 3.12+: the hashes of None keys are of no use. */
+        flags &= ~(uint64_t)MAP_PICKLE_SHAPE;
+    }
+#endif
+
+    if ((flags & MAP_PICKLE_SHAPE) && hash_size == sizeof(Py_hash_t) &&
+            fingerprint == our_fingerprint && count > 0)
+    {
+        Py_ssize_t root_count;
+        MapNode *root = map_unpickle_node(&r, 0, 0, &root_count);
+        if (root == NULL) {
+            goto done;
+        }
+
+        if (r.r_pos != r.r_len || root_count != (Py_ssize_t)count) {
+            Py_DECREF(root);
+            map_unpickle_error();
+            goto done;
+        }
+
+        res = map_new_from_root(st, root, root_count);
+        goto done;
+    }
+
+    /* The shape can't be trusted: hash the keys again. */
+    MapBulk bulk;
+    MapNode *root;
+    Py_ssize_t root_count;
+
+    map_bulk_init(&bulk, st, map_new_mutid(st));
+    if (map_bulk_reserve(&bulk, (Py_ssize_t)count)) {
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < (Py_ssize_t)count; i++) {
+        if (map_bulk_add(&bulk, PyTuple_GET_ITEM(kv, 2 * i),
+                         PyTuple_GET_ITEM(kv, 2 * i + 1)))
+        {
+            map_bulk_clear(&bulk);
+            goto done;
+        }
+    }
+
+    if (map_bulk_build(&bulk, &root, &root_count) == 0) {
+        res = map_new_from_root(st, root, root_count);
+    }
+
+done:
+    PyBuffer_Release(&view);
+    return res;
+}
+
+
+/////////////////////////////////// Archives
+
+
+/* Archives hold many versions of a Map, and every node the versions
+   share is stored once.  An archive is a pickle of a buffer with the
+   shape of all versions and a tuple of keys and values.  The buffer
+   holds:
+
+       version        1 byte  (MAP_ARCHIVE_VERSION)
+       maps           8 bytes
+
+   followed, for every Map, by the number of its items (8 bytes) and,
+   unless it's empty, its root node.  Nodes are numbered in the order
+   they are written, and are stored as:
+
+       'N' pairs children       a node with "pairs" keys of its own
+                                and "children" sub-nodes, which follow
+       'R' index                a node that was already written
+
+   ("pairs" and "children" are 4 bytes, "index" 8, little-endian).
+   Keys and values of all pairs are in the tuple in the same order,
+   interleaved.
+
+   Unlike pickles of single Maps, archives don't keep hashes: see
+   "Pickling" for why they can't be relied on.  The first Map is built
+   from its items, and every next one is the previous one with the
+   items of the nodes they don't share removed and added back.  Maps
+   built this way share nodes again, and it takes time and memory in
+   proportion to the number of distinct nodes. */
+
+#define MAP_ARCHIVE_VERSION     1
+#define MAP_ARCHIVE_MAX_DEPTH   32
+
+
+typedef struct {
+    MapPickleWriter a_w;
+    PyObject *a_kv;
+    /* Indexes of the nodes written so far, by address. */
+    PyObject *a_memo;
+    /* Keeps temporary nodes alive, so that addresses stay unique. */
+    PyObject *a_keep;
+    Py_ssize_t a_nodes;
+} MapArchiveWriter;
+
+typedef struct {
+    Py_ssize_t n_kv;
+    Py_ssize_t n_child;
+    uint32_t n_pairs;
+    uint32_t n_children;
+    /* The length of the longest path down, -1 until it's read. */
+    int n_height;
+    /* Set if the node is in the last Map built. */
+    int n_member;
+    /* The last walk that visited the node, and the last walk of a
+       new Map that found it in the previous one. */
+    Py_ssize_t n_seen;
+    Py_ssize_t n_shared;
+} MapArchiveNode;
+
+typedef struct {
+    MapPickleReader a_r;
+    MapArchiveNode *a_nodes;
+    Py_ssize_t a_nodes_len;
+    Py_ssize_t a_nodes_allocated;
+    Py_ssize_t *a_children;
+    Py_ssize_t a_children_len;
+    Py_ssize_t a_children_allocated;
+    /* Nodes found by the walks of the Map being built. */
+    Py_ssize_t *a_changed;
+    Py_ssize_t a_changed_len;
+    Py_ssize_t a_changed_allocated;
+} MapArchiveReader;
+
+
+static int
+map_archive_grow(void **array, Py_ssize_t *allocated, Py_ssize_t len,
+                 size_t item_size)
+{
+    /* Make room for one more item in a growable array. */
+
+    if (len < *allocated) {
+        return 0;
+    }
+
+    Py_ssize_t size = *allocated < 16 ? 16 : *allocated * 2;
+    if ((size_t)size > PY_SSIZE_T_MAX / item_size) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    void *new_array = PyMem_Realloc(*array, (size_t)size * item_size);
+    if (new_array == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    *array = new_array;
+    *allocated = size;
+    return 0;
+}
+
+static int
+map_archive_put_pair(MapArchiveWriter *a, PyObject *key, PyObject *val)
+{
+    if (PyList_Append(a->a_kv, key) || PyList_Append(a->a_kv, val)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+map_archive_node(MapArchiveWriter *a, MapNode *node)
+{
+    PyObject *addr = PyLong_FromVoidPtr(node);
+    if (addr == NULL) {
+        return -1;
+    }
+
+    PyObject *index = PyDict_GetItemWithError(a->a_memo, addr);
+    if (index != NULL) {
+        Py_DECREF(addr);
+        return map_pickle_put(&a->a_w, 'R', 1) ||
+               map_pickle_put(
+                   &a->a_w, (uint64_t)PyLong_AsSsize_t(index), 8);
+    }
+
+    if (PyErr_Occurred()) {
+        Py_DECREF(addr);
+        return -1;
+    }
+
+    index = PyLong_FromSsize_t(a->a_nodes++);
+    if (index == NULL) {
+        Py_DECREF(addr);
+        return -1;
+    }
+    int err = PyDict_SetItem(a->a_memo, addr, index);
+    Py_DECREF(addr);
+    Py_DECREF(index);
+    if (err) {
+        return -1;
+    }
+
+    Py_ssize_t i;
+
+    if (IS_BITMAP_NODE(node)) {
+        MapNode_Bitmap *b = (MapNode_Bitmap *)node;
+        Py_ssize_t data_count = map_node_bitmap_data_count(b);
+        Py_ssize_t node_count = map_node_bitmap_node_count(b);
+
+        if (map_pickle_put(&a->a_w, 'N', 1) ||
+                map_pickle_put(&a->a_w, (uint64_t)data_count, 4) ||
+                map_pickle_put(&a->a_w, (uint64_t)node_count, 4))
+        {
+            return -1;
+        }
+
+        for (i = 0; i < data_count; i++) {
+            if (map_archive_put_pair(a, b->b_array[2 * i],
+                                     b->b_array[2 * i + 1]))
+            {
+                return -1;
+            }
+        }
+
+        for (i = 0; i < node_count; i++) {
+            if (map_archive_node(a, BITMAP_NODE(b, i))) {
+                return -1;
+            }
+        }
+    }
+    else if (IS_ARRAY_NODE(node)) {
+        MapNode_Array *arr = (MapNode_Array *)node;
+
+        if (map_pickle_put(&a->a_w, 'N', 1) ||
+                map_pickle_put(&a->a_w, 0, 4) ||
+                map_pickle_put(&a->a_w, (uint64_t)arr->a_count, 4))
+        {
+            return -1;
+        }
+
+        for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+            if (arr->a_array[i] != NULL &&
+                    map_archive_node(a, arr->a_array[i]))
+            {
+                return -1;
+            }
+        }
+    }
+    else {
+        MapNode_Collision *c = (MapNode_Collision *)node;
+        Py_ssize_t count = map_node_collision_count(c);
+
+        assert(IS_COLLISION_NODE(node));
+
+        if (map_pickle_put(&a->a_w, 'N', 1) ||
+                map_pickle_put(&a->a_w, (uint64_t)count, 4) ||
+                map_pickle_put(&a->a_w, 0, 4))
+        {
+            return -1;
+        }
+
+        for (i = 0; i < count; i++) {
+            if (map_archive_put_pair(a, c->c_array[2 * i],
+                                     c->c_array[2 * i + 1]))
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static PyObject *
+map_archive(PyObject *maps)
+{
+    /* Return an archive of the Maps in the iterable "maps". */
+
+    MapArchiveWriter a;
+    PyObject *seq = NULL;
+    PyObject *shape = NULL;
+    PyObject *kv = NULL;
+    PyObject *res = NULL;
+
+    a.a_w.w_buf = NULL;
+    a.a_w.w_len = 0;
+    a.a_w.w_allocated = 0;
+    a.a_nodes = 0;
+    a.a_kv = PyList_New(0);
+    a.a_memo = PyDict_New();
+    a.a_keep = PyList_New(0);
+    if (a.a_kv == NULL || a.a_memo == NULL || a.a_keep == NULL) {
+        goto done;
+    }
+
+    seq = PySequence_Fast(maps, "archive() argument must be iterable");
+    if (seq == NULL) {
+        goto done;
+    }
+
+    Py_ssize_t len = PySequence_Fast_GET_SIZE(seq);
+    if (map_pickle_put(&a.a_w, MAP_ARCHIVE_VERSION, 1) ||
+            map_pickle_put(&a.a_w, (uint64_t)len, 8))
+    {
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < len; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        MapObject *o = (MapObject *)item;
+        MapNode *root;
+
+        if (!Map_Check(item)) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "archive() expects Maps, not %.200s",
+                Py_TYPE(item)->tp_name);
+            goto done;
+        }
+
+        if (map_pickle_put(&a.a_w, (uint64_t)o->h_count, 8)) {
+            goto done;
+        }
+        if (o->h_count == 0) {
+            continue;
+        }
+
+        if (IS_SMALL_MAP(o)) {
+            root = map_small_to_root(o, 0);
+            if (root == NULL) {
+                goto done;
+            }
+            int err = PyList_Append(a.a_keep, (PyObject *)root);
+            Py_DECREF(root);
+            if (err) {
+                goto done;
+            }
+        }
+        else {
+            root = o->h_root;
+        }
+
+        if (map_archive_node(&a, root)) {
+            goto done;
+        }
+    }
+
+    shape = PyBytes_FromStringAndSize((char *)a.a_w.w_buf, a.a_w.w_len);
+    kv = PyList_AsTuple(a.a_kv);
+    if (shape == NULL || kv == NULL) {
+        goto done;
+    }
+
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    if (pickle == NULL) {
+        goto done;
+    }
+    res = PyObject_CallMethod(pickle, "dumps", "(OO)i", shape, kv, 5);
+    Py_DECREF(pickle);
+
+done:
+    PyMem_Free(a.a_w.w_buf);
+    Py_XDECREF(a.a_kv);
+    Py_XDECREF(a.a_memo);
+    Py_XDECREF(a.a_keep);
+    Py_XDECREF(seq);
+    Py_XDECREF(shape);
+    Py_XDECREF(kv);
+    return res;
+}
+
+static int
+map_unarchive_node(MapArchiveReader *a, int depth, Py_ssize_t *index)
+{
+    /* Read a node and set *index to its number. */
+
+    MapPickleReader *r = &a->a_r;
+    uint64_t tag;
+    uint64_t v;
+
+    if (map_unpickle_get(r, 1, &tag)) {
+        return -1;
+    }
+
+    if (tag == 'R') {
+        if (map_unpickle_get(r, 8, &v)) {
+            return -1;
+        }
+
+        /* Nodes can only refer to nodes that are complete. */
+        if (v >= (uint64_t)a->a_nodes_len ||
+                a->a_nodes[v].n_height < 0 ||
+                depth + a->a_nodes[v].n_height >= MAP_ARCHIVE_MAX_DEPTH)
+        {
+            return map_unpickle_error();
+        }
+
+        *index = (Py_ssize_t)v;
+        return 0;
+    }
+
+    uint64_t pairs;
+    uint64_t children;
+
+    if (tag != 'N' || depth >= MAP_ARCHIVE_MAX_DEPTH ||
+            map_unpickle_get(r, 4, &pairs) ||
+            map_unpickle_get(r, 4, &children))
+    {
+        if (!PyErr_Occurred()) {
+            map_unpickle_error();
+        }
+        return -1;
+    }
+
+    if (pairs > (uint64_t)(PyTuple_GET_SIZE(r->r_kv) - r->r_kv_pos) / 2 ||
+            children > HAMT_ARRAY_NODE_SIZE ||
+            pairs + children == 0)
+    {
+        return map_unpickle_error();
+    }
+
+    if (map_archive_grow((void **)&a->a_nodes, &a->a_nodes_allocated,
+                         a->a_nodes_len, sizeof(MapArchiveNode)))
+    {
+        return -1;
+    }
+
+    Py_ssize_t idx = a->a_nodes_len++;
+    MapArchiveNode *node = &a->a_nodes[idx];
+    node->n_kv = r->r_kv_pos;
+    node->n_pairs = (uint32_t)pairs;
+    node->n_children = (uint32_t)children;
+    node->n_height = -1;
+    node->n_member = 0;
+    node->n_seen = 0;
+    node->n_shared = 0;
+    r->r_kv_pos += (Py_ssize_t)pairs * 2;
+
+    /* Children are read into their slots, reserved in advance. */
+    node->n_child = a->a_children_len;
+    for (uint64_t i = 0; i < children; i++) {
+        if (map_archive_grow((void **)&a->a_children,
+                             &a->a_children_allocated,
+                             a->a_children_len, sizeof(Py_ssize_t)))
+        {
+            return -1;
+        }
+        a->a_children[a->a_children_len++] = -1;
+    }
+
+    int height = 0;
+    Py_ssize_t first = node->n_child;
+
+    for (uint64_t i = 0; i < children; i++) {
+        Py_ssize_t child;
+
+        if (map_unarchive_node(a, depth + 1, &child)) {
+            return -1;
+        }
+
+        a->a_children[first + (Py_ssize_t)i] = child;
+        if (a->a_nodes[child].n_height + 1 > height) {
+            height = a->a_nodes[child].n_height + 1;
+        }
+    }
+
+    a->a_nodes[idx].n_height = height;
+    *index = idx;
+    return 0;
+}
+
+static int
+map_unarchive_walk(MapArchiveReader *a, Py_ssize_t idx, Py_ssize_t walk,
+                   int is_new)
+{
+    /* Find the nodes of a Map that the previous Map doesn't have
+       ("is_new" set) or the nodes of the previous Map that the new
+       one doesn't have.  Shared nodes have shared children, so they
+       aren't walked into. */
+
+    MapArchiveNode *node = &a->a_nodes[idx];
+
+    if (node->n_seen == walk) {
+        return 0;
+    }
+    node->n_seen = walk;
+
+    if (is_new) {
+        if (node->n_member) {
+            node->n_shared = walk;
+            return 0;
+        }
+    }
+    else if (node->n_shared == walk - 1) {
+        return 0;
+    }
+
+    if (map_archive_grow((void **)&a->a_changed, &a->a_changed_allocated,
+                         a->a_changed_len, sizeof(Py_ssize_t)))
+    {
+        return -1;
+    }
+    a->a_changed[a->a_changed_len++] = idx;
+
+    for (uint32_t i = 0; i < node->n_children; i++) {
+        if (map_unarchive_walk(
+                a, a->a_children[node->n_child + (Py_ssize_t)i],
+                walk, is_new))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static MapObject *
+map_unarchive_next(MapArchiveReader *a, MapObject *prev,
+                   Py_ssize_t added, Py_ssize_t removed)
+{
+    /* Build a Map out of "prev": remove the pairs of the nodes of
+       a_changed after the first "added" ones, and add the pairs of
+       those. */
+
+    MapState *st = a->a_r.r_state;
+    PyObject *tuple = a->a_r.r_kv;
+    Py_ssize_t total = added + removed;
+    Py_ssize_t i;
+    uint32_t j;
+
+    if (prev->h_count == 0) {
+        MapBulk bulk;
+        MapNode *root;
+        Py_ssize_t count;
+
+        assert(removed == 0);
+        map_bulk_init(&bulk, st, map_new_mutid(st));
+        for (i = 0; i < added; i++) {
+            MapArchiveNode *node = &a->a_nodes[a->a_changed[i]];
+
+            for (j = 0; j < node->n_pairs; j++) {
+                if (map_bulk_add(
+                        &bulk,
+                        PyTuple_GET_ITEM(tuple, node->n_kv + 2 * j),
+                        PyTuple_GET_ITEM(tuple, node->n_kv + 2 * j + 1)))
+                {
+                    map_bulk_clear(&bulk);
+                    return NULL;
+                }
+            }
+        }
+
+        if (map_bulk_build(&bulk, &root, &count)) {
+            return NULL;
+        }
+        return map_new_from_root(st, root, count);
+    }
+
+    MapMutationObject *mut =
+        (MapMutationObject *)map_py_mutate(prev, NULL);
+    if (mut == NULL) {
+        return NULL;
+    }
+
+    /* Removed pairs go first: keys can move from node to node. */
+    for (i = 0; i < total; i++) {
+        Py_ssize_t k = (i + added) % total;
+        MapArchiveNode *node = &a->a_nodes[a->a_changed[k]];
+
+        for (j = 0; j < node->n_pairs; j++) {
+            PyObject *key = PyTuple_GET_ITEM(tuple, node->n_kv + 2 * j);
+            Py_hash_t hash = map_hash(key);
+            int err;
+
+            if (hash == -1) {
+                goto error;
+            }
+
+            if (k >= added) {
+                err = mapmut_delete(mut, key, hash);
+                if (err && PyErr_ExceptionMatches(PyExc_KeyError)) {
+                    PyErr_Clear();
+                    map_unpickle_error();
+                }
+            }
+            else {
+                err = mapmut_set(
+                    mut, key, hash,
+                    PyTuple_GET_ITEM(tuple, node->n_kv + 2 * j + 1));
+            }
+
+            if (err) {
+                goto error;
+            }
+        }
+    }
+
+    if (mapmut_finish(mut)) {
+        goto error;
+    }
+    Py_INCREF(mut->m_root);
+    MapObject *res = map_new_from_root(st, mut->m_root, mut->m_count);
+    Py_DECREF(mut);
+    return res;
+
+error:
+    Py_DECREF(mut);
+    return NULL;
+}
+
+static PyObject *
+map_unarchive(MapState *st, PyObject *data)
+{
+    /* Return the list of Maps archived by map_archive(). */
+
+    MapArchiveReader a;
+    Py_buffer view;
+    PyObject *state = NULL;
+    PyObject *res = NULL;
+    MapObject *prev = NULL;
+    Py_ssize_t prev_root = -1;
+    uint64_t version;
+    uint64_t len;
+
+    memset(&a, 0, sizeof(a));
+    view.obj = NULL;
+
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    if (pickle == NULL) {
+        return NULL;
+    }
+    state = PyObject_CallMethod(pickle, "loads", "O", data);
+    Py_DECREF(pickle);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    if (!PyTuple_Check(state) || PyTuple_GET_SIZE(state) != 2 ||
+            !PyTuple_Check(PyTuple_GET_ITEM(state, 1)) ||
+            PyTuple_GET_SIZE(PyTuple_GET_ITEM(state, 1)) % 2)
+    {
+        map_unpickle_error();
+        goto done;
+    }
+
+    if (PyObject_GetBuffer(PyTuple_GET_ITEM(state, 0), &view,
+                           PyBUF_SIMPLE))
+    {
+        view.obj = NULL;
+        goto done;
+    }
+
+    a.a_r.r_buf = (const unsigned char *)view.buf;
+    a.a_r.r_len = view.len;
+    a.a_r.r_kv = PyTuple_GET_ITEM(state, 1);
+    a.a_r.r_state = st;
+
+    if (map_unpickle_get(&a.a_r, 1, &version) ||
+            map_unpickle_get(&a.a_r, 8, &len))
+    {
+        goto done;
+    }
+    if (version != MAP_ARCHIVE_VERSION ||
+            len > (uint64_t)(a.a_r.r_len - a.a_r.r_pos) / 8)
+    {
+        map_unpickle_error();
+        goto done;
+    }
+
+    res = PyList_New((Py_ssize_t)len);
+    prev = map_new(st);
+    if (res == NULL || prev == NULL) {
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < (Py_ssize_t)len; i++) {
+        Py_ssize_t root = -1;
+        uint64_t count;
+        MapObject *o;
+
+        if (map_unpickle_get(&a.a_r, 8, &count)) {
+            goto error;
+        }
+        if (count > 0 && map_unarchive_node(&a, 0, &root)) {
+            goto error;
+        }
+
+        a.a_changed_len = 0;
+        if (root >= 0 && map_unarchive_walk(&a, root, 2 * i + 1, 1)) {
+            goto error;
+        }
+        Py_ssize_t added = a.a_changed_len;
+        if (prev_root >= 0 &&
+                map_unarchive_walk(&a, prev_root, 2 * i + 2, 0))
+        {
+            goto error;
+        }
+        Py_ssize_t removed = a.a_changed_len - added;
+
+        if (removed == 0 && added == 0) {
+            Py_INCREF(prev);
+            o = prev;
+        }
+        else {
+            for (Py_ssize_t j = 0; j < added + removed; j++) {
+                a.a_nodes[a.a_changed[j]].n_member = j < added;
+            }
+
+            o = map_unarchive_next(&a, prev, added, removed);
+            if (o == NULL) {
+                goto error;
+            }
+        }
+
+        if (o->h_count != (Py_ssize_t)count) {
+            Py_DECREF(o);
+            map_unpickle_error();
+            goto error;
+        }
+
+        PyList_SET_ITEM(res, i, (PyObject *)o);
+        Py_INCREF(o);
+        Py_SETREF(prev, o);
+        prev_root = root;
+    }
+
+    if (a.a_r.r_pos != a.a_r.r_len ||
+            a.a_r.r_kv_pos != PyTuple_GET_SIZE(a.a_r.r_kv))
+    {
+        map_unpickle_error();
+        goto error;
+    }
+
+    goto done;
+
+error:
+    Py_CLEAR(res);
+
+done:
+    if (view.obj != NULL) {
+        PyBuffer_Release(&view);
+    }
+    PyMem_Free(a.a_nodes);
+    PyMem_Free(a.a_children);
+    PyMem_Free(a.a_changed);
+    Py_XDECREF(prev);
+    Py_XDECREF(state);
+    return res;
+}
+
+
+/////////////////////////////////// Patches
+
+
+/* Patches carry the changes that turn one version of a Map into
+   another, pickled as:
+
+       (version, count, new count, (key, ...), (key, value, ...))
+
+   where "count" is the number of items of the Map the patch applies
+   to, the first tuple has the keys removed from it, and the second
+   one the keys and values of items that were added or changed,
+   interleaved.  The items are found by map_node_diff(), so subtrees
+   the two versions share are skipped; patches are applied as a single
+   mutation of the Map.  Like archives, patches don't keep hashes. */
+
+#define MAP_PATCH_VERSION   1
+
+
+static PyObject *
+map_make_patch(MapObject *v, MapObject *w)
+{
+    /* Return a patch that turns "v" into "w". */
+
+    MapDiffState diff;
+    MapNode *v_root = NULL;
+    MapNode *w_root = NULL;
+    PyObject *removed = NULL;
+    PyObject *kv = NULL;
+    PyObject *res = NULL;
+
+    diff.d_state = map_state(v);
+    diff.d_mutid = map_new_mutid(diff.d_state);
+    for (int i = 0; i < 3; i++) {
+        diff.d_roots[i] = NULL;
+        diff.d_counts[i] = 0;
+    }
+    diff.d_removed = PyList_New(0);
+    diff.d_kv = PyList_New(0);
+    if (diff.d_removed == NULL || diff.d_kv == NULL) {
+        goto done;
+    }
+
+    v_root = map_diff_root(v, diff.d_mutid);
+    if (v_root == NULL) {
+        goto done;
+    }
+    w_root = map_diff_root(w, diff.d_mutid);
+    if (w_root == NULL) {
+        goto done;
+    }
+
+    if (map_node_diff(&diff, v_root, w_root, 0)) {
+        goto done;
+    }
+
+    removed = PyList_AsTuple(diff.d_removed);
+    kv = PyList_AsTuple(diff.d_kv);
+    if (removed == NULL || kv == NULL) {
+        goto done;
+    }
+
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    if (pickle == NULL) {
+        goto done;
+    }
+    res = PyObject_CallMethod(
+        pickle, "dumps", "(innOO)i", MAP_PATCH_VERSION,
+        v->h_count, w->h_count, removed, kv, 5);
+    Py_DECREF(pickle);
+
+done:
+    Py_XDECREF(v_root);
+    Py_XDECREF(w_root);
+    Py_XDECREF(diff.d_removed);
+    Py_XDECREF(diff.d_kv);
+    Py_XDECREF(removed);
+    Py_XDECREF(kv);
+    return res;
+}
+
+static MapObject *
+map_patch_error(void)
+{
+    PyErr_SetString(PyExc_ValueError, "invalid Map patch data");
+    return NULL;
+}
+
+static MapObject *
+map_patch_mismatch(void)
+{
+    PyErr_SetString(PyExc_ValueError, "the patch is not for this Map");
+    return NULL;
+}
+
+static MapObject *
+map_apply_patch(MapObject *o, PyObject *data)
+{
+    /* Return "o" changed by a patch made by map_make_patch(). */
+
+    MapMutationObject *mut = NULL;
+    MapObject *res = NULL;
+    Py_ssize_t header[3];
+    Py_ssize_t i;
+
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    if (pickle == NULL) {
+        return NULL;
+    }
+    PyObject *state = PyObject_CallMethod(pickle, "loads", "O", data);
+    Py_DECREF(pickle);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    if (!PyTuple_Check(state) || PyTuple_GET_SIZE(state) != 5 ||
+            !PyTuple_Check(PyTuple_GET_ITEM(state, 3)) ||
+            !PyTuple_Check(PyTuple_GET_ITEM(state, 4)) ||
+            PyTuple_GET_SIZE(PyTuple_GET_ITEM(state, 4)) % 2)
+    {
+        map_patch_error();
+        goto done;
+    }
+
+    for (i = 0; i < 3; i++) {
+        PyObject *item = PyTuple_GET_ITEM(state, i);
+        header[i] = PyLong_Check(item) ? PyLong_AsSsize_t(item) : -1;
+        if (header[i] < 0) {
+            PyErr_Clear();
+            map_patch_error();
+            goto done;
+        }
+    }
+    if (header[0] != MAP_PATCH_VERSION) {
+        map_patch_error();
+        goto done;
+    }
+    if (header[1] != o->h_count) {
+        map_patch_mismatch();
+        goto done;
+    }
+
+    PyObject *removed = PyTuple_GET_ITEM(state, 3);
+    PyObject *kv = PyTuple_GET_ITEM(state, 4);
+
+    if (PyTuple_GET_SIZE(removed) == 0 && PyTuple_GET_SIZE(kv) == 0) {
+        if (header[2] != o->h_count) {
+            map_patch_error();
+            goto done;
+        }
+        Py_INCREF(o);
+        res = o;
+        goto done;
+    }
+
+    mut = (MapMutationObject *)map_py_mutate(o, NULL);
+    if (mut == NULL) {
+        goto done;
+    }
+
+    for (i = 0; i < PyTuple_GET_SIZE(removed); i++) {
+        PyObject *key = PyTuple_GET_ITEM(removed, i);
+        Py_hash_t hash = map_hash(key);
+        if (hash == -1) {
+            goto done;
+        }
+
+        if (mapmut_delete(mut, key, hash)) {
+            if (PyErr_ExceptionMatches(PyExc_KeyError)) {
+                PyErr_Clear();
+                map_patch_mismatch();
+            }
+            goto done;
+        }
+    }
+
+    for (i = 0; i < PyTuple_GET_SIZE(kv); i += 2) {
+        PyObject *key = PyTuple_GET_ITEM(kv, i);
+        Py_hash_t hash = map_hash(key);
+        if (hash == -1) {
+            goto done;
+        }
+
+        if (mapmut_set(mut, key, hash, PyTuple_GET_ITEM(kv, i + 1))) {
+            goto done;
+        }
+    }
+
+    if (mapmut_finish(mut)) {
+        goto done;
+    }
+    if (mut->m_count != header[2]) {
+        map_patch_mismatch();
+        goto done;
+    }
+
+    Py_INCREF(mut->m_root);
+    res = map_new_from_root(map_state(o), mut->m_root, mut->m_count);
+
+done:
+    Py_XDECREF(mut);
+    Py_DECREF(state);
+    return res;
+}
+
+
+/////////////////////////////////// Deep Copies
+
+
+/* Deep copies of Maps are made node by node: every node of the copy
+   has the bitmaps and the key hashes of the original one, and only
+   keys and values are deep-copied.  Keys are hashed again only if
+   their copies are new objects, which can hash differently; if one
+   of them does, the Map is rebuilt from the copied items instead.
+   Subtrees whose keys and values all copy to themselves are shared
+   with the original Map. */
+
+typedef struct {
+    PyObject *c_deepcopy;
+    PyObject *c_memo;
+    /* Set once a copied key hashes differently from its original. */
+    int c_rehash;
+} MapDeepCopy;
+
+
+static MapNode *
+map_node_deepcopy(MapDeepCopy *c, MapNode *node);
+
+static PyObject *
+map_deepcopy_item(MapDeepCopy *c, PyObject *o)
+{
+    /* Objects of these types are what copy.deepcopy() returns as
+       they are, without looking at the memo. */
+    if (PyUnicode_CheckExact(o) || PyLong_CheckExact(o) ||
+            PyBytes_CheckExact(o) || PyFloat_CheckExact(o) ||
+            PyBool_Check(o) || o == Py_None)
+    {
+        Py_INCREF(o);
+        return o;
+    }
+
+    return PyObject_CallFunctionObjArgs(c->c_deepcopy, o, c->c_memo, NULL);
+}
+
+static int
+map_deepcopy_pair(MapDeepCopy *c, Py_hash_t hash, PyObject *key,
+                  PyObject *val, PyObject **new_key, PyObject **new_val)
+{
+    /* Deep-copy a key/value pair.  Return 1 if either copy is a new
+       object, 0 if both aren't, and -1 on error. */
+
+    *new_key = map_deepcopy_item(c, key);
+    if (*new_key == NULL) {
+        return -1;
+    }
+
+    if (*new_key != key && !c->c_rehash) {
+        Py_hash_t new_hash = map_hash(*new_key);
+        if (new_hash == -1) {
+            Py_CLEAR(*new_key);
+            return -1;
+        }
+        c->c_rehash = new_hash != hash;
+    }
+
+    *new_val = map_deepcopy_item(c, val);
+    if (*new_val == NULL) {
+        Py_CLEAR(*new_key);
+        return -1;
+    }
+
+    return *new_key != key || *new_val != val;
+}
+
+static MapNode_Bitmap *
+map_node_bitmap_deepcopy_start(MapNode_Bitmap *node,
+                               Py_ssize_t data_count, Py_ssize_t node_count)
+{
+    /* Start the copy of "node" once something in it changed: the
+       first "data_count" pairs and "node_count" sub-nodes copied to
+       themselves. */
+
+    MapNode_Bitmap *clone = (MapNode_Bitmap *)map_node_bitmap_new(
+        map_state(node),
+        map_node_bitmap_data_count(node),
+        map_node_bitmap_node_count(node), 0);
+    if (clone == NULL) {
+        return NULL;
+    }
+
+    map_node_bitmap_copy_data(clone, 0, node, 0, data_count);
+    map_node_bitmap_copy_nodes(clone, 0, node, 0, node_count);
+    clone->b_datamap = node->b_datamap;
+    clone->b_nodemap = node->b_nodemap;
+    return clone;
+}
+
+static MapNode *
+map_node_bitmap_deepcopy(MapDeepCopy *c, MapNode_Bitmap *node)
+{
+    Py_ssize_t data_count = map_node_bitmap_data_count(node);
+    Py_ssize_t node_count = map_node_bitmap_node_count(node);
+    Py_hash_t *hashes = BITMAP_HASHES(node);
+    MapNode_Bitmap *clone = NULL;
+    Py_ssize_t i;
+
+    for (i = 0; i < data_count; i++) {
+        PyObject *key;
+        PyObject *val;
+
+        int res = map_deepcopy_pair(
+            c, hashes[i], node->b_array[2 * i], node->b_array[2 * i + 1],
+            &key, &val);
+        if (res < 0) {
+            goto error;
+        }
+
+        if (res && clone == NULL) {
+            clone = map_node_bitmap_deepcopy_start(node, i, 0);
+        }
+        if (clone != NULL) {
+            map_node_bitmap_set_pair(clone, i, hashes[i], key, val);
+        }
+        Py_DECREF(key);
+        Py_DECREF(val);
+        if (res && clone == NULL) {
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < node_count; i++) {
+        MapNode *child = map_node_deepcopy(c, BITMAP_NODE(node, i));
+        if (child == NULL) {
+            goto error;
+        }
+
+        if (child != BITMAP_NODE(node, i) && clone == NULL) {
+            clone = map_node_bitmap_deepcopy_start(node, data_count, i);
+            if (clone == NULL) {
+                Py_DECREF(child);
+                return NULL;
+            }
+        }
+        if (clone == NULL) {
+            Py_DECREF(child);
+            continue;
+        }
+
+        clone->b_array[BITMAP_NODE_IDX(clone, i)] = (PyObject *)child;
+        map_gc_track_if(clone, (PyObject *)child);
+    }
+
+    if (clone == NULL) {
+        Py_INCREF(node);
+        return (MapNode *)node;
+    }
+    return (MapNode *)clone;
+
+error:
+    Py_XDECREF(clone);
+    return NULL;
+}
+
+static MapNode *
+map_node_array_deepcopy(MapDeepCopy *c, MapNode_Array *node)
+{
+    MapNode_Array *clone = NULL;
+    Py_ssize_t i;
+
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        if (node->a_array[i] == NULL) {
+            continue;
+        }
+
+        MapNode *child = map_node_deepcopy(c, node->a_array[i]);
+        if (child == NULL) {
+            Py_XDECREF(clone);
+            return NULL;
+        }
+
+        if (child != node->a_array[i] && clone == NULL) {
+            clone = (MapNode_Array *)map_node_array_new(
+                map_state(node), node->a_count, 0);
+            if (clone == NULL) {
+                Py_DECREF(child);
+                return NULL;
+            }
+            for (Py_ssize_t j = 0; j < i; j++) {
+                if (node->a_array[j] != NULL) {
+                    Py_INCREF(node->a_array[j]);
+                    clone->a_array[j] = node->a_array[j];
+                    map_gc_track_if(clone, (PyObject *)node->a_array[j]);
+                }
+            }
+        }
+        if (clone == NULL) {
+            Py_DECREF(child);
+            continue;
+        }
+
+        clone->a_array[i] = child;
+        map_gc_track_if(clone, (PyObject *)child);
+    }
+
+    if (clone == NULL) {
+        Py_INCREF(node);
+        return (MapNode *)node;
+    }
+    return (MapNode *)clone;
+}
+
+static MapNode *
+map_node_collision_deepcopy(MapDeepCopy *c, MapNode_Collision *node)
+{
+    MapNode_Collision *clone = NULL;
+    Py_ssize_t i;
+
+    for (i = 0; i < Py_SIZE(node); i += 2) {
+        PyObject *key;
+        PyObject *val;
+
+        int res = map_deepcopy_pair(
+            c, node->c_hash, node->c_array[i], node->c_array[i + 1],
+            &key, &val);
+        if (res < 0) {
+            Py_XDECREF(clone);
+            return NULL;
+        }
+
+        if (res && clone == NULL) {
+            clone = (MapNode_Collision *)map_node_collision_new(
+                map_state(node), node->c_hash, Py_SIZE(node), 0);
+            if (clone == NULL) {
+                Py_DECREF(key);
+                Py_DECREF(val);
+                return NULL;
+            }
+            for (Py_ssize_t j = 0; j < i; j++) {
+                Py_INCREF(node->c_array[j]);
+                clone->c_array[j] = node->c_array[j];
+                map_gc_track_if(clone, node->c_array[j]);
+            }
+        }
+        if (clone == NULL) {
+            Py_DECREF(key);
+            Py_DECREF(val);
+            continue;
+        }
+
+        clone->c_array[i] = key;
+        clone->c_array[i + 1] = val;
+        map_gc_track_if(clone, key);
+        map_gc_track_if(clone, val);
+    }
+
+    if (clone == NULL) {
+        Py_INCREF(node);
+        return (MapNode *)node;
+    }
+    return (MapNode *)clone;
+}
+
+static MapNode *
+map_node_deepcopy(MapDeepCopy *c, MapNode *node)
+{
+    /* Return a deep copy of "node", or "node" itself if all of its
+       keys and values copy to themselves. */
+
+    if (IS_BITMAP_NODE(node)) {
+        return map_node_bitmap_deepcopy(c, (MapNode_Bitmap *)node);
+    }
+    else if (IS_ARRAY_NODE(node)) {
+        return map_node_array_deepcopy(c, (MapNode_Array *)node);
+    }
+    else {
+        assert(IS_COLLISION_NODE(node));
+        return map_node_collision_deepcopy(c, (MapNode_Collision *)node);
+    }
+}
+
+static MapObject *
+map_deepcopy_rehash(MapObject *o)
+{
+    /* Rebuild "o", whose keys may be stored with stale hashes. */
+
+    MapIteratorState iter;
+    MapBulk bulk;
+    PyObject *key;
+    PyObject *val;
+    MapNode *root;
+    Py_ssize_t count;
+    MapState *st = map_state(o);
+
+    map_bulk_init(&bulk, st, map_new_mutid(st));
+    map_iterator_init_map(&iter, (BaseMapObject *)o);
+    while (map_iterator_next(&iter, &key, &val) == I_ITEM) {
+        if (map_bulk_add(&bulk, key, val)) {
+            map_bulk_clear(&bulk);
+            return NULL;
+        }
+    }
+
+    if (map_bulk_build(&bulk, &root, &count)) {
+        return NULL;
+    }
+    return map_new_from_root(st, root, count);
+}
+
+static MapObject *
+map_deepcopy(MapObject *o, PyObject *memo)
+{
+    /* Return a deep copy of "o" for copy.deepcopy(). */
+
+    MapDeepCopy c;
+    MapObject *res = NULL;
+    int changed = 0;
+
+    if (o->h_count == 0) {
+        Py_INCREF(o);
+        return o;
+    }
+
+    PyObject *copy = PyImport_ImportModule("copy");
+    if (copy == NULL) {
+        return NULL;
+    }
+    c.c_deepcopy = PyObject_GetAttrString(copy, "deepcopy");
+    Py_DECREF(copy);
+    if (c.c_deepcopy == NULL) {
+        return NULL;
+    }
+    c.c_memo = memo;
+    c.c_rehash = 0;
+
+    if (IS_SMALL_MAP(o)) {
+        res = map_alloc(map_state(o), o->h_count);
+        if (res == NULL) {
+            goto error;
+        }
+
+        for (Py_ssize_t i = 0; i < o->h_count; i++) {
+            MapEntry *entry = &o->h_entries[i];
+            PyObject *key;
+            PyObject *val;
+
+            int r = map_deepcopy_pair(
+                &c, entry->e_hash, entry->e_key, entry->e_val, &key, &val);
+            if (r < 0) {
+                goto error;
+            }
+            changed |= r;
+
+            map_small_set_entry(res, i, entry->e_hash, key, val);
+            Py_DECREF(key);
+            Py_DECREF(val);
+            res->h_count = i + 1;
+        }
+    }
+    else {
+        MapNode *root = map_node_deepcopy(&c, o->h_root);
+        if (root == NULL) {
+            goto error;
+        }
+        changed = root != o->h_root;
+
+        res = map_new_from_root(map_state(o), root, o->h_count);
+        if (res == NULL) {
+            goto error;
+        }
+    }
+
+    if (!changed) {
+        Py_INCREF(o);
+        Py_SETREF(res, o);
+    }
+    else if (c.c_rehash) {
+        Py_SETREF(res, map_deepcopy_rehash(res));
+    }
+
+    /* Like tuples, Maps reachable from their own keys or values
+       are copied once. */
+    if (res != NULL && PyDict_Check(memo)) {
+        PyObject *id = PyLong_FromVoidPtr(o);
+        if (id == NULL) {
+            goto error;
+        }
+        PyObject *memoized = PyDict_GetItemWithError(memo, id);
+        Py_DECREF(id);
+        if (memoized == NULL && PyErr_Occurred()) {
+            goto error;
+        }
+        if (memoized != NULL) {
+            Py_INCREF(memoized);
+            Py_SETREF(res, (MapObject *)memoized);
+        }
+    }
+
+    Py_DECREF(c.c_deepcopy);
+    return res;
+
+error:
+    Py_XDECREF(res);
+    Py_DECREF(c.c_deepcopy);
+    return NULL;
+}
+
+
+/////////////////////////////////// HAMT high-level functions
+
+
+static MapObject *
+map_assoc(MapObject *o, PyObject *key, PyObject *val)
+{
+    Py_hash_t key_hash = map_hash(key);
+    if (key_hash == -1) {
+        return NULL;
+    }
+
+    return map_assoc_hashed(o, key, key_hash, val);
+}
+
+static MapObject *
+map_assoc_hashed(MapObject *o, PyObject *key, Py_hash_t key_hash,
+                 PyObject *val)
+{
+    int added_leaf = 0;
+    MapNode *new_root;
+
+    if (IS_SMALL_MAP(o)) {
+        return map_small_assoc(o, key_hash, key, val);
+    }
+
+    new_root = map_node_assoc(
+        (MapNode *)(o->h_root),
+        0, key_hash, key, val, &added_leaf,
+        0);
+    if (new_root == NULL) {
+        return NULL;
+    }
+
+    if (new_root == o->h_root) {
+        Py_DECREF(new_root);
+        Py_INCREF(o);
+        return o;
+    }
+
+    return map_new_from_root(
+        map_state(o), new_root, added_leaf ? o->h_count + 1 : o->h_count);
+}
+
+static MapObject *
+map_without(MapObject *o, PyObject *key)
+{
+    Py_hash_t key_hash = map_hash(key);
+    if (key_hash == -1) {
+        return NULL;
+    }
+
+    return map_without_hashed(o, key, key_hash);
+}
+
+static MapObject *
+map_without_hashed(MapObject *o, PyObject *key, Py_hash_t key_hash)
+{
+    if (IS_SMALL_MAP(o)) {
+        return map_small_without(o, key_hash, key);
+    }
+
+    MapNode *new_root = NULL;
+
+    map_without_t res = map_node_without(
+        (MapNode *)(o->h_root),
+        0, key_hash, key,
+        &new_root,
+        0);
+
+    switch (res) {
+        case W_ERROR:
+            return NULL;
+        case W_EMPTY:
+            return map_new(map_state(o));
+        case W_NOT_FOUND:
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        case W_NEWNODE:
+            assert(new_root != NULL);
+            assert(o->h_count > 0);
+            return map_new_from_root(
+                map_state(o), new_root, o->h_count - 1);
+        default:
+            abort();
+    }
+}
+
+static int
+map_is_temporary(MapObject *o)
+{
+    /* Whether "o" is a temporary Map that set() and delete() can
+       update in place; see "Temporary Maps".  Small Maps are copied
+       anyway, and subclasses of Map aren't returned by them. */
+
+    return !IS_SMALL_MAP(o) &&
+           Py_TYPE(o) == map_state(o)->MapType &&
+           o->h_weakreflist == NULL &&
+           MAP_IS_UNIQUE_TEMPORARY(o);
+}
+
+static MapObject *
+map_assoc_temporary(MapObject *o, PyObject *key, PyObject *val)
+{
+    /* Like map_assoc(), but updates "o", a temporary Map. */
+
+    Py_hash_t key_hash = map_hash(key);
+    if (key_hash == -1) {
+        return NULL;
+    }
+
+    int added_leaf = 0;
+    MapNode *new_root = map_node_assoc(
+        o->h_root, 0, key_hash, key, val, &added_leaf, MAP_MUTID_UNIQUE);
+    if (new_root == NULL) {
+        return NULL;
+    }
+
+    Py_SETREF(o->h_root, new_root);
+    if (added_leaf) {
+        o->h_count++;
+    }
+    o->h_hash = -1;
+    map_gc_track_if(o, (PyObject *)new_root);
+
+    Py_INCREF(o);
+    return o;
+}
+
+static MapObject *
+map_without_temporary(MapObject *o, PyObject *key)
+{
+    /* Like map_without(), but updates "o", a temporary Map, unless
+       it becomes small. */
+
+    Py_hash_t key_hash = map_hash(key);
+    if (key_hash == -1) {
+        return NULL;
+    }
+
+    MapNode *new_root = NULL;
+    map_without_t res = map_node_without(
+        o->h_root, 0, key_hash, key, &new_root, MAP_MUTID_UNIQUE);
+
+    switch (res) {
+        case W_ERROR:
+            return NULL;
+        case W_EMPTY:
+            return map_new(map_state(o));
+        case W_NOT_FOUND:
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        case W_NEWNODE:
+            assert(new_root != NULL);
+            if (o->h_count - 1 <= MAP_SMALL_MAX_COUNT) {
+                return map_new_from_root(
+                    map_state(o), new_root, o->h_count - 1);
+            }
+            Py_SETREF(o->h_root, new_root);
+            o->h_count--;
+            o->h_hash = -1;
+            map_gc_track_if(o, (PyObject *)new_root);
+            Py_INCREF(o);
+            return o;
+        default:
+            abort();
+    }
+}
+
+static map_find_t
+map_find(BaseMapObject *o, PyObject *key, PyObject **val)
+{
+    if (o->b_count == 0) {
+        return F_NOT_FOUND;
+    }
+
+    Py_hash_t key_hash = map_hash(key);
+    if (key_hash == -1) {
+        return F_ERROR;
+    }
+
+    return map_find_hashed(o, key, key_hash, val);
+}
+
+static map_find_t
+map_find_hashed(BaseMapObject *o, PyObject *key, Py_hash_t key_hash,
+                PyObject **val)
+{
+    if (o->b_count == 0) {
+        return F_NOT_FOUND;
+    }
+
+    if (IS_SMALL_MAP(o)) {
+        return map_small_find((MapObject *)o, key_hash, key, val);
+    }
+
+    return map_node_find(o->b_root, 0, key_hash, key, val);
+}
+
+static int
+map_eq(BaseMapObject *v, BaseMapObject *w)
+{
+    if (v == w) {
+        return 1;
+    }
+
+    if (v->b_count != w->b_count) {
+        return 0;
+    }
+
+    if (!IS_SMALL_MAP(v) && !IS_SMALL_MAP(w)) {
+        return map_node_eq(v->b_root, w->b_root);
+    }
+
+    MapIteratorState iter;
+    map_iter_t iter_res;
+    map_find_t find_res;
+    PyObject *v_key;
+    PyObject *v_val;
+    PyObject *w_val;
+
+    map_iterator_init_map(&iter, v);
+
+    do {
+        iter_res = map_iterator_next(&iter, &v_key, &v_val);
+        if (iter_res == I_ITEM) {
+            find_res = map_find(w, v_key, &w_val);
+            switch (find_res) {
+                case F_ERROR:
+                    return -1;
+
+                case F_NOT_FOUND:
+                    return 0;
+
+                case F_FOUND: {
+                    int cmp = PyObject_RichCompareBool(v_val, w_val, Py_EQ);
+                    if (cmp < 0) {
+                        return -1;
+                    }
+                    if (cmp == 0) {
+                        return 0;
+                    }
+                }
+            }
+        }
+    } while (iter_res != I_END);
+
+    return 1;
+}
+
+static Py_ssize_t
+map_len(BaseMapObject *o)
+{
+    return o->b_count;
+}
+
+static MapObject *
+map_alloc(MapState *st, Py_ssize_t small_count)
+{
+    /* Allocate a small map with room for "small_count" entries.
+       The caller either fills the entries in and sets h_count,
+       or sets h_root to turn the map into a tree.
+
+       The map is not tracked by the GC; see map_gc_track_if(). */
+
+    MapObject *o;
+    assert(small_count >= 0 && small_count <= MAP_SMALL_MAX_COUNT);
+    o = PyObject_GC_NewVar(MapObject, st->MapType, small_count);
+    if (o == NULL) {
+        return NULL;
+    }
+    o->h_weakreflist = NULL;
+    o->h_hash = -1;
+    o->h_count = 0;
+    o->h_root = NULL;
+    for (Py_ssize_t i = 0; i < small_count; i++) {
+        o->h_entries[i].e_key = NULL;
+        o->h_entries[i].e_val = NULL;
+    }
+    return o;
+}
+
+static MapObject *
+map_new(MapState *st)
+{
+    return map_alloc(st, 0);
+}
+
+static MapObject *
+map_copy(MapObject *o)
+{
+    MapObject *new_o = map_alloc(
+        map_state(o), IS_SMALL_MAP(o) ? o->h_count : 0);
+    if (new_o == NULL) {
+        return NULL;
+    }
+
+    if (IS_SMALL_MAP(o)) {
+        map_small_copy_entries(new_o, 0, o, 0, o->h_count);
+    }
+    else {
+        Py_INCREF(o->h_root);
+        new_o->h_root = o->h_root;
+        map_gc_track_if(new_o, (PyObject *)o->h_root);
+    }
+
+    new_o->h_count = o->h_count;
+    new_o->h_hash = MAP_LOAD_HASH(o->h_hash);
+    return new_o;
+}
+
+static PyObject *
+map_dump(MapObject *self)
+{
+    _PyUnicodeWriter writer;
+
+    _PyUnicodeWriter_Init(&writer);
+
+    if (_map_dump_format(&writer, "HAMT(len=%zd):\n", self->h_count)) {
+        goto error;
+    }
+
+    if (IS_SMALL_MAP(self)) {
+        if (map_small_dump(self, &writer)) {
+            goto error;
+        }
+    }
+    else if (map_node_dump(self->h_root, &writer, 0)) {
+        goto error;
+    }
+
+    return _PyUnicodeWriter_Finish(&writer);
+
+error:
+    _PyUnicodeWriter_Dealloc(&writer);
+    return NULL;
+}
+
+
+/////////////////////////////////// Iterators: Shared Iterator Implementation
+
+
+static int
+map_baseiter_tp_clear(MapIterator *it)
+{
+    Py_CLEAR(it->mi_obj);
+    return 0;
+}
+
+static void
+map_baseiter_tp_dealloc(MapIterator *it)
+{
+    PyTypeObject *tp = Py_TYPE(it);
+    PyObject_GC_UnTrack(it);
+    (void)map_baseiter_tp_clear(it);
+    PyObject_GC_Del(it);
+    Py_DECREF(tp);
+}
+
+static int
+map_baseiter_tp_traverse(MapIterator *it, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(it));
+    Py_VISIT(it->mi_obj);
+    return 0;
+}
+
+static PyObject *
+map_baseiter_tp_iternext(MapIterator *it)
+{
+    PyObject *key;
+    PyObject *val;
+    map_iter_t res;
+
+    Py_BEGIN_CRITICAL_SECTION(it);
+    res = map_iterator_next(&it->mi_iter, &key, &val);
+    Py_END_CRITICAL_SECTION();
+
+    switch (res) {
+        case I_END:
+            PyErr_SetNone(PyExc_StopIteration);
+            return NULL;
+
+        case I_ITEM: {
+            return (*(it->mi_yield))(key, val);
+        }
+
+        default: {
+            abort();
+        }
+    }
+}
+
+static int
+map_baseview_tp_clear(MapView *view)
+{
+    Py_CLEAR(view->mv_obj);
+    Py_CLEAR(view->mv_itertype);
+    return 0;
+}
+
+static void
+map_baseview_tp_dealloc(MapView *view)
+{
+    PyTypeObject *tp = Py_TYPE(view);
+    PyObject_GC_UnTrack(view);
+    (void)map_baseview_tp_clear(view);
+    PyObject_GC_Del(view);
+    Py_DECREF(tp);
+}
+
+static int
+map_baseview_tp_traverse(MapView *view, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(view));
+    Py_VISIT(view->mv_obj);
+    Py_VISIT(view->mv_itertype);
+    return 0;
+}
+
+static Py_ssize_t
+map_baseview_tp_len(MapView *view)
+{
+    return view->mv_obj->h_count;
+}
+
+static PyObject *
+map_baseview_newiter(PyTypeObject *type, binaryfunc yield, MapObject *map)
+{
+    MapIterator *iter = PyObject_GC_New(MapIterator, type);
+    if (iter == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(map);
+    iter->mi_obj = map;
+    iter->mi_yield = yield;
+    map_iterator_init_map(&iter->mi_iter, (BaseMapObject *)map);
+
+    PyObject_GC_Track(iter);
+    return (PyObject *)iter;
+}
+
+static PyObject *
+map_baseview_iter(MapView *view)
+{
+    return map_baseview_newiter(
+        view->mv_itertype, view->mv_yield, view->mv_obj);
+}
+
+static PyObject *
+map_baseview_new(PyTypeObject *type, binaryfunc yield,
+                 MapObject *o, PyTypeObject *itertype)
+{
+    MapView *view = PyObject_GC_New(MapView, type);
+    if (view == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(o);
+    view->mv_obj = o;
+    view->mv_yield = yield;
+
+    Py_INCREF(itertype);
+    view->mv_itertype = itertype;
+
+    PyObject_GC_Track(view);
+    return (PyObject *)view;
+}
+
+#define ITERATOR_TYPE_SHARED_SLOTS                              \
+    {Py_tp_dealloc, map_baseiter_tp_dealloc},                   \
+    {Py_tp_getattro, PyObject_GenericGetAttr},                  \
+    {Py_tp_traverse, map_baseiter_tp_traverse},                 \
+    {Py_tp_clear, map_baseiter_tp_clear},                       \
+    {Py_tp_iter, PyObject_SelfIter},                            \
+    {Py_tp_iternext, map_baseiter_tp_iternext},
+
+
+#define VIEW_TYPE_SHARED_SLOTS                                  \
+    {Py_mp_length, map_baseview_tp_len},                        \
+    {Py_tp_dealloc, map_baseview_tp_dealloc},                   \
+    {Py_tp_getattro, PyObject_GenericGetAttr},                  \
+    {Py_tp_traverse, map_baseview_tp_traverse},                 \
+    {Py_tp_clear, map_baseview_tp_clear},                       \
+    {Py_tp_iter, map_baseview_iter},
+
+
+#define ITERATOR_TYPE_SPEC(spec_name, spec_slots)               \
+    {                                                           \
+        .name = spec_name,                                      \
+        .basicsize = sizeof(MapIterator),                       \
+        .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC        \
+            | MAP_TPFLAGS_INTERNAL,                             \
+        .slots = spec_slots,                                    \
+    }
+
+
+#define VIEW_TYPE_SPEC(spec_name, spec_slots)                   \
+    {                                                           \
+        .name = spec_name,                                      \
+        .basicsize = sizeof(MapView),                           \
+        .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC        \
+            | MAP_TPFLAGS_INTERNAL,                             \
+        .slots = spec_slots,                                    \
+    }
+
+
+/////////////////////////////////// _MapItems_Type
+
+
+static PyType_Slot MapItems_slots[] = {
+    VIEW_TYPE_SHARED_SLOTS
+    {0, NULL},
+};
+
+static PyType_Spec MapItems_spec =
+    VIEW_TYPE_SPEC("immutables._map.items", MapItems_slots);
+
+static PyType_Slot MapItemsIter_slots[] = {
+    ITERATOR_TYPE_SHARED_SLOTS
+    {0, NULL},
+};
+
+static PyType_Spec MapItemsIter_spec =
+    ITERATOR_TYPE_SPEC("immutables._map.items_iterator", MapItemsIter_slots);
+
+static PyObject *
+map_iter_yield_items(PyObject *key, PyObject *val)
+{
+    return PyTuple_Pack(2, key, val);
+}
+
+static PyObject *
+map_new_items_view(MapObject *o)
+{
+    MapState *st = map_state(o);
+    return map_baseview_new(
+        st->ItemsType, map_iter_yield_items, o, st->ItemsIterType);
+}
+
+
+/////////////////////////////////// _MapKeys_Type
+
+
+static int
+map_tp_contains(BaseMapObject *self, PyObject *key);
+
+static int
+_map_keys_tp_contains(MapView *self, PyObject *key)
+{
+	return map_tp_contains((BaseMapObject *)self->mv_obj, key);
+}
+
+static PyObject *
+map_new_keys_view(MapObject *o);
+
+static PyObject *
+map_keys_and(PyObject *a, PyObject *b);
+
+/* Keys views are told apart from other views by their "&", since
+   each module instance has its own types. */
+#define MapKeys_Check(o) \
+    (Py_TYPE(o)->tp_as_number != NULL && \
+     Py_TYPE(o)->tp_as_number->nb_and == map_keys_and)
+
+static PyObject *
+map_keys_setop(PyObject *a, PyObject *b, int op)
+{
+    /* Set operations on keys views of two Maps return keys views of
+       Maps built by walking both trees; "op" is a map_setop_t, or -1
+       for a union. */
+
+    if (!MapKeys_Check(a) || !MapKeys_Check(b)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    MapObject *v = ((MapView *)a)->mv_obj;
+    MapObject *w = ((MapView *)b)->mv_obj;
+    MapObject *res;
+
+    if (op < 0) {
+        res = map_merge(v, w, NULL);
+    }
+    else {
+        res = map_setop(v, w, (map_setop_t)op);
+    }
+    if (res == NULL) {
+        return NULL;
+    }
+
+    PyObject *view = map_new_keys_view(res);
+    Py_DECREF(res);
+    return view;
+}
+
+static PyObject *
+map_keys_and(PyObject *a, PyObject *b)
+{
+    return map_keys_setop(a, b, S_INTERSECTION);
+}
+
+static PyObject *
+map_keys_or(PyObject *a, PyObject *b)
+{
+    return map_keys_setop(a, b, -1);
+}
+
+static PyObject *
+map_keys_sub(PyObject *a, PyObject *b)
+{
+    return map_keys_setop(a, b, S_DIFFERENCE);
+}
+
+static PyObject *
+map_keys_xor(PyObject *a, PyObject *b)
+{
+    return map_keys_setop(a, b, S_SYMMETRIC_DIFFERENCE);
+}
+
+static PyType_Slot MapKeys_slots[] = {
+    {Py_sq_contains, _map_keys_tp_contains},
+    {Py_nb_and, map_keys_and},
+    {Py_nb_or, map_keys_or},
+    {Py_nb_subtract, map_keys_sub},
+    {Py_nb_xor, map_keys_xor},
+    VIEW_TYPE_SHARED_SLOTS
+    {0, NULL},
+};
+
+static PyType_Spec MapKeys_spec =
+    VIEW_TYPE_SPEC("immutables._map.keys", MapKeys_slots);
+
+static PyType_Slot MapKeysIter_slots[] = {
+    ITERATOR_TYPE_SHARED_SLOTS
+    {0, NULL},
+};
+
+static PyType_Spec MapKeysIter_spec =
+    ITERATOR_TYPE_SPEC("immutables._map.keys_iterator", MapKeysIter_slots);
+
+static PyObject *
+map_iter_yield_keys(PyObject *key, PyObject *val)
+{
+    Py_INCREF(key);
+    return key;
+}
+
+static PyObject *
+map_new_keys_iter(MapObject *o)
+{
+    return map_baseview_newiter(
+        map_state(o)->KeysIterType, map_iter_yield_keys, o);
+}
+
+static PyObject *
+map_new_keys_view(MapObject *o)
+{
+    MapState *st = map_state(o);
+    return map_baseview_new(
+        st->KeysType, map_iter_yield_keys, o, st->KeysIterType);
+}
+
+/////////////////////////////////// _MapValues_Type
+
+
+static PyType_Slot MapValues_slots[] = {
+    VIEW_TYPE_SHARED_SLOTS
+    {0, NULL},
+};
+
+static PyType_Spec MapValues_spec =
+    VIEW_TYPE_SPEC("immutables._map.values", MapValues_slots);
+
+static PyType_Slot MapValuesIter_slots[] = {
+    ITERATOR_TYPE_SHARED_SLOTS
+    {0, NULL},
+};
+
+static PyType_Spec MapValuesIter_spec =
+    ITERATOR_TYPE_SPEC(
+        "immutables._map.values_iterator", MapValuesIter_slots);
+
+static PyObject *
+map_iter_yield_values(PyObject *key, PyObject *val)
+{
+    Py_INCREF(val);
+    return val;
+}
+
+static PyObject *
+map_new_values_view(MapObject *o)
+{
+    MapState *st = map_state(o);
+    return map_baseview_new(
+        st->ValuesType, map_iter_yield_values, o, st->ValuesIterType);
+}
+
+
+/////////////////////////////////// _Map_Type
+
+
+static PyObject *
+map_dump(MapObject *self);
+
+
+static int
+map_check_nargs(const char *name, Py_ssize_t nargs,
+                Py_ssize_t min, Py_ssize_t max)
+{
+    /* Check the number of positional arguments of a METH_FASTCALL
+       function the way PyArg_UnpackTuple() does. */
+
+    if (nargs < min) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "%.200s expected %s%zd argument%s, got %zd",
+            name, min == max ? "" : "at least ", min,
+            min == 1 ? "" : "s", nargs);
+        return -1;
+    }
+    if (nargs > max) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "%.200s expected %s%zd argument%s, got %zd",
+            name, min == max ? "" : "at most ", max,
+            max == 1 ? "" : "s", nargs);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+map_kwargs(PyObject *const *args, PyObject *kwnames, PyObject **kwds)
+{
+    /* Collect the keyword arguments of a vectorcall, whose values
+       follow the positional ones in "args", into a new dict.  Set
+       "*kwds" to NULL if there are none. */
+
+    *kwds = NULL;
+    if (kwnames == NULL || PyTuple_GET_SIZE(kwnames) == 0) {
+        return 0;
+    }
+
+    *kwds = PyDict_New();
+    if (*kwds == NULL) {
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(kwnames); i++) {
+        if (PyDict_SetItem(*kwds, PyTuple_GET_ITEM(kwnames, i), args[i])) {
+            Py_CLEAR(*kwds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static PyObject *
+map_build(MapState *st, PyObject *arg, PyObject *kwds)
+{
+    /* Build a Map out of the arguments of Map(); "arg" and "kwds"
+       can be NULL. */
+
+    MapObject *o;
+    uint64_t mutid = 0;
+
+    if (arg == NULL) {
+        o = map_new(st);
+    }
+    else if (Map_Check(arg)) {
+        o = map_copy((MapObject *)arg);
+    }
+    else if (MapMutation_Check(arg)) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "cannot create Maps from MapMutations");
+        return NULL;
+    }
+    else {
+        MapObject *empty = map_new(st);
+        if (empty == NULL) {
+            return NULL;
+        }
+        mutid = map_new_mutid(st);
+        o = map_update(mutid, empty, arg);
+        Py_DECREF(empty);
+    }
+
+    if (o == NULL) {
+        return NULL;
+    }
+
+    if (kwds != NULL) {
+        if (!PyArg_ValidateKeywordArguments(kwds)) {
+            Py_DECREF(o);
+            return NULL;
+        }
+
+        if (!mutid) {
+            mutid = map_new_mutid(st);
+        }
+
+        Py_SETREF(o, map_update(mutid, o, kwds));
+    }
+
+    return (PyObject *)o;
+}
+
+static PyObject *
+map_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    /* Maps are built here rather than in tp_init: small maps store
+       their items inline, so their size has to be known before they
+       are allocated. */
+
+    PyObject *arg = NULL;
+
+    if (!PyArg_UnpackTuple(args, "immutables.Map", 0, 1, &arg)) {
+        return NULL;
+    }
+
+    return map_build(PyType_GetModuleState(type), arg, kwds);
+}
+
+static PyObject *
+map_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+               PyObject *kwnames)
+{
+    /* Map() without an argument tuple, nor a dict of keyword
+       arguments unless there are some. */
+
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    PyObject *kwds;
+
+    if (map_check_nargs("immutables.Map", nargs, 0, 1) ||
+            map_kwargs(args + nargs, kwnames, &kwds))
+    {
+        return NULL;
+    }
+
+    PyObject *res = map_build(
+        PyType_GetModuleState((PyTypeObject *)type),
+        nargs ? args[0] : NULL, kwds);
+    Py_XDECREF(kwds);
+    return res;
+}
+
+
+static int
+map_tp_clear(MapObject *self)
+{
+    if (IS_SMALL_MAP(self)) {
+        for (Py_ssize_t i = 0; i < self->h_count; i++) {
+            Py_CLEAR(self->h_entries[i].e_key);
+            Py_CLEAR(self->h_entries[i].e_val);
+        }
+    }
+    Py_CLEAR(self->h_root);
+    self->h_count = 0;
+    return 0;
+}
+
+
+static int
+map_tp_traverse(MapObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    if (IS_SMALL_MAP(self)) {
+        for (Py_ssize_t i = 0; i < self->h_count; i++) {
+            Py_VISIT(self->h_entries[i].e_key);
+            Py_VISIT(self->h_entries[i].e_val);
+        }
+    }
+    Py_VISIT(self->h_root);
+    return 0;
+}
+
+static void
+map_tp_dealloc(MapObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+    PyObject_GC_UnTrack(self);
+    if (self->h_weakreflist != NULL) {
+        PyObject_ClearWeakRefs((PyObject*)self);
+    }
+    (void)map_tp_clear(self);
+    tp->tp_free(self);
+    Py_DECREF(tp);
+}
+
+
+static PyObject *
+map_tp_richcompare(PyObject *v, PyObject *w, int op)
+{
+    if (!Map_Check(v) || !Map_Check(w) || (op != Py_EQ && op != Py_NE)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    int res = map_eq((BaseMapObject *)v, (BaseMapObject *)w);
+    if (res < 0) {
+        return NULL;
+    }
+
+    if (op == Py_NE) {
+        res = !res;
+    }
+
+    if (res) {
+        Py_RETURN_TRUE;
+    }
+    else {
+        Py_RETURN_FALSE;
+    }
+}
+
+static int
+map_tp_contains(BaseMapObject *self, PyObject *key)
+{
+    PyObject *val;
+    map_find_t res = map_find(self, key, &val);
+    switch (res) {
+        case F_ERROR:
+            return -1;
+        case F_NOT_FOUND:
+            return 0;
+        case F_FOUND:
+            return 1;
+        default:
+            abort();
+    }
+}
+
+static PyObject *
+map_tp_subscript(BaseMapObject *self, PyObject *key)
+{
+    PyObject *val;
+    map_find_t res = map_find(self, key, &val);
+    switch (res) {
+        case F_ERROR:
+            return NULL;
+        case F_FOUND:
+            Py_INCREF(val);
+            return val;
+        case F_NOT_FOUND:
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        default:
+            abort();
+    }
+}
+
+static Py_ssize_t
+map_tp_len(BaseMapObject *self)
+{
+    return map_len(self);
+}
+
+static PyObject *
+map_tp_iter(MapObject *self)
+{
+    return map_new_keys_iter(self);
+}
+
+static PyObject *
+map_py_set(MapObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (map_check_nargs("set", nargs, 2, 2)) {
+        return NULL;
+    }
+
+    if (map_is_temporary(self)) {
+        return (PyObject *)map_assoc_temporary(self, args[0], args[1]);
+    }
+    return (PyObject *)map_assoc(self, args[0], args[1]);
+}
+
+static PyObject *
+map_py_get(BaseMapObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (map_check_nargs("get", nargs, 1, 2)) {
+        return NULL;
+    }
+
+    PyObject *key = args[0];
+    PyObject *def = nargs > 1 ? args[1] : NULL;
+    PyObject *val = NULL;
+    map_find_t res = map_find(self, key, &val);
+    switch (res) {
+        case F_ERROR:
+            return NULL;
+        case F_FOUND:
+            Py_INCREF(val);
+            return val;
+        case F_NOT_FOUND:
+            if (def == NULL) {
+                Py_RETURN_NONE;
+            }
+            Py_INCREF(def);
+            return def;
+        default:
+            abort();
+    }
+}
+
+static PyObject *
+map_py_delete(MapObject *self, PyObject *key)
+{
+    if (map_is_temporary(self)) {
+        return (PyObject *)map_without_temporary(self, key);
+    }
+    return (PyObject *)map_without(self, key);
+}
+
+static int
+map_check_arg(const char *method, PyObject *other)
+{
+    if (!Map_Check(other)) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "Map.%s() argument must be a Map, not %.200s",
+            method, Py_TYPE(other)->tp_name);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+map_py_fromkeys(PyObject *type, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (map_check_nargs("fromkeys", nargs, 1, 2)) {
+        return NULL;
+    }
+
+    return (PyObject *)map_fromkeys(
+        PyType_GetModuleState((PyTypeObject *)type),
+        args[0], nargs > 1 ? args[1] : Py_None);
+}
+
+static PyObject *
+map_py_diff(MapObject *self, PyObject *other)
+{
+    if (map_check_arg("diff", other)) {
+        return NULL;
+    }
+
+    return map_diff(self, (MapObject *)other);
+}
+
+static PyObject *
+map_py_make_patch(MapObject *self, PyObject *other)
+{
+    if (map_check_arg("make_patch", other)) {
+        return NULL;
+    }
+
+    return map_make_patch(self, (MapObject *)other);
+}
+
+static PyObject *
+map_py_apply_patch(MapObject *self, PyObject *data)
+{
+    return (PyObject *)map_apply_patch(self, data);
+}
+
+static PyObject *
+map_py_intersection(MapObject *self, PyObject *other)
+{
+    if (map_check_arg("intersection", other)) {
+        return NULL;
+    }
+
+    return (PyObject *)map_setop(self, (MapObject *)other, S_INTERSECTION);
+}
+
+static PyObject *
+map_py_difference(MapObject *self, PyObject *other)
+{
+    if (map_check_arg("difference", other)) {
+        return NULL;
+    }
+
+    return (PyObject *)map_setop(self, (MapObject *)other, S_DIFFERENCE);
+}
+
+static PyObject *
+map_py_symmetric_difference(MapObject *self, PyObject *other)
+{
+    if (map_check_arg("symmetric_difference", other)) {
+        return NULL;
+    }
+
+    return (PyObject *)map_setop(
+        self, (MapObject *)other, S_SYMMETRIC_DIFFERENCE);
+}
+
+static PyObject *
+map_py_restrict(MapObject *self, PyObject *keys)
+{
+    /* Keys of Maps and of their keys views can be matched with the
+       keys of "self" tree against tree. */
+
+    if (Map_Check(keys)) {
+        return (PyObject *)map_setop(
+            self, (MapObject *)keys, S_INTERSECTION);
+    }
+
+    if (MapKeys_Check(keys)) {
+        return (PyObject *)map_setop(
+            self, ((MapView *)keys)->mv_obj, S_INTERSECTION);
+    }
+
+    return (PyObject *)map_restrict(self, keys);
+}
+
+static PyObject *
+map_py_mutate(MapObject *self, PyObject *args)
+{
+
+    MapMutationObject *o;
+    MapNode *root;
+    uint64_t mutid = map_new_mutid(map_state(self)) | MAP_MUTID_SPARE;
+
+    if (IS_SMALL_MAP(self)) {
+        root = map_small_to_root(self, mutid);
+        if (root == NULL) {
+            return NULL;
+        }
+    }
+    else {
+        Py_INCREF(self->h_root);
+        root = self->h_root;
+    }
+
+    o = PyObject_GC_New(MapMutationObject, map_state(self)->MapMutationType);
+    if (o == NULL) {
+        Py_DECREF(root);
+        return NULL;
+    }
+    Py_SET_SIZE(o, 0);
+    o->m_weakreflist = NULL;
+    o->m_count = self->h_count;
+    o->m_root = root;
+    o->m_mutid = mutid;
+
+    PyObject_GC_Track(o);
+    return (PyObject *)o;
+}
+
+static PyObject *
+map_update_with(MapObject *self, PyObject *arg, PyObject *kwds)
+{
+    /* Map.update(); "arg" and "kwds" can be NULL. */
+
+    MapObject *new = NULL;
+    uint64_t mutid = 0;
+
+    if (arg != NULL) {
+        mutid = map_new_mutid(map_state(self));
+        new = map_update(mutid, self, arg);
+        if (new == NULL) {
+            return NULL;
+        }
+    }
+    else {
+        Py_INCREF(self);
+        new = self;
+    }
+
+    if (kwds != NULL) {
+        if (!PyArg_ValidateKeywordArguments(kwds)) {
+            Py_DECREF(new);
+            return NULL;
+        }
+
+        if (!mutid) {
+            mutid = map_new_mutid(map_state(self));
+        }
+
+        MapObject *new2 = map_update(mutid, new, kwds);
+        Py_DECREF(new);
+        if (new2 == NULL) {
+            return NULL;
+        }
+        new = new2;
+    }
+
+    return (PyObject *)new;
+}
+
+static PyObject *
+map_py_update(MapObject *self, PyObject *const *args, Py_ssize_t nargs,
+              PyObject *kwnames)
+{
+    PyObject *kwds;
+
+    if (map_check_nargs("update", nargs, 0, 1) ||
+            map_kwargs(args + nargs, kwnames, &kwds))
+    {
+        return NULL;
+    }
+
+    PyObject *res = map_update_with(self, nargs ? args[0] : NULL, kwds);
+    Py_XDECREF(kwds);
+    return res;
+}
+
+static PyObject *
+map_py_merge(MapObject *self, PyObject *const *args, Py_ssize_t nargs,
+             PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"other", "resolve"};
+    PyObject *params[2] = {NULL, Py_None};
+
+    if (map_check_nargs("merge", nargs, 0, 2)) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        params[i] = args[i];
+    }
+
+    Py_ssize_t kwcount = kwnames == NULL ? 0 : PyTuple_GET_SIZE(kwnames);
+    for (Py_ssize_t i = 0; i < kwcount; i++) {
+        PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+        Py_ssize_t j = 0;
+        while (j < 2 &&
+               PyUnicode_CompareWithASCIIString(name, kwlist[j]) != 0)
+        {
+            j++;
+        }
+
+        if (j == 2) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "merge() got an unexpected keyword argument '%U'", name);
+            return NULL;
+        }
+        if (j < nargs) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "merge() got multiple values for argument '%s'",
+                kwlist[j]);
+            return NULL;
+        }
+        params[j] = args[nargs + i];
+    }
+
+    PyObject *other = params[0];
+    PyObject *resolve = params[1];
+    if (other == NULL) {
+        PyErr_SetString(
+            PyExc_TypeError,
+            "merge() missing required argument 'other' (pos 1)");
+        return NULL;
+    }
+
+    if (map_check_arg("merge", other)) {
+        return NULL;
+    }
+
+    if (resolve == Py_None) {
+        resolve = NULL;
+    }
+    else if (!PyCallable_Check(resolve)) {
+        PyErr_Format(
+            PyExc_TypeError,
+            "Map.merge() resolve must be callable, not %.200s",
+            Py_TYPE(resolve)->tp_name);
+        return NULL;
+    }
+
+    return (PyObject *)map_merge(self, (MapObject *)other, resolve);
+}
+
+static PyObject *
+map_py_or(PyObject *self, PyObject *other)
+{
+    if (!Map_Check(self) || !Map_Check(other)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    return (PyObject *)map_merge((MapObject *)self, (MapObject *)other, NULL);
+}
+
+static PyObject *
+map_py_items(MapObject *self, PyObject *args)
+{
+    return map_new_items_view(self);
+}
+
+static PyObject *
+map_py_values(MapObject *self, PyObject *args)
+{
+    return map_new_values_view(self);
+}
+
+static PyObject *
+map_py_keys(MapObject *self, PyObject *args)
+{
+    return map_new_keys_view(self);
+}
+
+static PyObject *
+map_py_dump(MapObject *self, PyObject *args)
+{
+    return map_dump(self);
+}
+
+
+static PyObject *
+map_py_repr(BaseMapObject *m)
+{
+    Py_ssize_t i;
+    _PyUnicodeWriter writer;
+
+
+    i = Py_ReprEnter((PyObject *)m);
+    if (i != 0) {
+        return i > 0 ? PyUnicode_FromString("{...}") : NULL;
+    }
+
+    _PyUnicodeWriter_Init(&writer);
+
+    if (MapMutation_Check(m)) {
+        if (_PyUnicodeWriter_WriteASCIIString(
+                &writer, "immutables.MapMutation({", 24) < 0)
+        {
+            goto error;
+        }
+    }
+    else {
+        if (_PyUnicodeWriter_WriteASCIIString(
+                &writer, "immutables.Map({", 16) < 0)
+        {
+            goto error;
+        }
+    }
+
+    MapIteratorState iter;
+    map_iter_t iter_res;
+    map_iterator_init_map(&iter, m);
+    int second = 0;
+    do {
+        PyObject *v_key;
+        PyObject *v_val;
+
+        iter_res = map_iterator_next(&iter, &v_key, &v_val);
+        if (iter_res == I_ITEM) {
+            if (second) {
+                if (_PyUnicodeWriter_WriteASCIIString(&writer, ", ", 2) < 0) {
+                    goto error;
+                }
+            }
+
+            PyObject *s = PyObject_Repr(v_key);
+            if (s == NULL) {
+                goto error;
+            }
+            if (_PyUnicodeWriter_WriteStr(&writer, s) < 0) {
+                Py_DECREF(s);
+                goto error;
+            }
+            Py_DECREF(s);
+
+            if (_PyUnicodeWriter_WriteASCIIString(&writer, ": ", 2) < 0) {
+                goto error;
+            }
+
+            s = PyObject_Repr(v_val);
+            if (s == NULL) {
+                goto error;
+            }
+            if (_PyUnicodeWriter_WriteStr(&writer, s) < 0) {
+                Py_DECREF(s);
+                goto error;
+            }
+            Py_DECREF(s);
+        }
+
+        second = 1;
+    } while (iter_res != I_END);
+
+    if (_PyUnicodeWriter_WriteASCIIString(&writer, "})", 2) < 0) {
+        goto error;
+    }
+
+    Py_ReprLeave((PyObject *)m);
+    return _PyUnicodeWriter_Finish(&writer);
+
+error:
+    _PyUnicodeWriter_Dealloc(&writer);
+    Py_ReprLeave((PyObject *)m);
+    return NULL;
+}
+
+
+static Py_hash_t
+map_py_hash(MapObject *self)
+{
+    /* Adapted version of frozenset.__hash__: it's important
+       that Map.__hash__ is independant of key/values order.
+
+       Tree nodes memoize hashes of their subtrees, so hashing
+       a map derived from an already hashed one is cheap.
+    */
+
+    Py_hash_t cached = MAP_LOAD_HASH(self->h_hash);
+    if (cached != -1) {
+        return cached;
+    }
+
+    Py_uhash_t hash = 0;
+
+    if (IS_SMALL_MAP(self)) {
+        for (Py_ssize_t i = 0; i < self->h_count; i++) {
+            MapEntry *entry = &self->h_entries[i];
+            if (map_hash_item(entry->e_key, entry->e_val, &hash)) {
+                return -1;
+            }
+        }
+    }
+    else if (map_node_hash(self->h_root, &hash)) {
+        return -1;
+    }
+
+    hash ^= ((Py_uhash_t)self->h_count * 2 + 1) * 1927868237UL;
+
+    hash ^= (hash >> 11) ^ (hash >> 25);
+    hash = hash * 69069U + 907133923UL;
+
+    cached = (Py_hash_t)hash;
+    if (cached == -1) {
+        cached = 1;
+    }
+    MAP_STORE_HASH(self->h_hash, cached);
+    return cached;
+}
+
+static PyObject *
+map_reduce_with(MapObject *self, int protocol)
+{
+    /* Pickle "self" as _unpickle(shape, keys_and_values); with
+       protocol 5 the shape can be passed out-of-band. */
+
+    PyObject *shape;
+    PyObject *kv;
+
+    if (map_pickle(self, &shape, &kv)) {
+        return NULL;
+    }
+
+    if (protocol >= 5) {
+        Py_SETREF(shape, PyPickleBuffer_FromObject(shape));
+        if (shape == NULL) {
+            Py_DECREF(kv);
+            return NULL;
+        }
+    }
+
+    PyObject *args = PyTuple_Pack(2, shape, kv);
+    Py_DECREF(shape);
+    Py_DECREF(kv);
+    if (args == NULL) {
+        return NULL;
+    }
+
+    PyObject *tup = PyTuple_Pack(2, map_state(self)->unpickle_func, args);
+    Py_DECREF(args);
+    return tup;
+}
+
+static PyObject *
+map_py_copy(MapObject *self, PyObject *Py_UNUSED(ignored))
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+map_py_deepcopy(MapObject *self, PyObject *memo)
+{
+    return (PyObject *)map_deepcopy(self, memo);
+}
+
+static PyObject *
+map_reduce(MapObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return map_reduce_with(self, 2);
+}
+
+static PyObject *
+map_reduce_ex(MapObject *self, PyObject *protocol)
+{
+    long proto = PyLong_AsLong(protocol);
+    if (proto == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+
+    return map_reduce_with(self, proto >= 5 ? 5 : 2);
+}
+
+static PyMethodDef Map_methods[] = {
+    {"set", (PyCFunction)map_py_set, METH_FASTCALL, NULL},
+    {"get", (PyCFunction)map_py_get, METH_FASTCALL, NULL},
+    {"delete", (PyCFunction)map_py_delete, METH_O, NULL},
+    {"mutate", (PyCFunction)map_py_mutate, METH_NOARGS, NULL},
+    {"fromkeys", (PyCFunction)map_py_fromkeys, METH_FASTCALL|METH_CLASS,
+     NULL},
+    {"diff", (PyCFunction)map_py_diff, METH_O, NULL},
+    {"make_patch", (PyCFunction)map_py_make_patch, METH_O, NULL},
+    {"apply_patch", (PyCFunction)map_py_apply_patch, METH_O, NULL},
+    {"intersection", (PyCFunction)map_py_intersection, METH_O, NULL},
+    {"difference", (PyCFunction)map_py_difference, METH_O, NULL},
+    {"symmetric_difference", (PyCFunction)map_py_symmetric_difference,
+     METH_O, NULL},
+    {"restrict", (PyCFunction)map_py_restrict, METH_O, NULL},
+    {"items", (PyCFunction)map_py_items, METH_NOARGS, NULL},
+    {"keys", (PyCFunction)map_py_keys, METH_NOARGS, NULL},
+    {"values", (PyCFunction)map_py_values, METH_NOARGS, NULL},
+    {"update", (PyCFunction)map_py_update,
+     METH_FASTCALL | METH_KEYWORDS, NULL},
+    {"merge", (PyCFunction)map_py_merge,
+     METH_FASTCALL | METH_KEYWORDS, NULL},
+    {"__reduce__", (PyCFunction)map_reduce, METH_NOARGS, NULL},
+    {"__reduce_ex__", (PyCFunction)map_reduce_ex, METH_O, NULL},
+    {"__copy__", (PyCFunction)map_py_copy, METH_NOARGS, NULL},
+    {"__deepcopy__", (PyCFunction)map_py_deepcopy, METH_O, NULL},
+    {"__dump__", (PyCFunction)map_py_dump, METH_NOARGS, NULL},
+    {
+        "__class_getitem__",
+        Py_GenericAlias,
+        METH_O|METH_CLASS,
+        "See PEP 585"
+    },
+    {NULL, NULL}
+};
+
+static PyMemberDef Map_members[] = {
+    {"__weaklistoffset__", T_PYSSIZET,
+     offsetof(MapObject, h_weakreflist), READONLY},
+    {NULL}
+};
+
+static PyType_Slot Map_slots[] = {
+    {Py_tp_methods, Map_methods},
+    {Py_tp_members, Map_members},
+    {Py_mp_length, map_tp_len},
+    {Py_mp_subscript, map_tp_subscript},
+    {Py_sq_contains, map_tp_contains},
+    {Py_nb_or, map_py_or},
+    {Py_tp_iter, map_tp_iter},
+    {Py_tp_dealloc, map_tp_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_richcompare, map_tp_richcompare},
+    {Py_tp_traverse, map_tp_traverse},
+    {Py_tp_clear, map_tp_clear},
+    {Py_tp_new, map_tp_new},
+    {Py_tp_hash, map_py_hash},
+    {Py_tp_repr, map_py_repr},
+    {0, NULL},
+};
+
+/* Map() is called through map_vectorcall(), which is set up once
+   the type is created. */
+static PyType_Spec Map_spec = {
+    .name = "immutables._map.Map",
+    .basicsize = sizeof(MapObject) - sizeof(MapEntry),
+    .itemsize = sizeof(MapEntry),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC |
+             MAP_TPFLAGS_IMMUTABLE | MAP_TPFLAGS_MAPPING,
+    .slots = Map_slots,
+};
+
+
+/////////////////////////////////// MapMutation
+
+
+static int
+map_node_update(uint64_t mutid,
+                PyObject *src,
+                MapNode *root, Py_ssize_t count,
+                MapNode **new_root, Py_ssize_t *new_count)
+{
+    if (Map_Check(src)) {
+        return map_node_merge_map(
+            mutid, (MapObject *)src, NULL, root, count, new_root, new_count);
+    }
+
+    MapBulk bulk;
+    int ret;
+
+    map_bulk_init(&bulk, map_state(root), mutid);
+
+    if (PyDict_Check(src)) {
+        ret = map_bulk_add_dict(&bulk, src);
+    }
+    else {
+        ret = map_bulk_add_seq(&bulk, src);
+    }
+
+    if (ret) {
+        map_bulk_clear(&bulk);
+        return -1;
+    }
+
+    return map_node_update_from_bulk(
+        mutid, &bulk, root, count, new_root, new_count);
+}
+
+
+static int
+map_update_inplace(uint64_t mutid, BaseMapObject *o, PyObject *src)
+{
+    MapNode *new_root = NULL;
+    Py_ssize_t new_count;
+
+    int ret = map_node_update(
+        mutid, src,
+        o->b_root, o->b_count,
+        &new_root, &new_count);
+
+    if (ret) {
+        return -1;
+    }
+
+    assert(new_root);
+
+    Py_SETREF(o->b_root, new_root);
+    o->b_count = new_count;
+
+    return 0;
+}
+
+
+static MapObject *
+map_update(uint64_t mutid, MapObject *o, PyObject *src)
+{
+    MapNode *root;
+    MapNode *new_root = NULL;
+    Py_ssize_t new_count;
+
+    if (IS_SMALL_MAP(o)) {
+        root = map_small_to_root(o, mutid);
+        if (root == NULL) {
+            return NULL;
+        }
+    }
+    else {
+        Py_INCREF(o->h_root);
+        root = o->h_root;
+    }
+
+    int ret = map_node_update(
+        mutid, src,
+        root, o->h_count,
+        &new_root, &new_count);
+
+    Py_DECREF(root);
+
+    if (ret) {
+        return NULL;
+    }
+
+    assert(new_root);
+
+    return map_new_from_root(map_state(o), new_root, new_count);
+}
+
+static int
+mapmut_check_finalized(MapMutationObject *o)
+{
+    if (o->m_mutid == 0) {
+        PyErr_Format(
+            PyExc_ValueError,
+            "mutation %R has been finished",
+            o, NULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+mapmut_delete(MapMutationObject *o, PyObject *key, Py_hash_t key_hash)
+{
+    MapNode *new_root = NULL;
+
+    assert(key_hash != -1);
+    map_without_t res = map_node_without(
+        (MapNode *)(o->m_root),
+        0, key_hash, key,
+        &new_root,
+        o->m_mutid);
+
+    switch (res) {
+        case W_ERROR:
+            return -1;
+
+        case W_EMPTY:
+            new_root = map_node_bitmap_new(map_state(o), 0, 0, o->m_mutid);
+            if (new_root == NULL) {
+                return -1;
+            }
+            Py_SETREF(o->m_root, new_root);
+            o->m_count = 0;
+            return 0;
+
+        case W_NOT_FOUND:
+            PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
+
+        case W_NEWNODE: {
+            assert(new_root != NULL);
+            Py_SETREF(o->m_root, new_root);
+            o->m_count--;
+            return 0;
+        }
+
+        default:
+            abort();
+    }
+}
+
+static int
+mapmut_set(MapMutationObject *o, PyObject *key, Py_hash_t key_hash,
+           PyObject *val)
+{
+    int added_leaf = 0;
+
+    assert(key_hash != -1);
+    MapNode *new_root = map_node_assoc(
+        (MapNode *)(o->m_root),
+        0, key_hash, key, val, &added_leaf,
+        o->m_mutid);
+    if (new_root == NULL) {
+        return -1;
+    }
+
+    if (added_leaf) {
+        o->m_count++;
+    }
+
+    if (new_root == o->m_root) {
+        Py_DECREF(new_root);
+        return 0;
+    }
+
+    Py_SETREF(o->m_root, new_root);
+    return 0;
+}
+
+static MapNode_Bitmap *
+map_node_bitmap_trim(MapNode_Bitmap *node)
+{
+    /* Drop the spare room of a node nothing else refers to: move
+       its sub-nodes and hashes right after its key/value pairs and
+       shrink the allocation.  Return the node, which may have moved;
+       if it can't be shrunk it's returned as it is, but compacted. */
+
+    Py_ssize_t data_count = map_node_bitmap_data_count(node);
+    Py_ssize_t node_count = map_node_bitmap_node_count(node);
+    Py_ssize_t used = 2 * data_count + node_count;
+    Py_hash_t *hashes = BITMAP_HASHES(node);
+    Py_ssize_t i;
+
+    assert(used < Py_SIZE(node));
+
+    for (i = node_count; --i >= 0; ) {
+        node->b_array[used - 1 - i] =
+            node->b_array[BITMAP_NODE_IDX(node, i)];
+    }
+    Py_SET_SIZE(node, used);
+    memmove(BITMAP_HASHES(node), hashes,
+            (size_t)data_count * sizeof(Py_hash_t));
+
+    int tracked = PyObject_GC_IsTracked((PyObject *)node);
+    if (tracked) {
+        PyObject_GC_UnTrack(node);
+    }
+    MapNode_Bitmap *trimmed = PyObject_GC_Resize(
+        MapNode_Bitmap, node, used + BITMAP_HASHES_ITEMS(data_count));
+    if (trimmed == NULL) {
+        /* Keep the node as it is; the spare room is harmless. */
+        PyErr_Clear();
+        trimmed = node;
+    }
+    /* PyObject_GC_Resize() sets the size to the number of items. */
+    Py_SET_SIZE(trimmed, used);
+    if (tracked) {
+        PyObject_GC_Track(trimmed);
+    }
+    return trimmed;
+}
+
+static int
+map_node_trim(MapNode **slot, uint64_t mutid)
+{
+    /* Drop the spare room of Bitmap nodes owned by 'mutid' in the
+       tree '*slot' points to; nodes still referred to from elsewhere
+       are replaced with exact copies.  Nodes a mutation doesn't own
+       can't have nodes it owns under them. */
+
+    MapNode *node = *slot;
+    Py_ssize_t i;
+
+    if (IS_BITMAP_NODE(node)) {
+        MapNode_Bitmap *b = (MapNode_Bitmap *)node;
+        if (b->b_mutid != mutid) {
+            return 0;
+        }
+
+        Py_ssize_t node_count = map_node_bitmap_node_count(b);
+        for (i = 0; i < node_count; i++) {
+            MapNode **child =
+                (MapNode **)&b->b_array[BITMAP_NODE_IDX(b, i)];
+            if (map_node_trim(child, mutid)) {
+                return -1;
+            }
+            map_gc_track_if(b, (PyObject *)*child);
+        }
+
+        if (map_node_bitmap_used(b) < Py_SIZE(b)) {
+            if (MAP_IS_UNIQUE(b)) {
+                *slot = (MapNode *)map_node_bitmap_trim(b);
+            }
+            else {
+                MapNode_Bitmap *clone = map_node_bitmap_clone(b, mutid);
+                if (clone == NULL) {
+                    return -1;
+                }
+                Py_SETREF(*slot, (MapNode *)clone);
+            }
+        }
+    }
+    else if (IS_ARRAY_NODE(node)) {
+        MapNode_Array *a = (MapNode_Array *)node;
+        if (a->a_mutid != mutid) {
+            return 0;
+        }
+
+        for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+            if (a->a_array[i] != NULL) {
+                if (map_node_trim(&a->a_array[i], mutid)) {
+                    return -1;
+                }
+                map_gc_track_if(a, (PyObject *)a->a_array[i]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int
+mapmut_finish(MapMutationObject *o)
+{
+    if (o->m_mutid != 0 && map_node_trim(&o->m_root, o->m_mutid)) {
+        return -1;
+    }
+    o->m_mutid = 0;
+    return 0;
+}
+
+static PyObject *
+mapmut_py_set(MapMutationObject *o, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (map_check_nargs("set", nargs, 2, 2)) {
+        return NULL;
+    }
+
+    Py_hash_t key_hash = map_hash(args[0]);
+    if (key_hash == -1) {
+        return NULL;
+    }
+
+    int err;
+    Py_BEGIN_CRITICAL_SECTION(o);
+    err = mapmut_check_finalized(o) ||
+        mapmut_set(o, args[0], key_hash, args[1]);
+    Py_END_CRITICAL_SECTION();
+    if (err) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+mapmut_py_get(MapMutationObject *o, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(o);
+    res = map_py_get((BaseMapObject *)o, args, nargs);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PyObject *
+mapmut_tp_subscript(MapMutationObject *o, PyObject *key)
+{
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(o);
+    res = map_tp_subscript((BaseMapObject *)o, key);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static int
+mapmut_tp_contains(MapMutationObject *o, PyObject *key)
+{
+    int res;
+    Py_BEGIN_CRITICAL_SECTION(o);
+    res = map_tp_contains((BaseMapObject *)o, key);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static Py_ssize_t
+mapmut_tp_len(MapMutationObject *o)
+{
+    Py_ssize_t res;
+    Py_BEGIN_CRITICAL_SECTION(o);
+    res = o->m_count;
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PyObject *
+mapmut_py_repr(MapMutationObject *o)
+{
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(o);
+    res = map_py_repr((BaseMapObject *)o);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PyObject *
+mapmut_tp_richcompare(PyObject *v, PyObject *w, int op)
+{
+    if (!MapMutation_Check(v) || !MapMutation_Check(w) ||
+            (op != Py_EQ && op != Py_NE))
+    {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    int res;
+    Py_BEGIN_CRITICAL_SECTION2(v, w);
+    res = map_eq((BaseMapObject *)v, (BaseMapObject *)w);
+    Py_END_CRITICAL_SECTION2();
+    if (res < 0) {
+        return NULL;
+    }
+
+    if (op == Py_NE) {
+        res = !res;
+    }
+
+    if (res) {
+        Py_RETURN_TRUE;
+    }
+    else {
+        Py_RETURN_FALSE;
+    }
+}
+
+static PyObject *
+mapmut_py_update(MapMutationObject *self, PyObject *const *args,
+                 Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *kwds;
+    int err = 0;
+
+    if (map_check_nargs("update", nargs, 0, 1) ||
+            map_kwargs(args + nargs, kwnames, &kwds))
+    {
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (mapmut_check_finalized(self)) {
+        err = -1;
+    }
+    else if (nargs) {
+        err = map_update_inplace(
+            self->m_mutid, (BaseMapObject *)self, args[0]);
+    }
+    if (!err && kwds != NULL) {
+        err = map_update_inplace(
+            self->m_mutid, (BaseMapObject *)self, kwds);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    Py_XDECREF(kwds);
+    if (err) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+mapmut_py_finish(MapMutationObject *self, PyObject *args)
+{
+    PyObject *res = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!mapmut_finish(self)) {
+        Py_INCREF(self->m_root);
+        res = (PyObject *)map_new_from_root(
+            map_state(self), self->m_root, self->m_count);
+    }
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PyObject *
+mapmut_py_enter(MapMutationObject *self, PyObject *args)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+mapmut_py_exit(MapMutationObject *self, PyObject *const *args,
+               Py_ssize_t nargs)
+{
+    int err;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    err = mapmut_finish(self);
+    Py_END_CRITICAL_SECTION();
+    if (err) {
+        return NULL;
+    }
+    Py_RETURN_FALSE;
+}
+
+static int
+mapmut_tp_ass_sub(MapMutationObject *self, PyObject *key, PyObject *val)
+{
+    Py_hash_t key_hash = map_hash(key);
+    if (key_hash == -1) {
+        return -1;
+    }
+
+    int err;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (mapmut_check_finalized(self)) {
+        err = -1;
+    }
+    else if (val == NULL) {
+        err = mapmut_delete(self, key, key_hash);
+    }
+    else {
+        err = mapmut_set(self, key, key_hash, val);
+    }
+    Py_END_CRITICAL_SECTION();
+    return err;
+}
+
+static PyObject *
+mapmut_pop(MapMutationObject *self, PyObject *key, PyObject *deflt)
+{
+    PyObject *val = NULL;
+
+    if (mapmut_check_finalized(self)) {
+        return NULL;
+    }
+
+    if (!self->m_count) {
+        goto not_found;
+    }
+
+    Py_hash_t key_hash = map_hash(key);
+    if (key_hash == -1) {
+        return NULL;
+    }
+
+    map_find_t find_res = map_node_find(self->m_root, 0, key_hash, key, &val);
+
+    switch (find_res) {
+        case F_ERROR:
+            return NULL;
+
+        case F_NOT_FOUND:
+            goto not_found;
+
+        case F_FOUND:
+            break;
+
+        default:
+            abort();
+    }
+
+    Py_INCREF(val);
+
+    if (mapmut_delete(self, key, key_hash)) {
+        Py_DECREF(val);
+        return NULL;
+    }
+
+    return val;
+
+not_found:
+    if (deflt) {
+        Py_INCREF(deflt);
+        return deflt;
+    }
+
+    PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+}
+
+static PyObject *
+mapmut_py_pop(MapMutationObject *self, PyObject *const *args,
+              Py_ssize_t nargs)
+{
+    if (map_check_nargs("pop", nargs, 1, 2)) {
+        return NULL;
+    }
+
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    res = mapmut_pop(self, args[0], nargs > 1 ? args[1] : NULL);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static int
+mapmut_tp_clear(MapMutationObject *self)
+{
+    Py_CLEAR(self->m_root);
+    self->m_count = 0;
+    return 0;
+}
+
+static int
+mapmut_tp_traverse(MapMutationObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->m_root);
+    return 0;
+}
+
+static void
+mapmut_tp_dealloc(MapMutationObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+    PyObject_GC_UnTrack(self);
+    if (self->m_weakreflist != NULL) {
+        PyObject_ClearWeakRefs((PyObject*)self);
+    }
+    (void)mapmut_tp_clear(self);
+    PyObject_GC_Del(self);
+    Py_DECREF(tp);
+}
+
+
+static PyMethodDef MapMutation_methods[] = {
+    {"set", (PyCFunction)mapmut_py_set, METH_FASTCALL, NULL},
+    {"get", (PyCFunction)mapmut_py_get, METH_FASTCALL, NULL},
+    {"pop", (PyCFunction)mapmut_py_pop, METH_FASTCALL, NULL},
+    {"finish", (PyCFunction)mapmut_py_finish, METH_NOARGS, NULL},
+    {"update", (PyCFunction)mapmut_py_update,
+        METH_FASTCALL | METH_KEYWORDS, NULL},
+    {"__enter__", (PyCFunction)mapmut_py_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)mapmut_py_exit, METH_FASTCALL, NULL},
+    {NULL, NULL}
+};
+
+static PyMemberDef MapMutation_members[] = {
+    {"__weaklistoffset__", T_PYSSIZET,
+     offsetof(MapMutationObject, m_weakreflist), READONLY},
+    {NULL}
+};
+
+static PyType_Slot MapMutation_slots[] = {
+    {Py_tp_methods, MapMutation_methods},
+    {Py_tp_members, MapMutation_members},
+    {Py_mp_length, mapmut_tp_len},
+    {Py_mp_subscript, mapmut_tp_subscript},
+    {Py_mp_ass_subscript, mapmut_tp_ass_sub},
+    {Py_sq_contains, mapmut_tp_contains},
+    {Py_tp_dealloc, mapmut_tp_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_traverse, mapmut_tp_traverse},
+    {Py_tp_richcompare, mapmut_tp_richcompare},
+    {Py_tp_clear, mapmut_tp_clear},
+    {Py_tp_repr, mapmut_py_repr},
+    {Py_tp_hash, PyObject_HashNotImplemented},
+    {0, NULL},
+};
+
+static PyType_Spec MapMutation_spec = {
+    .name = "immutables._map.MapMutation",
+    .basicsize = sizeof(MapMutationObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | MAP_TPFLAGS_INTERNAL,
+    .slots = MapMutation_slots,
+};
+
+
+/////////////////////////////////// Atom
+
+
+/* An Atom holds a Map that threads replace by comparing and setting
+   it, like the atoms of Clojure: swap() calls a function on the
+   current Map and sets the result unless another thread replaced the
+   Map in the meantime, in which case it tries again.
+
+   With the GIL, loading and replacing the pointer is atomic as it is.
+   Free-threaded builds have to make sure that a Map a reader loaded
+   isn't deallocated by a writer before the reader takes a reference
+   to it, without readers ever waiting for anything:
+
+   - readers count themselves in the counters of the current epoch,
+     load the pointer, take a reference and count themselves out.
+     A writer may move to the next epoch between a reader reading it
+     and counting itself in, and then not wait for that reader, so
+     readers check that the epoch is still the same once counted in,
+     and start over otherwise;
+
+   - writers replace the pointer atomically, then move to the next
+     epoch and wait for the counters of the previous one to drop to
+     zero before they release the Map they replaced.  Readers that
+     come after that use the other set of counters, so writers only
+     wait for the readers that were there already, and these are
+     done as soon as they have taken their reference.
+
+   Writers wait one at a time, on "a_mutex". */
+
+#ifdef Py_GIL_DISABLED
+
+#ifdef MS_WINDOWS
+#  include <windows.h>
+#  define map_atom_yield() SwitchToThread()
+#else
+#  include <sched.h>
+#  define map_atom_yield() sched_yield()
+#endif
+
+static inline Py_ssize_t *
+map_atom_counter(MapAtomObject *a, Py_ssize_t epoch)
+{
+    /* The counter of the calling thread in "epoch". */
+    uint64_t tid = (uint64_t)_Py_ThreadId();
+    size_t stripe = (size_t)(
+        (tid * 0x9E3779B97F4A7C15ULL) >> (64 - _MAP_ATOM_STRIPE_BITS));
+    return &a->a_readers[epoch & 1][stripe].r_count;
+}
+
+#endif
+
+static MapObject *
+map_atom_load(MapAtomObject *a)
+{
+    /* Return a new reference to the Map of "a". */
+
+#ifdef Py_GIL_DISABLED
+    Py_ssize_t epoch = _Py_atomic_load_ssize(&a->a_epoch);
+    Py_ssize_t *counter;
+    for (;;) {
+        counter = map_atom_counter(a, epoch);
+        _Py_atomic_add_ssize(counter, 1);
+        Py_ssize_t cur = _Py_atomic_load_ssize(&a->a_epoch);
+        if (cur == epoch) {
+            break;
+        }
+        _Py_atomic_add_ssize(counter, -1);
+        epoch = cur;
+    }
+    MapObject *m = (MapObject *)_Py_atomic_load_ptr(&a->a_map);
+    Py_INCREF(m);
+    _Py_atomic_add_ssize(counter, -1);
+    return m;
+#else
+    Py_INCREF(a->a_map);
+    return a->a_map;
+#endif
+}
+
+static void
+map_atom_release(MapAtomObject *a, MapObject *old)
+{
+    /* Release the reference "a" had to "old", which was just
+       replaced. */
+
+#ifdef Py_GIL_DISABLED
+    PyMutex_Lock(&a->a_mutex);
+    Py_ssize_t epoch = _Py_atomic_add_ssize(&a->a_epoch, 1);
+    for (size_t i = 0; i < (1 << _MAP_ATOM_STRIPE_BITS); i++) {
+        Py_ssize_t *counter = &a->a_readers[epoch & 1][i].r_count;
+        while (_Py_atomic_load_ssize(counter) != 0) {
+            /* Let readers that were preempted finish. */
+            map_atom_yield();
+        }
+    }
+    PyMutex_Unlock(&a->a_mutex);
+#endif
+
+    Py_DECREF(old);
+}
+
+static void
+map_atom_set(MapAtomObject *a, MapObject *m)
+{
+    /* Replace the Map of "a" with "m", which is borrowed. */
+
+    Py_INCREF(m);
+#ifdef Py_GIL_DISABLED
+    MapObject *old = (MapObject *)_Py_atomic_exchange_ptr(&a->a_map, m);
+#else
+    MapObject *old = a->a_map;
+    a->a_map = m;
+#endif
+    map_atom_release(a, old);
+}
+
+static int
+map_atom_compare_and_set(MapAtomObject *a, PyObject *expected, MapObject *m)
+{
+    /* Replace the Map of "a" with "m", which is borrowed, if it is
+       "expected"; return whether it was replaced.  Callers hold a
+       reference to "expected", so it can't have been deallocated and
+       its memory reused for another Map in between. */
+
+    Py_INCREF(m);
+#ifdef Py_GIL_DISABLED
+    void *cur = expected;
+    if (!_Py_atomic_compare_exchange_ptr(&a->a_map, &cur, m)) {
+        Py_DECREF(m);
+        return 0;
+    }
+#else
+    if ((PyObject *)a->a_map != expected) {
+        Py_DECREF(m);
+        return 0;
+    }
+    a->a_map = m;
+#endif
+    map_atom_release(a, (MapObject *)expected);
+    return 1;
+}
+
+static int
+map_atom_check_map(const char *what, PyObject *o)
+{
+    if (!Map_Check(o)) {
+        PyErr_Format(
+            PyExc_TypeError, "%s must be an immutables.Map, not %.100s",
+            what, Py_TYPE(o)->tp_name);
+        return -1;
+    }
+    return 0;
+}
+
+
+static PyObject *
+atom_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *m = NULL;
+
+    if (kwds != NULL && PyDict_GET_SIZE(kwds)) {
+        PyErr_SetString(
+            PyExc_TypeError, "Atom() takes no keyword arguments");
+        return NULL;
+    }
+    if (!PyArg_UnpackTuple(args, "Atom", 0, 1, &m)) {
+        return NULL;
+    }
+
+    if (m == NULL) {
+        m = (PyObject *)map_new(PyType_GetModuleState(type));
+        if (m == NULL) {
+            return NULL;
+        }
+    }
+    else if (map_atom_check_map("Atom() argument", m)) {
+        return NULL;
+    }
+    else {
+        Py_INCREF(m);
+    }
+
+    MapAtomObject *a = PyObject_GC_New(MapAtomObject, type);
+    if (a == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    a->a_map = (MapObject *)m;
+    a->a_weakreflist = NULL;
+#ifdef Py_GIL_DISABLED
+    memset(&a->a_mutex, 0, sizeof(a->a_mutex));
+    a->a_epoch = 0;
+    memset(a->a_readers, 0, sizeof(a->a_readers));
+#endif
+
+    PyObject_GC_Track(a);
+    return (PyObject *)a;
+}
+
+/* Atoms don't have a tp_clear: the Maps they hold break cycles. */
+
+static int
+atom_tp_traverse(MapAtomObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->a_map);
+    return 0;
+}
+
+static void
+atom_tp_dealloc(MapAtomObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+    PyObject_GC_UnTrack(self);
+    if (self->a_weakreflist != NULL) {
+        PyObject_ClearWeakRefs((PyObject*)self);
+    }
+    Py_CLEAR(self->a_map);
+    PyObject_GC_Del(self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+atom_tp_repr(MapAtomObject *self)
+{
+    MapObject *m = map_atom_load(self);
+    PyObject *res = PyUnicode_FromFormat("<immutables.Atom(%R)>", m);
+    Py_DECREF(m);
+    return res;
+}
+
+static PyObject *
+atom_py_deref(MapAtomObject *self, PyObject *args)
+{
+    return (PyObject *)map_atom_load(self);
+}
+
+static PyObject *
+atom_py_reset(MapAtomObject *self, PyObject *m)
+{
+    if (map_atom_check_map("reset() argument", m)) {
+        return NULL;
+    }
+    map_atom_set(self, (MapObject *)m);
+    Py_INCREF(m);
+    return m;
+}
+
+static PyObject *
+atom_py_compare_and_set(MapAtomObject *self, PyObject *const *args,
+                        Py_ssize_t nargs)
+{
+    if (map_check_nargs("compare_and_set", nargs, 2, 2) ||
+            map_atom_check_map("compare_and_set() argument 2", args[1]))
+    {
+        return NULL;
+    }
+    return PyBool_FromLong(
+        map_atom_compare_and_set(self, args[0], (MapObject *)args[1]));
+}
+
+static PyObject *
+atom_py_swap(MapAtomObject *self, PyObject *const *args, Py_ssize_t nargs,
+             PyObject *kwnames)
+{
+    /* swap(fn, *args, **kwargs) calls fn(map, *args, **kwargs). */
+
+    if (nargs < 1) {
+        PyErr_SetString(PyExc_TypeError,
+                        "swap() missing required argument 'fn'");
+        return NULL;
+    }
+
+    /* The arguments of "fn", with a free slot in front of them for
+       PY_VECTORCALL_ARGUMENTS_OFFSET. */
+    Py_ssize_t total = nargs + (kwnames ? PyTuple_GET_SIZE(kwnames) : 0);
+    PyObject *small[8];
+    PyObject **call_args = small;
+    if (total + 1 > (Py_ssize_t)Py_ARRAY_LENGTH(small)) {
+        call_args = PyMem_New(PyObject *, (size_t)total + 1);
+        if (call_args == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    memcpy(call_args + 1, args, (size_t)total * sizeof(PyObject *));
+
+    PyObject *res = NULL;
+    for (;;) {
+        MapObject *m = map_atom_load(self);
+        call_args[1] = (PyObject *)m;
+
+        PyObject *new_m = PyObject_Vectorcall(
+            args[0], call_args + 1,
+            (size_t)nargs | PY_VECTORCALL_ARGUMENTS_OFFSET, kwnames);
+        if (new_m == NULL ||
+                map_atom_check_map("swap() function result", new_m))
+        {
+            Py_DECREF(m);
+            Py_XDECREF(new_m);
+            break;
+        }
+
+        int done = map_atom_compare_and_set(
+            self, (PyObject *)m, (MapObject *)new_m);
+        Py_DECREF(m);
+        if (done) {
+            res = new_m;
+            break;
+        }
+        /* Another thread replaced the Map: start over with its one. */
+        Py_DECREF(new_m);
+    }
+
+    if (call_args != small) {
+        PyMem_Free(call_args);
+    }
+    return res;
+}
+
+
+static PyMethodDef MapAtom_methods[] = {
+    {"deref", (PyCFunction)atom_py_deref, METH_NOARGS, NULL},
+    {"reset", (PyCFunction)atom_py_reset, METH_O, NULL},
+    {"compare_and_set", (PyCFunction)atom_py_compare_and_set,
+     METH_FASTCALL, NULL},
+    {"swap", (PyCFunction)atom_py_swap, METH_FASTCALL | METH_KEYWORDS,
+     NULL},
+    {
+        "__class_getitem__",
+        Py_GenericAlias,
+        METH_O|METH_CLASS,
+        "See PEP 585"
+    },
+    {NULL, NULL}
+};
+
+static PyMemberDef MapAtom_members[] = {
+    {"__weaklistoffset__", T_PYSSIZET,
+     offsetof(MapAtomObject, a_weakreflist), READONLY},
+    {NULL}
+};
+
+static PyType_Slot MapAtom_slots[] = {
+    {Py_tp_methods, MapAtom_methods},
+    {Py_tp_members, MapAtom_members},
+    {Py_tp_dealloc, atom_tp_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_traverse, atom_tp_traverse},
+    {Py_tp_new, atom_tp_new},
+    {Py_tp_repr, atom_tp_repr},
+    {0, NULL},
+};
+
+static PyType_Spec MapAtom_spec = {
+    .name = "immutables._map.Atom",
+    .basicsize = sizeof(MapAtomObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC |
+             MAP_TPFLAGS_IMMUTABLE,
+    .slots = MapAtom_slots,
+};
+
+
+/////////////////////////////////// MappedMap
+
+
+/* A MappedMap is a read-only Map laid out in a flat buffer, with
+   offsets instead of pointers, so that a file can be memory-mapped
+   and used as it is, without loading it.  Keys and values are only
+   turned into Python objects when they are read.  All integers are
+   little-endian; offsets are from the start of the buffer.
+
+   Header:
+
+       magic       8 bytes  MAPPED_MAGIC
+       version     4 bytes  MAPPED_VERSION
+       reserved    4 bytes
+       count       8 bytes
+       root        8 bytes  offset of the root node, 0 if empty
+       size        8 bytes  size of the buffer
+
+   Keys and values are stored as records: a tag byte and a payload.
+
+       'i'         8 bytes, int64
+       'I'         4 bytes length and hex digits, larger ints
+       'f'         8 bytes, double
+       's'         4 bytes length and UTF-8 data, str
+       'b'         4 bytes length and data, bytes
+       'N' 'T' 'F' nothing, None, True and False
+
+   Nodes are 8-byte aligned and mirror Bitmap and Collision nodes:
+
+       MAPPED_BITMAP datamap nodemap 0       4 bytes each
+       (hash key value) for every pair       8 bytes each
+       (child) for every sub-node            8 bytes each
+
+       MAPPED_COLLISION count hash           4, 4 and 8 bytes
+       (key value) for every pair            8 bytes each
+
+   Bitmap nodes can have all 32 slots: Array nodes only exist to
+   make updates cheaper.
+
+   Python hashes of str and bytes change from process to process, so
+   keys are hashed with a hash of their records instead.  Keys can be
+   str, bytes or int (bool keys are stored as ints); integral floats
+   are looked up as ints. */
+
+#define MAPPED_MAGIC        "IMMUTMAP"
+#define MAPPED_VERSION      1
+#define MAPPED_HEADER       40
+#define MAPPED_BITMAP       1
+#define MAPPED_COLLISION    2
+#define MAPPED_HASH_BITS    64
+
+
+/* The record a key is stored as: "k_data" points at the payload
+   (the length of which is not included). */
+typedef struct {
+    unsigned char k_tag;
+    const char *k_data;
+    Py_ssize_t k_len;
+    unsigned char k_int[8];
+    /* Keeps "k_data" alive, if needed. */
+    PyObject *k_owned;
+} MappedKey;
+
+/* A key/value pair: the hash of the key and offsets of the records. */
+typedef struct {
+    uint64_t e_hash;
+    uint64_t e_key;
+    uint64_t e_val;
+} MappedEntry;
+
+typedef struct {
+    unsigned char *w_buf;
+    Py_ssize_t w_len;
+    Py_ssize_t w_allocated;
+    MappedEntry *w_entries;
+    Py_ssize_t w_count;
+    Py_ssize_t w_entries_allocated;
+} MappedWriter;
+
+/* A slot of a Bitmap node being written: a pair or a sub-node. */
+typedef struct {
+    MappedEntry s_pair;
+    uint64_t s_node;
+} MappedSlot;
+
+
+static PyObject *
+mapped_iter_new(MappedMapObject *o, mapped_view_t kind);
+
+
+static inline uint64_t
+mapped_get(const unsigned char *p, int size)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < size; i++) {
+        v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+static inline void
+mapped_set(unsigned char *p, uint64_t v, int size)
+{
+    for (int i = 0; i < size; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint64_t
+mapped_hash(unsigned char tag, const char *data, Py_ssize_t len)
+{
+    /* FNV-1a of the record, with the finalizer of MurmurHash3 to
+       spread its bits across all levels of the tree. */
+
+    uint64_t h = 14695981039346656037ULL;
+
+    h = (h ^ tag) * 1099511628211ULL;
+    for (Py_ssize_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int
+mapped_corrupt(void)
+{
+    PyErr_SetString(PyExc_ValueError, "corrupted MappedMap data");
+    return -1;
+}
+
+static inline const unsigned char *
+mapped_at(MappedMapObject *o, uint64_t offset, uint64_t size)
+{
+    /* Return a pointer to "size" bytes at "offset", if the buffer
+       has them. */
+
+    if (offset > o->mm_size || size > o->mm_size - offset) {
+        mapped_corrupt();
+        return NULL;
+    }
+    return o->mm_buf + offset;
+}
+
+static int
+mapped_key_encode(PyObject *key, MappedKey *k, int strict)
+{
+    /* Set *k to the record "key" is stored as.  Return 1 on success,
+       0 if no such key can be stored, and -1 on errors.  Unless
+       "strict" is set, keys that are equal to keys that can be
+       stored are converted to them. */
+
+    k->k_owned = NULL;
+
+    if (PyUnicode_Check(key)) {
+        k->k_tag = 's';
+        k->k_data = PyUnicode_AsUTF8AndSize(key, &k->k_len);
+        if (k->k_data == NULL) {
+            /* Strings with lone surrogates can't be encoded. */
+            if (!strict &&
+                    PyErr_ExceptionMatches(PyExc_UnicodeEncodeError)) {
+                PyErr_Clear();
+                return 0;
+            }
+            return -1;
+        }
+        return 1;
+    }
+
+    if (PyBytes_Check(key)) {
+        k->k_tag = 'b';
+        k->k_data = PyBytes_AS_STRING(key);
+        k->k_len = PyBytes_GET_SIZE(key);
+        return 1;
+    }
+
+    if (PyLong_Check(key)) {
+        int overflow;
+        long long v = PyLong_AsLongLongAndOverflow(key, &overflow);
+        if (v == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+
+        if (!overflow) {
+            k->k_tag = 'i';
+            mapped_set(k->k_int, (uint64_t)v, 8);
+            k->k_data = (const char *)k->k_int;
+            k->k_len = 8;
+            return 1;
+        }
+
+        PyObject *hex = PyNumber_ToBase(key, 16);
+        if (hex == NULL) {
+            return -1;
+        }
+
+        k->k_tag = 'I';
+        k->k_data = PyUnicode_AsUTF8AndSize(hex, &k->k_len);
+        if (k->k_data == NULL) {
+            Py_DECREF(hex);
+            return -1;
+        }
+        k->k_owned = hex;
+        return 1;
+    }
+
+    if (!strict && PyFloat_Check(key)) {
+        double d = PyFloat_AS_DOUBLE(key);
+        if (!isfinite(d) || d != floor(d)) {
+            return 0;
+        }
+
+        PyObject *i = PyLong_FromDouble(d);
+        if (i == NULL) {
+            return -1;
+        }
+        int ret = mapped_key_encode(i, k, strict);
+        Py_DECREF(i);
+        return ret;
+    }
+
+    return 0;
+}
+
+static void
+mapped_key_clear(MappedKey *k)
+{
+    Py_CLEAR(k->k_owned);
+}
+
+
+/////////////////////////////////// MappedMap: Writer
+
+
+static int
+mapped_reserve(MappedWriter *w, Py_ssize_t size)
+{
+    if (size > PY_SSIZE_T_MAX - w->w_len) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if (w->w_len + size > w->w_allocated) {
+        Py_ssize_t allocated = w->w_allocated + (w->w_allocated >> 1);
+        if (allocated < w->w_len + size) {
+            allocated = w->w_len + size;
+        }
+
+        unsigned char *buf = (unsigned char *)PyMem_Realloc(
+            w->w_buf, (size_t)allocated);
+        if (buf == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        w->w_buf = buf;
+        w->w_allocated = allocated;
+    }
+
+    return 0;
+}
+
+static int
+mapped_put(MappedWriter *w, uint64_t v, int size)
+{
+    if (mapped_reserve(w, size)) {
+        return -1;
+    }
+    mapped_set(w->w_buf + w->w_len, v, size);
+    w->w_len += size;
+    return 0;
+}
+
+static int
+mapped_put_data(MappedWriter *w, unsigned char tag,
+                const char *data, Py_ssize_t len, int with_len)
+{
+    /* Append a record. */
+
+    if ((uint64_t)len > UINT32_MAX) {
+        PyErr_SetString(
+            PyExc_OverflowError,
+            "MappedMap keys and values must be shorter than 4 GiB");
+        return -1;
+    }
+
+    if (mapped_reserve(w, len + 5)) {
+        return -1;
+    }
+
+    w->w_buf[w->w_len++] = tag;
+    if (with_len) {
+        mapped_set(w->w_buf + w->w_len, (uint64_t)len, 4);
+        w->w_len += 4;
+    }
+    memcpy(w->w_buf + w->w_len, data, (size_t)len);
+    w->w_len += len;
+    return 0;
+}
+
+static int
+mapped_put_node_header(MappedWriter *w, uint64_t *offset)
+{
+    /* Align the buffer for a node and set *offset to it. */
+
+    while (w->w_len % 8) {
+        if (mapped_put(w, 0, 1)) {
+            return -1;
+        }
+    }
+
+    *offset = (uint64_t)w->w_len;
+    return 0;
+}
+
+static int
+mapped_put_key(MappedWriter *w, PyObject *key, MappedEntry *entry)
+{
+    MappedKey k;
+
+    int ret = mapped_key_encode(key, &k, 1);
+    if (ret <= 0) {
+        if (ret == 0) {
+            PyErr_Format(
+                PyExc_TypeError,
+                "MappedMap keys must be str, bytes or int, not %.200s",
+                Py_TYPE(key)->tp_name);
+        }
+        return -1;
+    }
+
+    entry->e_key = (uint64_t)w->w_len;
+    entry->e_hash = mapped_hash(k.k_tag, k.k_data, k.k_len);
+    ret = mapped_put_data(w, k.k_tag, k.k_data, k.k_len, k.k_tag != 'i');
+    mapped_key_clear(&k);
+    return ret;
+}
+
+static int
+mapped_put_value(MappedWriter *w, PyObject *val, MappedEntry *entry)
+{
+    entry->e_val = (uint64_t)w->w_len;
+
+    if (val == Py_None) {
+        return mapped_put_data(w, 'N', NULL, 0, 0);
+    }
+    if (val == Py_True || val == Py_False) {
+        return mapped_put_data(w, val == Py_True ? 'T' : 'F', NULL, 0, 0);
+    }
+    if (PyFloat_Check(val)) {
+        double d = PyFloat_AS_DOUBLE(val);
+        uint64_t bits;
+        unsigned char buf[8];
+        memcpy(&bits, &d, 8);
+        mapped_set(buf, bits, 8);
+        return mapped_put_data(w, 'f', (const char *)buf, 8, 0);
+    }
+
+    if (PyUnicode_Check(val) || PyBytes_Check(val) || PyLong_Check(val)) {
+        MappedKey k;
+        if (mapped_key_encode(val, &k, 1) < 0) {
+            return -1;
+        }
+        int ret = mapped_put_data(
+            w, k.k_tag, k.k_data, k.k_len, k.k_tag != 'i');
+        mapped_key_clear(&k);
+        return ret;
+    }
+
+    PyErr_Format(
+        PyExc_TypeError,
+        "MappedMap values must be None, bool, int, float, str or bytes, "
+        "not %.200s",
+        Py_TYPE(val)->tp_name);
+    return -1;
+}
+
+static int
+mapped_put_item(MappedWriter *w, PyObject *key, PyObject *val)
+{
+    if (w->w_count == w->w_entries_allocated) {
+        Py_ssize_t size = w->w_entries_allocated;
+        size = size < 8 ? 8 : size + (size >> 1);
+
+        if ((size_t)size > PY_SSIZE_T_MAX / sizeof(MappedEntry)) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        MappedEntry *entries = (MappedEntry *)PyMem_Realloc(
+            w->w_entries, (size_t)size * sizeof(MappedEntry));
+        if (entries == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        w->w_entries = entries;
+        w->w_entries_allocated = size;
+    }
+
+    MappedEntry *entry = &w->w_entries[w->w_count];
+    if (mapped_put_key(w, key, entry) || mapped_put_value(w, val, entry)) {
+        return -1;
+    }
+
+    w->w_count++;
+    return 0;
+}
+
+static int
+mapped_put_items(MappedWriter *w, PyObject *src)
+{
+    /* Append the records of all keys and values of the mapping "src". */
+
+    if (Map_Check(src)) {
+        MapIteratorState iter;
+        PyObject *key;
+        PyObject *val;
+
+        map_iterator_init_map(&iter, (BaseMapObject *)src);
+        while (map_iterator_next(&iter, &key, &val) == I_ITEM) {
+            if (mapped_put_item(w, key, val)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (PyDict_CheckExact(src)) {
+        Py_ssize_t pos = 0;
+        PyObject *key;
+        PyObject *val;
+
+        while (PyDict_Next(src, &pos, &key, &val)) {
+            if (mapped_put_item(w, key, val)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    PyObject *items = PyMapping_Items(src);
+    if (items == NULL) {
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(items); i++) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+            PyErr_SetString(
+                PyExc_TypeError, "items() must return (key, value) pairs");
+            Py_DECREF(items);
+            return -1;
+        }
+
+        if (mapped_put_item(w, PyTuple_GET_ITEM(item, 0),
+                            PyTuple_GET_ITEM(item, 1)))
+        {
+            Py_DECREF(items);
+            return -1;
+        }
+    }
+
+    Py_DECREF(items);
+    return 0;
+}
+
+static int
+mapped_record_eq(MappedWriter *w, uint64_t a, uint64_t b)
+{
+    /* Return 1 if the key records at "a" and "b" are equal. */
+
+    const unsigned char *pa = w->w_buf + a;
+    const unsigned char *pb = w->w_buf + b;
+
+    if (pa[0] != pb[0]) {
+        return 0;
+    }
+    if (pa[0] == 'i') {
+        return memcmp(pa + 1, pb + 1, 8) == 0;
+    }
+
+    uint64_t len = mapped_get(pa + 1, 4);
+    return len == mapped_get(pb + 1, 4) &&
+           memcmp(pa + 5, pb + 5, (size_t)len) == 0;
+}
+
+static int
+mapped_put_collision(MappedWriter *w, MappedEntry *entries, Py_ssize_t n,
+                     uint32_t shift, MappedSlot *out)
+{
+    /* Write a Collision node for "n" keys with equal hashes, below a
+       chain of Bitmap nodes with a single sub-node each. */
+
+    uint64_t hash = entries[0].e_hash;
+    uint64_t node;
+    Py_ssize_t i;
+
+    for (i = 1; i < n; i++) {
+        for (Py_ssize_t j = 0; j < i; j++) {
+            if (mapped_record_eq(w, entries[i].e_key, entries[j].e_key)) {
+                PyErr_SetString(
+                    PyExc_ValueError, "duplicate keys in MappedMap items");
+                return -1;
+            }
+        }
+    }
+
+    if (n > UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "too many equal hashes");
+        return -1;
+    }
+
+    if (mapped_put_node_header(w, &node) ||
+            mapped_put(w, MAPPED_COLLISION, 4) ||
+            mapped_put(w, (uint64_t)n, 4) ||
+            mapped_put(w, hash, 8))
+    {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (mapped_put(w, entries[i].e_key, 8) ||
+                mapped_put(w, entries[i].e_val, 8))
+        {
+            return -1;
+        }
+    }
+
+    for (int64_t s = (MAPPED_HASH_BITS - 1) / 5 * 5;
+            s >= (int64_t)shift; s -= 5)
+    {
+        uint64_t child = node;
+        if (mapped_put_node_header(w, &node) ||
+                mapped_put(w, MAPPED_BITMAP, 4) ||
+                mapped_put(w, 0, 4) ||
+                mapped_put(w, (uint64_t)1 << ((hash >> s) & 0x1f), 4) ||
+                mapped_put(w, 0, 4) ||
+                mapped_put(w, child, 8))
+        {
+            return -1;
+        }
+    }
+
+    out->s_node = node;
+    return 0;
+}
+
+static int
+mapped_put_node(MappedWriter *w, MappedEntry *entries, MappedEntry *tmp,
+                Py_ssize_t n, uint32_t shift, MappedSlot *out)
+{
+    /* Write the subtree at "shift" for "n" entries, children before
+       their parents, like map_bulk_node() builds trees.  The result
+       is a single pair or the offset of the node. */
+
+    out->s_node = 0;
+
+    if (n == 1) {
+        out->s_pair = entries[0];
+        return 0;
+    }
+
+    if (shift >= MAPPED_HASH_BITS) {
+        return mapped_put_collision(w, entries, n, shift, out);
+    }
+
+    Py_ssize_t offsets[HAMT_ARRAY_NODE_SIZE + 1] = {0};
+    int same = 1;
+    Py_ssize_t i;
+
+    for (i = 0; i < n; i++) {
+        offsets[((entries[i].e_hash >> shift) & 0x1f) + 1]++;
+        same &= entries[i].e_hash == entries[0].e_hash;
+    }
+
+    if (same) {
+        return mapped_put_collision(w, entries, n, shift, out);
+    }
+
+    for (i = 0; i < HAMT_ARRAY_NODE_SIZE; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+
+    Py_ssize_t pos[HAMT_ARRAY_NODE_SIZE];
+    memcpy(pos, offsets, sizeof(pos));
+    for (i = 0; i < n; i++) {
+        tmp[pos[(entries[i].e_hash >> shift) & 0x1f]++] = entries[i];
+    }
+    memcpy(entries, tmp, (size_t)n * sizeof(MappedEntry));
+
+    MappedSlot slots[HAMT_ARRAY_NODE_SIZE];
+    uint32_t datamap = 0;
+    uint32_t nodemap = 0;
+    uint32_t b;
+
+    for (b = 0; b < HAMT_ARRAY_NODE_SIZE; b++) {
+        Py_ssize_t start = offsets[b];
+        Py_ssize_t count = offsets[b + 1] - start;
+
+        if (count == 0) {
+            continue;
+        }
+
+        if (mapped_put_node(w, entries + start, tmp + start, count,
+                            shift + 5, &slots[b]))
+        {
+            return -1;
+        }
+
+        if (slots[b].s_node) {
+            nodemap |= (uint32_t)1 << b;
+        }
+        else {
+            datamap |= (uint32_t)1 << b;
+        }
+    }
+
+    if (mapped_put_node_header(w, &out->s_node) ||
+            mapped_put(w, MAPPED_BITMAP, 4) ||
+            mapped_put(w, datamap, 4) ||
+            mapped_put(w, nodemap, 4) ||
+            mapped_put(w, 0, 4))
+    {
+        return -1;
+    }
+
+    for (b = 0; b < HAMT_ARRAY_NODE_SIZE; b++) {
+        if (datamap & ((uint32_t)1 << b)) {
+            MappedEntry *e = &slots[b].s_pair;
+            if (mapped_put(w, e->e_hash, 8) ||
+                    mapped_put(w, e->e_key, 8) ||
+                    mapped_put(w, e->e_val, 8))
+            {
+                return -1;
+            }
+        }
+    }
+
+    for (b = 0; b < HAMT_ARRAY_NODE_SIZE; b++) {
+        if ((nodemap & ((uint32_t)1 << b)) &&
+                mapped_put(w, slots[b].s_node, 8))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static PyObject *
+mapped_dumps(PyObject *src)
+{
+    /* Return the MappedMap image of the mapping "src". */
+
+    MappedWriter w;
+    MappedEntry *tmp = NULL;
+    PyObject *res = NULL;
+    uint64_t root = 0;
+
+    w.w_buf = NULL;
+    w.w_len = 0;
+    w.w_allocated = 0;
+    w.w_entries = NULL;
+    w.w_count = 0;
+    w.w_entries_allocated = 0;
+
+    /* The header is filled in last. */
+    if (mapped_reserve(&w, MAPPED_HEADER)) {
+        goto done;
+    }
+    memset(w.w_buf, 0, MAPPED_HEADER);
+    w.w_len = MAPPED_HEADER;
+
+    if (mapped_put_items(&w, src)) {
+        goto done;
+    }
+
+    if (w.w_count > 0) {
+        MappedSlot out;
+
+        tmp = (MappedEntry *)PyMem_Malloc(
+            (size_t)w.w_count * sizeof(MappedEntry));
+        if (tmp == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+
+        if (mapped_put_node(&w, w.w_entries, tmp, w.w_count, 0, &out)) {
+            goto done;
+        }
+
+        root = out.s_node;
+        if (root == 0) {
+            /* A single pair still needs a node. */
+            MappedEntry *e = &out.s_pair;
+            if (mapped_put_node_header(&w, &root) ||
+                    mapped_put(&w, MAPPED_BITMAP, 4) ||
+                    mapped_put(&w, (uint64_t)1 << (e->e_hash & 0x1f), 4) ||
+                    mapped_put(&w, 0, 4) ||
+                    mapped_put(&w, 0, 4) ||
+                    mapped_put(&w, e->e_hash, 8) ||
+                    mapped_put(&w, e->e_key, 8) ||
+                    mapped_put(&w, e->e_val, 8))
+            {
+                goto done;
+            }
+        }
+    }
+
+    memcpy(w.w_buf, MAPPED_MAGIC, 8);
+    mapped_set(w.w_buf + 8, MAPPED_VERSION, 4);
+    mapped_set(w.w_buf + 16, (uint64_t)w.w_count, 8);
+    mapped_set(w.w_buf + 24, root, 8);
+    mapped_set(w.w_buf + 32, (uint64_t)w.w_len, 8);
+
+    res = PyBytes_FromStringAndSize((const char *)w.w_buf, w.w_len);
+
+done:
+    PyMem_Free(tmp);
+    PyMem_Free(w.w_entries);
+    PyMem_Free(w.w_buf);
+    return res;
+}
+
+
+/////////////////////////////////// MappedMap: Reader
+
+
+static PyObject *
+mapped_load(MappedMapObject *o, uint64_t offset)
+{
+    /* Return a new object for the record at "offset". */
+
+    const unsigned char *p = mapped_at(o, offset, 1);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    switch (p[0]) {
+        case 'N':
+            Py_RETURN_NONE;
+        case 'T':
+            Py_RETURN_TRUE;
+        case 'F':
+            Py_RETURN_FALSE;
+
+        case 'i':
+        case 'f': {
+            p = mapped_at(o, offset + 1, 8);
+            if (p == NULL) {
+                return NULL;
+            }
+            uint64_t v = mapped_get(p, 8);
+            if (p[-1] == 'i') {
+                return PyLong_FromLongLong((long long)v);
+            }
+            double d;
+            memcpy(&d, &v, 8);
+            return PyFloat_FromDouble(d);
+        }
+
+        case 's':
+        case 'b':
+        case 'I': {
+            unsigned char tag = p[0];
+            p = mapped_at(o, offset + 1, 4);
+            if (p == NULL) {
+                return NULL;
+            }
+            uint64_t len = mapped_get(p, 4);
+            p = mapped_at(o, offset + 5, len);
+            if (p == NULL) {
+                return NULL;
+            }
+
+            if (tag == 'b') {
+                return PyBytes_FromStringAndSize(
+                    (const char *)p, (Py_ssize_t)len);
+            }
+
+            PyObject *s = PyUnicode_DecodeUTF8(
+                (const char *)p, (Py_ssize_t)len, NULL);
+            if (s == NULL || tag == 's') {
+                return s;
+            }
+            PyObject *i = PyLong_FromUnicodeObject(s, 16);
+            Py_DECREF(s);
+            return i;
+        }
+
+        default:
+            mapped_corrupt();
+            return NULL;
+    }
+}
+
+static int
+mapped_key_eq(MappedMapObject *o, uint64_t offset, MappedKey *k)
+{
+    /* Return 1 if the record at "offset" is the key "k", 0 if not,
+       and -1 on errors. */
+
+    const unsigned char *p = mapped_at(o, offset, 1);
+    if (p == NULL) {
+        return -1;
+    }
+    if (p[0] != k->k_tag) {
+        return 0;
+    }
+
+    if (k->k_tag == 'i') {
+        p = mapped_at(o, offset + 1, 8);
+        if (p == NULL) {
+            return -1;
+        }
+        return memcmp(p, k->k_int, 8) == 0;
+    }
+
+    p = mapped_at(o, offset + 1, 4);
+    if (p == NULL) {
+        return -1;
+    }
+    if (mapped_get(p, 4) != (uint64_t)k->k_len) {
+        return 0;
+    }
+
+    p = mapped_at(o, offset + 5, (uint64_t)k->k_len);
+    if (p == NULL) {
+        return -1;
+    }
+    return memcmp(p, k->k_data, (size_t)k->k_len) == 0;
+}
+
+static map_find_t
+mapped_node_find(MappedMapObject *o, uint64_t node, uint64_t hash,
+                 MappedKey *k, uint64_t *val)
+{
+    /* Mirrors map_node_find(). */
+
+    for (uint32_t shift = 0; ; shift += 5) {
+        const unsigned char *p = mapped_at(o, node, 16);
+        if (p == NULL) {
+            return F_ERROR;
+        }
+
+        uint64_t type = mapped_get(p, 4);
+
+        if (type == MAPPED_BITMAP && shift < MAPPED_HASH_BITS) {
+            uint32_t datamap = (uint32_t)mapped_get(p + 4, 4);
+            uint32_t nodemap = (uint32_t)mapped_get(p + 8, 4);
+            uint32_t bit = (uint32_t)1 << ((hash >> shift) & 0x1f);
+
+            if (datamap & bit) {
+                uint64_t idx = map_bitindex(datamap, bit);
+                p = mapped_at(o, node + 16 + idx * 24, 24);
+                if (p == NULL) {
+                    return F_ERROR;
+                }
+                if (mapped_get(p, 8) != hash) {
+                    return F_NOT_FOUND;
+                }
+
+                int eq = mapped_key_eq(o, mapped_get(p + 8, 8), k);
+                if (eq < 0) {
+                    return F_ERROR;
+                }
+                if (!eq) {
+                    return F_NOT_FOUND;
+                }
+                *val = mapped_get(p + 16, 8);
+                return F_FOUND;
+            }
+
+            if (nodemap & bit) {
+                uint64_t idx = map_bitcount(datamap) * 3 +
+                               map_bitindex(nodemap, bit);
+                p = mapped_at(o, node + 16 + idx * 8, 8);
+                if (p == NULL) {
+                    return F_ERROR;
+                }
+                node = mapped_get(p, 8);
+                continue;
+            }
+
+            return F_NOT_FOUND;
+        }
+
+        if (type == MAPPED_COLLISION && shift >= MAPPED_HASH_BITS) {
+            uint64_t count = mapped_get(p + 4, 4);
+
+            if (mapped_get(p + 8, 8) != hash) {
+                return F_NOT_FOUND;
+            }
+
+            for (uint64_t i = 0; i < count; i++) {
+                p = mapped_at(o, node + 16 + i * 16, 16);
+                if (p == NULL) {
+                    return F_ERROR;
+                }
+
+                int eq = mapped_key_eq(o, mapped_get(p, 8), k);
+                if (eq < 0) {
+                    return F_ERROR;
+                }
+                if (eq) {
+                    *val = mapped_get(p + 8, 8);
+                    return F_FOUND;
+                }
+            }
+
+            return F_NOT_FOUND;
+        }
+
+        mapped_corrupt();
+        return F_ERROR;
+    }
+}
+
+static map_find_t
+mapped_find(MappedMapObject *o, PyObject *key, uint64_t *val)
+{
+    MappedKey k;
+
+    int ret = mapped_key_encode(key, &k, 0);
+    if (ret <= 0) {
+        /* Unhashable keys are errors, as they are for Maps. */
+        if (ret < 0 || PyObject_Hash(key) == -1) {
+            return F_ERROR;
+        }
+        return F_NOT_FOUND;
+    }
+
+    map_find_t res = F_NOT_FOUND;
+    if (o->mm_root != 0) {
+        res = mapped_node_find(
+            o, o->mm_root, mapped_hash(k.k_tag, k.k_data, k.k_len),
+            &k, val);
+    }
+
+    mapped_key_clear(&k);
+    return res;
+}
+
+static void
+mapped_iterator_init(MappedIteratorState *iter, MappedMapObject *o)
+{
+    iter->i_level = o->mm_root ? 0 : -1;
+    iter->i_nodes[0] = o->mm_root;
+    iter->i_pos[0] = 0;
+}
+
+static int
+mapped_iterator_next(MappedMapObject *o, MappedIteratorState *iter,
+                     uint64_t *key, uint64_t *val)
+{
+    /* Mirrors map_iterator_next(): return 1 and the offsets of the
+       next key and value, 0 at the end, and -1 on errors. */
+
+    while (iter->i_level >= 0) {
+        int8_t level = iter->i_level;
+        uint64_t node = iter->i_nodes[level];
+        uint64_t pos = iter->i_pos[level];
+
+        const unsigned char *p = mapped_at(o, node, 16);
+        if (p == NULL) {
+            return -1;
+        }
+
+        uint64_t type = mapped_get(p, 4);
+        uint64_t data_count;
+        uint64_t node_count;
+
+        if (type == MAPPED_BITMAP) {
+            data_count = map_bitcount((uint32_t)mapped_get(p + 4, 4));
+            node_count = map_bitcount((uint32_t)mapped_get(p + 8, 4));
+        }
+        else if (type == MAPPED_COLLISION) {
+            data_count = mapped_get(p + 4, 4);
+            node_count = 0;
+        }
+        else {
+            return mapped_corrupt();
+        }
+
+        if (pos < data_count) {
+            uint64_t size = type == MAPPED_BITMAP ? 24 : 16;
+            p = mapped_at(o, node + 16 + pos * size, size);
+            if (p == NULL) {
+                return -1;
+            }
+            p += size - 16;
+            *key = mapped_get(p, 8);
+            *val = mapped_get(p + 8, 8);
+            iter->i_pos[level] = pos + 1;
+            return 1;
+        }
+
+        if (pos < data_count + node_count) {
+            p = mapped_at(o, node + 16 + data_count * 24 +
+                             (pos - data_count) * 8, 8);
+            if (p == NULL) {
+                return -1;
+            }
+            if (level + 1 >= _MAPPED_MAX_TREE_DEPTH) {
+                return mapped_corrupt();
+            }
+
+            iter->i_pos[level] = pos + 1;
+            iter->i_level = level + 1;
+            iter->i_nodes[level + 1] = mapped_get(p, 8);
+            iter->i_pos[level + 1] = 0;
+            continue;
+        }
+
+        iter->i_level--;
+    }
+
+    return 0;
+}
+
+
+/////////////////////////////////// _MappedMap_Type
+
+
+static PyObject *
+mapped_open(PyObject *path)
+{
+    /* Return a read-only mmap of the file at "path". */
+
+    PyObject *mmap_mod = NULL;
+    PyObject *io_mod = NULL;
+    PyObject *file = NULL;
+    PyObject *fileno = NULL;
+    PyObject *mmap_new = NULL;
+    PyObject *args = NULL;
+    PyObject *kwargs = NULL;
+    PyObject *res = NULL;
+
+    mmap_mod = PyImport_ImportModule("mmap");
+    io_mod = PyImport_ImportModule("io");
+    if (mmap_mod == NULL || io_mod == NULL) {
+        goto done;
+    }
+
+    file = PyObject_CallMethod(io_mod, "open", "Os", path, "rb");
+    if (file == NULL) {
+        goto done;
+    }
+
+    fileno = PyObject_CallMethod(file, "fileno", NULL);
+    mmap_new = PyObject_GetAttrString(mmap_mod, "mmap");
+    kwargs = PyDict_New();
+    if (fileno == NULL || mmap_new == NULL || kwargs == NULL) {
+        goto close;
+    }
+
+    PyObject *access = PyObject_GetAttrString(mmap_mod, "ACCESS_READ");
+    if (access == NULL) {
+        goto close;
+    }
+    int err = PyDict_SetItemString(kwargs, "access", access);
+    Py_DECREF(access);
+    if (err) {
+        goto close;
+    }
+
+    args = Py_BuildValue("(Oi)", fileno, 0);
+    if (args == NULL) {
+        goto close;
+    }
+
+    /* The mmap doesn't need the file to stay open. */
+    res = PyObject_Call(mmap_new, args, kwargs);
+
+close: {
+        PyObject *exc_type, *exc_val, *exc_tb;
+        PyErr_Fetch(&exc_type, &exc_val, &exc_tb);
+        PyObject *closed = PyObject_CallMethod(file, "close", NULL);
+        if (closed == NULL) {
+            Py_CLEAR(res);
+        }
+        Py_XDECREF(closed);
+        if (exc_type != NULL) {
+            PyErr_Restore(exc_type, exc_val, exc_tb);
+        }
+    }
+
+done:
+    Py_XDECREF(mmap_mod);
+    Py_XDECREF(io_mod);
+    Py_XDECREF(file);
+    Py_XDECREF(fileno);
+    Py_XDECREF(mmap_new);
+    Py_XDECREF(args);
+    Py_XDECREF(kwargs);
+    return res;
+}
+
+static PyObject *
+mapped_tp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *source;
+    PyObject *data;
+
+    if (kwds != NULL && PyDict_GET_SIZE(kwds)) {
+        PyErr_SetString(
+            PyExc_TypeError, "MappedMap() takes no keyword arguments");
+        return NULL;
+    }
+    if (!PyArg_UnpackTuple(args, "MappedMap", 1, 1, &source)) {
+        return NULL;
+    }
+
+    /* Paths are memory-mapped; anything else has to be a buffer. */
+    if (PyUnicode_Check(source) ||
+            (!PyObject_CheckBuffer(source) &&
+             PyObject_HasAttrString(source, "__fspath__")))
+    {
+        data = mapped_open(source);
+        if (data == NULL) {
+            return NULL;
+        }
+    }
+    else {
+        Py_INCREF(source);
+        data = source;
+    }
+
+    MappedMapObject *o = PyObject_New(MappedMapObject, type);
+    if (o == NULL) {
+        Py_DECREF(data);
+        return NULL;
+    }
+    o->mm_weakreflist = NULL;
+    o->mm_view.obj = NULL;
+
+    int err = PyObject_GetBuffer(data, &o->mm_view, PyBUF_SIMPLE);
+    Py_DECREF(data);
+    if (err) {
+        o->mm_view.obj = NULL;
+        Py_DECREF(o);
+        return NULL;
+    }
+
+    o->mm_buf = (const unsigned char *)o->mm_view.buf;
+    o->mm_size = (uint64_t)o->mm_view.len;
+
+    const unsigned char *p = o->mm_buf;
+    if (o->mm_size < MAPPED_HEADER || memcmp(p, MAPPED_MAGIC, 8) != 0) {
+        PyErr_SetString(PyExc_ValueError, "not a MappedMap");
+        Py_DECREF(o);
+        return NULL;
+    }
+
+    if (mapped_get(p + 8, 4) != MAPPED_VERSION) {
+        PyErr_Format(
+            PyExc_ValueError, "unsupported MappedMap version %d",
+            (int)mapped_get(p + 8, 4));
+        Py_DECREF(o);
+        return NULL;
+    }
+
+    o->mm_count = mapped_get(p + 16, 8);
+    o->mm_root = mapped_get(p + 24, 8);
+
+    if (mapped_get(p + 32, 8) != o->mm_size ||
+            o->mm_count > PY_SSIZE_T_MAX ||
+            (o->mm_root == 0) != (o->mm_count == 0))
+    {
+        mapped_corrupt();
+        Py_DECREF(o);
+        return NULL;
+    }
+
+    return (PyObject *)o;
+}
+
+static void
+mapped_tp_dealloc(MappedMapObject *self)
+{
+    if (self->mm_weakreflist != NULL) {
+        PyObject_ClearWeakRefs((PyObject *)self);
+    }
+    if (self->mm_view.obj != NULL) {
+        PyBuffer_Release(&self->mm_view);
+    }
+    PyTypeObject *tp = Py_TYPE(self);
+    tp->tp_free((PyObject *)self);
+    Py_DECREF(tp);
+}
+
+static Py_ssize_t
+mapped_tp_len(MappedMapObject *self)
+{
+    return (Py_ssize_t)self->mm_count;
+}
+
+static PyObject *
+mapped_tp_subscript(MappedMapObject *self, PyObject *key)
+{
+    uint64_t val;
+
+    switch (mapped_find(self, key, &val)) {
+        case F_ERROR:
+            return NULL;
+        case F_FOUND:
+            return mapped_load(self, val);
+        case F_NOT_FOUND:
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        default:
+            abort();
+    }
+}
+
+static int
+mapped_tp_contains(MappedMapObject *self, PyObject *key)
+{
+    uint64_t val;
+
+    switch (mapped_find(self, key, &val)) {
+        case F_ERROR:
+            return -1;
+        case F_FOUND:
+            return 1;
+        case F_NOT_FOUND:
+            return 0;
+        default:
+            abort();
+    }
+}
+
+static PyObject *
+mapped_tp_iter(MappedMapObject *self)
+{
+    return mapped_iter_new(self, MV_KEYS);
+}
+
+static PyObject *
+mapped_tp_repr(MappedMapObject *self)
+{
+    return PyUnicode_FromFormat(
+        "<immutables.MappedMap of %zd items at %p>",
+        (Py_ssize_t)self->mm_count, self);
+}
+
+static PyObject *
+mapped_py_get(MappedMapObject *self, PyObject *const *args,
+              Py_ssize_t nargs)
+{
+    uint64_t val;
+
+    if (map_check_nargs("get", nargs, 1, 2)) {
+        return NULL;
+    }
+
+    PyObject *key = args[0];
+    PyObject *def = nargs > 1 ? args[1] : Py_None;
+
+    switch (mapped_find(self, key, &val)) {
+        case F_ERROR:
+            return NULL;
+        case F_FOUND:
+            return mapped_load(self, val);
+        case F_NOT_FOUND:
+            Py_INCREF(def);
+            return def;
+        default:
+            abort();
+    }
+}
+
+static PyObject *
+mapped_view_new(MappedMapObject *o, mapped_view_t kind)
+{
+    MappedMapView *view = PyObject_New(
+        MappedMapView, map_state(o)->MappedMapViewType);
+    if (view == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(o);
+    view->mv_obj = o;
+    view->mv_kind = kind;
+    return (PyObject *)view;
+}
+
+static PyObject *
+mapped_py_keys(MappedMapObject *self, PyObject *args)
+{
+    return mapped_view_new(self, MV_KEYS);
+}
+
+static PyObject *
+mapped_py_values(MappedMapObject *self, PyObject *args)
+{
+    return mapped_view_new(self, MV_VALUES);
+}
+
+static PyObject *
+mapped_py_items(MappedMapObject *self, PyObject *args)
+{
+    return mapped_view_new(self, MV_ITEMS);
+}
+
+static PyObject *
+mapped_py_dumps(PyObject *self, PyObject *src)
+{
+    return mapped_dumps(src);
+}
+
+static PyObject *
+mapped_py_write(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    /* Write the image of a mapping to a new file next to "path" and
+       then move it to "path": processes that have the old file
+       mapped keep using it. */
+
+    PyObject *os_mod = NULL;
+    PyObject *io_mod = NULL;
+    PyObject *tmp_path = NULL;
+    PyObject *file = NULL;
+    PyObject *res = NULL;
+
+    if (map_check_nargs("write", nargs, 2, 2)) {
+        return NULL;
+    }
+
+    PyObject *path = args[0];
+    PyObject *data = mapped_dumps(args[1]);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    os_mod = PyImport_ImportModule("os");
+    io_mod = PyImport_ImportModule("io");
+    if (os_mod == NULL || io_mod == NULL) {
+        goto done;
+    }
+
+    PyObject *fspath = PyOS_FSPath(path);
+    if (fspath == NULL) {
+        goto done;
+    }
+    PyObject *suffix = PyUnicode_Check(fspath) ?
+        PyUnicode_FromString(".tmp") : PyBytes_FromString(".tmp");
+    if (suffix == NULL) {
+        Py_DECREF(fspath);
+        goto done;
+    }
+    tmp_path = PyNumber_Add(fspath, suffix);
+    Py_DECREF(suffix);
+    Py_DECREF(fspath);
+    if (tmp_path == NULL) {
+        goto done;
+    }
+
+    file = PyObject_CallMethod(io_mod, "open", "Os", tmp_path, "wb");
+    if (file == NULL) {
+        goto done;
+    }
+
+    PyObject *written = PyObject_CallMethod(file, "write", "O", data);
+    Py_XDECREF(written);
+    PyObject *closed = PyObject_CallMethod(file, "close", NULL);
+    Py_XDECREF(closed);
+    if (written == NULL || closed == NULL) {
+        goto done;
+    }
+
+    res = PyObject_CallMethod(os_mod, "replace", "OO", tmp_path, path);
+
+done:
+    Py_DECREF(data);
+    Py_XDECREF(os_mod);
+    Py_XDECREF(io_mod);
+    Py_XDECREF(tmp_path);
+    Py_XDECREF(file);
+    return res;
+}
+
+
+static PyMethodDef MappedMap_methods[] = {
+    {"get", (PyCFunction)mapped_py_get, METH_FASTCALL, NULL},
+    {"keys", (PyCFunction)mapped_py_keys, METH_NOARGS, NULL},
+    {"values", (PyCFunction)mapped_py_values, METH_NOARGS, NULL},
+    {"items", (PyCFunction)mapped_py_items, METH_NOARGS, NULL},
+    {"dumps", (PyCFunction)mapped_py_dumps, METH_O|METH_STATIC, NULL},
+    {"write", (PyCFunction)mapped_py_write, METH_FASTCALL|METH_STATIC,
+     NULL},
+    {NULL, NULL}
+};
+
+static PyMemberDef MappedMap_members[] = {
+    {"__weaklistoffset__", T_PYSSIZET,
+     offsetof(MappedMapObject, mm_weakreflist), READONLY},
+    {NULL}
+};
+
+static PyType_Slot MappedMap_slots[] = {
+    {Py_tp_methods, MappedMap_methods},
+    {Py_tp_members, MappedMap_members},
+    {Py_mp_length, mapped_tp_len},
+    {Py_mp_subscript, mapped_tp_subscript},
+    {Py_sq_contains, mapped_tp_contains},
+    {Py_tp_iter, mapped_tp_iter},
+    {Py_tp_dealloc, mapped_tp_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_new, mapped_tp_new},
+    {Py_tp_repr, mapped_tp_repr},
+    {0, NULL},
+};
+
+static PyType_Spec MappedMap_spec = {
+    .name = "immutables._map.MappedMap",
+    .basicsize = sizeof(MappedMapObject),
+    .flags = Py_TPFLAGS_DEFAULT | MAP_TPFLAGS_IMMUTABLE,
+    .slots = MappedMap_slots,
+};
+
+
+/////////////////////////////////// MappedMap: Views and Iterators
+
+
+static PyObject *
+mapped_iter_new(MappedMapObject *o, mapped_view_t kind)
+{
+    MappedMapIterator *it = PyObject_New(
+        MappedMapIterator, map_state(o)->MappedMapIterType);
+    if (it == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(o);
+    it->mi_obj = o;
+    it->mi_kind = kind;
+    mapped_iterator_init(&it->mi_iter, o);
+    return (PyObject *)it;
+}
+
+static void
+mapped_iter_tp_dealloc(MappedMapIterator *it)
+{
+    PyTypeObject *tp = Py_TYPE(it);
+    Py_CLEAR(it->mi_obj);
+    PyObject_Del(it);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+mapped_iter_tp_iternext(MappedMapIterator *it)
+{
+    uint64_t key_offset;
+    uint64_t val_offset;
+
+    int ret;
+
+    Py_BEGIN_CRITICAL_SECTION(it);
+    ret = mapped_iterator_next(
+        it->mi_obj, &it->mi_iter, &key_offset, &val_offset);
+    Py_END_CRITICAL_SECTION();
+    if (ret <= 0) {
+        return NULL;
+    }
+
+    switch (it->mi_kind) {
+        case MV_KEYS:
+            return mapped_load(it->mi_obj, key_offset);
+
+        case MV_VALUES:
+            return mapped_load(it->mi_obj, val_offset);
+
+        case MV_ITEMS: {
+            PyObject *key = mapped_load(it->mi_obj, key_offset);
+            if (key == NULL) {
+                return NULL;
+            }
+            PyObject *val = mapped_load(it->mi_obj, val_offset);
+            if (val == NULL) {
+                Py_DECREF(key);
+                return NULL;
+            }
+            PyObject *item = PyTuple_Pack(2, key, val);
+            Py_DECREF(key);
+            Py_DECREF(val);
+            return item;
+        }
+
+        default:
+            abort();
+    }
+}
+
+static void
+mapped_view_tp_dealloc(MappedMapView *view)
+{
+    PyTypeObject *tp = Py_TYPE(view);
+    Py_CLEAR(view->mv_obj);
+    PyObject_Del(view);
+    Py_DECREF(tp);
+}
+
+static Py_ssize_t
+mapped_view_tp_len(MappedMapView *view)
+{
+    return (Py_ssize_t)view->mv_obj->mm_count;
+}
+
+static PyObject *
+mapped_view_tp_iter(MappedMapView *view)
+{
+    return mapped_iter_new(view->mv_obj, view->mv_kind);
+}
+
+static PyType_Slot MappedMapView_slots[] = {
+    {Py_mp_length, mapped_view_tp_len},
+    {Py_tp_iter, mapped_view_tp_iter},
+    {Py_tp_dealloc, mapped_view_tp_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {0, NULL},
+};
+
+static PyType_Spec MappedMapView_spec = {
+    .name = "immutables._map.mapped_map_view",
+    .basicsize = sizeof(MappedMapView),
+    .flags = Py_TPFLAGS_DEFAULT | MAP_TPFLAGS_INTERNAL,
+    .slots = MappedMapView_slots,
+};
+
+static PyType_Slot MappedMapIter_slots[] = {
+    {Py_tp_dealloc, mapped_iter_tp_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, mapped_iter_tp_iternext},
+    {0, NULL},
+};
+
+static PyType_Spec MappedMapIter_spec = {
+    .name = "immutables._map.mapped_map_iterator",
+    .basicsize = sizeof(MappedMapIterator),
+    .flags = Py_TPFLAGS_DEFAULT | MAP_TPFLAGS_INTERNAL,
+    .slots = MappedMapIter_slots,
+};
+
+
+/////////////////////////////////// Tree Node Types
+
+
+static PyType_Slot MapArrayNode_slots[] = {
+    {Py_tp_dealloc, map_node_array_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_traverse, map_node_array_traverse},
+    {Py_tp_free, PyObject_GC_Del},
+    {Py_tp_hash, PyObject_HashNotImplemented},
+    {0, NULL},
+};
+
+static PyType_Spec MapArrayNode_spec = {
+    .name = "immutables._map.map_array_node",
+    .basicsize = sizeof(MapNode_Array),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | MAP_TPFLAGS_INTERNAL,
+    .slots = MapArrayNode_slots,
+};
+
+static PyType_Slot MapBitmapNode_slots[] = {
+    {Py_tp_dealloc, map_node_bitmap_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_traverse, map_node_bitmap_traverse},
+    {Py_tp_free, PyObject_GC_Del},
+    {Py_tp_hash, PyObject_HashNotImplemented},
+    {0, NULL},
+};
+
+static PyType_Spec MapBitmapNode_spec = {
+    .name = "immutables._map.map_bitmap_node",
+    .basicsize = sizeof(MapNode_Bitmap) - sizeof(PyObject *),
+    .itemsize = sizeof(PyObject *),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | MAP_TPFLAGS_INTERNAL,
+    .slots = MapBitmapNode_slots,
+};
+
+static PyType_Slot MapCollisionNode_slots[] = {
+    {Py_tp_dealloc, map_node_collision_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_traverse, map_node_collision_traverse},
+    {Py_tp_free, PyObject_GC_Del},
+    {Py_tp_hash, PyObject_HashNotImplemented},
+    {0, NULL},
+};
+
+static PyType_Spec MapCollisionNode_spec = {
+    .name = "immutables._map.map_collision_node",
+    .basicsize = sizeof(MapNode_Collision) - sizeof(PyObject *),
+    .itemsize = sizeof(PyObject *),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | MAP_TPFLAGS_INTERNAL,
+    .slots = MapCollisionNode_slots,
+};
+
+
+/////////////////////////////////// C API
+
+
+/* The functions of Immutables_CAPI; see capi.h. */
 
-        default:
-            abort();
-    }
-}
 
 static int
-mapmut_set(MapMutationObject *o, PyObject *key, int32_t key_hash,
-           PyObject *val)
+map_capi_check(PyObject *o, int mutation)
 {
-    int added_leaf = 0;
+    /* Check that "o" is a Map, or a MapMutation if "mutation" is
+       set. */
 
-    assert(key_hash != -1);
-    MapNode *new_root = map_node_assoc(
-        (MapNode *)(o->m_root),
-        0, key_hash, key, val, &added_leaf,
-        o->m_mutid);
-    if (new_root == NULL) {
+    if (mutation ? !MapMutation_Check(o) : !Map_Check(o)) {
+        PyErr_Format(PyExc_TypeError, "expected immutables._map.%s, got %s",
+                     mutation ? "MapMutation" : "Map", Py_TYPE(o)->tp_name);
         return -1;
     }
-
-    if (added_leaf) {
-        o->m_count++;
-    }
-
-    if (new_root == o->m_root) {
-        Py_DECREF(new_root);
-        return 0;
-    }
-
-    Py_SETREF(o->m_root, new_root);
     return 0;
 }
 
 static int
-mapmut_finish(MapMutationObject *o)
+map_capi_map_check(PyObject *o)
 {
-    o->m_mutid = 0;
-    return 0;
+    return Map_Check(o);
 }
 
-static PyObject *
-mapmut_py_set(MapMutationObject *o, PyObject *args)
+static int
+map_capi_mutation_check(PyObject *o)
 {
-    PyObject *key;
-    PyObject *val;
+    return MapMutation_Check(o);
+}
 
-    if (!PyArg_UnpackTuple(args, "set", 2, 2, &key, &val)) {
-        return NULL;
-    }
+static PyObject *
+map_capi_new(void)
+{
+    /* The empty Map of the module instance of the current
+       interpreter. */
 
-    if (mapmut_check_finalized(o)) {
+    PyObject *m = PyImport_ImportModule("immutables._map");
+    if (m == NULL) {
         return NULL;
     }
+    MapObject *o = map_new(PyModule_GetState(m));
+    Py_DECREF(m);
+    return (PyObject *)o;
+}
 
-    int32_t key_hash = map_hash(key);
-    if (key_hash == -1) {
-        return NULL;
+static Py_ssize_t
+map_capi_size(PyObject *map)
+{
+    if (Map_Check(map)) {
+        return map_len((BaseMapObject *)map);
     }
-
-    if (mapmut_set(o, key, key_hash, val)) {
-        return NULL;
+    if (map_capi_check(map, 1)) {
+        return -1;
     }
-
-    Py_RETURN_NONE;
+    return mapmut_tp_len((MapMutationObject *)map);
 }
 
-static PyObject *
-mapmut_tp_richcompare(PyObject *v, PyObject *w, int op)
+static int
+map_capi_find(PyObject *map, PyObject *key, Py_hash_t hash,
+              PyObject **val)
 {
-    if (!MapMutation_Check(v) || !MapMutation_Check(w) ||
-            (op != Py_EQ && op != Py_NE))
-    {
-        Py_RETURN_NOTIMPLEMENTED;
-    }
+    map_find_t res;
 
-    int res = map_eq((BaseMapObject *)v, (BaseMapObject *)w);
-    if (res < 0) {
-        return NULL;
+    if (!Map_Check(map) && map_capi_check(map, 1)) {
+        return -1;
     }
-
-    if (op == Py_NE) {
-        res = !res;
+    if (hash == -1 && (hash = map_hash(key)) == -1) {
+        return -1;
     }
 
-    if (res) {
-        Py_RETURN_TRUE;
+    if (Map_Check(map)) {
+        res = map_find_hashed((BaseMapObject *)map, key, hash, val);
     }
     else {
-        Py_RETURN_FALSE;
+        Py_BEGIN_CRITICAL_SECTION(map);
+        res = map_find_hashed((BaseMapObject *)map, key, hash, val);
+        Py_END_CRITICAL_SECTION();
+    }
+
+    switch (res) {
+        case F_ERROR:
+            return -1;
+        case F_NOT_FOUND:
+            return 0;
+        case F_FOUND:
+            return 1;
+        default:
+            abort();
     }
 }
 
 static PyObject *
-mapmut_py_update(MapMutationObject *self, PyObject *args, PyObject *kwds)
+map_capi_assoc(PyObject *map, PyObject *key, Py_hash_t hash,
+               PyObject *val)
 {
-    PyObject *arg = NULL;
-
-    if (!PyArg_UnpackTuple(args, "update", 0, 1, &arg)) {
+    if (map_capi_check(map, 0)) {
         return NULL;
     }
-
-    if (mapmut_check_finalized(self)) {
+    if (hash == -1 && (hash = map_hash(key)) == -1) {
         return NULL;
     }
-
-    if (arg != NULL) {
-        if (map_update_inplace(self->m_mutid, (BaseMapObject *)self, arg)) {
-            return NULL;
-        }
-    }
-
-    if (kwds != NULL) {
-        if (!PyArg_ValidateKeywordArguments(kwds)) {
-            return NULL;
-        }
-
-        if (map_update_inplace(self->m_mutid, (BaseMapObject *)self, kwds)) {
-            return NULL;
-        }
-    }
-
-    Py_RETURN_NONE;
+    return (PyObject *)map_assoc_hashed((MapObject *)map, key, hash, val);
 }
 
-
 static PyObject *
-mapmut_py_finish(MapMutationObject *self, PyObject *args)
+map_capi_without(PyObject *map, PyObject *key, Py_hash_t hash)
 {
-    if (mapmut_finish(self)) {
+    if (map_capi_check(map, 0)) {
         return NULL;
     }
-
-    MapObject *o = map_alloc();
-    if (o == NULL) {
+    if (hash == -1 && (hash = map_hash(key)) == -1) {
         return NULL;
     }
+    return (PyObject *)map_without_hashed((MapObject *)map, key, hash);
+}
 
-    Py_INCREF(self->m_root);
-    o->h_root = self->m_root;
-    o->h_count = self->m_count;
+static int
+map_capi_iter_init(ImmutablesMapIter *iter, PyObject *map)
+{
+    Py_BUILD_ASSERT(sizeof(MapIteratorState) <= sizeof(ImmutablesMapIter));
 
-    return (PyObject *)o;
+    if (map_capi_check(map, 0)) {
+        return -1;
+    }
+    map_iterator_init_map((MapIteratorState *)iter, (BaseMapObject *)map);
+    return 0;
 }
 
-static PyObject *
-mapmut_py_enter(MapMutationObject *self, PyObject *args)
+static int
+map_capi_iter_next(ImmutablesMapIter *iter, PyObject **key,
+                   PyObject **val, Py_hash_t *hash)
 {
-    Py_INCREF(self);
-    return (PyObject *)self;
+    Py_hash_t key_hash;
+    map_iter_t res = map_iterator_next_hashed(
+        (MapIteratorState *)iter, key, val, &key_hash);
+
+    if (res == I_END) {
+        return 0;
+    }
+    if (hash != NULL) {
+        *hash = key_hash;
+    }
+    return 1;
 }
 
 static PyObject *
-mapmut_py_exit(MapMutationObject *self, PyObject *args)
+map_capi_mutate(PyObject *map)
 {
-    if (mapmut_finish(self)) {
+    if (map_capi_check(map, 0)) {
         return NULL;
     }
-    Py_RETURN_FALSE;
+    return map_py_mutate((MapObject *)map, NULL);
 }
 
 static int
-mapmut_tp_ass_sub(MapMutationObject *self, PyObject *key, PyObject *val)
+map_capi_mutation_set(PyObject *mutation, PyObject *key, Py_hash_t hash,
+                      PyObject *val)
 {
-    if (mapmut_check_finalized(self)) {
+    MapMutationObject *o = (MapMutationObject *)mutation;
+    int err;
+
+    if (map_capi_check(mutation, 1)) {
         return -1;
     }
-
-    int32_t key_hash = map_hash(key);
-    if (key_hash == -1) {
+    if (hash == -1 && (hash = map_hash(key)) == -1) {
         return -1;
     }
 
-    if (val == NULL) {
-        return mapmut_delete(self, key, key_hash);
+    Py_BEGIN_CRITICAL_SECTION(o);
+    err = mapmut_check_finalized(o) || mapmut_set(o, key, hash, val);
+    Py_END_CRITICAL_SECTION();
+    return err ? -1 : 0;
+}
+
+static int
+map_capi_mutation_delete(PyObject *mutation, PyObject *key,
+                         Py_hash_t hash)
+{
+    MapMutationObject *o = (MapMutationObject *)mutation;
+    int err;
+
+    if (map_capi_check(mutation, 1)) {
+        return -1;
     }
-    else {
-        return mapmut_set(self, key, key_hash, val);
+    if (hash == -1 && (hash = map_hash(key)) == -1) {
+        return -1;
     }
+
+    Py_BEGIN_CRITICAL_SECTION(o);
+    err = mapmut_check_finalized(o) || mapmut_delete(o, key, hash);
+    Py_END_CRITICAL_SECTION();
+    return err ? -1 : 0;
 }
 
 static PyObject *
-mapmut_py_pop(MapMutationObject *self, PyObject *args)
+map_capi_mutation_finish(PyObject *mutation)
 {
-    PyObject *key, *deflt = NULL, *val = NULL;
-
-    if(!PyArg_UnpackTuple(args, "pop", 1, 2, &key, &deflt)) {
+    if (map_capi_check(mutation, 1)) {
         return NULL;
     }
+    return mapmut_py_finish((MapMutationObject *)mutation, NULL);
+}
 
-    if (mapmut_check_finalized(self)) {
-        return NULL;
-    }
 
-    if (!self->m_count) {
-        goto not_found;
-    }
+static Immutables_CAPI map_capi = {
+    .version = IMMUTABLES_CAPI_VERSION,
+    .Map_Check = map_capi_map_check,
+    .Mutation_Check = map_capi_mutation_check,
+    .Hash = map_hash,
+    .Map_New = map_capi_new,
+    .Map_Size = map_capi_size,
+    .Map_Find = map_capi_find,
+    .Map_Assoc = map_capi_assoc,
+    .Map_Without = map_capi_without,
+    .Map_IterInit = map_capi_iter_init,
+    .Map_IterNext = map_capi_iter_next,
+    .Map_Mutate = map_capi_mutate,
+    .Mutation_Set = map_capi_mutation_set,
+    .Mutation_Delete = map_capi_mutation_delete,
+    .Mutation_Finish = map_capi_mutation_finish,
+};
 
-    int32_t key_hash = map_hash(key);
-    if (key_hash == -1) {
+
+static PyObject *
+map_module_unpickle(PyObject *m, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (map_check_nargs("_unpickle", nargs, 2, 2)) {
         return NULL;
     }
 
-    map_find_t find_res = map_node_find(self->m_root, 0, key_hash, key, &val);
+    return (PyObject *)map_unpickle(
+        PyModule_GetState(m), args[0], args[1]);
+}
 
-    switch (find_res) {
-        case F_ERROR:
-            return NULL;
 
-        case F_NOT_FOUND:
-            goto not_found;
+static PyObject *
+map_module_archive(PyObject *m, PyObject *maps)
+{
+    return map_archive(maps);
+}
 
-        case F_FOUND:
-            break;
 
-        default:
-            abort();
-    }
+static PyObject *
+map_module_unarchive(PyObject *m, PyObject *data)
+{
+    return map_unarchive(PyModule_GetState(m), data);
+}
 
-    Py_INCREF(val);
 
-    if (mapmut_delete(self, key, key_hash)) {
-        Py_DECREF(val);
-        return NULL;
+static PyMethodDef _mapmodule_methods[] = {
+    {"_unpickle", (PyCFunction)map_module_unpickle, METH_FASTCALL, NULL},
+    {"archive", (PyCFunction)map_module_archive, METH_O, NULL},
+    {"unarchive", (PyCFunction)map_module_unarchive, METH_O, NULL},
+    {NULL, NULL}
+};
+
+
+static int
+module_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    MapState *st = PyModule_GetState(m);
+    Py_VISIT(st->MapType);
+    Py_VISIT(st->MapMutationType);
+    Py_VISIT(st->ArrayNodeType);
+    Py_VISIT(st->BitmapNodeType);
+    Py_VISIT(st->CollisionNodeType);
+    Py_VISIT(st->KeysType);
+    Py_VISIT(st->ValuesType);
+    Py_VISIT(st->ItemsType);
+    Py_VISIT(st->KeysIterType);
+    Py_VISIT(st->ValuesIterType);
+    Py_VISIT(st->ItemsIterType);
+    Py_VISIT(st->MappedMapType);
+    Py_VISIT(st->MappedMapViewType);
+    Py_VISIT(st->MappedMapIterType);
+    Py_VISIT(st->AtomType);
+    Py_VISIT(st->empty_bitmap_node);
+    Py_VISIT(st->unpickle_func);
+    return 0;
+}
+
+
+static void
+module_clear_freelists(MapState *st)
+{
+    /* Free the nodes kept for reuse; see MAP_NODE_FREELISTS. */
+
+#ifdef MAP_NODE_FREELISTS
+    for (Py_ssize_t i = 0; i < MAP_BITMAP_FREELIST_SIZES; i++) {
+        while (st->bitmap_freelist[i] != NULL) {
+            MapNode_Bitmap *node = st->bitmap_freelist[i];
+            st->bitmap_freelist[i] = (MapNode_Bitmap *)node->b_array[0];
+            PyObject_GC_Del(node);
+        }
+        st->bitmap_numfree[i] = 0;
     }
 
-    return val;
+    while (st->array_freelist != NULL) {
+        MapNode_Array *node = st->array_freelist;
+        st->array_freelist = (MapNode_Array *)node->a_array[0];
+        PyObject_GC_Del(node);
+    }
+    st->array_numfree = 0;
 
-not_found:
-    if (deflt) {
-        Py_INCREF(deflt);
-        return deflt;
+    while (st->collision_freelist != NULL) {
+        MapNode_Collision *node = st->collision_freelist;
+        st->collision_freelist = (MapNode_Collision *)node->c_array[0];
+        PyObject_GC_Del(node);
     }
+    st->collision_numfree = 0;
+#else
+    (void)st;
+#endif
+}
 
-    PyErr_SetObject(PyExc_KeyError, key);
-    return NULL;
+
+static int
+module_clear(PyObject *m)
+{
+    MapState *st = PyModule_GetState(m);
+    Py_CLEAR(st->MapType);
+    Py_CLEAR(st->MapMutationType);
+    Py_CLEAR(st->ArrayNodeType);
+    Py_CLEAR(st->BitmapNodeType);
+    Py_CLEAR(st->CollisionNodeType);
+    Py_CLEAR(st->KeysType);
+    Py_CLEAR(st->ValuesType);
+    Py_CLEAR(st->ItemsType);
+    Py_CLEAR(st->KeysIterType);
+    Py_CLEAR(st->ValuesIterType);
+    Py_CLEAR(st->ItemsIterType);
+    Py_CLEAR(st->MappedMapType);
+    Py_CLEAR(st->MappedMapViewType);
+    Py_CLEAR(st->MappedMapIterType);
+    Py_CLEAR(st->AtomType);
+    Py_CLEAR(st->empty_bitmap_node);
+    Py_CLEAR(st->unpickle_func);
+    module_clear_freelists(st);
+    return 0;
 }
 
 
-static PyMethodDef MapMutation_methods[] = {
-    {"set", (PyCFunction)mapmut_py_set, METH_VARARGS, NULL},
-    {"get", (PyCFunction)map_py_get, METH_VARARGS, NULL},
-    {"pop", (PyCFunction)mapmut_py_pop, METH_VARARGS, NULL},
-    {"finish", (PyCFunction)mapmut_py_finish, METH_NOARGS, NULL},
-    {"update", (PyCFunction)mapmut_py_update,
-        METH_VARARGS | METH_KEYWORDS, NULL},
-    {"__enter__", (PyCFunction)mapmut_py_enter, METH_NOARGS, NULL},
-    {"__exit__", (PyCFunction)mapmut_py_exit, METH_VARARGS, NULL},
-    {NULL, NULL}
-};
+static void
+module_free(void *m)
+{
+    (void)module_clear((PyObject *)m);
+}
 
-static PySequenceMethods MapMutation_as_sequence = {
-    0,                                /* sq_length */
-    0,                                /* sq_concat */
-    0,                                /* sq_repeat */
-    0,                                /* sq_item */
-    0,                                /* sq_slice */
-    0,                                /* sq_ass_item */
-    0,                                /* sq_ass_slice */
-    (objobjproc)map_tp_contains,      /* sq_contains */
-    0,                                /* sq_inplace_concat */
-    0,                                /* sq_inplace_repeat */
-};
 
-static PyMappingMethods MapMutation_as_mapping = {
-    (lenfunc)map_tp_len,              /* mp_length */
-    (binaryfunc)map_tp_subscript,     /* mp_subscript */
-    (objobjargproc)mapmut_tp_ass_sub, /* mp_subscript */
-};
+static PyTypeObject *
+module_new_type(PyObject *m, PyType_Spec *spec)
+{
+    PyTypeObject *type = (PyTypeObject *)PyType_FromModuleAndSpec(
+        m, spec, NULL);
+
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+    /* Python 3.9 gives types without a tp_new the one of object. */
+    if (type != NULL) {
+        PyType_Slot *slot = spec->slots;
+        while (slot->slot != 0 && slot->slot != Py_tp_new) {
+            slot++;
+        }
+        if (slot->slot == 0) {
+            type->tp_new = NULL;
+        }
+    }
+#endif
 
-PyTypeObject _MapMutation_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "immutables._map.MapMutation",
-    sizeof(MapMutationObject),
-    .tp_methods = MapMutation_methods,
-    .tp_as_mapping = &MapMutation_as_mapping,
-    .tp_as_sequence = &MapMutation_as_sequence,
-    .tp_dealloc = (destructor)map_tp_dealloc,
-    .tp_getattro = PyObject_GenericGetAttr,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
-    .tp_traverse = (traverseproc)map_tp_traverse,
-    .tp_richcompare = mapmut_tp_richcompare,
-    .tp_clear = (inquiry)map_tp_clear,
-    .tp_weaklistoffset = offsetof(MapMutationObject, m_weakreflist),
-    .tp_repr = (reprfunc)map_py_repr,
-    .tp_hash = PyObject_HashNotImplemented,
-};
+    return type;
+}
 
 
-/////////////////////////////////// Tree Node Types
+static int
+module_exec(PyObject *m)
+{
+    MapState *st = PyModule_GetState(m);
+
+    /* Mutids of mutations start at 1: 0 marks immutable nodes. */
+    st->mutid_counter = 1;
+
+    if ((st->MapType = module_new_type(m, &Map_spec)) == NULL ||
+        (st->MapMutationType =
+            module_new_type(m, &MapMutation_spec)) == NULL ||
+        (st->ArrayNodeType =
+            module_new_type(m, &MapArrayNode_spec)) == NULL ||
+        (st->BitmapNodeType =
+            module_new_type(m, &MapBitmapNode_spec)) == NULL ||
+        (st->CollisionNodeType =
+            module_new_type(m, &MapCollisionNode_spec)) == NULL ||
+        (st->KeysType = module_new_type(m, &MapKeys_spec)) == NULL ||
+        (st->ValuesType = module_new_type(m, &MapValues_spec)) == NULL ||
+        (st->ItemsType = module_new_type(m, &MapItems_spec)) == NULL ||
+        (st->KeysIterType =
+            module_new_type(m, &MapKeysIter_spec)) == NULL ||
+        (st->ValuesIterType =
+            module_new_type(m, &MapValuesIter_spec)) == NULL ||
+        (st->ItemsIterType =
+            module_new_type(m, &MapItemsIter_spec)) == NULL ||
+        (st->MappedMapType =
+            module_new_type(m, &MappedMap_spec)) == NULL ||
+        (st->MappedMapViewType =
+            module_new_type(m, &MappedMapView_spec)) == NULL ||
+        (st->MappedMapIterType =
+            module_new_type(m, &MappedMapIter_spec)) == NULL ||
+        (st->AtomType = module_new_type(m, &MapAtom_spec)) == NULL)
+    {
+        return -1;
+    }
 
+    st->MapType->tp_vectorcall = map_vectorcall;
 
-PyTypeObject _Map_ArrayNode_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "map_array_node",
-    sizeof(MapNode_Array),
-    0,
-    .tp_dealloc = (destructor)map_node_array_dealloc,
-    .tp_getattro = PyObject_GenericGetAttr,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
-    .tp_traverse = (traverseproc)map_node_array_traverse,
-    .tp_free = PyObject_GC_Del,
-    .tp_hash = PyObject_HashNotImplemented,
-};
+    if (PyModule_AddType(m, st->MapType) < 0 ||
+        PyModule_AddType(m, st->MappedMapType) < 0 ||
+        PyModule_AddType(m, st->AtomType) < 0)
+    {
+        return -1;
+    }
 
-PyTypeObject _Map_BitmapNode_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "map_bitmap_node",
-    sizeof(MapNode_Bitmap) - sizeof(PyObject *),
-    sizeof(PyObject *),
-    .tp_dealloc = (destructor)map_node_bitmap_dealloc,
-    .tp_getattro = PyObject_GenericGetAttr,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
-    .tp_traverse = (traverseproc)map_node_bitmap_traverse,
-    .tp_free = PyObject_GC_Del,
-    .tp_hash = PyObject_HashNotImplemented,
-};
+    st->empty_bitmap_node = (MapNode_Bitmap *)map_node_bitmap_new(
+        st, 0, 0, 0);
+    if (st->empty_bitmap_node == NULL) {
+        return -1;
+    }
 
-PyTypeObject _Map_CollisionNode_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "map_collision_node",
-    sizeof(MapNode_Collision) - sizeof(PyObject *),
-    sizeof(PyObject *),
-    .tp_dealloc = (destructor)map_node_collision_dealloc,
-    .tp_getattro = PyObject_GenericGetAttr,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
-    .tp_traverse = (traverseproc)map_node_collision_traverse,
-    .tp_free = PyObject_GC_Del,
-    .tp_hash = PyObject_HashNotImplemented,
-};
+    PyObject *capi = PyCapsule_New(&map_capi, IMMUTABLES_CAPI_NAME, NULL);
+    if (capi == NULL) {
+        return -1;
+    }
+    if (PyModule_AddObject(m, "_C_API", capi) < 0) {
+        Py_DECREF(capi);
+        return -1;
+    }
 
+    st->unpickle_func = PyObject_GetAttrString(m, "_unpickle");
+    if (st->unpickle_func == NULL) {
+        return -1;
+    }
 
-static void
-module_free(void *m)
-{
-    Py_CLEAR(_empty_bitmap_node);
+    return 0;
 }
 
 
+static PyModuleDef_Slot _mapmodule_slots[] = {
+    {Py_mod_exec, module_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
+
 static struct PyModuleDef _mapmodule = {
     PyModuleDef_HEAD_INIT,      /* m_base */
     "_map",                     /* m_name */
     NULL,                       /* m_doc */
-    -1,                         /* m_size */
-    NULL,                       /* m_methods */
-    NULL,                       /* m_slots */
-    NULL,                       /* m_traverse */
-    NULL,                       /* m_clear */
+    sizeof(MapState),           /* m_size */
+    _mapmodule_methods,         /* m_methods */
+    _mapmodule_slots,           /* m_slots */
+    module_traverse,            /* m_traverse */
+    module_clear,               /* m_clear */
     module_free,                /* m_free */
 };
 
@@ -4172,28 +13171,5 @@ static struct PyModuleDef _mapmodule = {
 PyMODINIT_FUNC
 PyInit__map(void)
 {
-    PyObject *m = PyModule_Create(&_mapmodule);
-
-    if ((PyType_Ready(&_Map_Type) < 0) ||
-        (PyType_Ready(&_MapMutation_Type) < 0) ||
-        (PyType_Ready(&_Map_ArrayNode_Type) < 0) ||
-        (PyType_Ready(&_Map_BitmapNode_Type) < 0) ||
-        (PyType_Ready(&_Map_CollisionNode_Type) < 0) ||
-        (PyType_Ready(&_MapKeys_Type) < 0) ||
-        (PyType_Ready(&_MapValues_Type) < 0) ||
-        (PyType_Ready(&_MapItems_Type) < 0) ||
-        (PyType_Ready(&_MapKeysIter_Type) < 0) ||
-        (PyType_Ready(&_MapValuesIter_Type) < 0) ||
-        (PyType_Ready(&_MapItemsIter_Type) < 0))
-    {
-        return 0;
-    }
-
-    Py_INCREF(&_Map_Type);
-    if (PyModule_AddObject(m, "Map", (PyObject *)&_Map_Type) < 0) {
-        Py_DECREF(&_Map_Type);
-        return NULL;
-    }
-
-    return m;
+    return PyModuleDef_Init(&_mapmodule);
 }
@@ -6,20 +6,21 @@
 
 /*
 HAMT tree is shaped by hashes of keys. Every group of 5 bits of a hash denotes
-the exact position of the key in one level of the tree. Since we're using
-32 bit hashes, we can have at most 7 such levels. Although if there are
-two distinct keys with equal hashes, they will have to occupy the same
-cell in the 7th level of the tree -- so we'd put them in a "collision" node.
-Which brings the total possible tree depth to 8. Read more about the actual
-layout of the HAMT tree in `_map.c`.
+the exact position of the key in one level of the tree. We use the full
+Python hash: with 64 bit hashes we can have at most 13 such levels (7 with
+32 bit hashes). Although if there are two distinct keys with equal hashes,
+they will have to occupy the same cell in the last level of the tree -- so
+we'd put them in a "collision" node. Which brings the total possible tree
+depth to 14 (or 8). Read more about the actual layout of the HAMT tree in
+`_map.c`.
 
 This constant is used to define a datastucture for storing iteration state.
 */
+#if SIZEOF_PY_HASH_T > 4
+#define _Py_HAMT_MAX_TREE_DEPTH 14
+#else
 #define _Py_HAMT_MAX_TREE_DEPTH 8
-
-
-#define Map_Check(o) (Py_TYPE(o) == &_Map_Type)
-#define MapMutation_Check(o) (Py_TYPE(o) == &_MapMutation_Type)
+#endif
 
 
 /* Abstract tree node. */
@@ -29,7 +30,7 @@ typedef struct {
 
 
 #define _MapCommonFields(pref)          \
-    PyObject_HEAD                       \
+    PyObject_VAR_HEAD                   \
     MapNode *pref##_root;               \
     PyObject *pref##_weakreflist;       \
     Py_ssize_t pref##_count;
@@ -42,10 +43,22 @@ typedef struct {
 } BaseMapObject;
 
 
-/* An HAMT immutable mapping collection. */
+/* A key/value pair of a small map, along with the hash of the key. */
+typedef struct {
+    PyObject *e_key;
+    PyObject *e_val;
+    Py_hash_t e_hash;
+} MapEntry;
+
+
+/* An HAMT immutable mapping collection.
+
+   Small maps (see MAP_SMALL_MAX_COUNT) don't have a tree: h_root
+   is NULL, and their items are stored in h_entries. */
 typedef struct {
     _MapCommonFields(h)
     Py_hash_t h_hash;
+    MapEntry h_entries[1];
 } MapObject;
 
 
@@ -64,14 +77,18 @@ typedef struct {
    So for iterators, we can implement zero allocations and zero reference
    inc/dec depth-first iteration.
 
-   - i_nodes: an array of seven pointers to tree nodes
+   - i_nodes: an array of pointers to tree nodes, one for each level
    - i_level: the current node in i_nodes
    - i_pos: an array of positions within nodes in i_nodes.
+   - i_entries, i_entries_count: items of a small map, if we're
+     iterating over one; i_pos[0] is the position within them.
 */
 typedef struct {
     MapNode *i_nodes[_Py_HAMT_MAX_TREE_DEPTH];
     Py_ssize_t i_pos[_Py_HAMT_MAX_TREE_DEPTH];
     int8_t i_level;
+    MapEntry *i_entries;
+    Py_ssize_t i_entries_count;
 } MapIteratorState;
 
 
@@ -99,20 +116,68 @@ typedef struct {
 } MapIterator;
 
 
-/* PyTypes */
+/* A reference to a Map that threads replace atomically; see "Atom"
+   in `_map.c`.  Free-threaded builds count the readers of the Map in
+   one of two sets of counters, striped by thread and a cache line
+   each. */
+#define _MAP_ATOM_STRIPE_BITS 3
 
+typedef struct {
+    PyObject_HEAD
+    MapObject *a_map;
+    PyObject *a_weakreflist;
+#ifdef Py_GIL_DISABLED
+    PyMutex a_mutex;
+    Py_ssize_t a_epoch;
+    struct {
+        Py_ssize_t r_count;
+        char r_pad[64 - sizeof(Py_ssize_t)];
+    } a_readers[2][1 << _MAP_ATOM_STRIPE_BITS];
+#endif
+} MapAtomObject;
+
+
+/* A read-only Map stored in a flat buffer, usually a memory-mapped
+   file; see "MappedMap" in `_map.c` for the layout.  Keys and values
+   are only turned into Python objects when they are read. */
+typedef struct {
+    PyObject_HEAD
+    Py_buffer mm_view;
+    const unsigned char *mm_buf;
+    uint64_t mm_size;
+    uint64_t mm_count;
+    uint64_t mm_root;
+    PyObject *mm_weakreflist;
+} MappedMapObject;
 
-PyTypeObject _Map_Type;
-PyTypeObject _MapMutation_Type;
-PyTypeObject _Map_ArrayNode_Type;
-PyTypeObject _Map_BitmapNode_Type;
-PyTypeObject _Map_CollisionNode_Type;
-PyTypeObject _MapKeys_Type;
-PyTypeObject _MapValues_Type;
-PyTypeObject _MapItems_Type;
-PyTypeObject _MapKeysIter_Type;
-PyTypeObject _MapValuesIter_Type;
-PyTypeObject _MapItemsIter_Type;
+
+/* Mapped files always use 64-bit hashes, see _Py_HAMT_MAX_TREE_DEPTH. */
+#define _MAPPED_MAX_TREE_DEPTH 14
+
+
+/* The state of a depth-first traverse of a MappedMap; mirrors
+   MapIteratorState, with offsets of nodes instead of pointers. */
+typedef struct {
+    uint64_t i_nodes[_MAPPED_MAX_TREE_DEPTH];
+    uint64_t i_pos[_MAPPED_MAX_TREE_DEPTH];
+    int8_t i_level;
+} MappedIteratorState;
+
+
+typedef enum {MV_KEYS, MV_VALUES, MV_ITEMS} mapped_view_t;
+
+typedef struct {
+    PyObject_HEAD
+    MappedMapObject *mv_obj;
+    mapped_view_t mv_kind;
+} MappedMapView;
+
+typedef struct {
+    PyObject_HEAD
+    MappedMapObject *mi_obj;
+    mapped_view_t mi_kind;
+    MappedIteratorState mi_iter;
+} MappedMapIterator;
 
 
 #endif
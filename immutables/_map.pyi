@@ -1,9 +1,12 @@
+import os
 import sys
 from typing import Any
+from typing import Callable
 from typing import Dict
 from typing import Generic
 from typing import Iterable
 from typing import Iterator
+from typing import List
 from typing import Mapping
 from typing import Optional
 from typing import Tuple
@@ -22,6 +25,7 @@ from ._protocols import MapValues
 from ._protocols import HT
 from ._protocols import KT
 from ._protocols import T
+from ._protocols import VT
 from ._protocols import VT_co
 
 
@@ -40,7 +44,15 @@ class Map(Mapping[KT, VT_co]):
         __col: Union[IterableItems[KT, VT_co], Iterable[Tuple[KT, VT_co]]],
         **kw: VT_co
     ) -> None: ...
-    def __reduce__(self) -> Tuple[Type[Map[KT, VT_co]], Tuple[Dict[KT, VT_co]]]: ...
+    @overload
+    @classmethod
+    def fromkeys(cls, keys: Iterable[HT]) -> Map[HT, None]: ...
+    @overload
+    @classmethod
+    def fromkeys(cls, keys: Iterable[HT], value: T) -> Map[HT, T]: ...
+    def __reduce__(self) -> Tuple[Any, Tuple[Any, ...]]: ...
+    def __copy__(self) -> Map[KT, VT_co]: ...
+    def __deepcopy__(self, memo: Dict[int, Any]) -> Map[KT, VT_co]: ...
     def __len__(self) -> int: ...
     def __eq__(self, other: Any) -> bool: ...
     @overload
@@ -59,7 +71,26 @@ class Map(Mapping[KT, VT_co]):
         self: Map[Union[HT, str], Any],
         **kw: VT_co  # type: ignore[misc]
     ) -> Map[KT, VT_co]: ...
+    def merge(
+        self,
+        other: Map[KT, VT_co],
+        resolve: Optional[Callable[[KT, VT_co, VT_co], VT_co]] = ...,
+    ) -> Map[KT, VT_co]: ...
+    def __or__(self, other: Map[KT, VT_co]) -> Map[KT, VT_co]: ...
     def mutate(self) -> MapMutation[KT, VT_co]: ...
+    def diff(
+        self, other: Map[KT, VT_co]
+    ) -> Tuple[
+        Map[KT, VT_co], Map[KT, VT_co], Map[KT, Tuple[VT_co, VT_co]]
+    ]: ...
+    def make_patch(self, other: Map[KT, VT_co]) -> bytes: ...
+    def apply_patch(self, data: bytes) -> Map[KT, VT_co]: ...
+    def intersection(self, other: Map[KT, Any]) -> Map[KT, VT_co]: ...
+    def difference(self, other: Map[KT, Any]) -> Map[KT, VT_co]: ...
+    def symmetric_difference(
+        self, other: Map[KT, VT_co]
+    ) -> Map[KT, VT_co]: ...
+    def restrict(self, keys: Iterable[Any]) -> Map[KT, VT_co]: ...
     def set(self, key: KT, val: VT_co) -> Map[KT, VT_co]: ...  # type: ignore[misc]
     def delete(self, key: KT) -> Map[KT, VT_co]: ...
     @overload
@@ -78,3 +109,52 @@ class Map(Mapping[KT, VT_co]):
         def __class_getitem__(cls, item: Any) -> GenericAlias: ...
     else:
         def __class_getitem__(cls, item: Any) -> Type[Map[Any, Any]]: ...
+
+
+def archive(maps: Iterable[Map[Any, Any]]) -> bytes: ...
+def unarchive(data: bytes) -> List[Map[Any, Any]]: ...
+
+class Atom(Generic[KT, VT]):
+    @overload
+    def __init__(self) -> None: ...
+    @overload
+    def __init__(self, __map: Map[KT, VT]) -> None: ...
+    def deref(self) -> Map[KT, VT]: ...
+    def reset(self, __map: Map[KT, VT]) -> Map[KT, VT]: ...
+    def compare_and_set(
+        self, __expected: Map[KT, VT], __map: Map[KT, VT]
+    ) -> bool: ...
+    def swap(
+        self,
+        __fn: Callable[..., Map[KT, VT]],
+        *args: Any,
+        **kwargs: Any,
+    ) -> Map[KT, VT]: ...
+    def __class_getitem__(cls, item: Any) -> GenericAlias: ...
+
+_MappedKey = Union[str, bytes, int]
+_MappedValue = Union[str, bytes, int, float, bool, None]
+
+class MappedMap:
+    def __init__(
+        self,
+        source: Union[str, 'os.PathLike[str]', bytes, bytearray, memoryview],
+    ) -> None: ...
+    @staticmethod
+    def dumps(src: Mapping[_MappedKey, _MappedValue]) -> bytes: ...
+    @staticmethod
+    def write(
+        path: Union[str, 'os.PathLike[str]'],
+        src: Mapping[_MappedKey, _MappedValue],
+    ) -> None: ...
+    def __len__(self) -> int: ...
+    def __getitem__(self, key: Any) -> _MappedValue: ...
+    def __contains__(self, key: Any) -> bool: ...
+    def __iter__(self) -> Iterator[_MappedKey]: ...
+    @overload
+    def get(self, key: Any) -> _MappedValue: ...
+    @overload
+    def get(self, key: Any, default: T) -> Union[_MappedValue, T]: ...
+    def keys(self) -> Iterable[_MappedKey]: ...
+    def values(self) -> Iterable[_MappedValue]: ...
+    def items(self) -> Iterable[Tuple[_MappedKey, _MappedValue]]: ...
@@ -33,6 +33,10 @@ class MapKeys(Protocol[KT_co]):
     def __len__(self) -> int: ...
     def __iter__(self) -> Iterator[KT_co]: ...
     def __contains__(self, __key: object) -> bool: ...
+    def __and__(self, __other: 'MapKeys[Any]') -> 'MapKeys[KT_co]': ...
+    def __or__(self, __other: 'MapKeys[Any]') -> 'MapKeys[Any]': ...
+    def __sub__(self, __other: 'MapKeys[Any]') -> 'MapKeys[KT_co]': ...
+    def __xor__(self, __other: 'MapKeys[Any]') -> 'MapKeys[Any]': ...
 
 
 class MapValues(Protocol[VT_co]):
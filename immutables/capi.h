@@ -0,0 +1,129 @@
+#ifndef IMMUTABLES_CAPI_H
+#define IMMUTABLES_CAPI_H
+
+#include "Python.h"
+
+/*
+C API of immutables, for extensions that read and build Maps without
+going through Python-level calls.
+
+The API is a table of functions exported by the `immutables._map`
+module as a capsule.  Extensions add `immutables.get_include()` to
+their include directories, and import the table once, usually in
+their module init function, before using anything below:
+
+    #include "capi.h"
+
+    if (Immutables_ImportCAPI() < 0) {
+        return NULL;
+    }
+
+    PyObject *val;
+    int found = ImmutablesCAPI->Map_Find(map, key, -1, &val);
+
+Conventions:
+
+- Functions taking a key also take its hash, as returned by
+  `ImmutablesCAPI->Hash()`; pass -1 to have it computed.  Looking up
+  the same key in many Maps only needs it to be hashed once.
+- Find functions return 1 and set `*val` to a borrowed reference if
+  the key is there, 0 if it isn't, and -1 with an exception set on
+  error.  Other functions returning `int` return 0 on success and -1
+  on error; functions returning `PyObject *` return a new reference,
+  or NULL on error.
+- Arguments of the wrong types raise TypeError.
+- Maps can be used from any number of threads.  A value found in a
+  MapMutation is only guaranteed to stay alive until the mutation is
+  changed; take a reference to it if other threads may change it.
+
+New members are only ever added at the end of the table; the version
+tells which of them are there.
+*/
+
+#define IMMUTABLES_CAPI_VERSION 1
+#define IMMUTABLES_CAPI_NAME "immutables._map._C_API"
+
+
+/* The state of an iteration over a Map; opaque. */
+typedef struct {
+    Py_ssize_t _private[32];
+} ImmutablesMapIter;
+
+
+typedef struct {
+    int version;
+
+    /* Whether "o" is a Map, or a MapMutation.  Every interpreter has
+       types of its own, so use these rather than comparing types. */
+    int (*Map_Check)(PyObject *o);
+    int (*Mutation_Check)(PyObject *o);
+
+    /* The hash Maps use for "key"; -1 on error. */
+    Py_hash_t (*Hash)(PyObject *key);
+
+    /* Maps.  Map_Size() and Map_Find() also accept MapMutations. */
+    PyObject *(*Map_New)(void);
+    Py_ssize_t (*Map_Size)(PyObject *map);
+    int (*Map_Find)(PyObject *map, PyObject *key, Py_hash_t hash,
+                    PyObject **val);
+    PyObject *(*Map_Assoc)(PyObject *map, PyObject *key, Py_hash_t hash,
+                           PyObject *val);
+    /* Raises KeyError if "key" isn't in "map". */
+    PyObject *(*Map_Without)(PyObject *map, PyObject *key,
+                             Py_hash_t hash);
+
+    /* Iteration over a Map, which has to stay alive until the
+       iteration is over.  Map_IterNext() returns 1 and sets borrowed
+       references to the next item, and its hash unless "hash" is
+       NULL, or returns 0 once all items were visited. */
+    int (*Map_IterInit)(ImmutablesMapIter *iter, PyObject *map);
+    int (*Map_IterNext)(ImmutablesMapIter *iter, PyObject **key,
+                        PyObject **val, Py_hash_t *hash);
+
+    /* Mutations: Map_Mutate() returns a MapMutation of "map" that is
+       updated in place, and Mutation_Finish() returns the resulting
+       Map and makes the mutation read-only. */
+    PyObject *(*Map_Mutate)(PyObject *map);
+    int (*Mutation_Set)(PyObject *mutation, PyObject *key,
+                        Py_hash_t hash, PyObject *val);
+    /* Raises KeyError if "key" isn't in "mutation". */
+    int (*Mutation_Delete)(PyObject *mutation, PyObject *key,
+                           Py_hash_t hash);
+    PyObject *(*Mutation_Finish)(PyObject *mutation);
+} Immutables_CAPI;
+
+
+#ifndef IMMUTABLES_CAPI_IMPLEMENTATION
+
+static Immutables_CAPI *ImmutablesCAPI = NULL;
+
+#define ImmutablesMap_Check(o) \
+    (ImmutablesCAPI->Map_Check(o))
+#define ImmutablesMapMutation_Check(o) \
+    (ImmutablesCAPI->Mutation_Check(o))
+
+static int
+Immutables_ImportCAPI(void)
+{
+    Immutables_CAPI *api = (Immutables_CAPI *)PyCapsule_Import(
+        IMMUTABLES_CAPI_NAME, 0);
+    if (api == NULL) {
+        return -1;
+    }
+
+    if (api->version < IMMUTABLES_CAPI_VERSION) {
+        PyErr_Format(
+            PyExc_ImportError,
+            "immutables C API version %d is older than version %d "
+            "this extension was built with",
+            api->version, IMMUTABLES_CAPI_VERSION);
+        return -1;
+    }
+
+    ImmutablesCAPI = api;
+    return 0;
+}
+
+#endif  /* !IMMUTABLES_CAPI_IMPLEMENTATION */
+
+#endif  /* IMMUTABLES_CAPI_H */
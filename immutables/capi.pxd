@@ -0,0 +1,50 @@
+# Cython declarations of the C API of immutables; see capi.h.
+#
+#     from immutables cimport capi
+#
+#     capi.Immutables_ImportCAPI()
+#     found = capi.ImmutablesCAPI.Map_Find(m, key, -1, &val)
+
+from cpython.object cimport PyObject
+
+
+cdef extern from "capi.h":
+    ctypedef Py_ssize_t Py_hash_t
+
+    int IMMUTABLES_CAPI_VERSION
+
+    ctypedef struct ImmutablesMapIter:
+        pass
+
+    ctypedef struct Immutables_CAPI:
+        int version
+
+        bint (*Map_Check)(object o)
+        bint (*Mutation_Check)(object o)
+
+        Py_hash_t (*Hash)(object key) except -1
+
+        object (*Map_New)()
+        Py_ssize_t (*Map_Size)(object map) except -1
+        int (*Map_Find)(object map, object key, Py_hash_t hash,
+                        PyObject **val) except -1
+        object (*Map_Assoc)(object map, object key, Py_hash_t hash,
+                            object val)
+        object (*Map_Without)(object map, object key, Py_hash_t hash)
+
+        int (*Map_IterInit)(ImmutablesMapIter *iter, object map) except -1
+        int (*Map_IterNext)(ImmutablesMapIter *iter, PyObject **key,
+                            PyObject **val, Py_hash_t *hash)
+
+        object (*Map_Mutate)(object map)
+        int (*Mutation_Set)(object mutation, object key, Py_hash_t hash,
+                            object val) except -1
+        int (*Mutation_Delete)(object mutation, object key,
+                               Py_hash_t hash) except -1
+        object (*Mutation_Finish)(object mutation)
+
+    Immutables_CAPI *ImmutablesCAPI
+
+    bint ImmutablesMap_Check(object o)
+    bint ImmutablesMapMutation_Check(object o)
+    int Immutables_ImportCAPI() except -1
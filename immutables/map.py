@@ -1,11 +1,18 @@
 import collections.abc
+import copy
 import itertools
+import math
+import mmap
+import os
+import pickle
 import reprlib
+import struct
 import sys
+import threading
 import types
 
 
-__all__ = ('Map',)
+__all__ = ('Atom', 'Map', 'MappedMap', 'archive', 'unarchive')
 
 
 # Thread-safe counter.
@@ -18,12 +25,14 @@ _mut_id = itertools.count(1).__next__
 # debugging and testing easier.
 
 
+# Number of bits in a hash returned by map_hash().
+HASH_BITS = sys.hash_info.width
+
+
 def map_hash(o):
-    x = hash(o)
-    if sys.hash_info.width > 32:
-        return (x & 0xffffffff) ^ ((x >> 32) & 0xffffffff)
-    else:
-        return x
+    # The C implementation treats hashes as unsigned when computing
+    # masks; do the same here so that both build the same tree.
+    return hash(o) & ((1 << HASH_BITS) - 1)
 
 
 def map_mask(hash, shift):
@@ -62,43 +71,51 @@ del _Unhashable
 
 class BitmapNode:
 
-    def __init__(self, size, bitmap, array, mutid):
-        self.size = size
-        self.bitmap = bitmap
-        assert isinstance(array, list) and len(array) == size
+    def __init__(self, datamap, nodemap, array, hashes, nodes, mutid):
+        self.datamap = datamap
+        self.nodemap = nodemap
+        assert isinstance(array, list)
+        assert len(array) == 2 * map_bitcount(datamap)
         self.array = array
+        assert isinstance(hashes, list) and len(hashes) == len(array) // 2
+        self.hashes = hashes
+        assert isinstance(nodes, list) and len(nodes) == map_bitcount(nodemap)
+        self.nodes = nodes
         self.mutid = mutid
 
+    def deepcopy(self, c):
+        array = []
+        for i, hash in enumerate(self.hashes):
+            array.extend(c.pair(hash, self.array[2 * i],
+                                self.array[2 * i + 1]))
+        nodes = [node.deepcopy(c) for node in self.nodes]
+
+        if (all(a is b for a, b in zip(array, self.array)) and
+                all(a is b for a, b in zip(nodes, self.nodes))):
+            return self
+        return BitmapNode(
+            self.datamap, self.nodemap, array, self.hashes.copy(),
+            nodes, 0)
+
     def clone(self, mutid):
-        return BitmapNode(self.size, self.bitmap, self.array.copy(), mutid)
+        return BitmapNode(
+            self.datamap, self.nodemap, self.array.copy(),
+            self.hashes.copy(), self.nodes.copy(), mutid)
 
     def assoc(self, shift, hash, key, val, mutid):
         bit = map_bitpos(hash, shift)
-        idx = map_bitindex(self.bitmap, bit)
 
-        if self.bitmap & bit:
+        if self.datamap & bit:
+            idx = map_bitindex(self.datamap, bit)
             key_idx = 2 * idx
             val_idx = key_idx + 1
 
-            key_or_null = self.array[key_idx]
-            val_or_node = self.array[val_idx]
-
-            if key_or_null is _NULL:
-                sub_node, added = val_or_node.assoc(
-                    shift + 5, hash, key, val, mutid)
-                if val_or_node is sub_node:
-                    return self, added
+            existing_key = self.array[key_idx]
+            existing_val = self.array[val_idx]
+            existing_hash = self.hashes[idx]
 
-                if mutid and mutid == self.mutid:
-                    self.array[val_idx] = sub_node
-                    return self, added
-                else:
-                    ret = self.clone(mutid)
-                    ret.array[val_idx] = sub_node
-                    return ret, added
-
-            if key == key_or_null:
-                if val is val_or_node:
+            if hash == existing_hash and key == existing_key:
+                if val is existing_val:
                     return self, False
 
                 if mutid and mutid == self.mutid:
@@ -109,184 +126,241 @@ class BitmapNode:
                     ret.array[val_idx] = val
                     return ret, False
 
-            existing_key_hash = map_hash(key_or_null)
-            if existing_key_hash == hash:
-                sub_node = CollisionNode(
-                    4, hash, [key_or_null, val_or_node, key, val], mutid)
-            else:
-                sub_node = BitmapNode(0, 0, [], mutid)
-                sub_node, _ = sub_node.assoc(
-                    shift + 5, existing_key_hash,
-                    key_or_null, val_or_node,
-                    mutid)
-                sub_node, _ = sub_node.assoc(
-                    shift + 5, hash, key, val,
-                    mutid)
+            sub_node = map_node_new_bitmap_or_collision(
+                shift + 5,
+                existing_hash, existing_key, existing_val,
+                hash, key, val,
+                mutid)
+
+            node_idx = map_bitindex(self.nodemap, bit)
+
+            new_array = self.array[:key_idx]
+            new_array.extend(self.array[val_idx + 1:])
+
+            new_hashes = self.hashes[:idx]
+            new_hashes.extend(self.hashes[idx + 1:])
+
+            new_nodes = self.nodes[:node_idx]
+            new_nodes.append(sub_node)
+            new_nodes.extend(self.nodes[node_idx:])
 
             if mutid and mutid == self.mutid:
-                self.array[key_idx] = _NULL
-                self.array[val_idx] = sub_node
+                self.datamap &= ~bit
+                self.nodemap |= bit
+                self.array = new_array
+                self.hashes = new_hashes
+                self.nodes = new_nodes
                 return self, True
+            else:
+                return BitmapNode(
+                    self.datamap & ~bit, self.nodemap | bit,
+                    new_array, new_hashes, new_nodes, mutid), True
+
+        elif self.nodemap & bit:
+            node_idx = map_bitindex(self.nodemap, bit)
+            node = self.nodes[node_idx]
+
+            sub_node, added = node.assoc(shift + 5, hash, key, val, mutid)
+            if node is sub_node:
+                return self, added
+
+            if mutid and mutid == self.mutid:
+                self.nodes[node_idx] = sub_node
+                return self, added
             else:
                 ret = self.clone(mutid)
-                ret.array[key_idx] = _NULL
-                ret.array[val_idx] = sub_node
-                return ret, True
+                ret.nodes[node_idx] = sub_node
+                return ret, added
 
         else:
+            idx = map_bitindex(self.datamap, bit)
             key_idx = 2 * idx
-            val_idx = key_idx + 1
-
-            n = map_bitcount(self.bitmap)
 
             new_array = self.array[:key_idx]
             new_array.append(key)
             new_array.append(val)
             new_array.extend(self.array[key_idx:])
 
+            new_hashes = self.hashes[:idx]
+            new_hashes.append(hash)
+            new_hashes.extend(self.hashes[idx:])
+
             if mutid and mutid == self.mutid:
-                self.size = 2 * (n + 1)
-                self.bitmap |= bit
+                self.datamap |= bit
                 self.array = new_array
+                self.hashes = new_hashes
                 return self, True
             else:
                 return BitmapNode(
-                    2 * (n + 1), self.bitmap | bit, new_array, mutid), True
+                    self.datamap | bit, self.nodemap, new_array, new_hashes,
+                    self.nodes.copy(), mutid), True
 
     def find(self, shift, hash, key):
         bit = map_bitpos(hash, shift)
 
-        if not (self.bitmap & bit):
+        if self.nodemap & bit:
+            node_idx = map_bitindex(self.nodemap, bit)
+            return self.nodes[node_idx].find(shift + 5, hash, key)
+
+        if not (self.datamap & bit):
             raise KeyError
 
-        idx = map_bitindex(self.bitmap, bit)
+        idx = map_bitindex(self.datamap, bit)
         key_idx = idx * 2
-        val_idx = key_idx + 1
-
-        key_or_null = self.array[key_idx]
-        val_or_node = self.array[val_idx]
-
-        if key_or_null is _NULL:
-            return val_or_node.find(shift + 5, hash, key)
 
-        if key == key_or_null:
-            return val_or_node
+        if hash == self.hashes[idx] and key == self.array[key_idx]:
+            return self.array[key_idx + 1]
 
         raise KeyError(key)
 
+    def is_single_pair(self):
+        return not self.nodemap and len(self.hashes) == 1
+
     def without(self, shift, hash, key, mutid):
         bit = map_bitpos(hash, shift)
-        if not (self.bitmap & bit):
-            return W_NOT_FOUND, None
 
-        idx = map_bitindex(self.bitmap, bit)
-        key_idx = 2 * idx
-        val_idx = key_idx + 1
+        if self.datamap & bit:
+            idx = map_bitindex(self.datamap, bit)
+            key_idx = 2 * idx
+            val_idx = key_idx + 1
+
+            if not (hash == self.hashes[idx] and key == self.array[key_idx]):
+                return W_NOT_FOUND, None
 
-        key_or_null = self.array[key_idx]
-        val_or_node = self.array[val_idx]
+            if self.datamap == bit and not self.nodemap:
+                return W_EMPTY, None
 
-        if key_or_null is _NULL:
-            res, sub_node = val_or_node.without(shift + 5, hash, key, mutid)
+            new_array = self.array[:key_idx]
+            new_array.extend(self.array[val_idx + 1:])
 
-            if res is W_EMPTY:
-                raise RuntimeError('unreachable code')  # pragma: no cover
+            new_hashes = self.hashes[:idx]
+            new_hashes.extend(self.hashes[idx + 1:])
 
-            elif res is W_NEWNODE:
-                if (type(sub_node) is BitmapNode and
-                        sub_node.size == 2 and
-                        sub_node.array[0] is not _NULL):
+            if mutid and mutid == self.mutid:
+                self.datamap &= ~bit
+                self.array = new_array
+                self.hashes = new_hashes
+                return W_NEWNODE, self
+            else:
+                new_node = BitmapNode(
+                    self.datamap & ~bit, self.nodemap, new_array,
+                    new_hashes, self.nodes.copy(), mutid)
+                return W_NEWNODE, new_node
 
-                    if mutid and mutid == self.mutid:
-                        self.array[key_idx] = sub_node.array[0]
-                        self.array[val_idx] = sub_node.array[1]
-                        return W_NEWNODE, self
-                    else:
-                        clone = self.clone(mutid)
-                        clone.array[key_idx] = sub_node.array[0]
-                        clone.array[val_idx] = sub_node.array[1]
-                        return W_NEWNODE, clone
+        if not (self.nodemap & bit):
+            return W_NOT_FOUND, None
 
-                if mutid and mutid == self.mutid:
-                    self.array[val_idx] = sub_node
-                    return W_NEWNODE, self
-                else:
-                    clone = self.clone(mutid)
-                    clone.array[val_idx] = sub_node
-                    return W_NEWNODE, clone
+        node_idx = map_bitindex(self.nodemap, bit)
+        res, sub_node = self.nodes[node_idx].without(
+            shift + 5, hash, key, mutid)
 
-            else:
-                assert sub_node is None
-                return res, None
+        if res is W_EMPTY:
+            raise RuntimeError('unreachable code')  # pragma: no cover
 
-        else:
-            if key == key_or_null:
-                if self.size == 2:
-                    return W_EMPTY, None
+        elif res is W_NEWNODE:
+            if type(sub_node) is BitmapNode and sub_node.is_single_pair():
+                idx = map_bitindex(self.datamap, bit)
+                key_idx = 2 * idx
 
                 new_array = self.array[:key_idx]
-                new_array.extend(self.array[val_idx + 1:])
+                new_array.extend(sub_node.array)
+                new_array.extend(self.array[key_idx:])
+
+                new_hashes = self.hashes[:idx]
+                new_hashes.extend(sub_node.hashes)
+                new_hashes.extend(self.hashes[idx:])
+
+                new_nodes = self.nodes[:node_idx]
+                new_nodes.extend(self.nodes[node_idx + 1:])
 
                 if mutid and mutid == self.mutid:
-                    self.size -= 2
-                    self.bitmap &= ~bit
+                    self.datamap |= bit
+                    self.nodemap &= ~bit
                     self.array = new_array
+                    self.hashes = new_hashes
+                    self.nodes = new_nodes
                     return W_NEWNODE, self
                 else:
                     new_node = BitmapNode(
-                        self.size - 2, self.bitmap & ~bit, new_array, mutid)
+                        self.datamap | bit, self.nodemap & ~bit,
+                        new_array, new_hashes, new_nodes, mutid)
                     return W_NEWNODE, new_node
 
+            if mutid and mutid == self.mutid:
+                self.nodes[node_idx] = sub_node
+                return W_NEWNODE, self
             else:
-                return W_NOT_FOUND, None
+                clone = self.clone(mutid)
+                clone.nodes[node_idx] = sub_node
+                return W_NEWNODE, clone
 
-    def keys(self):
-        for i in range(0, self.size, 2):
-            key_or_null = self.array[i]
+        else:
+            assert sub_node is None
+            return res, None
 
-            if key_or_null is _NULL:
-                val_or_node = self.array[i + 1]
-                yield from val_or_node.keys()
-            else:
-                yield key_or_null
+    def keys(self):
+        yield from self.array[::2]
+        for node in self.nodes:
+            yield from node.keys()
 
     def values(self):
-        for i in range(0, self.size, 2):
-            key_or_null = self.array[i]
-            val_or_node = self.array[i + 1]
-
-            if key_or_null is _NULL:
-                yield from val_or_node.values()
-            else:
-                yield val_or_node
+        yield from self.array[1::2]
+        for node in self.nodes:
+            yield from node.values()
 
     def items(self):
-        for i in range(0, self.size, 2):
-            key_or_null = self.array[i]
-            val_or_node = self.array[i + 1]
+        for i in range(0, len(self.array), 2):
+            yield self.array[i], self.array[i + 1]
+        for node in self.nodes:
+            yield from node.items()
 
-            if key_or_null is _NULL:
-                yield from val_or_node.items()
-            else:
-                yield key_or_null, val_or_node
+    def hashed_items(self):
+        for i in range(0, len(self.array), 2):
+            yield self.array[i], self.array[i + 1], self.hashes[i // 2]
+        for node in self.nodes:
+            yield from node.hashed_items()
 
     def dump(self, buf, level):  # pragma: no cover
         buf.append(
             '    ' * (level + 1) +
-            'BitmapNode(size={} count={} bitmap={} id={:0x}):'.format(
-                self.size, self.size / 2, bin(self.bitmap), id(self)))
+            'BitmapNode(size={} count={} datamap={} nodemap={} '
+            'id={:0x}):'.format(
+                len(self.array) + len(self.nodes),
+                len(self.hashes) + len(self.nodes),
+                bin(self.datamap), bin(self.nodemap), id(self)))
 
-        for i in range(0, self.size, 2):
-            key_or_null = self.array[i]
-            val_or_node = self.array[i + 1]
+        pad = '    ' * (level + 2)
 
-            pad = '    ' * (level + 2)
+        for i in range(0, len(self.array), 2):
+            buf.append(pad + '{!r}: {!r}'.format(
+                self.array[i], self.array[i + 1]))
 
-            if key_or_null is _NULL:
-                buf.append(pad + 'NULL:')
-                val_or_node.dump(buf, level + 2)
-            else:
-                buf.append(pad + '{!r}: {!r}'.format(key_or_null, val_or_node))
+        for node in self.nodes:
+            buf.append(pad + 'NODE:')
+            node.dump(buf, level + 2)
+
+
+def map_node_new_bitmap_or_collision(shift, hash1, key1, val1,
+                                     hash2, key2, val2, mutid):
+    if shift >= HASH_BITS:
+        assert hash1 == hash2
+        return CollisionNode(4, hash1, [key1, val1, key2, val2], mutid)
+
+    bit1 = map_bitpos(hash1, shift)
+    bit2 = map_bitpos(hash2, shift)
+
+    if bit1 == bit2:
+        sub_node = map_node_new_bitmap_or_collision(
+            shift + 5, hash1, key1, val1, hash2, key2, val2, mutid)
+        return BitmapNode(0, bit1, [], [], [sub_node], mutid)
+
+    if bit1 < bit2:
+        array = [key1, val1, key2, val2]
+        hashes = [hash1, hash2]
+    else:
+        array = [key2, val2, key1, val1]
+        hashes = [hash2, hash1]
+    return BitmapNode(bit1 | bit2, 0, array, hashes, [], mutid)
 
 
 class CollisionNode:
@@ -297,6 +371,15 @@ class CollisionNode:
         self.array = array
         self.mutid = mutid
 
+    def deepcopy(self, c):
+        array = []
+        for i in range(0, self.size, 2):
+            array.extend(c.pair(self.hash, self.array[i], self.array[i + 1]))
+
+        if all(a is b for a, b in zip(array, self.array)):
+            return self
+        return CollisionNode(self.size, self.hash, array, 0)
+
     def find_index(self, key):
         for i in range(0, self.size, 2):
             if self.array[i] == key:
@@ -304,49 +387,44 @@ class CollisionNode:
         return -1
 
     def find(self, shift, hash, key):
+        assert hash == self.hash
         for i in range(0, self.size, 2):
             if self.array[i] == key:
                 return self.array[i + 1]
         raise KeyError(key)
 
     def assoc(self, shift, hash, key, val, mutid):
-        if hash == self.hash:
-            key_idx = self.find_index(key)
-
-            if key_idx == -1:
-                new_array = self.array.copy()
-                new_array.append(key)
-                new_array.append(val)
-
-                if mutid and mutid == self.mutid:
-                    self.size += 2
-                    self.array = new_array
-                    return self, True
-                else:
-                    new_node = CollisionNode(
-                        self.size + 2, hash, new_array, mutid)
-                    return new_node, True
+        assert hash == self.hash
+        key_idx = self.find_index(key)
 
-            val_idx = key_idx + 1
-            if self.array[val_idx] is val:
-                return self, False
+        if key_idx == -1:
+            new_array = self.array.copy()
+            new_array.append(key)
+            new_array.append(val)
 
             if mutid and mutid == self.mutid:
-                self.array[val_idx] = val
-                return self, False
+                self.size += 2
+                self.array = new_array
+                return self, True
             else:
-                new_array = self.array.copy()
-                new_array[val_idx] = val
-                return CollisionNode(self.size, hash, new_array, mutid), False
+                new_node = CollisionNode(
+                    self.size + 2, hash, new_array, mutid)
+                return new_node, True
 
+        val_idx = key_idx + 1
+        if self.array[val_idx] is val:
+            return self, False
+
+        if mutid and mutid == self.mutid:
+            self.array[val_idx] = val
+            return self, False
         else:
-            new_node = BitmapNode(
-                2, map_bitpos(self.hash, shift), [_NULL, self], mutid)
-            return new_node.assoc(shift, hash, key, val, mutid)
+            new_array = self.array.copy()
+            new_array[val_idx] = val
+            return CollisionNode(self.size, hash, new_array, mutid), False
 
     def without(self, shift, hash, key, mutid):
-        if hash != self.hash:
-            return W_NOT_FOUND, None
+        assert hash == self.hash
 
         key_idx = self.find_index(key)
         if key_idx == -1:
@@ -364,8 +442,8 @@ class CollisionNode:
                 assert key_idx == 2
                 new_array = [self.array[0], self.array[1]]
 
-            new_node = BitmapNode(
-                2, map_bitpos(hash, shift), new_array, mutid)
+            # The parent node inlines the remaining pair right away.
+            new_node = BitmapNode(1, 0, new_array, [hash], [], mutid)
             return W_NEWNODE, new_node
 
         new_array = self.array[:key_idx]
@@ -391,6 +469,10 @@ class CollisionNode:
         for i in range(0, self.size, 2):
             yield self.array[i], self.array[i + 1]
 
+    def hashed_items(self):
+        for i in range(0, self.size, 2):
+            yield self.array[i], self.array[i + 1], self.hash
+
     def dump(self, buf, level):  # pragma: no cover
         pad = '    ' * (level + 1)
         buf.append(
@@ -417,6 +499,29 @@ class MapKeys:
     def __iter__(self):
         return iter(self.__root.keys())
 
+    def __map(self):
+        return Map._new(self.__count, self.__root)
+
+    def __and__(self, other):
+        if not isinstance(other, MapKeys):
+            return NotImplemented
+        return self.__map().intersection(other.__map()).keys()
+
+    def __or__(self, other):
+        if not isinstance(other, MapKeys):
+            return NotImplemented
+        return self.__map().merge(other.__map()).keys()
+
+    def __sub__(self, other):
+        if not isinstance(other, MapKeys):
+            return NotImplemented
+        return self.__map().difference(other.__map()).keys()
+
+    def __xor__(self, other):
+        if not isinstance(other, MapKeys):
+            return NotImplemented
+        return self.__map().symmetric_difference(other.__map()).keys()
+
 
 class MapValues:
 
@@ -444,6 +549,20 @@ class MapItems:
         return iter(self.__root.items())
 
 
+class _DeepCopy:
+
+    def __init__(self, memo):
+        self.memo = memo
+        # Set once a copied key hashes differently from its original.
+        self.rehash = False
+
+    def pair(self, hash, key, val):
+        new_key = copy.deepcopy(key, self.memo)
+        if new_key is not key and not self.rehash:
+            self.rehash = map_hash(new_key) != hash
+        return new_key, copy.deepcopy(val, self.memo)
+
+
 class Map:
 
     def __init__(self, *args, **kw):
@@ -458,7 +577,7 @@ class Map:
             )
 
         self.__count = 0
-        self.__root = BitmapNode(0, 0, [], 0)
+        self.__root = BitmapNode(0, 0, [], [], [], 0)
         self.__hash = -1
 
         if isinstance(col, Map):
@@ -482,9 +601,36 @@ class Map:
         m.__hash = -1
         return m
 
+    @classmethod
+    def fromkeys(cls, keys, value=None):
+        mutid = _mut_id()
+        root = BitmapNode(0, 0, [], [], [], mutid)
+        count = 0
+        for key in keys:
+            root, added = root.assoc(0, map_hash(key), key, value, mutid)
+            if added:
+                count += 1
+        return Map._new(count, root)
+
     def __reduce__(self):
         return (type(self), (dict(self.items()),))
 
+    def __copy__(self):
+        return self
+
+    def __deepcopy__(self, memo):
+        c = _DeepCopy(memo)
+        root = self.__root.deepcopy(c)
+        if root is self.__root:
+            return self
+
+        m = Map._new(self.__count, root)
+        if c.rehash:
+            m = Map(list(m.items()))
+        # Like tuples, Maps reachable from their own keys or values
+        # are copied once.
+        return memo.get(id(self), m)
+
     def __len__(self):
         return self.__count
 
@@ -516,6 +662,15 @@ class Map:
                 "update expected at most 1 arguments, got {}".format(len(args))
             )
 
+        if isinstance(col, Map):
+            mutid = _mut_id()
+            root, count = col._update_node(self.__root, self.__count, mutid)
+            col = None
+        else:
+            mutid = 0
+            root = self.__root
+            count = self.__count
+
         it = None
 
         if col is not None:
@@ -532,12 +687,12 @@ class Map:
                 it = iter(kw.items())
 
         if it is None:
-
+            if mutid:
+                return Map._new(count, root)
             return self
 
-        mutid = _mut_id()
-        root = self.__root
-        count = self.__count
+        if not mutid:
+            mutid = _mut_id()
 
         i = 0
         while True:
@@ -566,9 +721,193 @@ class Map:
 
         return Map._new(count, root)
 
+    def merge(self, other, resolve=None):
+        if not isinstance(other, Map):
+            raise TypeError(
+                'Map.merge() argument must be a Map, '
+                'not {}'.format(type(other).__name__))
+
+        if resolve is None:
+            return self.update(other)
+        if not callable(resolve):
+            raise TypeError(
+                'Map.merge() resolve must be callable, '
+                'not {}'.format(type(resolve).__name__))
+
+        mutid = _mut_id()
+        root = self.__root
+        count = self.__count
+        for key, val, hash in other.__root.hashed_items():
+            try:
+                old = root.find(0, hash, key)
+            except KeyError:
+                pass
+            else:
+                val = resolve(key, old, val)
+            root, added = root.assoc(0, hash, key, val, mutid)
+            if added:
+                count += 1
+        return Map._new(count, root)
+
+    def __or__(self, other):
+        if not isinstance(other, Map):
+            return NotImplemented
+        return self.update(other)
+
+    def _update_node(self, root, count, mutid):
+        # Keys of a Map are already hashed; reuse their hashes.
+        for key, val, hash in self.__root.hashed_items():
+            root, added = root.assoc(0, hash, key, val, mutid)
+            if added:
+                count += 1
+        return root, count
+
     def mutate(self):
         return MapMutation(self.__count, self.__root)
 
+    def diff(self, other):
+        if not isinstance(other, Map):
+            raise TypeError(
+                'Map.diff() argument must be a Map, '
+                'not {}'.format(type(other).__name__))
+
+        removed = []
+        changed = []
+        for key, val, hash in self.__root.hashed_items():
+            try:
+                oval = other.__root.find(0, hash, key)
+            except KeyError:
+                removed.append((key, val, hash))
+            else:
+                if not (val is oval or val == oval):
+                    changed.append((key, (val, oval), hash))
+
+        added = []
+        for key, val, hash in other.__root.hashed_items():
+            try:
+                self.__root.find(0, hash, key)
+            except KeyError:
+                added.append((key, val, hash))
+
+        return (
+            Map._from_hashed_items(added),
+            Map._from_hashed_items(removed),
+            Map._from_hashed_items(changed),
+        )
+
+    def make_patch(self, other):
+        if not isinstance(other, Map):
+            raise TypeError(
+                'Map.make_patch() argument must be a Map, '
+                'not {}'.format(type(other).__name__))
+
+        removed = []
+        kv = []
+        for key, val, hash in self.__root.hashed_items():
+            try:
+                oval = other.__root.find(0, hash, key)
+            except KeyError:
+                removed.append(key)
+            else:
+                if not (val is oval or val == oval):
+                    kv.extend((key, oval))
+
+        for key, val, hash in other.__root.hashed_items():
+            try:
+                self.__root.find(0, hash, key)
+            except KeyError:
+                kv.extend((key, val))
+
+        return pickle.dumps(
+            (MAP_PATCH_VERSION, self.__count, other.__count,
+             tuple(removed), tuple(kv)), 5)
+
+    def apply_patch(self, data):
+        state = pickle.loads(data)
+        if (not isinstance(state, tuple) or len(state) != 5 or
+                not all(isinstance(n, int) and n >= 0 for n in state[:3]) or
+                not isinstance(state[3], tuple) or
+                not isinstance(state[4], tuple) or len(state[4]) % 2 or
+                state[0] != MAP_PATCH_VERSION):
+            raise ValueError('invalid Map patch data')
+
+        _, count, new_count, removed, kv = state
+        if count != self.__count:
+            raise ValueError('the patch is not for this Map')
+        if not removed and not kv:
+            if new_count != count:
+                raise ValueError('invalid Map patch data')
+            return self
+
+        with self.mutate() as mm:
+            for key in removed:
+                try:
+                    del mm[key]
+                except KeyError:
+                    raise ValueError('the patch is not for this Map') \
+                        from None
+            for i in range(0, len(kv), 2):
+                mm[kv[i]] = kv[i + 1]
+            m = mm.finish()
+
+        if len(m) != new_count:
+            raise ValueError('the patch is not for this Map')
+        return m
+
+    def intersection(self, other):
+        return Map._from_hashed_items(
+            self.__filter('intersection', other, True))
+
+    def difference(self, other):
+        return Map._from_hashed_items(
+            self.__filter('difference', other, False))
+
+    def symmetric_difference(self, other):
+        items = self.__filter('symmetric_difference', other, False)
+        items.extend(other.__filter('symmetric_difference', self, False))
+        return Map._from_hashed_items(items)
+
+    def __filter(self, method, other, present):
+        if not isinstance(other, Map):
+            raise TypeError(
+                'Map.{}() argument must be a Map, '
+                'not {}'.format(method, type(other).__name__))
+
+        items = []
+        for key, val, hash in self.__root.hashed_items():
+            try:
+                other.__root.find(0, hash, key)
+            except KeyError:
+                found = False
+            else:
+                found = True
+            if found is present:
+                items.append((key, val, hash))
+        return items
+
+    def restrict(self, keys):
+        mutid = _mut_id()
+        root = BitmapNode(0, 0, [], [], [], mutid)
+        count = 0
+        for key in keys:
+            hash = map_hash(key)
+            try:
+                val = self.__root.find(0, hash, key)
+            except KeyError:
+                continue
+            root, added = root.assoc(0, hash, key, val, mutid)
+            if added:
+                count += 1
+        return Map._new(count, root)
+
+    @classmethod
+    def _from_hashed_items(cls, items):
+        mutid = _mut_id()
+        root = BitmapNode(0, 0, [], [], [], mutid)
+        for key, val, hash in items:
+            root, _ = root.assoc(0, hash, key, val, mutid)
+        return Map._new(len(items), root)
+
     def set(self, key, val):
         new_count = self.__count
         new_root, added = self.__root.assoc(0, map_hash(key), key, val, 0)
@@ -697,7 +1036,7 @@ class MapMutation:
             0, map_hash(key), key, self.__mutid)
         if res is W_EMPTY:
             self.__count = 0
-            self.__root = BitmapNode(0, 0, [], self.__mutid)
+            self.__root = BitmapNode(0, 0, [], [], [], self.__mutid)
         elif res is W_NOT_FOUND:
             raise KeyError(key)
         else:
@@ -769,6 +1108,11 @@ class MapMutation:
         if self.__mutid == 0:
             raise ValueError('mutation {!r} has been finished'.format(self))
 
+        if isinstance(col, Map):
+            self.__root, self.__count = col._update_node(
+                self.__root, self.__count, self.__mutid)
+            col = None
+
         it = None
         if col is not None:
             if hasattr(col, 'items'):
@@ -856,4 +1200,681 @@ class MapMutation:
         return True
 
 
+def _atom_check_map(what, m):
+    if not isinstance(m, Map):
+        raise TypeError('{} must be an immutables.Map, not {}'.format(
+            what, type(m).__name__))
+
+
+class Atom:
+
+    # Readers only load the attribute; writers compare and set it
+    # under the lock.
+
+    def __init__(self, *args):
+        if len(args) > 1:
+            raise TypeError(
+                'Atom expected at most 1 argument, got {}'.format(len(args)))
+        if args:
+            _atom_check_map('Atom() argument', args[0])
+            self.__map = args[0]
+        else:
+            self.__map = Map()
+        self.__lock = threading.Lock()
+
+    def deref(self):
+        return self.__map
+
+    def reset(self, m):
+        _atom_check_map('reset() argument', m)
+        with self.__lock:
+            self.__map = m
+        return m
+
+    def compare_and_set(self, expected, m):
+        _atom_check_map('compare_and_set() argument 2', m)
+        with self.__lock:
+            if self.__map is not expected:
+                return False
+            self.__map = m
+            return True
+
+    def swap(self, fn, /, *args, **kwargs):
+        while True:
+            m = self.__map
+            new_m = fn(m, *args, **kwargs)
+            _atom_check_map('swap() function result', new_m)
+            if self.compare_and_set(m, new_m):
+                return new_m
+
+    def __repr__(self):
+        return '<immutables.Atom({!r})>'.format(self.__map)
+
+    __class_getitem__ = classmethod(types.GenericAlias)
+
+
+# Patches: the changes between two versions of a Map.  See "Patches"
+# in _map.c for the format.
+
+MAP_PATCH_VERSION = 1
+
+
+# Archives: many versions of a Map, with the nodes they share stored
+# once.  See "Archives" in _map.c for the format; both implementations
+# read each other's archives.
+
+MAP_ARCHIVE_VERSION = 1
+MAP_ARCHIVE_MAX_DEPTH = 32
+
+_ARCHIVE_NODE = struct.Struct('<II')
+_TAG = struct.Struct('<c')
+
+
+def _archive_error():
+    return ValueError('invalid pickled Map data')
+
+
+def archive(maps):
+    shape = bytearray()
+    kv = []
+    memo = {}
+
+    def put_node(node):
+        index = memo.get(id(node))
+        if index is not None:
+            shape.extend(b'R' + _U64.pack(index))
+            return
+
+        memo[id(node)] = len(memo)
+        if isinstance(node, BitmapNode):
+            pairs = node.array
+            children = node.nodes
+        else:
+            pairs = node.array[:node.size]
+            children = []
+
+        shape.extend(b'N' + _ARCHIVE_NODE.pack(len(pairs) // 2,
+                                               len(children)))
+        kv.extend(pairs)
+        for child in children:
+            put_node(child)
+
+    maps = list(maps)
+    shape.extend(bytes([MAP_ARCHIVE_VERSION]) + _U64.pack(len(maps)))
+    for m in maps:
+        if not isinstance(m, Map):
+            raise TypeError('archive() expects Maps, not {}'.format(
+                type(m).__name__))
+
+        shape.extend(_U64.pack(len(m)))
+        if len(m):
+            put_node(m._Map__root)
+
+    return pickle.dumps((bytes(shape), tuple(kv)), 5)
+
+
+class _ArchiveNode:
+
+    __slots__ = ('kv', 'pairs', 'children', 'height', 'member', 'seen',
+                 'shared')
+
+    def __init__(self, kv, pairs):
+        self.kv = kv
+        self.pairs = pairs
+        self.children = []
+        self.height = -1
+        self.member = False
+        self.seen = 0
+        self.shared = 0
+
+
+class _ArchiveReader:
+
+    def __init__(self, shape, kv):
+        self.shape = shape
+        self.pos = 0
+        self.kv = kv
+        self.kv_pos = 0
+        self.nodes = []
+
+    def get(self, st):
+        if len(self.shape) - self.pos < st.size:
+            raise _archive_error()
+        ret = st.unpack_from(self.shape, self.pos)
+        self.pos += st.size
+        return ret
+
+    def read_node(self, depth):
+        tag = self.get(_TAG)[0]
+
+        if tag == b'R':
+            index = self.get(_U64)[0]
+            if (index >= len(self.nodes) or
+                    self.nodes[index].height < 0 or
+                    depth + self.nodes[index].height >=
+                    MAP_ARCHIVE_MAX_DEPTH):
+                raise _archive_error()
+            return index
+
+        if tag != b'N' or depth >= MAP_ARCHIVE_MAX_DEPTH:
+            raise _archive_error()
+
+        pairs, children = self.get(_ARCHIVE_NODE)
+        if (pairs > (len(self.kv) - self.kv_pos) // 2 or
+                children > 32 or pairs + children == 0):
+            raise _archive_error()
+
+        index = len(self.nodes)
+        node = _ArchiveNode(self.kv_pos, pairs)
+        self.nodes.append(node)
+        self.kv_pos += pairs * 2
+
+        height = 0
+        for _ in range(children):
+            child = self.read_node(depth + 1)
+            node.children.append(child)
+            height = max(height, self.nodes[child].height + 1)
+
+        node.height = height
+        return index
+
+    def walk(self, index, walk, is_new, changed):
+        # Mirrors map_unarchive_walk().
+        node = self.nodes[index]
+        if node.seen == walk:
+            return
+        node.seen = walk
+
+        if is_new:
+            if node.member:
+                node.shared = walk
+                return
+        elif node.shared == walk - 1:
+            return
+
+        changed.append(node)
+        for child in node.children:
+            self.walk(child, walk, is_new, changed)
+
+    def pairs(self, nodes):
+        kv = self.kv
+        for node in nodes:
+            for i in range(node.kv, node.kv + node.pairs * 2, 2):
+                yield kv[i], kv[i + 1]
+
+
+def unarchive(data):
+    state = pickle.loads(data)
+    if (not isinstance(state, tuple) or len(state) != 2 or
+            not isinstance(state[1], tuple) or len(state[1]) % 2):
+        raise _archive_error()
+
+    r = _ArchiveReader(bytes(state[0]), state[1])
+    version, = r.get(_TAG)
+    count, = r.get(_U64)
+    if version != bytes([MAP_ARCHIVE_VERSION]):
+        raise _archive_error()
+
+    res = []
+    prev = Map()
+    prev_root = None
+
+    for i in range(count):
+        size, = r.get(_U64)
+        root = r.read_node(0) if size else None
+
+        added = []
+        removed = []
+        if root is not None:
+            r.walk(root, 2 * i + 1, True, added)
+        if prev_root is not None:
+            r.walk(prev_root, 2 * i + 2, False, removed)
+
+        for node in added:
+            node.member = True
+        for node in removed:
+            node.member = False
+
+        if not added and not removed:
+            m = prev
+        elif not len(prev):
+            m = Map(r.pairs(added))
+        else:
+            with prev.mutate() as mm:
+                for key, _ in r.pairs(removed):
+                    try:
+                        del mm[key]
+                    except KeyError:
+                        raise _archive_error() from None
+                for key, val in r.pairs(added):
+                    mm[key] = val
+                m = mm.finish()
+
+        if len(m) != size:
+            raise _archive_error()
+
+        res.append(m)
+        prev = m
+        prev_root = root
+
+    if r.pos != len(r.shape) or r.kv_pos != len(r.kv):
+        raise _archive_error()
+
+    return res
+
+
+# MappedMap: a read-only Map stored in a flat buffer.  See "MappedMap"
+# in _map.c for the layout; both implementations write the same bytes.
+
+MAPPED_MAGIC = b'IMMUTMAP'
+MAPPED_VERSION = 1
+MAPPED_HEADER = struct.Struct('<8sIIQQQ')
+MAPPED_BITMAP = 1
+MAPPED_COLLISION = 2
+MAPPED_HASH_BITS = 64
+_MAPPED_MAX_TREE_DEPTH = 14
+
+_U32 = struct.Struct('<I')
+_U64 = struct.Struct('<Q')
+_I64 = struct.Struct('<q')
+_F64 = struct.Struct('<d')
+_MAPPED_BITMAP_NODE = struct.Struct('<IIII')
+_MAPPED_COLLISION_NODE = struct.Struct('<IIQ')
+_MAPPED_MASK = (1 << 64) - 1
+
+
+def mapped_hash(tag, data):
+    # FNV-1a of the record, with the finalizer of MurmurHash3.
+    h = 14695981039346656037
+    for b in tag + data:
+        h = ((h ^ b) * 1099511628211) & _MAPPED_MASK
+
+    h ^= h >> 33
+    h = (h * 0xff51afd7ed558ccd) & _MAPPED_MASK
+    h ^= h >> 33
+    h = (h * 0xc4ceb9fe1a85ec53) & _MAPPED_MASK
+    h ^= h >> 33
+    return h
+
+
+def mapped_key_encode(key, strict):
+    # Return the tag and the payload of the record "key" is stored
+    # as, or None.  Unless "strict" is set, keys that are equal to
+    # keys that can be stored are converted to them.
+    if isinstance(key, str):
+        try:
+            return b's', key.encode('utf-8')
+        except UnicodeEncodeError:
+            if strict:
+                raise
+            return None
+
+    if isinstance(key, bytes):
+        return b'b', bytes(key)
+
+    if isinstance(key, int):
+        if -(1 << 63) <= key < (1 << 63):
+            return b'i', _I64.pack(key)
+        return b'I', hex(key).encode('ascii')
+
+    if not strict and isinstance(key, float):
+        if math.isfinite(key) and key.is_integer():
+            return mapped_key_encode(int(key), strict)
+
+    return None
+
+
+def mapped_record(tag, data):
+    if tag in (b'i', b'f', b'N', b'T', b'F'):
+        return tag + data
+    if len(data) > 0xffffffff:
+        raise OverflowError(
+            'MappedMap keys and values must be shorter than 4 GiB')
+    return tag + _U32.pack(len(data)) + data
+
+
+def mapped_value_record(val):
+    if val is None:
+        return b'N'
+    if val is True:
+        return b'T'
+    if val is False:
+        return b'F'
+    if isinstance(val, float):
+        return b'f' + _F64.pack(val)
+    if isinstance(val, (str, bytes, int)):
+        return mapped_record(*mapped_key_encode(val, True))
+    raise TypeError(
+        'MappedMap values must be None, bool, int, float, str or bytes, '
+        'not {}'.format(type(val).__name__))
+
+
+def mapped_put_node_header(buf):
+    buf += bytes(-len(buf) % 8)
+    return len(buf)
+
+
+def mapped_put_collision(buf, entries, shift):
+    hash = entries[0][0]
+
+    for i in range(1, len(entries)):
+        for j in range(i):
+            if entries[i][3] == entries[j][3]:
+                raise ValueError('duplicate keys in MappedMap items')
+
+    node = mapped_put_node_header(buf)
+    buf += _MAPPED_COLLISION_NODE.pack(MAPPED_COLLISION, len(entries), hash)
+    for _, key, val, _ in entries:
+        buf += _U64.pack(key) + _U64.pack(val)
+
+    for s in range((MAPPED_HASH_BITS - 1) // 5 * 5, shift - 1, -5):
+        child = node
+        node = mapped_put_node_header(buf)
+        buf += _MAPPED_BITMAP_NODE.pack(
+            MAPPED_BITMAP, 0, 1 << ((hash >> s) & 0x1f), 0)
+        buf += _U64.pack(child)
+
+    return None, node
+
+
+def mapped_put_node(buf, entries, shift):
+    # Return a single pair or the offset of the written node.
+    if len(entries) == 1:
+        return entries[0], 0
+
+    if (shift >= MAPPED_HASH_BITS or
+            all(e[0] == entries[0][0] for e in entries)):
+        return mapped_put_collision(buf, entries, shift)
+
+    buckets = [[] for _ in range(32)]
+    for e in entries:
+        buckets[(e[0] >> shift) & 0x1f].append(e)
+
+    slots = []
+    datamap = nodemap = 0
+    for b, bucket in enumerate(buckets):
+        if not bucket:
+            continue
+        pair, node = mapped_put_node(buf, bucket, shift + 5)
+        slots.append((pair, node))
+        if node:
+            nodemap |= 1 << b
+        else:
+            datamap |= 1 << b
+
+    node = mapped_put_node_header(buf)
+    buf += _MAPPED_BITMAP_NODE.pack(MAPPED_BITMAP, datamap, nodemap, 0)
+    for pair, child in slots:
+        if not child:
+            buf += _U64.pack(pair[0]) + _U64.pack(pair[1])
+            buf += _U64.pack(pair[2])
+    for pair, child in slots:
+        if child:
+            buf += _U64.pack(child)
+
+    return None, node
+
+
+def mapped_dumps(src):
+    buf = bytearray(MAPPED_HEADER.size)
+    entries = []
+
+    for key, val in src.items():
+        encoded = mapped_key_encode(key, True)
+        if encoded is None:
+            raise TypeError(
+                'MappedMap keys must be str, bytes or int, not {}'.format(
+                    type(key).__name__))
+
+        record = mapped_record(*encoded)
+        key_offset = len(buf)
+        buf += record
+        val_offset = len(buf)
+        buf += mapped_value_record(val)
+        entries.append(
+            (mapped_hash(*encoded), key_offset, val_offset, record))
+
+    root = 0
+    if entries:
+        pair, root = mapped_put_node(buf, entries, 0)
+        if not root:
+            root = mapped_put_node_header(buf)
+            buf += _MAPPED_BITMAP_NODE.pack(
+                MAPPED_BITMAP, 1 << (pair[0] & 0x1f), 0, 0)
+            buf += _U64.pack(pair[0]) + _U64.pack(pair[1])
+            buf += _U64.pack(pair[2])
+
+    buf[:MAPPED_HEADER.size] = MAPPED_HEADER.pack(
+        MAPPED_MAGIC, MAPPED_VERSION, 0, len(entries), root, len(buf))
+    return bytes(buf)
+
+
+class MappedMapView:
+
+    def __init__(self, m, kind):
+        self.__map = m
+        self.__kind = kind
+
+    def __len__(self):
+        return len(self.__map)
+
+    def __iter__(self):
+        return self.__map._iter(self.__kind)
+
+
+class MappedMap:
+
+    def __init__(self, source):
+        if isinstance(source, str) or (
+                hasattr(source, '__fspath__') and
+                not isinstance(source, (bytes, bytearray, memoryview))):
+            with open(source, 'rb') as f:
+                # The mmap doesn't need the file to stay open.
+                source = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        self.__buf = memoryview(source).cast('B')
+
+        if (len(self.__buf) < MAPPED_HEADER.size or
+                self.__buf[:8] != MAPPED_MAGIC):
+            raise ValueError('not a MappedMap')
+
+        _, version, _, count, root, size = MAPPED_HEADER.unpack_from(
+            self.__buf)
+        if version != MAPPED_VERSION:
+            raise ValueError(
+                'unsupported MappedMap version {}'.format(version))
+
+        if size != len(self.__buf) or (root == 0) != (count == 0):
+            raise ValueError('corrupted MappedMap data')
+
+        self.__count = count
+        self.__root = root
+
+    @staticmethod
+    def dumps(src):
+        return mapped_dumps(src)
+
+    @staticmethod
+    def write(path, src):
+        # Write to a new file and move it over "path": processes
+        # that have the old file mapped keep using it.
+        data = mapped_dumps(src)
+        tmp_path = os.fspath(path)
+        tmp_path += '.tmp' if isinstance(tmp_path, str) else b'.tmp'
+        with open(tmp_path, 'wb') as f:
+            f.write(data)
+        os.replace(tmp_path, path)
+
+    def __at(self, offset, size):
+        if offset + size > len(self.__buf):
+            raise ValueError('corrupted MappedMap data')
+        return offset
+
+    def __load(self, offset):
+        tag = self.__buf[self.__at(offset, 1)]
+
+        if tag == ord('N'):
+            return None
+        if tag == ord('T'):
+            return True
+        if tag == ord('F'):
+            return False
+        if tag == ord('i'):
+            return _I64.unpack_from(self.__buf, self.__at(offset + 1, 8))[0]
+        if tag == ord('f'):
+            return _F64.unpack_from(self.__buf, self.__at(offset + 1, 8))[0]
+
+        if tag in b'sbI':
+            size = _U32.unpack_from(self.__buf, self.__at(offset + 1, 4))[0]
+            data = self.__buf[self.__at(offset + 5, size):offset + 5 + size]
+            if tag == ord('b'):
+                return bytes(data)
+            s = str(data, 'utf-8')
+            return s if tag == ord('s') else int(s, 16)
+
+        raise ValueError('corrupted MappedMap data')
+
+    def __key_eq(self, offset, tag, data):
+        record = mapped_record(tag, data)
+        end = self.__at(offset, len(record)) + len(record)
+        return self.__buf[offset:end] == record
+
+    def __find(self, key):
+        # Mirrors BitmapNode.find(); returns the offset of the value.
+        encoded = mapped_key_encode(key, False)
+        if encoded is None:
+            # Unhashable keys are errors, as they are for Maps.
+            hash(key)
+            raise KeyError(key)
+        if not self.__root:
+            raise KeyError(key)
+
+        tag, data = encoded
+        hash_ = mapped_hash(tag, data)
+        buf = self.__buf
+        node = self.__root
+        shift = 0
+
+        while True:
+            type_, a, b, _ = _MAPPED_BITMAP_NODE.unpack_from(
+                buf, self.__at(node, 16))
+
+            if type_ == MAPPED_BITMAP and shift < MAPPED_HASH_BITS:
+                bit = 1 << ((hash_ >> shift) & 0x1f)
+
+                if a & bit:
+                    pos = node + 16 + map_bitindex(a, bit) * 24
+                    ehash, ekey, val = struct.unpack_from(
+                        '<QQQ', buf, self.__at(pos, 24))
+                    if ehash == hash_ and self.__key_eq(ekey, tag, data):
+                        return val
+                    raise KeyError(key)
+
+                if b & bit:
+                    pos = (node + 16 + map_bitcount(a) * 24 +
+                           map_bitindex(b, bit) * 8)
+                    node = _U64.unpack_from(buf, self.__at(pos, 8))[0]
+                    shift += 5
+                    continue
+
+                raise KeyError(key)
+
+            if type_ == MAPPED_COLLISION and shift >= MAPPED_HASH_BITS:
+                if _MAPPED_COLLISION_NODE.unpack_from(buf, node)[2] != hash_:
+                    raise KeyError(key)
+
+                for i in range(a):
+                    ekey, val = struct.unpack_from(
+                        '<QQ', buf, self.__at(node + 16 + i * 16, 16))
+                    if self.__key_eq(ekey, tag, data):
+                        return val
+
+                raise KeyError(key)
+
+            raise ValueError('corrupted MappedMap data')
+
+    def _iter(self, kind):
+        # Mirrors map_iterator_next(), with a stack of node offsets.
+        if not self.__root:
+            return
+
+        buf = self.__buf
+        stack = [(self.__root, 0)]
+
+        while stack:
+            node, pos = stack.pop()
+            type_, a, b, _ = _MAPPED_BITMAP_NODE.unpack_from(
+                buf, self.__at(node, 16))
+
+            if type_ == MAPPED_BITMAP:
+                data_count = map_bitcount(a)
+                node_count = map_bitcount(b)
+                size = 24
+            elif type_ == MAPPED_COLLISION:
+                data_count = a
+                node_count = 0
+                size = 16
+            else:
+                raise ValueError('corrupted MappedMap data')
+
+            if pos < data_count:
+                stack.append((node, pos + 1))
+                key, val = struct.unpack_from(
+                    '<QQ', buf, self.__at(node + 16 + pos * size, size) +
+                    size - 16)
+                if kind == 'keys':
+                    yield self.__load(key)
+                elif kind == 'values':
+                    yield self.__load(val)
+                else:
+                    yield self.__load(key), self.__load(val)
+
+            elif pos < data_count + node_count:
+                stack.append((node, pos + 1))
+                if len(stack) >= _MAPPED_MAX_TREE_DEPTH:
+                    raise ValueError('corrupted MappedMap data')
+                child = node + 16 + data_count * 24 + (pos - data_count) * 8
+                stack.append(
+                    (_U64.unpack_from(buf, self.__at(child, 8))[0], 0))
+
+    def get(self, key, default=None):
+        try:
+            return self.__load(self.__find(key))
+        except KeyError:
+            return default
+
+    def keys(self):
+        return MappedMapView(self, 'keys')
+
+    def values(self):
+        return MappedMapView(self, 'values')
+
+    def items(self):
+        return MappedMapView(self, 'items')
+
+    def __getitem__(self, key):
+        return self.__load(self.__find(key))
+
+    def __contains__(self, key):
+        try:
+            self.__find(key)
+        except KeyError:
+            return False
+        else:
+            return True
+
+    def __iter__(self):
+        return self._iter('keys')
+
+    def __len__(self):
+        return self.__count
+
+    def __reduce__(self):
+        raise TypeError("can't pickle {} objects".format(type(self).__name__))
+
+    def __repr__(self):
+        return '<immutables.MappedMap of {} items at 0x{:x}>'.format(
+            self.__count, id(self))
+
+
 collections.abc.Mapping.register(Map)
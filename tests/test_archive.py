@@ -0,0 +1,140 @@
+import pickle
+import random
+import re
+import unittest
+
+import immutables.map
+from immutables._testutils import HashKey
+
+
+def node_ids(m):
+    return set(re.findall(r'id=(\w+)', m.__dump__()))
+
+
+class BaseArchiveTest:
+
+    Map = None
+    archive = None
+    unarchive = None
+
+    def versions(self, count, size, changes):
+        rnd = random.Random(count)
+        m = self.Map({'k{}'.format(i): i for i in range(size)})
+        versions = [m]
+        for v in range(count - 1):
+            with m.mutate() as mm:
+                for _ in range(changes):
+                    k = 'k{}'.format(rnd.randrange(size * 2))
+                    if k in mm and rnd.random() < 0.5:
+                        del mm[k]
+                    else:
+                        mm[k] = v
+                m = mm.finish()
+            versions.append(m)
+        return versions
+
+    def test_archive_basics(self):
+        big = self.Map({str(i): i for i in range(100)})
+        versions = [
+            self.Map(),
+            self.Map(a=1),
+            self.Map(a=1, b=2),
+            big,
+            big,
+            big.set('x', []),
+            self.Map(),
+            big.delete('1'),
+            self.Map({HashKey(1, str(i)): i for i in range(20)}),
+        ]
+
+        out = self.unarchive(self.archive(versions))
+        self.assertEqual(out, versions)
+        self.assertTrue(all(type(m) is self.Map for m in out))
+        self.assertIs(out[3], out[4])
+
+        self.assertEqual(self.unarchive(self.archive([])), [])
+        self.assertEqual(
+            self.unarchive(self.archive(iter([self.Map(a=1)]))),
+            [self.Map(a=1)])
+
+    def test_archive_sharing(self):
+        versions = self.versions(50, 2000, 3)
+
+        data = self.archive(versions)
+        single = len(self.archive(versions[:1]))
+        self.assertLess(len(data), single * 4)
+
+        out = self.unarchive(data)
+        self.assertEqual(out, versions)
+
+        # Versions share nodes like the archived ones do.
+        ids = [node_ids(m) for m in out]
+        for i in range(1, len(ids)):
+            self.assertGreater(
+                len(ids[i] & ids[i - 1]), len(ids[i]) * 0.9)
+
+    def test_archive_compat(self):
+        versions = self.versions(10, 500, 5)
+        for archive, unarchive in [
+                (self.archive, immutables.map.unarchive),
+                (immutables.map.archive, self.unarchive)]:
+            src = [immutables.map.Map(m) for m in versions] \
+                if archive is immutables.map.archive else versions
+            out = unarchive(archive(src))
+            self.assertEqual(
+                [dict(m.items()) for m in out],
+                [dict(m.items()) for m in versions])
+
+    def test_archive_errors(self):
+        with self.assertRaisesRegex(TypeError, 'expects Maps'):
+            self.archive([self.Map(), {}])
+        with self.assertRaises(TypeError):
+            self.archive(1)
+
+        for state in [None, (b'', ()), (b'\1', ()), (b'', (1,)),
+                      (b'\2' + bytes(8), ())]:
+            with self.assertRaises(ValueError):
+                self.unarchive(pickle.dumps(state))
+
+        versions = self.versions(5, 100, 5)
+        shape, kv = pickle.loads(self.archive(versions))
+
+        for bad in [(shape[:-1], kv), (shape + b'\0', kv),
+                    (shape, kv[:-2]), (shape, kv + (1, 2))]:
+            with self.assertRaises(ValueError):
+                self.unarchive(pickle.dumps(bad))
+
+        rnd = random.Random(0)
+        for _ in range(500):
+            bad = bytearray(shape)
+            for _ in range(rnd.randint(1, 3)):
+                bad[rnd.randrange(len(bad))] = rnd.randrange(256)
+            try:
+                self.unarchive(pickle.dumps((bytes(bad), kv)))
+            except ValueError:
+                pass
+
+
+class PyArchiveTest(BaseArchiveTest, unittest.TestCase):
+
+    Map = immutables.map.Map
+    archive = staticmethod(immutables.map.archive)
+    unarchive = staticmethod(immutables.map.unarchive)
+
+
+try:
+    from immutables import _map
+except ImportError:
+    _map = None
+
+
+@unittest.skipIf(_map is None, 'C Map is not available')
+class CArchiveTest(BaseArchiveTest, unittest.TestCase):
+
+    Map = getattr(_map, 'Map', None)
+    archive = staticmethod(getattr(_map, 'archive', None))
+    unarchive = staticmethod(getattr(_map, 'unarchive', None))
+
+
+if __name__ == "__main__":
+    unittest.main()
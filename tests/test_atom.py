@@ -0,0 +1,183 @@
+import gc
+import threading
+import unittest
+import weakref
+
+from immutables.map import Atom as PyAtom
+from immutables.map import Map as PyMap
+
+
+class BaseAtomTest:
+
+    Atom = None
+    Map = None
+
+    def test_atom_basics(self):
+        a = self.Atom()
+        self.assertEqual(a.deref(), self.Map())
+
+        m = self.Map(a=1)
+        a = self.Atom(m)
+        self.assertIs(a.deref(), m)
+        self.assertEqual(repr(a), '<immutables.Atom({!r})>'.format(m))
+
+        m2 = self.Map(b=2)
+        self.assertIs(a.reset(m2), m2)
+        self.assertIs(a.deref(), m2)
+
+        self.assertEqual(self.Atom[str, int].__args__, (str, int))
+        self.assertIsNotNone(weakref.ref(a)())
+
+        with self.assertRaisesRegex(TypeError, 'must be an immutables.Map'):
+            self.Atom({})
+        with self.assertRaisesRegex(TypeError, 'must be an immutables.Map'):
+            a.reset({})
+        with self.assertRaises(TypeError):
+            self.Atom(m, m)
+
+    def test_atom_compare_and_set(self):
+        m = self.Map(a=1)
+        a = self.Atom(m)
+
+        m2 = m.set('b', 2)
+        self.assertTrue(a.compare_and_set(m, m2))
+        self.assertIs(a.deref(), m2)
+
+        # Maps are compared by identity.
+        self.assertFalse(a.compare_and_set(self.Map(a=1, b=2), m))
+        self.assertFalse(a.compare_and_set(None, m))
+        self.assertIs(a.deref(), m2)
+
+        with self.assertRaisesRegex(TypeError, 'must be an immutables.Map'):
+            a.compare_and_set(m2, {})
+        with self.assertRaises(TypeError):
+            a.compare_and_set(m2)
+
+    def test_atom_swap(self):
+        a = self.Atom()
+        m = a.swap(lambda m, k, v=0: m.set(k, v), 'x', v=1)
+        self.assertEqual(m, self.Map(x=1))
+        self.assertIs(a.deref(), m)
+
+        m = a.swap(lambda m, *keys: m.update({k: 2 for k in keys}),
+                   *range(20))
+        self.assertEqual(len(m), 21)
+        self.assertIs(a.deref(), m)
+
+        # Functions see the Map set by another swap() they raced with.
+        seen = []
+
+        def racing(m):
+            seen.append(m)
+            if len(seen) == 1:
+                a.swap(lambda m: m.set('y', 1))
+            return m.set('z', len(seen))
+
+        m = a.swap(racing)
+        self.assertEqual(len(seen), 2)
+        self.assertNotIn('y', seen[0])
+        self.assertEqual(m['y'], 1)
+        self.assertEqual(m['z'], 2)
+
+        with self.assertRaises(ZeroDivisionError):
+            a.swap(lambda m: 1 / 0)
+        with self.assertRaisesRegex(TypeError, 'must be an immutables.Map'):
+            a.swap(lambda m: dict(m))
+        with self.assertRaises(TypeError):
+            a.swap()
+        self.assertIs(a.deref(), m)
+
+    def test_atom_threads(self):
+        a = self.Atom(self.Map(n=0))
+        errors = []
+
+        def run(n):
+            try:
+                for i in range(500):
+                    a.swap(lambda m: m.set('n', m['n'] + 1))
+                    a.swap(lambda m: m.set((n, i), i))
+                    self.assertIn('n', a.deref())
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=run, args=(n,))
+                   for n in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        self.assertEqual(errors, [])
+        m = a.deref()
+        self.assertEqual(m['n'], 8 * 500)
+        self.assertEqual(len(m), 1 + 8 * 500)
+
+    def test_atom_load_replace_threads(self):
+        # Readers load Maps that writers replace, and so free, right
+        # away; on free-threaded builds they run at the same time.
+        a = self.Atom(self.Map(n=0, k=0))
+        done = threading.Event()
+        errors = []
+
+        def read():
+            try:
+                while not done.is_set():
+                    m = a.deref()
+                    self.assertEqual(m['k'], m['n'] * 2)
+            except Exception as e:
+                errors.append(e)
+
+        def write(n):
+            try:
+                for i in range(2000):
+                    a.reset(self.Map(n=i, k=i * 2))
+                    m = a.deref()
+                    a.compare_and_set(m, self.Map(n=n, k=n * 2))
+            except Exception as e:
+                errors.append(e)
+
+        readers = [threading.Thread(target=read) for _ in range(4)]
+        writers = [threading.Thread(target=write, args=(n,))
+                   for n in range(4)]
+        for t in readers + writers:
+            t.start()
+        for t in writers:
+            t.join()
+        done.set()
+        for t in readers:
+            t.join()
+
+        self.assertEqual(errors, [])
+
+    def test_atom_gc(self):
+        a = self.Atom()
+        a.reset(self.Map(atom=a))
+        ref = weakref.ref(a)
+        del a
+        gc.collect()
+        self.assertIsNone(ref())
+
+
+class PyAtomTest(BaseAtomTest, unittest.TestCase):
+
+    Atom = PyAtom
+    Map = PyMap
+
+
+try:
+    from immutables._map import Atom as CAtom
+    from immutables._map import Map as CMap
+except ImportError:
+    CAtom = None
+    CMap = None
+
+
+@unittest.skipIf(CAtom is None, 'C Atom is not available')
+class CAtomTest(BaseAtomTest, unittest.TestCase):
+
+    Atom = CAtom
+    Map = CMap
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,171 @@
+import ctypes
+import os.path
+import unittest
+
+import immutables
+from immutables._testutils import HashKey
+
+try:
+    from immutables import _map
+except ImportError:
+    _map = None
+
+
+def load_capi():
+    # Calls the C API through ctypes, the way an extension would
+    # after Immutables_ImportCAPI().
+    obj = ctypes.py_object
+    ptr = ctypes.POINTER(ctypes.py_object)
+    hash_t = ctypes.c_ssize_t
+    api = ctypes.PYFUNCTYPE
+
+    class Iter(ctypes.Structure):
+        _fields_ = [('_private', ctypes.c_ssize_t * 32)]
+
+    class CAPI(ctypes.Structure):
+        _fields_ = [
+            ('version', ctypes.c_int),
+            ('Map_Check', api(ctypes.c_int, obj)),
+            ('Mutation_Check', api(ctypes.c_int, obj)),
+            ('Hash', api(hash_t, obj)),
+            ('Map_New', api(obj)),
+            ('Map_Size', api(ctypes.c_ssize_t, obj)),
+            ('Map_Find', api(ctypes.c_int, obj, obj, hash_t, ptr)),
+            ('Map_Assoc', api(obj, obj, obj, hash_t, obj)),
+            ('Map_Without', api(obj, obj, obj, hash_t)),
+            ('Map_IterInit',
+             api(ctypes.c_int, ctypes.POINTER(Iter), obj)),
+            ('Map_IterNext',
+             api(ctypes.c_int, ctypes.POINTER(Iter), ptr, ptr,
+                 ctypes.POINTER(hash_t))),
+            ('Map_Mutate', api(obj, obj)),
+            ('Mutation_Set', api(ctypes.c_int, obj, obj, hash_t, obj)),
+            ('Mutation_Delete', api(ctypes.c_int, obj, obj, hash_t)),
+            ('Mutation_Finish', api(obj, obj)),
+        ]
+
+    get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+    get_pointer.restype = ctypes.c_void_p
+    get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+    addr = get_pointer(_map._C_API, b'immutables._map._C_API')
+    return CAPI.from_address(addr), Iter
+
+
+@unittest.skipIf(_map is None, 'C Map is not available')
+class CAPITest(unittest.TestCase):
+
+    def setUp(self):
+        self.api, self.Iter = load_capi()
+
+    def find(self, m, key, hash=-1):
+        val = ctypes.py_object()
+        if self.api.Map_Find(m, key, hash, ctypes.byref(val)):
+            return val.value
+        return None
+
+    def items(self, m):
+        it = self.Iter()
+        self.api.Map_IterInit(ctypes.byref(it), m)
+        key = ctypes.py_object()
+        val = ctypes.py_object()
+        hash = ctypes.c_ssize_t()
+        items = []
+        while self.api.Map_IterNext(
+                ctypes.byref(it), ctypes.byref(key), ctypes.byref(val),
+                ctypes.byref(hash)):
+            self.assertEqual(hash.value, self.api.Hash(key.value))
+            items.append((key.value, val.value))
+        return items
+
+    def test_capi_include(self):
+        self.assertGreaterEqual(self.api.version, 1)
+        self.assertTrue(os.path.exists(
+            os.path.join(immutables.get_include(), 'capi.h')))
+
+    def test_capi_map(self):
+        api = self.api
+        for size in [0, 5, 100]:
+            m = _map.Map({str(i): i for i in range(size)})
+            self.assertEqual(api.Map_Size(m), size)
+            self.assertEqual(sorted(self.items(m)), sorted(m.items()))
+
+            m2 = api.Map_Assoc(m, 'x', -1, 'y')
+            self.assertEqual(m2, m.set('x', 'y'))
+            self.assertEqual(self.find(m2, 'x'), 'y')
+            self.assertEqual(self.find(m2, 'x', api.Hash('x')), 'y')
+            self.assertIsNone(self.find(m, 'x'))
+
+            m3 = api.Map_Without(m2, 'x', api.Hash('x'))
+            self.assertEqual(m3, m)
+            with self.assertRaises(KeyError):
+                api.Map_Without(m, 'x', -1)
+
+        self.assertEqual(api.Map_New(), _map.Map())
+
+        m = _map.Map({HashKey(1, str(i)): i for i in range(10)})
+        for k, v in m.items():
+            self.assertEqual(self.find(m, k, 1), v)
+
+    def test_capi_mutation(self):
+        api = self.api
+        m = _map.Map({str(i): i for i in range(50)})
+        mm = api.Map_Mutate(m)
+        api.Mutation_Set(mm, 'x', -1, 1)
+        api.Mutation_Delete(mm, '1', api.Hash('1'))
+        self.assertEqual(api.Map_Size(mm), 50)
+        self.assertEqual(self.find(mm, 'x'), 1)
+        with self.assertRaises(KeyError):
+            api.Mutation_Delete(mm, '1', -1)
+
+        m2 = api.Mutation_Finish(mm)
+        self.assertEqual(m2, m.set('x', 1).delete('1'))
+        with self.assertRaisesRegex(ValueError, 'has been finished'):
+            api.Mutation_Set(mm, 'y', -1, 1)
+
+    def test_capi_call_only_reference(self):
+        # A Map the caller holds the only reference to isn't a
+        # temporary: set() and delete() called on it from C must not
+        # change it.
+        call_method = ctypes.PYFUNCTYPE(
+            ctypes.py_object, ctypes.py_object,
+            ctypes.POINTER(ctypes.c_void_p), ctypes.c_size_t,
+            ctypes.c_void_p)(('PyObject_VectorcallMethod', ctypes.pythonapi))
+        incref = ctypes.pythonapi.Py_IncRef
+        incref.argtypes = [ctypes.c_void_p]
+        decref = ctypes.pythonapi.Py_DecRef
+        decref.argtypes = [ctypes.c_void_p]
+
+        items = {str(i): i for i in range(100)}
+        key, val = 'x', 'y'
+        for name, args in [('set', (key, val)), ('delete', ('5',))]:
+            m = _map.Map(items)
+            ptr = id(m)
+            incref(ptr)
+            del m
+            argv = (ctypes.c_void_p * 3)(ptr, *map(id, args))
+            try:
+                res = call_method(name, argv, 1 + len(args), None)
+                m = ctypes.cast(ptr, ctypes.py_object).value
+                self.assertIsNot(res, m)
+                self.assertEqual(m, _map.Map(items))
+                self.assertNotEqual(res, m)
+                del res, m
+            finally:
+                decref(ptr)
+
+    def test_capi_errors(self):
+        api = self.api
+        with self.assertRaisesRegex(TypeError, 'expected immutables._map.Map'):
+            api.Map_Assoc({}, 'x', -1, 1)
+        with self.assertRaises(TypeError):
+            api.Map_Size({})
+        with self.assertRaises(TypeError):
+            api.Map_IterInit(ctypes.byref(self.Iter()), {})
+        with self.assertRaises(TypeError):
+            api.Mutation_Set(_map.Map(), 'x', -1, 1)
+        with self.assertRaises(TypeError):
+            api.Map_Assoc(_map.Map(), [], -1, 1)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -31,7 +31,7 @@ class Issue24Base:
         self.assertEqual(node_size, size)
 
     def dump_check_bitmap_count(self, header, count):
-        header = header.split('bitmap=')[1]
+        header = header.split('datamap=')[1]
         bitmap = int(header.split(maxsplit=1)[0], 0)
         self.assertEqual(map_bitcount(bitmap), count)
 
@@ -44,8 +44,21 @@ class Issue24Base:
         self.dump_check_node_kind(header, 'Collision')
         self.dump_check_node_size(header, 2 * count)
 
+    def dump_collision_headers(self, m):
+        # Colliding keys are pushed down through a chain of Bitmap
+        # nodes until all hash bits are consumed.
+        d = m.__dump__().splitlines()
+        if d[0].startswith('HAMT'):
+            d = d[1:]  # skip _map.Map.__dump__() header
+        headers = [line for line in d if line.strip().endswith('):')]
+        self.assertTrue(len(headers) > 2)
+        return headers[0], headers[-1]
+
+    # The C Map stores maps of up to 8 items without a tree, so the
+    # tests below use enough keys to get one.
+
     def test_bitmap_node_update_in_place_count(self):
-        keys = range(7)
+        keys = range(12)
         new_entries = dict.fromkeys(keys, True)
         m = self.Map(new_entries)
         d = m.__dump__().splitlines()
@@ -54,10 +67,10 @@ class Issue24Base:
             header = d[1]  # skip _map.Map.__dump__() header
         else:
             header = d[0]
-        self.dump_check_bitmap_node_count(header, 7)
+        self.dump_check_bitmap_node_count(header, 12)
 
     def test_bitmap_node_delete_in_place_count(self):
-        keys = range(7)
+        keys = range(12)
         new_entries = dict.fromkeys(keys, True)
         m = self.Map(new_entries)
         with m.mutate() as mm:
@@ -69,38 +82,26 @@ class Issue24Base:
             header = d[1]  # skip _map.Map.__dump__() header
         else:
             header = d[0]
-        self.dump_check_bitmap_node_count(header, 4)
+        self.dump_check_bitmap_node_count(header, 9)
 
     def test_collision_node_update_in_place_count(self):
-        keys = (CollisionKey() for i in range(7))
+        keys = (CollisionKey() for i in range(12))
         new_entries = dict.fromkeys(keys, True)
         m = self.Map(new_entries)
-        d = m.__dump__().splitlines()
-        self.assertTrue(len(d) > 3)
-        # get node headers
-        if d[0].startswith('HAMT'):
-            h1, h2 = d[1], d[3]  # skip _map.Map.__dump__() header
-        else:
-            h1, h2 = d[0], d[2]
+        h1, h2 = self.dump_collision_headers(m)
         self.dump_check_node_kind(h1, 'Bitmap')
-        self.dump_check_collision_node_count(h2, 7)
+        self.dump_check_collision_node_count(h2, 12)
 
     def test_collision_node_delete_in_place_count(self):
-        keys = [CollisionKey() for i in range(7)]
+        keys = [CollisionKey() for i in range(12)]
         new_entries = dict.fromkeys(keys, True)
         m = self.Map(new_entries)
         with m.mutate() as mm:
             del mm[keys[0]], mm[keys[2]], mm[keys[3]]
             m2 = mm.finish()
-        d = m2.__dump__().splitlines()
-        self.assertTrue(len(d) > 3)
-        # get node headers
-        if d[0].startswith('HAMT'):
-            h1, h2 = d[1], d[3]  # skip _map.Map.__dump__() header
-        else:
-            h1, h2 = d[0], d[2]
+        h1, h2 = self.dump_collision_headers(m2)
         self.dump_check_node_kind(h1, 'Bitmap')
-        self.dump_check_collision_node_count(h2, 4)
+        self.dump_check_collision_node_count(h2, 9)
 
 
 try:
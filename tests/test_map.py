@@ -1,8 +1,13 @@
 import collections.abc
+import copy
 import gc
+import os
 import pickle
 import random
+import re
+import subprocess
 import sys
+import threading
 import unittest
 import weakref
 
@@ -83,6 +88,32 @@ class BaseMapTest:
         self.assertEqual(len(h2), 1)
         self.assertIsNot(h1.get('key'), h2.get('key'))
 
+    def test_map_basics_5(self):
+        # Arguments are checked the same way whichever way methods
+        # are called.
+        h = self.Map(a=1)
+        mm = h.mutate()
+
+        self.assertEqual(h.get('a'), 1)
+        self.assertEqual(h.get('b', 2), 2)
+        self.assertEqual(mm.pop('b', 2), 2)
+        self.assertEqual(self.Map.fromkeys('a'), self.Map(a=None))
+        self.assertEqual(self.Map.fromkeys('a', 1), h)
+        self.assertEqual(self.Map({'a': 1}, b=2), h.update(b=2))
+        self.assertEqual(h.merge(other=h, resolve=None), h)
+
+        for call in [
+                lambda: self.Map(1, 2), lambda: self.Map.fromkeys(),
+                lambda: h.get(), lambda: h.get(1, 2, 3),
+                lambda: h.set('a'),
+                lambda: h.set('a', 1, 2), lambda: h.update({}, {}),
+                lambda: h.merge(), lambda: h.merge(h, None, None),
+                lambda: h.merge(h, other=h), lambda: h.merge(h, x=1),
+                lambda: mm.get(), lambda: mm.set('a'), lambda: mm.pop(),
+                lambda: mm.pop(1, 2, 3), lambda: mm.update({}, {})]:
+            with self.assertRaises(TypeError):
+                call()
+
     def test_map_collision_1(self):
         k1 = HashKey(10, 'aaa')
         k2 = HashKey(10, 'bbb')
@@ -288,6 +319,119 @@ class BaseMapTest:
 
         self.assertEqual({k.name for k in h.keys()}, {'C', 'D', 'E'})
 
+    def test_map_collision_4(self):
+        # Keys that share a slot but have different hashes must
+        # never be compared with __eq__.
+
+        A = HashKey(0b00001, 'A')
+        B = HashKey(0b00001 | (1 << 5), 'B')
+        C = HashKey(0b00001 | (1 << 10), 'C')
+
+        h = self.Map({A: 'a'})
+
+        with HashKeyCrasher(error_on_eq=True):
+            self.assertNotIn(B, h)
+            self.assertIsNone(h.get(B))
+            with self.assertRaises(KeyError):
+                h.delete(B)
+
+            h2 = h.set(B, 'b')
+            self.assertNotIn(C, h2)
+
+        self.assertEqual(h2.get(A), 'a')
+        self.assertEqual(h2.get(B), 'b')
+
+        h3 = h2.delete(A)
+        self.assertNotIn(A, h3)
+        self.assertEqual(h3.get(B), 'b')
+
+    def test_map_canonical_shape(self):
+        # The shape of the tree only depends on the keys it holds,
+        # not on the order in which they were added or removed.
+        # (Keys within a collision node are kept in insertion order,
+        # so only node headers are compared.)
+
+        def shape(m):
+            return [re.sub(r'id=\w+', '', line)
+                    for line in m.__dump__().splitlines()
+                    if 'Node(' in line]
+
+        keys = [HashKey(i * 7919 % 1009, 'k{}'.format(i)) for i in range(300)]
+        keys += [HashKey(42, 'c{}'.format(i)) for i in range(3)]
+        extra = [HashKey(i * 31 + 5, 'x{}'.format(i)) for i in range(500)]
+        extra += [HashKey(42, 'xc'), HashKey(2 ** 31 + 42, 'xd')]
+
+        h1 = self.Map()
+        for k in keys:
+            h1 = h1.set(k, k.name)
+
+        h2 = self.Map()
+        for k in reversed(keys + extra):
+            h2 = h2.set(k, k.name)
+        for k in extra:
+            h2 = h2.delete(k)
+
+        shuffled = keys + extra
+        random.shuffle(shuffled)
+        with self.Map().mutate() as mm:
+            for k in shuffled:
+                mm[k] = k.name
+            random.shuffle(extra)
+            for k in extra:
+                del mm[k]
+            h3 = mm.finish()
+
+        self.assertEqual(dict(h1.items()), dict(h2.items()))
+        self.assertEqual(dict(h1.items()), dict(h3.items()))
+        self.assertEqual(shape(h1), shape(h2))
+        self.assertEqual(shape(h1), shape(h3))
+
+        for k in keys[:290]:
+            h1 = h1.delete(k)
+            h2 = h2.delete(k)
+        h4 = self.Map()
+        for k in keys[290:]:
+            h4 = h4.set(k, k.name)
+        self.assertEqual(shape(h1), shape(h4))
+        self.assertEqual(shape(h2), shape(h4))
+
+    def test_map_small_boundary(self):
+        # Grow and shrink maps across the size at which the C Map
+        # switches between a flat array and a tree.
+        keys = [HashKey(i % 5, 'k{}'.format(i)) for i in range(12)]
+
+        h = self.Map()
+        maps = [h]
+        for i, k in enumerate(keys):
+            h = h.set(k, i)
+            maps.append(h)
+
+        for n, m in enumerate(maps):
+            expected = {k: i for i, k in enumerate(keys[:n])}
+            self.assertEqual(len(m), n)
+            self.assertEqual(dict(m.items()), expected)
+            self.assertEqual(m, self.Map(expected))
+            self.assertEqual(hash(m), hash(self.Map(expected)))
+            for k in keys[n:]:
+                self.assertNotIn(k, m)
+
+            with m.mutate() as mm:
+                mm[keys[-1]] = 'last'
+                m2 = mm.finish()
+            self.assertEqual(m2, m.set(keys[-1], 'last'))
+            self.assertEqual(m2, m.update({keys[-1]: 'last'}))
+
+        for k in reversed(keys):
+            h = h.delete(k)
+            self.assertEqual(h, maps[len(h)])
+            with self.assertRaises(KeyError):
+                h.delete(k)
+        self.assertEqual(h, self.Map())
+
+        h = maps[8].set(keys[0], 'new')
+        self.assertEqual(h[keys[0]], 'new')
+        self.assertIs(maps[8].set(keys[0], 0), maps[8])
+
     def test_map_stress_02(self):
         COLLECTION_SIZE = 20000
         TEST_ITERS_EVERY = 647
@@ -792,9 +936,379 @@ class BaseMapTest:
         with self.assertRaisesRegex(ValueError, 'cannot compare'):
             h1 != h2
 
+    def test_map_eq_4(self):
+        # Maps built in different orders, with collisions and
+        # nodes of all kinds.
+        keys = [HashKey(i * 7919 % 1009, str(i)) for i in range(300)]
+        keys += [HashKey(42, 'c{}'.format(i)) for i in range(3)]
+        items = [(k, k.name) for k in keys]
+
+        h1 = self.Map(items)
+        h2 = self.Map(reversed(items))
+        self.assertEqual(h1, h2)
+
+        for k in keys[::17]:
+            self.assertNotEqual(h1, h2.set(k, 'other'))
+            self.assertNotEqual(h1, h2.delete(k))
+            self.assertEqual(h1, h2.delete(k).set(k, k.name))
+            self.assertNotEqual(
+                h1.delete(k), h2.delete(k).set(HashKey(k.hash, 'x'), 1))
+
+        h3 = h2.set(keys[-1], 1).set(keys[-1], keys[-1].name)
+        self.assertEqual(h1, h3)
+
     def test_map_eq_3(self):
         self.assertNotEqual(self.Map(), 1)
 
+    def test_map_diff_1(self):
+        h = self.Map(a=1, b=2, c=3)
+        h2 = h.set('a', 10).delete('b').set('d', 4)
+
+        added, removed, changed = h.diff(h2)
+        self.assertEqual(added, self.Map(d=4))
+        self.assertEqual(removed, self.Map(b=2))
+        self.assertEqual(changed, self.Map(a=(1, 10)))
+
+        added, removed, changed = h2.diff(h)
+        self.assertEqual(added, self.Map(b=2))
+        self.assertEqual(removed, self.Map(d=4))
+        self.assertEqual(changed, self.Map(a=(10, 1)))
+
+        self.assertEqual(h.diff(h), (self.Map(),) * 3)
+        self.assertEqual(h.diff(self.Map(h)), (self.Map(),) * 3)
+        self.assertEqual(self.Map().diff(h), (h, self.Map(), self.Map()))
+        self.assertEqual(h.diff(self.Map()), (self.Map(), h, self.Map()))
+
+        # Values are compared with ==.
+        self.assertEqual(h.diff(h.set('a', 1.0)), (self.Map(),) * 3)
+
+        with self.assertRaisesRegex(TypeError, 'must be a Map'):
+            h.diff({'a': 1})
+
+    def test_map_diff_2(self):
+        # Maps derived from one another and built separately, with
+        # collisions and nodes of all kinds.
+        keys = [HashKey(i * 7919 % 1009, str(i)) for i in range(300)]
+        keys += [HashKey(42, 'c{}'.format(i)) for i in range(3)]
+        items = {k: k.name for k in keys}
+        h = self.Map(items)
+
+        def check(d1, d2):
+            h1 = h if d1 is items else self.Map(d1)
+            added, removed, changed = h1.diff(self.Map(d2))
+            self.assertEqual(
+                dict(added.items()),
+                {k: v for k, v in d2.items() if k not in d1})
+            self.assertEqual(
+                dict(removed.items()),
+                {k: v for k, v in d1.items() if k not in d2})
+            self.assertEqual(
+                dict(changed.items()),
+                {k: (v, d2[k]) for k, v in d1.items()
+                 if k in d2 and d2[k] != v})
+
+            h2 = h1
+            for k in d1.keys() - d2.keys():
+                h2 = h2.delete(k)
+            for k, v in d2.items():
+                h2 = h2.set(k, v)
+            self.assertEqual(h1.diff(h2), h1.diff(self.Map(d2)))
+
+        r = random.Random(0)
+        for n in (0, 1, 5, 20, 100, 300):
+            for _ in range(3):
+                d2 = dict(items)
+                for k in r.sample(keys, n):
+                    choice = r.randrange(3)
+                    if choice == 0:
+                        del d2[k]
+                    elif choice == 1:
+                        d2[k] = 'other'
+                    else:
+                        d2[HashKey(k.hash, k.name + 'x')] = 'new'
+                check(items, d2)
+                check(d2, items)
+                small = dict(r.sample(list(d2.items()), 5))
+                check(small, d2)
+                check(d2, small)
+
+    def test_map_patch_1(self):
+        h = self.Map(a=1, b=2, c=3)
+        h2 = h.set('a', 10).delete('b').set('d', 4)
+
+        data = h.make_patch(h2)
+        self.assertIsInstance(data, bytes)
+        self.assertEqual(h.apply_patch(data), h2)
+        self.assertIs(type(h.apply_patch(data)), self.Map)
+        self.assertEqual(h2.apply_patch(h2.make_patch(h)), h)
+
+        self.assertIs(h.apply_patch(h.make_patch(h)), h)
+        self.assertIs(h.apply_patch(h.make_patch(h.set('a', 1.0))), h)
+        self.assertEqual(
+            self.Map().apply_patch(self.Map().make_patch(h)), h)
+        self.assertEqual(
+            h.apply_patch(h.make_patch(self.Map())), self.Map())
+
+        # Both implementations apply each other's patches.
+        self.assertEqual(PyMap(h).apply_patch(data), PyMap(h2))
+        py_data = PyMap(h).make_patch(PyMap(h2))
+        self.assertEqual(h.apply_patch(py_data), h2)
+
+        with self.assertRaisesRegex(TypeError, 'must be a Map'):
+            h.make_patch({'a': 1})
+        with self.assertRaisesRegex(ValueError, 'not for this Map'):
+            h2.apply_patch(data)
+        with self.assertRaisesRegex(ValueError, 'not for this Map'):
+            h.delete('b').set('x', 1).apply_patch(data)
+
+        for state in [None, (), (1, 3, 4, (), ()), (2, 3, 3, (), ()),
+                      (1, 3, 3, ('a',), ('a',)), (1, 3, 3, [], ()),
+                      (1, 3, -1, (), ('a', 1)), (1, 2 ** 70, 3, (), ())]:
+            with self.assertRaises(ValueError):
+                h.apply_patch(pickle.dumps(state))
+
+    def test_map_patch_2(self):
+        # Patches carry only the changes and apply to Maps derived
+        # from one another and built separately, with collisions and
+        # nodes of all kinds.
+        keys = [HashKey(i * 7919 % 1009, str(i)) for i in range(300)]
+        keys += [HashKey(42, 'c{}'.format(i)) for i in range(3)]
+        items = {k: k.name for k in keys}
+        h = self.Map(items)
+
+        r = random.Random(0)
+        for n in (0, 1, 5, 20, 100, 300):
+            h2 = h
+            with h2.mutate() as mm:
+                for k in r.sample(keys, n):
+                    choice = r.randrange(3)
+                    if choice == 0:
+                        del mm[k]
+                    elif choice == 1:
+                        mm[k] = 'other'
+                    else:
+                        mm[HashKey(k.hash, k.name + 'x')] = 'new'
+                h2 = mm.finish()
+
+            added, removed, changed = h.diff(h2)
+            _, _, _, patch_removed, patch_kv = pickle.loads(
+                h.make_patch(h2))
+            self.assertEqual(len(patch_removed), len(removed))
+            self.assertEqual(len(patch_kv), 2 * (len(added) + len(changed)))
+
+            for h1 in (h, self.Map(items)):
+                self.assertEqual(h1.apply_patch(h.make_patch(h2)), h2)
+                self.assertEqual(
+                    self.Map(h2.items()).apply_patch(h2.make_patch(h1)), h)
+
+    def test_map_merge_1(self):
+        h = self.Map(a=1, b=2)
+        h2 = self.Map(b=20, c=30)
+
+        self.assertEqual(h | h2, self.Map(a=1, b=20, c=30))
+        self.assertEqual(h2 | h, self.Map(a=1, b=2, c=30))
+        self.assertEqual(h.merge(h2), h | h2)
+        self.assertEqual(
+            h.merge(h2, lambda k, v1, v2: (k, v1, v2)),
+            self.Map(a=1, b=('b', 2, 20), c=30))
+        self.assertEqual(
+            h.merge(other=h2, resolve=lambda k, v1, v2: v1),
+            self.Map(a=1, b=2, c=30))
+        self.assertEqual(h | self.Map(), h)
+        self.assertEqual(self.Map() | h, h)
+
+        h3 = h
+        h3 |= h2
+        self.assertEqual(h3, self.Map(a=1, b=20, c=30))
+        self.assertEqual(h, self.Map(a=1, b=2))
+
+        with self.assertRaises(TypeError):
+            h | {'a': 1}
+        with self.assertRaises(TypeError):
+            {'a': 1} | h
+        with self.assertRaisesRegex(TypeError, 'must be a Map'):
+            h.merge({'a': 1})
+        with self.assertRaisesRegex(TypeError, 'must be callable'):
+            h.merge(h2, 1)
+
+        def resolve(k, v1, v2):
+            raise ZeroDivisionError
+        with self.assertRaises(ZeroDivisionError):
+            h.merge(h2, resolve)
+
+    def test_map_merge_2(self):
+        # Maps derived from one another and built separately, with
+        # collisions and nodes of all kinds.
+        keys = [HashKey(i * 7919 % 1009, str(i)) for i in range(300)]
+        keys += [HashKey(42, 'c{}'.format(i)) for i in range(3)]
+
+        def resolve(key, v1, v2):
+            return (v1, v2)
+
+        r = random.Random(0)
+        for n1, n2 in ((300, 300), (300, 20), (20, 300), (5, 300),
+                       (300, 5), (100, 150)):
+            for _ in range(3):
+                d1 = {k: k.name for k in r.sample(keys, n1)}
+                d2 = {k: 'other' for k in r.sample(keys, n2)}
+                h1 = self.Map(d1)
+                derived = h1
+                for k, v in d2.items():
+                    derived = derived.set(k, v)
+
+                for h2 in (self.Map(d2), derived):
+                    d = dict(d1)
+                    d.update(h2.items())
+                    self.assertEqual(h1 | h2, self.Map(d))
+                    self.assertEqual(len(h1 | h2), len(d))
+
+                    d = dict(d1)
+                    for k, v in h2.items():
+                        d[k] = (d[k], v) if k in d else v
+                    merged = h1.merge(h2, resolve)
+                    self.assertEqual(merged, self.Map(d))
+                    self.assertEqual(len(merged), len(d))
+
+    def test_map_merge_3(self):
+        # Like dict.update(), merges keep the key objects of the Map
+        # merged into, whatever the shapes of both trees are.
+        for n1, n2 in ((0, 0), (0, 18), (18, 0), (20, 20), (200, 3),
+                       (3, 200)):
+            h1 = self.Map({i: 'a' for i in range(2, 2 + n1)})
+            h1 = h1.set(1, 'a').set(0.0, 'a')
+            h2 = self.Map({i: 'b' for i in range(1000, 1000 + n2)})
+            h2 = h2.set(True, 'b').set(0, 'b')
+
+            def keys(m):
+                return sorted(repr(k) for k in m if k in (0, 1))
+
+            for m in (h1.update(h2), h1 | h2, h1.merge(h2)):
+                self.assertEqual(keys(m), ['0.0', '1'])
+                self.assertEqual((m[0], m[1]), ('b', 'b'))
+
+            mm = h1.mutate()
+            mm.update(h2)
+            self.assertEqual(keys(mm.finish()), ['0.0', '1'])
+
+            seen = []
+
+            def resolve(key, v1, v2):
+                seen.append(repr(key))
+                return v1
+
+            m = h1.merge(h2, resolve)
+            self.assertEqual(keys(m), ['0.0', '1'])
+            self.assertEqual((m[0], m[1]), ('a', 'a'))
+            # resolve() is passed the key objects of the other Map.
+            self.assertEqual(sorted(seen), ['0', 'True'])
+
+        # Against the only pair of a child of an Array node.
+        h2 = self.Map({i: 'b' for i in range(2, 32)}).set(True, 'b')
+        m = self.Map({1: 'a'}).update(h2)
+        self.assertEqual([repr(k) for k in m if k == 1], ['1'])
+        self.assertEqual(m, h2)
+
+    def test_map_setops_1(self):
+        h = self.Map(a=1, b=2, c=3)
+        h2 = self.Map(b=20, c=30, d=40)
+
+        self.assertEqual(h.intersection(h2), self.Map(b=2, c=3))
+        self.assertEqual(h2.intersection(h), self.Map(b=20, c=30))
+        self.assertEqual(h.difference(h2), self.Map(a=1))
+        self.assertEqual(h2.difference(h), self.Map(d=40))
+        self.assertEqual(h.symmetric_difference(h2), self.Map(a=1, d=40))
+
+        self.assertEqual(h.intersection(h), h)
+        self.assertEqual(h.difference(h), self.Map())
+        self.assertEqual(h.symmetric_difference(h), self.Map())
+        self.assertEqual(h.intersection(self.Map()), self.Map())
+        self.assertEqual(h.difference(self.Map()), h)
+        self.assertEqual(self.Map().symmetric_difference(h), h)
+
+        self.assertEqual(h.restrict(['a', 'c', 'x']), self.Map(a=1, c=3))
+        self.assertEqual(h.restrict('aab'), self.Map(a=1, b=2))
+        self.assertEqual(len(h.restrict('aab')), 2)
+        self.assertEqual(h.restrict(h2), self.Map(b=2, c=3))
+        self.assertEqual(h.restrict(h2.keys()), self.Map(b=2, c=3))
+        self.assertEqual(h.restrict(()), self.Map())
+
+        for method in ('intersection', 'difference',
+                       'symmetric_difference'):
+            with self.assertRaisesRegex(TypeError, 'must be a Map'):
+                getattr(h, method)({'a': 1})
+        with self.assertRaises(TypeError):
+            h.restrict(1)
+
+        with HashKeyCrasher(error_on_hash=True):
+            with self.assertRaises(HashingError):
+                h.restrict([HashKey(1, 'a')])
+
+    def test_map_setops_4(self):
+        # Intersections keep the key objects of the Map they're called
+        # on, whatever the shapes of both trees are.
+        for n1, n2 in ((0, 0), (0, 18), (18, 0), (20, 20), (200, 3),
+                       (3, 200)):
+            h1 = self.Map({i: 'a' for i in range(2, 2 + n1)})
+            h1 = h1.set(1, 'a').set(0.0, 'a')
+            h2 = self.Map({i: 'b' for i in range(1000, 1000 + n2)})
+            h2 = h2.set(True, 'b').set(0, 'b')
+
+            m = h1.intersection(h2)
+            self.assertEqual(sorted(repr(k) for k in m), ['0.0', '1'])
+            self.assertEqual(m, self.Map({1: 'a', 0: 'a'}))
+            m = h2.intersection(h1)
+            self.assertEqual(sorted(repr(k) for k in m), ['0', 'True'])
+            self.assertEqual(m, self.Map({1: 'b', 0: 'b'}))
+
+    def test_map_setops_2(self):
+        h = self.Map(a=1, b=2, c=3)
+        h2 = self.Map(b=20, c=30, d=40)
+
+        self.assertEqual(set(h.keys() & h2.keys()), {'b', 'c'})
+        self.assertEqual(set(h.keys() | h2.keys()), {'a', 'b', 'c', 'd'})
+        self.assertEqual(set(h.keys() - h2.keys()), {'a'})
+        self.assertEqual(set(h.keys() ^ h2.keys()), {'a', 'd'})
+        self.assertEqual(len(h.keys() ^ h2.keys()), 2)
+        self.assertIn('d', h.keys() | h2.keys())
+
+        with self.assertRaises(TypeError):
+            h.keys() & {'a'}
+        with self.assertRaises(TypeError):
+            h.keys() - h2.values()
+
+    def test_map_setops_3(self):
+        # Maps derived from one another and built separately, with
+        # collisions and nodes of all kinds.
+        keys = [HashKey(i * 7919 % 1009, str(i)) for i in range(300)]
+        keys += [HashKey(42, 'c{}'.format(i)) for i in range(3)]
+
+        r = random.Random(0)
+        for n1, n2 in ((300, 300), (300, 20), (20, 300), (5, 300),
+                       (300, 5), (100, 150)):
+            for _ in range(3):
+                d1 = {k: k.name for k in r.sample(keys, n1)}
+                d2 = {k: 'other' for k in r.sample(keys, n2)}
+                h1 = self.Map(d1)
+                derived = h1
+                for k in r.sample(list(d1), n1 // 10):
+                    derived = derived.delete(k)
+                for k, v in d2.items():
+                    derived = derived.set(k, v)
+
+                for h2 in (self.Map(d2), derived):
+                    d2 = dict(h2.items())
+                    inter = {k: v for k, v in d1.items() if k in d2}
+                    diff = {k: v for k, v in d1.items() if k not in d2}
+                    sym = dict(diff)
+                    sym.update((k, v) for k, v in d2.items() if k not in d1)
+
+                    for res, d in ((h1.intersection(h2), inter),
+                                   (h1.restrict(list(d2)), inter),
+                                   (h1.difference(h2), diff),
+                                   (h1.symmetric_difference(h2), sym)):
+                        self.assertEqual(res, self.Map(d))
+                        self.assertEqual(len(res), len(d))
+
     def test_map_gc_1(self):
         A = HashKey(100, 'A')
 
@@ -837,6 +1351,32 @@ class BaseMapTest:
 
         self.assertIsNone(ref())
 
+    def test_map_gc_3(self):
+        # Cycles through values stored in place by a mutation, in
+        # nodes that held only atomic keys and values so far: a chain
+        # of bitmap nodes, array nodes and a collision node.
+        chain = [i << 10 for i in range(12)]
+        wide = list(range(100))
+        colliding = [7 + i * sys.hash_info.modulus for i in range(3)]
+
+        for keys in (chain, wide, wide + colliding):
+            with self.Map().mutate() as mm:
+                for k in keys:
+                    mm[k] = str(k)
+                obj = []
+                mm[keys[-1]] = obj
+                h = mm.finish()
+            obj.append(h)
+
+            ref = weakref.ref(h)
+            del h, obj, mm
+
+            gc.collect()
+            gc.collect()
+            gc.collect()
+
+            self.assertIsNone(ref())
+
     def test_map_in_1(self):
         A = HashKey(100, 'A')
         AA = HashKey(100, 'A')
@@ -944,6 +1484,36 @@ class BaseMapTest:
             with HashKeyCrasher(error_on_hash=True):
                 hash(m)
 
+    def test_hash_3(self):
+        # Hashes of maps derived from already hashed maps.
+        keys = [HashKey(i % 300, str(i)) for i in range(1000)]
+        h = self.Map({k: k.name for k in keys})
+        hash(h)
+
+        def check(m):
+            self.assertEqual(hash(m), hash(self.Map(m.items())))
+
+        for i in range(0, 1000, 37):
+            check(h.set(keys[i], 'new'))
+            check(h.set(HashKey(i, 'extra'), i))
+            check(h.delete(keys[i]))
+
+        with h.mutate() as mm:
+            for i in range(0, 1000, 3):
+                mm[keys[i]] = i
+            check(mm.finish())
+
+        with h.mutate() as mm:
+            for i in range(0, 1000, 2):
+                del mm[keys[i]]
+            m = mm.finish()
+        check(m)
+
+        with m.mutate() as mm:
+            for i in range(0, 1000, 2):
+                mm[keys[i]] = keys[i].name
+            self.assertEqual(hash(mm.finish()), hash(h))
+
     def test_abc_1(self):
         self.assertTrue(issubclass(self.Map, collections.abc.Mapping))
 
@@ -1073,11 +1643,6 @@ class BaseMapTest:
             with self.assertRaises(HashingError):
                 h.update(upd)
 
-        upd = self.Map({key: 'zzz'})
-        with HashKeyCrasher(error_on_hash=True):
-            with self.assertRaises(HashingError):
-                h.update(upd)
-
         upd = [(1, 2), (key, 'zzz')]
         with HashKeyCrasher(error_on_hash=True):
             with self.assertRaises(HashingError):
@@ -1085,6 +1650,22 @@ class BaseMapTest:
 
         self.assertEqual(dict(h.items()), {'a': 1, 'b': 2, 'z': 100})
 
+        # Maps store hashes of their keys, so updating from
+        # another Map doesn't need to hash them again.
+        upd = self.Map({key: 'zzz'})
+        with HashKeyCrasher(error_on_hash=True):
+            h2 = h.update(upd)
+
+        self.assertEqual(dict(h2.items()),
+                         {'a': 1, 'b': 2, 'z': 100, key: 'zzz'})
+
+        with HashKeyCrasher(error_on_hash=True):
+            with h.mutate() as mm:
+                mm.update(upd)
+                h3 = mm.finish()
+
+        self.assertEqual(h2, h3)
+
     def test_map_mut_8(self):
         key1 = HashKey(123, 'aaa')
         key2 = HashKey(123, 'bbb')
@@ -1262,6 +1843,30 @@ class BaseMapTest:
         m2 = m.update({'a': 20})
         self.assertEqual(len(m2), 2)
 
+    def test_map_mut_update_map(self):
+        # Maps are merged into the tree of the mutation, which has
+        # to stay updatable in place afterwards.
+        keys = [HashKey(i * 7919 % 1009, str(i)) for i in range(300)]
+        keys += [HashKey(42, 'c{}'.format(i)) for i in range(3)]
+        d = {k: k.name for k in keys[:200]}
+        d2 = {k: 'other' for k in keys[100:]}
+        h = self.Map(d)
+
+        with h.mutate() as mm:
+            mm.update(self.Map(d2))
+            self.assertEqual(len(mm), len(keys))
+            for k in keys[::7]:
+                mm[k] = 'mut'
+                d2[k] = 'mut'
+            del mm[keys[1]]
+            m2 = mm.finish()
+
+        d.update(d2)
+        del d[keys[1]]
+        self.assertEqual(m2, self.Map(d))
+        self.assertEqual(len(m2), len(d))
+        self.assertEqual(h, self.Map({k: k.name for k in keys[:200]}))
+
     def test_map_mut_20(self):
         # Issue 24:
 
@@ -1384,6 +1989,104 @@ class BaseMapTest:
         with self.assertRaisesRegex(TypeError, "can('t|not) pickle"):
             pickle.dumps(h.mutate())
 
+    def test_map_copy(self):
+        for h in (self.Map(), self.Map(a=[1]),
+                  self.Map((str(i), [i]) for i in range(100))):
+            self.assertIs(copy.copy(h), h)
+
+    def test_map_deepcopy_1(self):
+        # Maps of keys and values that copy to themselves are returned
+        # as they are.
+        for h in (self.Map(), self.Map(a=1),
+                  self.Map((str(i), (i, 'x')) for i in range(1000))):
+            self.assertIs(copy.deepcopy(h), h)
+
+        for size in (1, 5, 100, 1000):
+            h = self.Map((str(i), [i]) for i in range(size))
+            h = h.set('shared', 'x')
+            h2 = copy.deepcopy(h)
+
+            self.assertIs(type(h2), self.Map)
+            self.assertEqual(h2, h)
+            for k in h:
+                if k != 'shared':
+                    self.assertIsNot(h2[k], h[k])
+            h2['0'].append(1)
+            self.assertEqual(h['0'], [0])
+
+        # Values are copied with the memo.
+        lst = []
+        h = self.Map(a=lst, b=lst)
+        h2 = copy.deepcopy(h)
+        self.assertIs(h2['a'], h2['b'])
+        self.assertIsNot(h2['a'], lst)
+
+        h = self.Map(a=lst)
+        lst.append(h)
+        h2 = copy.deepcopy(h)
+        self.assertIs(h2['a'][0], h2)
+
+        class Error(Exception):
+            pass
+
+        class Bad:
+            def __deepcopy__(self, memo):
+                raise Error
+
+        for size in (1, 100):
+            h = self.Map((str(i), i) for i in range(size)).set('x', Bad())
+            with self.assertRaises(Error):
+                copy.deepcopy(h)
+
+    def test_map_deepcopy_2(self):
+        # Trees are cloned as they are, with collisions and nodes of
+        # all kinds, and keys are only hashed if their copies are new
+        # objects.
+        hashed = []
+
+        class Key(str):
+            def __hash__(self):
+                hashed.append(self)
+                return str.__hash__(self)
+
+            def __deepcopy__(self, memo):
+                return self
+
+        keys = [HashKey(i * 7919 % 1009, str(i)) for i in range(1000)]
+        keys += [HashKey(42, 'c{}'.format(i)) for i in range(3)]
+        h = self.Map((k, [k.name]) for k in keys)
+        h = h.update((Key(i), [i]) for i in 'abcdefghijk')
+        del hashed[:]
+
+        h2 = copy.deepcopy(h)
+        self.assertEqual(hashed, [])
+        self.assertEqual(h2, h)
+        self.assertEqual(h2.__dump__().count('CollisionNode'),
+                         h.__dump__().count('CollisionNode'))
+        for k, v in h.items():
+            self.assertEqual(h2[k], v)
+            self.assertIsNot(h2[k], v)
+
+        # Keys whose copies hash differently are hashed again.
+        class IdKey:
+            def __init__(self, name):
+                self.name = name
+
+            def __eq__(self, other):
+                return isinstance(other, IdKey) and self.name == other.name
+
+            def __hash__(self):
+                return id(self)
+
+        for size in (5, 100):
+            h = self.Map((IdKey(str(i)), i) for i in range(size))
+            h = h.set('shared', 'x')
+            h2 = copy.deepcopy(h)
+            self.assertEqual(len(h2), len(h))
+            for k in h2:
+                self.assertEqual(h2[k], h[k] if k == 'shared' else
+                                 int(k.name))
+
     def test_map_is_subscriptable(self):
         if sys.version_info >= (3, 9):
             with_args = self.Map[int, str]
@@ -1401,6 +2104,102 @@ class BaseMapTest:
         m = self.Map(foo="bar")
         self.assertTrue("foo" in m.keys())
 
+    def test_map_build_1(self):
+        # Maps built from dicts, sequences and keys in one go have
+        # the same contents and shape as Maps built key by key.
+        keys = [HashKey(i * 7919 % 1009, str(i)) for i in range(1000)]
+        keys += [HashKey(42, 'c{}'.format(i)) for i in range(3)]
+        keys += [HashKey(-1 << 63, 'min'), HashKey((1 << 63) - 1, 'max')]
+
+        def by_key(items):
+            h = self.Map()
+            for k, v in items:
+                h = h.set(k, v)
+            return h
+
+        for n in (0, 1, 8, 9, 50, len(keys)):
+            items = [(k, k.name) for k in keys[:n]]
+            h = by_key(items)
+            for built in (self.Map(items), self.Map(dict(items)),
+                          self.Map(iter(items)),
+                          self.Map([list(i) for i in items])):
+                self.assertEqual(built, h)
+                self.assertEqual(len(built), n)
+                self.assertEqual(hash(built), hash(h))
+                self.assertEqual(
+                    re.sub(r'id=\w+', '', built.__dump__()),
+                    re.sub(r'id=\w+', '', h.__dump__()))
+
+            self.assertEqual(
+                self.Map.fromkeys(k for k, _ in items),
+                by_key((k, None) for k, _ in items))
+            self.assertEqual(
+                self.Map.fromkeys(keys[:n], 1), by_key((k, 1) for k in keys[:n]))
+
+    def test_map_build_2(self):
+        # Of pairs with equal keys, the first key and the last value win.
+        a1 = HashKey(1, 'a')
+        a2 = HashKey(1, 'a')
+        b = HashKey(1, 'b')
+        h = self.Map([(a1, 1), (b, 2), (a2, 3)])
+        self.assertEqual(len(h), 2)
+        self.assertEqual(h[a1], 3)
+        self.assertIs([k for k in h if k == a1][0], a1)
+
+        h = self.Map([(i % 10, i) for i in range(100)])
+        self.assertEqual(h, self.Map({i: 90 + i for i in range(10)}))
+        self.assertEqual(len(self.Map.fromkeys('abcab')), 3)
+
+        with self.assertRaises(ValueError):
+            self.Map([(1, 2), (3,)])
+        with self.assertRaises(TypeError):
+            self.Map([(1, 2), 3])
+        with self.assertRaises(TypeError):
+            self.Map.fromkeys(1)
+        with self.assertRaises(TypeError):
+            self.Map.fromkeys([[]])
+
+        with HashKeyCrasher(error_on_eq=True):
+            with self.assertRaises(EqError):
+                self.Map([(a1, 1), (b, 2)])
+            with self.assertRaises(EqError):
+                self.Map.fromkeys([a1, b])
+        with HashKeyCrasher(error_on_hash=True):
+            with self.assertRaises(HashingError):
+                self.Map({a1: 1})
+
+    def test_map_build_3(self):
+        # Like dict.update(), updates from dicts and sequences keep
+        # the key objects already in the Map, whatever the shapes of
+        # the Map and of the tree built from the pairs are.
+        def keys(m):
+            return sorted(repr(k) for k in m if k in (0, 1))
+
+        for n1, n2 in ((0, 0), (0, 18), (18, 0), (20, 20), (200, 3),
+                       (3, 200)):
+            h = self.Map({i: 'a' for i in range(2, 2 + n1)})
+            h = h.set(1, 'a').set(0.0, 'a')
+            d = {i: 'b' for i in range(1000, 1000 + n2)}
+            d.update({True: 'b', 0: 'b'})
+
+            for arg in (d, list(d.items())):
+                m = h.update(arg)
+                self.assertEqual(keys(m), ['0.0', '1'])
+                self.assertEqual((m[0], m[1]), ('b', 'b'))
+                self.assertEqual(len(m), len(h) + n2)
+
+                mm = h.mutate()
+                mm.update(arg)
+                self.assertEqual(keys(mm.finish()), ['0.0', '1'])
+
+        items = [(1, 'a'), (True, 'b'), (0.0, 'c'), (0, 'd')]
+        for n in (0, 50):
+            pairs = items + [(i, i) for i in range(2, 2 + n)]
+            for m in (self.Map(pairs), self.Map().update(pairs),
+                      self.Map({5: 5}).update(pairs)):
+                self.assertEqual(keys(m), ['0.0', '1'])
+                self.assertEqual((m[0], m[1]), ('d', 'b'))
+
 
 class PyMapTest(BaseMapTest, unittest.TestCase):
 
@@ -1418,6 +2217,438 @@ class CMapTest(BaseMapTest, unittest.TestCase):
 
     Map = CMap
 
+    def test_map_gc_untracked(self):
+        # Maps of atomic keys and values are invisible to the GC.
+        h = self.Map({str(i): i for i in range(1000)})
+        self.assertFalse(gc.is_tracked(h))
+        self.assertFalse(gc.is_tracked(self.Map(a=1, b=(1, 2))))
+        self.assertFalse(gc.is_tracked(self.Map(a=h)))
+
+        self.assertTrue(gc.is_tracked(h.set('x', [])))
+        self.assertTrue(gc.is_tracked(h.set('1', {})))
+        self.assertTrue(gc.is_tracked(self.Map(a=[])))
+        self.assertTrue(gc.is_tracked(self.Map(a=h.set('x', []))))
+
+        with h.mutate() as mm:
+            mm['1'] = 'one'
+            mm['500'] = []
+            self.assertTrue(gc.is_tracked(mm.finish()))
+
+    def test_map_eq_shared(self):
+        # Subtrees shared by both maps are not compared at all, and
+        # copied nodes compare keys that are the same objects.
+        keys = [HashKey(i, str(i)) for i in range(1000)]
+        h = self.Map((k, k.name) for k in keys)
+        h2 = h.set(keys[500], 'other')
+        h3 = h2.set(keys[500], keys[500].name)
+
+        with HashKeyCrasher(error_on_eq=True):
+            self.assertNotEqual(h, h2)
+            self.assertEqual(h, h3)
+            self.assertNotEqual(h, h.delete(keys[10]))
+
+    def test_map_diff_shared(self):
+        # Subtrees shared by both maps are skipped, and copied nodes
+        # compare keys that are the same objects.
+        keys = [HashKey(i, str(i)) for i in range(1000)]
+        h = self.Map((k, k.name) for k in keys)
+        h2 = h.set(keys[500], 'other').delete(keys[10])
+
+        with HashKeyCrasher(error_on_eq=True):
+            added, removed, changed = h.diff(h2)
+            self.assertEqual(len(added), 0)
+            self.assertEqual(len(removed), 1)
+            self.assertEqual(len(changed), 1)
+
+        self.assertEqual(removed, self.Map({keys[10]: '10'}))
+        self.assertEqual(changed, self.Map({keys[500]: ('500', 'other')}))
+
+    def test_map_patch_shared(self):
+        # Patches are made skipping subtrees shared by both maps.
+        keys = [HashKey(i, str(i)) for i in range(1000)]
+        h = self.Map((k, k.name) for k in keys)
+        h2 = h.set(keys[500], 'other').delete(keys[10])
+
+        with HashKeyCrasher(error_on_eq=True):
+            data = h.make_patch(h2)
+
+        self.assertEqual(
+            pickle.loads(data), (1, 1000, 999, (keys[10],),
+                                 (keys[500], 'other')))
+        self.assertEqual(h.apply_patch(data), h2)
+
+    def test_map_merge_shared(self):
+        # Subtrees shared by both maps are reused as they are.
+        keys = [HashKey(i, str(i)) for i in range(1000)]
+        h = self.Map((k, k.name) for k in keys)
+        h2 = h.set(keys[500], 'other')
+
+        with HashKeyCrasher(error_on_eq=True):
+            merged = h | h2
+            self.assertEqual(len(merged), len(keys))
+            self.assertIs(h | h, h)
+
+        self.assertEqual(merged, h2)
+
+    def test_map_setops_shared(self):
+        # Subtrees shared by both maps are reused or dropped as they are.
+        keys = [HashKey(i, str(i)) for i in range(1000)]
+        h = self.Map((k, k.name) for k in keys)
+        h2 = h.delete(keys[500]).set(HashKey(2000, 'x'), 'x')
+
+        with HashKeyCrasher(error_on_eq=True):
+            inter = h.intersection(h2)
+            diff = h.difference(h2)
+            sym = h.symmetric_difference(h2)
+            self.assertIs(h.intersection(h), h)
+            self.assertIs(h.difference(self.Map()), h)
+
+        self.assertEqual(inter, h.delete(keys[500]))
+        self.assertEqual(diff, self.Map({keys[500]: '500'}))
+        self.assertEqual(
+            sym, self.Map({keys[500]: '500', HashKey(2000, 'x'): 'x'}))
+
+    def test_map_pickle_shape(self):
+        # Trees are unpickled as they were pickled.
+        def shape(m):
+            return re.sub(r'id=\w+', '', m.__dump__())
+
+        keys = ['k{}'.format(i) for i in range(1000)]
+        keys += [-1, -2, (1, 'a'), 1.5, None, b'b']
+        for n in (0, 1, 9, 100, len(keys)):
+            h = self.Map((k, i) for i, k in enumerate(keys[-n:]))
+            for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+                uh = pickle.loads(pickle.dumps(h, proto))
+                self.assertEqual(uh, h)
+                self.assertEqual(len(uh), len(h))
+                self.assertEqual(shape(uh), shape(h))
+
+            buffers = []
+            data = pickle.dumps(h, 5, buffer_callback=buffers.append)
+            self.assertEqual(len(buffers), 1)
+            self.assertEqual(pickle.loads(data, buffers=buffers), h)
+
+        # Keys with hashes of their own are hashed again.
+        h = self.Map({HashKey(i % 10, str(i)): i for i in range(100)})
+        uh = pickle.loads(pickle.dumps(h))
+        self.assertEqual(uh, h)
+        self.assertEqual(shape(uh), shape(h))
+
+    def test_map_pickle_none_nan(self):
+        # NaNs hash by identity, and None by address before 3.12:
+        # their pickled hashes can't be reused.
+        nan = float('nan')
+        items = {'k{}'.format(i): i for i in range(100)}
+        items.update({None: 'none', nan: 'nan', (1, nan): 'tuple-nan',
+                      (2, None): 'tuple-none'})
+        h = self.Map(items)
+
+        def check(m):
+            self.assertEqual(len(m), len(items))
+            for k in m:
+                self.assertIn(k, m)
+            self.assertEqual(m[None], 'none')
+            self.assertEqual(m[(2, None)], 'tuple-none')
+            self.assertEqual(m, self.Map(m.items()))
+
+        for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+            check(pickle.loads(pickle.dumps(h, proto)))
+
+        # Processes with the same hash seed reuse the hashes of the
+        # other keys.
+        code = (
+            'import pickle, sys\n'
+            'sys.path[:0] = {path!r}\n'
+            'from immutables._map import Map\n'
+            'nan = float("nan")\n'
+            'if len(sys.argv) == 1:\n'
+            '    items = {{"k{{}}".format(i): i for i in range(100)}}\n'
+            '    items.update({{None: 0, nan: 1,\n'
+            '                  (1, nan): 2, (2, None): 3}})\n'
+            '    sys.stdout.write(pickle.dumps(Map(items)).hex())\n'
+            'else:\n'
+            '    m = pickle.loads(bytes.fromhex(sys.stdin.read()))\n'
+            '    assert len(m) == 104, len(m)\n'
+            '    assert all(k in m for k in m)\n'
+            '    assert m[None] == 0 and m[(2, None)] == 3\n'
+            '    assert m == Map(m.items())\n'
+        ).format(path=sys.path)
+        env = dict(os.environ, PYTHONHASHSEED='1')
+        data = subprocess.run(
+            [sys.executable, '-c', code], env=env, check=True,
+            stdout=subprocess.PIPE).stdout
+        subprocess.run(
+            [sys.executable, '-c', code, 'load'], env=env, check=True,
+            input=data)
+
+    def test_map_pickle_invalid(self):
+        from immutables._map import _unpickle
+
+        h = self.Map({'k{}'.format(i): i for i in range(100)})
+        shape, kv = h.__reduce__()[1]
+        self.assertEqual(_unpickle(shape, kv), h)
+
+        with self.assertRaises(ValueError):
+            _unpickle(shape[:-1], kv)
+        with self.assertRaises(ValueError):
+            _unpickle(shape + b'B', kv)
+        with self.assertRaises(ValueError):
+            _unpickle(shape, kv[:-2])
+        with self.assertRaises(ValueError):
+            _unpickle(b'\xff' + shape[1:], kv)
+        with self.assertRaises(TypeError):
+            _unpickle(shape, list(kv))
+        with self.assertRaises(TypeError):
+            _unpickle(None, kv)
+
+    def test_map_small_dump(self):
+        def kind(m):
+            return m.__dump__().splitlines()[1].split('(')[0].strip()
+
+        h = self.Map({i: i for i in range(8)})
+        self.assertEqual(kind(h), 'SmallMap')
+        h = h.set(8, 8)
+        self.assertEqual(kind(h), 'BitmapNode')
+        h = h.delete(0)
+        self.assertEqual(kind(h), 'SmallMap')
+
+        with h.mutate() as mm:
+            mm[0] = 0
+            mm[9] = 9
+            del mm[1], mm[2]
+            self.assertEqual(kind(mm.finish()), 'SmallMap')
+
+    def test_map_threads(self):
+        # Maps are read and a mutation is changed from many threads;
+        # on free-threaded builds this runs without the GIL.
+        h = self.Map({str(i): i for i in range(1000)})
+        mm = h.mutate()
+        errors = []
+
+        def run(n):
+            try:
+                for i in range(1000):
+                    self.assertEqual(h[str(i)], i)
+                    mm[(n, i)] = i
+                    if i % 2:
+                        del mm[(n, i - 1)]
+                    self.assertIn((n, i), mm)
+                    hash(h.set((n, i), i))
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=run, args=(n,))
+                   for n in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        self.assertEqual(errors, [])
+        self.assertEqual(len(mm), 1000 + 8 * 500)
+        m2 = mm.finish()
+        self.assertEqual(
+            m2, h.update({(n, i): i for n in range(8)
+                          for i in range(1, 1000, 2)}))
+
+    def test_map_node_type_refs(self):
+        # Tree nodes hold a reference to their type, which they drop
+        # when they are freed.
+        def node_types(m):
+            types = set()
+            todo = [m]
+            while todo:
+                for o in gc.get_referents(todo.pop()):
+                    if type(o).__name__.endswith('_node'):
+                        types.add(type(o))
+                        todo.append(o)
+            return types
+
+        keys = [HashKey(i % 500, str(i)) for i in range(1000)]
+        h = self.Map((k, i) for i, k in enumerate(keys))
+        types = node_types(h.set(None, 0))
+        self.assertEqual(len(types), 3)
+        refs = [sys.getrefcount(t) for t in types]
+
+        for i, k in enumerate(keys):
+            h2 = h.set(k, -i).delete(keys[i - 1])
+            self.assertEqual(h2[k], -i)
+            self.assertNotIn(keys[i - 1], h2)
+            mm = h.mutate()
+            mm[k] = i
+            del mm[keys[i - 1]]
+            self.assertEqual(mm.finish(), h2.set(k, i))
+        self.assertEqual(dict(h.items()), {k: i for i, k in enumerate(keys)})
+
+        del h2, mm
+        gc.collect()
+        self.assertEqual([sys.getrefcount(t) for t in types], refs)
+
+    def test_map_set_temporary(self):
+        # set() and delete() update Maps nothing else refers to in
+        # place; Maps that are referred to must never change.
+        ids = []
+
+        def keep_id(m):
+            ids.append(id(m))
+            return m
+
+        def keep_hash(m):
+            hash(m)
+            return m
+
+        items = {str(i): i for i in range(100)}
+        h = self.Map(items)
+
+        h2 = keep_id(self.Map(items)).set('a', 1).set('b', 2).delete('5')
+        if sys.version_info >= (3, 14):
+            # Older versions can't tell temporaries apart.
+            self.assertEqual(id(h2), ids[0])
+        expected = dict(items, a=1, b=2)
+        del expected['5']
+        self.assertEqual(dict(h2.items()), expected)
+        self.assertEqual(h, self.Map(items))
+
+        # Nodes shared with other Maps are copied.
+        h3 = h.set('a', 1).set('b', 2).set('0', 'x').delete('5')
+        self.assertEqual(h, self.Map(items))
+        self.assertEqual(h3, h2.set('0', 'x'))
+        h4 = h3.set('c', 3)
+        self.assertNotIn('c', h3)
+        self.assertEqual(len(h4), len(h3) + 1)
+
+        # The memoized hash is dropped.
+        h5 = keep_hash(h.set('a', 1)).set('b', 2)
+        self.assertEqual(hash(h5), hash(self.Map(dict(items, a=1, b=2))))
+        h5 = keep_hash(h.set('a', 1)).delete('a')
+        self.assertEqual(hash(h5), hash(h))
+
+        # Containers are tracked by the GC once they hold one.
+        h6 = self.Map(items).set('a', [])
+        self.assertTrue(gc.is_tracked(h6))
+
+        # Deleting down to a small Map.
+        h7 = self.Map({str(i): i for i in range(10)})
+        for i in range(9):
+            h7 = h7.set('x', i).delete(str(i)).delete('x')
+        self.assertEqual(h7, self.Map({'9': 9}))
+
+        # Colliding keys, and errors.
+        keys = [HashKey(i % 7, str(i)) for i in range(60)]
+        h8 = self.Map()
+        for k in keys:
+            h8 = h8.set(k, k.name).set(k, k.name + '!')
+        self.assertEqual(dict(h8.items()), {k: k.name + '!' for k in keys})
+        with HashKeyCrasher(error_on_eq=True):
+            with self.assertRaises(EqError):
+                self.Map(h8).set(HashKey(0, '0'), 0)
+        with self.assertRaises(KeyError):
+            self.Map(h8).delete('missing')
+
+    def test_map_build_large(self):
+        # Free-threaded builds build Maps of this size on several
+        # threads; the result must be the same as the one of set().
+        def serial(items):
+            mm = self.Map().mutate()
+            for k, v in items:
+                mm[k] = v
+            return mm.finish()
+
+        items = [(str(i), i) for i in range(150000)]
+        items += [(HashKey(i % 3, str(i)), i) for i in range(300)]
+        items += [(str(i), -i) for i in range(0, 150000, 7)]
+        h = self.Map(items)
+        self.assertEqual(len(h), 150300)
+        self.assertEqual(h, serial(items))
+        self.assertEqual(self.Map(i for i in items), h)
+        self.assertEqual(self.Map.fromkeys(range(200000)),
+                         serial((i, None) for i in range(200000)))
+
+        # The error of the first key that can't be hashed is raised.
+        class Unhashable:
+            def __init__(self, n):
+                self.n = n
+
+            def __hash__(self):
+                raise HashingError(self.n)
+
+        items[80000] = (Unhashable(1), 1)
+        items[140000] = (Unhashable(2), 2)
+        with self.assertRaisesRegex(HashingError, '^1$'):
+            self.Map(items)
+        with self.assertRaisesRegex(HashingError, '^1$'):
+            self.Map(i for i in items)
+
+    def test_map_mutate_spare(self):
+        # Nodes of mutations have spare room until finish(); Maps
+        # never keep it.
+        def shape(m):
+            return re.sub(r'id=\w+', '', m.__dump__())
+
+        keys = [HashKey(i % 300, str(i)) for i in range(1000)]
+        h = self.Map((k, i) for i, k in enumerate(keys[:100]))
+        for items in (keys[:100], keys, keys[::-1]):
+            mm = h.mutate()
+            expected = dict(h.items())
+            for i, k in enumerate(items):
+                mm[k] = expected[k] = i
+                if i % 3 == 0:
+                    mm.pop(items[i // 2], None)
+                    expected.pop(items[i // 2], None)
+            m = mm.finish()
+            self.assertEqual(dict(m.items()), expected)
+            self.assertEqual(shape(m), shape(self.Map(expected)))
+            self.assertEqual(hash(m), hash(self.Map(expected)))
+            self.assertEqual(h, self.Map(
+                (k, i) for i, k in enumerate(keys[:100])))
+
+        # Trimmed nodes are tracked by the GC if they need to be.
+        mm = self.Map().mutate()
+        for i in range(100):
+            mm[str(i)] = i
+        mm['x'] = mm
+        m = mm.finish()
+        del mm
+        ref = weakref.ref(m)
+        del m
+        gc.collect()
+        self.assertIsNone(ref())
+
+    def test_map_subinterpreters(self):
+        # Every interpreter gets a module instance with types of its
+        # own; on 3.12+ interpreters created this way have their own
+        # GIL and only accept modules that support it.
+        try:
+            import _interpreters as interpreters
+            run = interpreters.exec
+        except ImportError:
+            try:
+                import _xxsubinterpreters as interpreters
+                run = interpreters.run_string
+            except ImportError:
+                raise unittest.SkipTest('no subinterpreters')
+
+        code = (
+            'import sys\n'
+            'sys.path[:] = {!r}\n'
+            'import pickle, immutables\n'
+            'm = immutables.Map({{str(i): i for i in range(100)}})\n'
+            'assert pickle.loads(pickle.dumps(m.set("a", 1))) == '
+            'm.set("a", 1)\n'
+            'assert immutables.unarchive(immutables.archive([m]))[0] == m\n'
+            'assert len(m.keys() & m.keys()) == 100\n'
+        ).format(sys.path)
+
+        for _ in range(2):
+            interp = interpreters.create()
+            try:
+                self.assertIsNone(run(interp, code))
+            finally:
+                interpreters.destroy(interp)
+
+        h = self.Map(a=1)
+        self.assertEqual(h.set('b', 2), self.Map(a=1, b=2))
+
 
 if __name__ == "__main__":
     unittest.main()
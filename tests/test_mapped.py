@@ -0,0 +1,250 @@
+import os
+import pathlib
+import pickle
+import random
+import tempfile
+import unittest
+from unittest import mock
+
+import immutables.map
+from immutables.map import Map as PyMap
+from immutables.map import MappedMap as PyMappedMap
+
+
+ITEMS = {
+    'a': 1,
+    'é': 'ü',
+    '': b'',
+    b'b': 2.5,
+    0: None,
+    -5: True,
+    7: False,
+    2 ** 63 - 1: -2 ** 63,
+    2 ** 70: -2 ** 80,
+    -2 ** 90: 'big',
+}
+
+
+def weak_hash(tag, data):
+    # Leaves most levels empty and makes plenty of full collisions.
+    return immutables.map._MAPPED_MASK & (
+        (len(data) % 3) * 0x0842108421084210 + (data[0] % 2 if data else 0))
+
+
+class BaseMappedMapTest:
+
+    MappedMap = None
+
+    def test_mapped_basics(self):
+        m = self.MappedMap(self.MappedMap.dumps(ITEMS))
+
+        self.assertEqual(len(m), len(ITEMS))
+        self.assertEqual(dict(m.items()), ITEMS)
+        self.assertEqual(set(m), set(ITEMS))
+        self.assertEqual(list(m), list(m.keys()))
+        self.assertEqual(list(m.values()), [ITEMS[k] for k in m])
+        self.assertEqual(len(m.keys()), len(ITEMS))
+        self.assertEqual(len(m.items()), len(ITEMS))
+
+        for key, val in ITEMS.items():
+            self.assertIn(key, m)
+            self.assertIs(type(m[key]), type(val))
+            self.assertEqual(m[key], val)
+            self.assertEqual(m.get(key), val)
+
+        self.assertEqual(m[0.0], None)
+        self.assertEqual(m[7.0], False)
+        self.assertEqual(m[False], None)
+        self.assertNotIn(True, m)
+        self.assertNotIn('b', m)
+        self.assertNotIn(b'a', m)
+        self.assertNotIn(0.5, m)
+        self.assertNotIn(float('nan'), m)
+        self.assertNotIn((1,), m)
+        self.assertNotIn('\ud800', m)
+        self.assertIsNone(m.get(1))
+        self.assertEqual(m.get(1, 'x'), 'x')
+
+        with self.assertRaises(KeyError):
+            m['b']
+        with self.assertRaises(TypeError):
+            m[[]]
+        with self.assertRaises(TypeError):
+            [] in m
+
+        self.assertIn('MappedMap of 10 items', repr(m))
+
+        with self.assertRaises(TypeError):
+            pickle.dumps(m)
+
+    def test_mapped_empty(self):
+        data = self.MappedMap.dumps({})
+        self.assertEqual(len(data), 40)
+
+        m = self.MappedMap(data)
+        self.assertEqual(len(m), 0)
+        self.assertEqual(list(m.items()), [])
+        self.assertNotIn('a', m)
+
+        m = self.MappedMap(self.MappedMap.dumps({'a': 'b'}))
+        self.assertEqual(dict(m.items()), {'a': 'b'})
+
+    def test_mapped_large(self):
+        items = {}
+        for i in range(20000):
+            items[str(i)] = i
+            items[i] = str(i).encode()
+
+        m = self.MappedMap(self.MappedMap.dumps(PyMap(items)))
+        self.assertEqual(len(m), len(items))
+        self.assertEqual(dict(m.items()), items)
+        for key in random.sample(list(items), 1000):
+            self.assertEqual(m[key], items[key])
+        for i in range(20000, 21000):
+            self.assertNotIn(i, m)
+            self.assertNotIn(str(i), m)
+
+    def test_mapped_sources(self):
+        data = self.MappedMap.dumps(ITEMS)
+
+        for source in (bytearray(data), memoryview(data)):
+            self.assertEqual(dict(self.MappedMap(source).items()), ITEMS)
+
+        with tempfile.TemporaryDirectory() as dir:
+            path = os.path.join(dir, 'items.map')
+
+            self.MappedMap.write(path, ITEMS)
+            with open(path, 'rb') as f:
+                self.assertEqual(f.read(), data)
+            self.assertEqual(os.listdir(dir), ['items.map'])
+
+            for source in (path, pathlib.Path(path)):
+                m = self.MappedMap(source)
+                self.assertEqual(dict(m.items()), ITEMS)
+
+            # Files are replaced, not rewritten, so that maps that
+            # are in use keep working.
+            self.MappedMap.write(pathlib.Path(path), {'a': 2})
+            self.assertEqual(dict(m.items()), ITEMS)
+            self.assertEqual(self.MappedMap(path)['a'], 2)
+            del m
+
+    def test_mapped_dumps_errors(self):
+        with self.assertRaisesRegex(TypeError, 'keys must be'):
+            self.MappedMap.dumps({1.0: 1})
+        with self.assertRaisesRegex(TypeError, 'keys must be'):
+            self.MappedMap.dumps({(1, 2): 1})
+        with self.assertRaisesRegex(TypeError, 'values must be'):
+            self.MappedMap.dumps({1: [1]})
+        with self.assertRaises(UnicodeEncodeError):
+            self.MappedMap.dumps({'\ud800': 1})
+        with self.assertRaises(AttributeError):
+            self.MappedMap.dumps([(1, 2)])
+
+        class Items:
+            def items(self):
+                return [('a', 1), ('b', 2), ('a', 3)]
+
+        with self.assertRaisesRegex(ValueError, 'duplicate keys'):
+            self.MappedMap.dumps(Items())
+
+    def test_mapped_invalid(self):
+        data = self.MappedMap.dumps(ITEMS)
+
+        for bad in (b'', b'IMMUTMAP', data[:-1], data + b'\0',
+                    b'X' + data[1:]):
+            with self.assertRaises(ValueError):
+                self.MappedMap(bad)
+
+        with self.assertRaisesRegex(ValueError, 'version'):
+            self.MappedMap(data[:8] + b'\2' + data[9:])
+
+        with self.assertRaises(TypeError):
+            self.MappedMap(1)
+
+        # Damaged data is never read past the end of the buffer.
+        rnd = random.Random(0)
+        items = {str(i): i for i in range(200)}
+        items.update(ITEMS)
+        data = self.MappedMap.dumps(items)
+
+        for _ in range(2000):
+            bad = bytearray(data)
+            for _ in range(rnd.randint(1, 4)):
+                bad[rnd.randrange(40, len(bad))] = rnd.randrange(256)
+
+            try:
+                m = self.MappedMap(bytes(bad))
+                list(m.items())
+            except (ValueError, UnicodeDecodeError):
+                pass
+
+            try:
+                for key in rnd.sample(list(items), 20):
+                    m.get(key)
+            except (ValueError, UnicodeDecodeError):
+                pass
+
+    def test_mapped_compat(self):
+        # Both implementations write and read the same files.
+        data = self.MappedMap.dumps(ITEMS)
+        self.assertEqual(data, PyMappedMap.dumps(ITEMS))
+        self.assertEqual(dict(PyMappedMap(data).items()), ITEMS)
+
+        items = PyMap({'k{}'.format(i): i for i in range(5000)})
+        self.assertEqual(
+            self.MappedMap.dumps(items), PyMappedMap.dumps(items))
+
+
+class PyMappedMapTest(BaseMappedMapTest, unittest.TestCase):
+
+    MappedMap = PyMappedMap
+
+    def test_mapped_collisions(self):
+        items = {'k{}'.format(i): i for i in range(500)}
+        items.update(ITEMS)
+
+        with mock.patch.object(immutables.map, 'mapped_hash', weak_hash):
+            m = self.MappedMap(self.MappedMap.dumps(items))
+
+            self.assertEqual(dict(m.items()), items)
+            for key, val in items.items():
+                self.assertEqual(m[key], val)
+            self.assertNotIn('x', m)
+            self.assertNotIn(1, m)
+
+            class Items:
+                def items(self):
+                    return [('a', 1), ('b', 2), ('a', 3)]
+
+            with self.assertRaisesRegex(ValueError, 'duplicate keys'):
+                self.MappedMap.dumps(Items())
+
+
+try:
+    from immutables._map import MappedMap as CMappedMap
+except ImportError:
+    CMappedMap = None
+
+
+@unittest.skipIf(CMappedMap is None, 'C MappedMap is not available')
+class CMappedMapTest(BaseMappedMapTest, unittest.TestCase):
+
+    MappedMap = CMappedMap
+
+    def test_mapped_collisions(self):
+        # Collision nodes are only found by iteration here: this
+        # implementation hashes keys properly.
+        items = {'k{}'.format(i): i for i in range(500)}
+        items.update(ITEMS)
+
+        with mock.patch.object(immutables.map, 'mapped_hash', weak_hash):
+            data = PyMappedMap.dumps(items)
+
+        m = self.MappedMap(data)
+        self.assertEqual(dict(m.items()), items)
+        self.assertEqual(len(m), len(items))
+
+
+if __name__ == "__main__":
+    unittest.main()
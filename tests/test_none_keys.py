@@ -1,25 +1,29 @@
 import ctypes
 import unittest
 
-from immutables.map import map_hash, map_mask, Map as PyMap
+from immutables.map import map_hash, map_mask, Map as PyMap, HASH_BITS
 from immutables._testutils import HashKey
 
 
+# Number of tree levels that consume 5 bits of a hash each.
+LEVELS = -(-HASH_BITS // 5)
+
 none_hash = map_hash(None)
 assert none_hash != 1
-assert none_hash.bit_length() <= 32
+assert none_hash.bit_length() <= HASH_BITS
 
-none_hash_u = ctypes.c_size_t(none_hash).value
-not_collision = 0xffffffff & (~none_hash_u)
+hash_mask = (1 << HASH_BITS) - 1
+not_collision = hash_mask & (~none_hash)
 
-mask = 0x7ffffffff
-none_collisions = [none_hash_u & (mask >> shift)
-                   for shift in reversed(range(0, 32, 5))]
-assert len(none_collisions) == 7
-none_collisions = [
-    ctypes.c_ssize_t(h | (not_collision & (mask << shift))).value
-    for shift, h in zip(range(5, 37, 5), none_collisions)
-]
+# The hash of the key at index N matches the hash of None
+# on the first N + 1 levels, and differs from it on all others.
+# The last one is a full collision.
+none_collisions = []
+for level in range(LEVELS):
+    low_mask = (1 << (5 * (level + 1))) - 1
+    h = (none_hash & low_mask) | (not_collision & ~low_mask & hash_mask)
+    none_collisions.append(ctypes.c_ssize_t(h).value)
+assert len(none_collisions) == LEVELS
 
 
 class NoneCollision(HashKey):
@@ -40,8 +44,8 @@ class BaseNoneTest:
     Map = None
 
     def test_none_collisions(self):
-        collisions = [NoneCollision('a', level) for level in range(7)]
-        indices = [map_mask(none_hash, shift) for shift in range(0, 32, 5)]
+        collisions = [NoneCollision('a', level) for level in range(LEVELS)]
+        indices = [map_mask(none_hash, shift) for shift in range(0, HASH_BITS, 5)]
 
         for i, c in enumerate(collisions[:-1], 1):
             self.assertNotEqual(c, None)
@@ -67,7 +71,7 @@ class BaseNoneTest:
         self.assertEqual(m[None], 1)
         self.assertEqual(repr(m), 'immutables.Map({None: 1})')
 
-        for level in range(7):
+        for level in range(LEVELS):
             key = NoneCollision('a', level)
             self.assertFalse(key in m)
             with self.assertRaises(KeyError):
@@ -106,7 +110,7 @@ class BaseNoneTest:
             m.delete(None)
 
     def test_none_collision_1(self):
-        for level in range(7):
+        for level in range(LEVELS):
             key = NoneCollision('a', level)
             m = self.Map({None: 1, key: 2})
 
@@ -171,7 +175,7 @@ class BaseNoneTest:
         self.assertTrue(key in m)
         self.assertTrue(None in m)
 
-        for level in range(7):
+        for level in range(LEVELS):
             key2 = NoneCollision('b', level)
             self.assertFalse(key2 in m)
             m2 = m.set(key2, 1)
@@ -249,7 +253,7 @@ class BaseNoneTest:
             m2.delete(key)
 
     def test_none_collision_3(self):
-        for level in range(7):
+        for level in range(LEVELS):
             key = NoneCollision('a', level)
             m = self.Map({key: 2})
 